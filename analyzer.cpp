@@ -0,0 +1,105 @@
+﻿#include "analyzer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "checksum.hpp"
+
+LineReader::LineReader(std::istream& stream, size_t bufferSize) : mStream(stream)
+{
+	mBuffer.resize(std::max<size_t>(bufferSize, 64));
+
+	mBegin = 0;
+	mEnd = 0;
+	mOffset = 0;
+
+	mChecksum = 0;
+	mChecksumKnown = true;
+}
+
+bool LineReader::Seek(uint64_t offset)
+{
+	mStream.clear();
+	mStream.seekg(static_cast<std::streamoff>(offset));
+
+	mBegin = 0;
+	mEnd = 0;
+	mOffset = offset;
+
+	mChecksum = 0;
+	mChecksumKnown = (offset == 0);
+
+	return !mStream.fail();
+}
+
+bool LineReader::NextLine(const char*& first, const char*& last, uint64_t& lineOffset)
+{
+	while (true)
+	{
+		const char* begin = mBuffer.data() + mBegin;
+		const char* newline = static_cast<const char*>(std::memchr(begin, '\n', mEnd - mBegin));
+
+		// Строка без перевода строки в конце буфера - либо обрезана блоком, либо последняя в потоке.
+		if (newline == nullptr && Refill())
+		{
+			continue;
+		}
+
+		if (newline == nullptr && mBegin == mEnd)
+		{
+			return false;
+		}
+
+		const char* end = (newline != nullptr) ? newline : mBuffer.data() + mEnd;
+
+		lineOffset = mOffset + mBegin;
+		mBegin = static_cast<size_t>(end - mBuffer.data()) + ((newline != nullptr) ? 1 : 0);
+
+		first = begin;
+		last = end;
+
+		if (textload::TrimLine(first, last))
+		{
+			return true;
+		}
+	}
+}
+
+bool LineReader::GetChecksum(uint64_t end, uint32_t& crc) const
+{
+	if (!mChecksumKnown || end < mOffset || end > mOffset + mEnd)
+	{
+		return false;
+	}
+
+	crc = checksum::Crc32c(mBuffer.data(), static_cast<size_t>(end - mOffset), mChecksum);
+
+	return true;
+}
+
+bool LineReader::Refill()
+{
+	// Непрочитанный остаток переносится в начало буфера. Если он занимает весь буфер, то буфер растёт.
+	if (mBegin > 0)
+	{
+		mChecksum = checksum::Crc32c(mBuffer.data(), mBegin, mChecksum);
+
+		std::memmove(mBuffer.data(), mBuffer.data() + mBegin, mEnd - mBegin);
+
+		mOffset += mBegin;
+		mEnd -= mBegin;
+		mBegin = 0;
+	}
+
+	if (mEnd == mBuffer.size())
+	{
+		mBuffer.resize(mBuffer.size() * 2);
+	}
+
+	mStream.read(mBuffer.data() + mEnd, static_cast<std::streamsize>(mBuffer.size() - mEnd));
+
+	size_t read = static_cast<size_t>(mStream.gcount());
+	mEnd += read;
+
+	return read > 0;
+}
@@ -0,0 +1,355 @@
+﻿#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <istream>
+#include <vector>
+
+#include "btree.hpp"
+#include "textload.hpp"
+
+/*
+	Чтение текстового формата по строкам большими блоками, с запоминанием смещения каждой строки в потоке.
+	Строки обрезаются так же, как в textload, и пустые строки пропускаются.
+*/
+class LineReader
+{
+private:
+	std::istream& mStream;
+
+	// Прочитанный блок: непрочитанные строки лежат в [mBegin, mEnd).
+	std::vector<char> mBuffer;
+	size_t mBegin;
+	size_t mEnd;
+
+	// Смещение mBuffer[0] от начала потока.
+	uint64_t mOffset;
+
+	// CRC32C байт потока [0, mOffset). Известна, только если чтение шло с начала потока без Seek в середину.
+	uint32_t mChecksum;
+	bool mChecksumKnown;
+public:
+	explicit LineReader(std::istream& stream, size_t bufferSize = 1 << 20);
+public:
+	// Переход к смещению offset от начала потока. Возвращает false, если поток не умеет перемещаться.
+	bool Seek(uint64_t offset);
+
+	/*
+		Следующая строка со значением. [first, last) - обрезанная строка, lineOffset - смещение начала строки в потоке.
+		Возвращает false, когда строки закончились. Указатели верны до следующего вызова.
+	*/
+	bool NextLine(const char*& first, const char*& last, uint64_t& lineOffset);
+
+	/*
+		CRC32C байт потока [0, end). end должен лежать в уже прочитанной части буфера (например, смещение
+		только что полученной строки). Возвращает false, если сумма неизвестна.
+	*/
+	bool GetChecksum(uint64_t end, uint32_t& crc) const;
+private:
+	// Дочитывание потока в буфер. Возвращает false, если поток закончился и ничего не прочитано.
+	bool Refill();
+};
+
+// Агрегаты поддерева, как они хранятся во временных файлах потокового анализа.
+template<typename T>
+struct stream_aggregate_t
+{
+	leaf_weight_t<T> weightSum;
+	uint64_t count;
+};
+
+/*
+	Потоковый анализ: поиск минимального и максимального отношения по текстовому файлу без построения дерева.
+
+	Строки файла идут по уровням, поэтому уровень - это непрерывный отрезок файла. Первый проход по потоку
+	запоминает только смещения начал уровней. Затем уровни обрабатываются снизу вверх: значения уровня читаются
+	с его смещения, а агрегаты потомков - из временного файла, куда их записал предыдущий (более глубокий) уровень.
+	Потомки родителей одного уровня идут подряд, так что и поток, и временные файлы читаются последовательно.
+
+	В памяти держатся только смещения уровней и буферы чтения и записи, поэтому файл может быть больше памяти.
+	Временные файлы (tmpfile) в сумме занимают не больше 16 байт на лепесток двух соседних уровней.
+*/
+template<typename T>
+class StreamAnalyzer
+{
+private:
+	// Временный файл агрегатов одного уровня с буфером записи или чтения.
+	class AggregateFile
+	{
+	private:
+		FILE* mFile;
+
+		std::vector<stream_aggregate_t<T>> mBuffer;
+		size_t mPosition;
+		size_t mSize;
+	public:
+		AggregateFile()
+		{
+			mFile = std::tmpfile();
+			mBuffer.resize(64 * 1024);
+
+			mPosition = 0;
+			mSize = 0;
+		}
+
+		~AggregateFile()
+		{
+			if (mFile != nullptr)
+			{
+				std::fclose(mFile);
+			}
+		}
+
+		AggregateFile(const AggregateFile&) = delete;
+		AggregateFile& operator=(const AggregateFile&) = delete;
+	public:
+		bool IsOpen() const
+		{
+			return mFile != nullptr;
+		}
+
+		// Начало записи нового уровня. Прежнее содержимое перестаёт быть нужным.
+		void BeginWrite()
+		{
+			std::rewind(mFile);
+
+			mPosition = 0;
+		}
+
+		void Write(const stream_aggregate_t<T>& aggregate)
+		{
+			if (mPosition >= mBuffer.size())
+			{
+				Flush();
+			}
+
+			mBuffer[mPosition] = aggregate;
+			mPosition++;
+		}
+
+		bool EndWrite()
+		{
+			Flush();
+
+			return std::fflush(mFile) == 0;
+		}
+
+		void BeginRead()
+		{
+			std::rewind(mFile);
+
+			mPosition = 0;
+			mSize = 0;
+		}
+
+		bool Read(stream_aggregate_t<T>& aggregate)
+		{
+			if (mPosition >= mSize)
+			{
+				mSize = std::fread(mBuffer.data(), sizeof(stream_aggregate_t<T>), mBuffer.size(), mFile);
+				mPosition = 0;
+
+				if (mSize == 0)
+				{
+					return false;
+				}
+			}
+
+			aggregate = mBuffer[mPosition];
+			mPosition++;
+
+			return true;
+		}
+	private:
+		void Flush()
+		{
+			std::fwrite(mBuffer.data(), sizeof(stream_aggregate_t<T>), mPosition, mFile);
+
+			mPosition = 0;
+		}
+	};
+public:
+	/*
+		Поиск по потоку stream, который должен уметь перемещаться (например, std::ifstream в двоичном режиме).
+		По ссылкам outputMinHolder и outputMaxHolder записываются номера лепестков в порядке Walk (номера строк
+		со значениями, с нуля); глубину лепестка даёт GetDepth.
+
+		Результат совпадает с BinaryLeaf::GetMinMaxWeightSumChildrenRatio для того же файла: при равных отношениях
+		побеждает лепесток, который Walk посетил бы первым. Значения outputs меняются, только если найдено что-то
+		строго лучше переданных. Возвращает false, если поток не читается, какое-то значение не разобралось или
+		строки контрольной суммы не сошлись (первый проход сверяет их, так что обрезанный файл не анализируется).
+	*/
+	static bool GetMinMaxWeightSumChildrenRatio(std::istream& stream, double& outputMin, uint64_t& outputMinHolder, double& outputMax, uint64_t& outputMaxHolder)
+	{
+		LineReader reader(stream);
+
+		// Первый проход - смещения начал уровней: уровень level начинается со строки номер 2^level - 1.
+		std::vector<uint64_t> levelOffsets = {};
+		uint64_t count = 0;
+
+		const char* first = nullptr;
+		const char* last = nullptr;
+		uint64_t offset = 0;
+
+		textload::TextFrame frame;
+
+		while (reader.NextLine(first, last, offset))
+		{
+			uint32_t expected = 0;
+			uint32_t actual = 0;
+
+			textload::textline_t line = textload::ClassifyLine(first, last, expected);
+
+			if (!frame.Next(line))
+			{
+				return false;
+			}
+
+			if (line == textload::TextLine::FOOTER && (!reader.GetChecksum(offset, actual) || actual != expected))
+			{
+				return false;
+			}
+
+			if (line != textload::TextLine::VALUE)
+			{
+				continue;
+			}
+
+			if (std::has_single_bit(count + 1))
+			{
+				levelOffsets.push_back(offset);
+			}
+
+			count++;
+		}
+
+		if (!frame.IsComplete())
+		{
+			return false;
+		}
+
+		if (count == 0)
+		{
+			return true;
+		}
+
+		// Агрегаты предыдущего (более глубокого) уровня и текущего. Файлы меняются местами после каждого уровня.
+		AggregateFile files[2];
+		if (!files[0].IsOpen() || !files[1].IsOpen())
+		{
+			return false;
+		}
+
+		size_t current = 0;
+
+		// Лучшие найденные отношения, их лепестки и глубины.
+		bool found = false;
+
+		double minRatio = 0.0;
+		uint64_t minHolder = 0;
+		uint16_t minDepth = 0;
+
+		double maxRatio = 0.0;
+		uint64_t maxHolder = 0;
+		uint16_t maxDepth = 0;
+
+		for (size_t level = levelOffsets.size(); level-- > 0;)
+		{
+			uint64_t levelFirst = (static_cast<uint64_t>(1) << level) - 1;
+			uint64_t width = std::min<uint64_t>(levelFirst + 1, count - levelFirst);
+
+			// Потомков у уровня столько, сколько лепестков на следующем уровне.
+			uint64_t childWidth = (level + 1 < levelOffsets.size()) ? count - (2 * levelFirst + 1) : 0;
+			childWidth = std::min(childWidth, 2 * width);
+
+			if (!reader.Seek(levelOffsets[level]))
+			{
+				return false;
+			}
+
+			AggregateFile& input = files[1 - current];
+			AggregateFile& output = files[current];
+
+			input.BeginRead();
+			output.BeginWrite();
+
+			for (uint64_t position = 0; position < width; position++)
+			{
+				T value = {};
+
+				if (!reader.NextLine(first, last, offset) || !textload::ParseValue(first, last, value))
+				{
+					return false;
+				}
+
+				stream_aggregate_t<T> aggregate = { static_cast<leaf_weight_t<T>>(level) * value, 1 };
+
+				// Два потомка этого лепестка - очередные две записи файла потомков, если они есть.
+				for (uint64_t child = 2 * position; child < 2 * position + 2 && child < childWidth; child++)
+				{
+					stream_aggregate_t<T> childAggregate = {};
+
+					if (!input.Read(childAggregate))
+					{
+						return false;
+					}
+
+					aggregate.weightSum += childAggregate.weightSum;
+					aggregate.count += childAggregate.count;
+				}
+
+				output.Write(aggregate);
+
+				uint64_t divisor = std::max<uint64_t>(1, aggregate.count - 1);
+				double ratio = static_cast<double>(aggregate.weightSum) / static_cast<double>(divisor);
+
+				// Уровни идут снизу вверх, поэтому при равенстве заменяем только на лепесток с меньшего уровня.
+				uint16_t depth = static_cast<uint16_t>(level);
+
+				if (!found || ratio < minRatio || (ratio == minRatio && depth < minDepth))
+				{
+					minRatio = ratio;
+					minHolder = levelFirst + position;
+					minDepth = depth;
+				}
+
+				if (!found || ratio > maxRatio || (ratio == maxRatio && depth < maxDepth))
+				{
+					maxRatio = ratio;
+					maxHolder = levelFirst + position;
+					maxDepth = depth;
+				}
+
+				found = true;
+			}
+
+			if (!output.EndWrite())
+			{
+				return false;
+			}
+
+			current = 1 - current;
+		}
+
+		if (minRatio < outputMin)
+		{
+			outputMin = minRatio;
+			outputMinHolder = minHolder;
+		}
+
+		if (maxRatio > outputMax)
+		{
+			outputMax = maxRatio;
+			outputMaxHolder = maxHolder;
+		}
+
+		return true;
+	}
+
+	// Глубина лепестка с номером index в порядке Walk.
+	static uint16_t GetDepth(uint64_t index)
+	{
+		return static_cast<uint16_t>(std::bit_width(index + 1) - 1);
+	}
+};
@@ -0,0 +1,159 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Объявление лепестка наперёд. Арена подключается из btree.hpp до объявления самого лепестка.
+template<typename T>
+class BinaryLeaf;
+
+/*
+	Арена лепестков. Вместо отдельного new на каждый лепесток память выделяется большими блоками (слэбами),
+	а лепестки размещаются в них подряд в порядке создания. Освобождается арена целиком, несколькими большими delete.
+
+	Лепестки из арены нельзя удалять через delete - ими владеет арена. Обычно арена живёт внутри ArenaTree.
+*/
+template<typename T>
+class LeafArena
+{
+private:
+	// Слэбы и их вместимость в лепестках. Каждый следующий слэб в два раза больше предыдущего, но не больше MAX_SLAB_LEAVES.
+	std::vector<BinaryLeaf<T>*> mSlabs;
+	std::vector<size_t> mSlabCapacities;
+
+	// Сколько лепестков уже занято в последнем слэбе.
+	size_t mUsed;
+
+	static constexpr size_t MIN_SLAB_LEAVES = 1024;
+	static constexpr size_t MAX_SLAB_LEAVES = 1024 * 1024;
+public:
+	LeafArena()
+	{
+		mUsed = 0;
+	}
+
+	LeafArena(const LeafArena<T>&) = delete;
+	LeafArena<T>& operator=(const LeafArena<T>&) = delete;
+
+	~LeafArena()
+	{
+		Clear();
+	}
+public:
+	// Создание лепестка в арене.
+	BinaryLeaf<T>* Create(T value)
+	{
+		if (mSlabs.size() == 0 || mUsed >= mSlabCapacities.back())
+		{
+			size_t capacity = (mSlabs.size() == 0) ? MIN_SLAB_LEAVES : std::min(mSlabCapacities.back() * 2, MAX_SLAB_LEAVES);
+
+			mSlabs.push_back(static_cast<BinaryLeaf<T>*>(::operator new(capacity * sizeof(BinaryLeaf<T>))));
+			mSlabCapacities.push_back(capacity);
+
+			mUsed = 0;
+		}
+
+		BinaryLeaf<T>* leaf = mSlabs.back() + mUsed;
+		mUsed++;
+
+		return new (leaf) BinaryLeaf<T>(value);
+	}
+
+	/*
+		Освобождение всех лепестков арены.
+
+		Если у лепестков нечего разрушать (T тривиально разрушаем), то слэбы просто освобождаются, и это не зависит
+		ни от формы дерева, ни от количества лепестков. Иначе каждый лепесток сначала отсоединяется от потомков,
+		чтобы его деструктор не пытался удалить их через delete, и только потом разрушается.
+	*/
+	void Clear()
+	{
+		for (size_t slab = 0; slab < mSlabs.size(); slab++)
+		{
+			if constexpr (!std::is_trivially_destructible_v<T>)
+			{
+				size_t used = (slab + 1 == mSlabs.size()) ? mUsed : mSlabCapacities[slab];
+
+				for (size_t index = 0; index < used; index++)
+				{
+					BinaryLeaf<T>* leaf = mSlabs[slab] + index;
+
+					*leaf->GetLeftChild() = nullptr;
+					*leaf->GetRightChild() = nullptr;
+
+					leaf->~BinaryLeaf();
+				}
+			}
+
+			::operator delete(mSlabs[slab]);
+		}
+
+		mSlabs.clear();
+		mSlabCapacities.clear();
+
+		mUsed = 0;
+	}
+
+	// Количество байт, зарезервированных слэбами.
+	size_t GetReservedBytes() const
+	{
+		size_t result = 0;
+
+		for (size_t capacity : mSlabCapacities)
+		{
+			result += capacity * sizeof(BinaryLeaf<T>);
+		}
+
+		return result;
+	}
+};
+
+/*
+	Дерево, владеющее ареной своих лепестков. Корень и все лепестки, созданные через GetArena(), освобождаются
+	вместе с деревом.
+*/
+template<typename T>
+class ArenaTree
+{
+private:
+	LeafArena<T> mArena;
+
+	BinaryLeaf<T>* mRoot;
+public:
+	ArenaTree()
+	{
+		mRoot = nullptr;
+	}
+
+	ArenaTree(const ArenaTree<T>&) = delete;
+	ArenaTree<T>& operator=(const ArenaTree<T>&) = delete;
+
+	~ArenaTree()
+	{
+		mArena.Clear();
+	}
+public:
+	LeafArena<T>& GetArena()
+	{
+		return mArena;
+	}
+
+	BinaryLeaf<T>* GetRoot() const
+	{
+		return mRoot;
+	}
+
+	// Установка корня. Корень должен быть создан в арене этого дерева.
+	void SetRoot(BinaryLeaf<T>* root)
+	{
+		mRoot = root;
+	}
+
+	// Указатель на корень. Нужен, чтобы генерация и десериализация могли записать туда созданный корень.
+	BinaryLeaf<T>** GetRootOutput()
+	{
+		return &mRoot;
+	}
+};
@@ -0,0 +1,431 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <set>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "btree.hpp"
+
+template<typename T>
+class AggregatedBinaryTree;
+
+// Запись индекса отношений: отношение поддерева, глубина его корня и сам корень.
+template<typename T>
+struct leaf_ratio_entry_t
+{
+	double ratio;
+	uint16_t depth;
+
+	BinaryLeaf<T>* leaf;
+};
+
+/*
+	Порядок записей индекса - тот, в котором их предпочитает последовательный поиск: по отношению, затем по глубине,
+	затем по положению в дереве (см. AggregatedBinaryTree::IsPreferred). Так у минимума и максимума при равных
+	отношениях побеждает тот же лепесток, что и в BinaryLeaf::GetMinMaxWeightSumChildrenRatio. Положение лепестка
+	знает только дерево (по таблице родителей), поэтому порядок хранит указатель на него.
+*/
+template<typename T>
+struct leaf_ratio_order_t
+{
+	const AggregatedBinaryTree<T>* tree;
+
+	bool operator()(const leaf_ratio_entry_t<T>& first, const leaf_ratio_entry_t<T>& second) const
+	{
+		if (first.ratio != second.ratio)
+		{
+			return first.ratio < second.ratio;
+		}
+
+		if (first.depth != second.depth)
+		{
+			return first.depth < second.depth;
+		}
+
+		return tree->IsPreferred(first.leaf, second.leaf);
+	}
+};
+
+// Индекс отношений всех поддеревьев дерева. Минимум лежит в начале, максимум - в конце.
+template<typename T>
+using leaf_ratio_index_t = std::set<leaf_ratio_entry_t<T>, leaf_ratio_order_t<T>>;
+
+// Закэшированные агрегаты поддерева одного лепестка в AggregatedBinaryTree.
+template<typename T>
+struct leaf_aggregate_t
+{
+	// Родитель лепестка. nullptr у корня.
+	BinaryLeaf<T>* parent;
+
+	// Количество предков лепестка в дереве. В отличие от mDepth, верно и внутри перенесённого поддерева.
+	size_t level;
+
+	// Сумма весов и количество лепестков поддерева, включая сам лепесток.
+	leaf_weight_t<T> weightSum;
+	size_t count;
+
+	// Запись этого лепестка в индексе отношений.
+	typename leaf_ratio_index_t<T>::iterator entry;
+};
+
+/*
+	Дерево BinaryLeaf с закэшированными агрегатами поддеревьев.
+
+	Каждый лепесток получает сумму весов и количество лепестков своего поддерева, а всё дерево - индекс отношений
+	всех поддеревьев. Правки через SetValue, SetLeftChild и SetRightChild этого объекта обновляют только лепестки
+	на пути до корня, GetWeightSumChildrenRatio работает за O(1), а GetMinMaxWeightSumChildrenRatio берёт ответ
+	из индекса. Повторный анализ после k правок стоит O(k * высота * log n) вместо полного обхода.
+
+	Агрегаты лежат не в лепестках, а в таблице этого объекта (лепесток -> агрегаты), так что лепестки деревьев
+	без агрегатов не становятся больше. Правки в обход этого объекта (прямо через BinaryLeaf) агрегаты не видят.
+	Лепестками по-прежнему владеет корень или арена, и они должны жить дольше этого объекта.
+
+	Объект нельзя копировать и перемещать: порядок индекса ссылается на него самого.
+*/
+template<typename T>
+class AggregatedBinaryTree
+{
+	static_assert(std::is_arithmetic_v<T>, "AggregatedBinaryTree aggregates numeric values only");
+private:
+	BinaryLeaf<T>* mRoot;
+
+	std::unordered_map<BinaryLeaf<T>*, leaf_aggregate_t<T>> mAggregates;
+
+	// Индекс отношений всех поддеревьев.
+	leaf_ratio_index_t<T> mIndex;
+
+	// Порядку индекса нужен IsPreferred.
+	friend struct leaf_ratio_order_t<T>;
+public:
+	// Построение агрегатов дерева root за один обход в обратном порядке.
+	explicit AggregatedBinaryTree(BinaryLeaf<T>* root)
+	{
+		mRoot = root;
+		mIndex = leaf_ratio_index_t<T>(leaf_ratio_order_t<T>{ this });
+
+		if (mRoot != nullptr)
+		{
+			Attach(mRoot, nullptr);
+		}
+	}
+
+	AggregatedBinaryTree(const AggregatedBinaryTree<T>&) = delete;
+	AggregatedBinaryTree<T>& operator=(const AggregatedBinaryTree<T>&) = delete;
+public:
+	BinaryLeaf<T>* GetRoot() const
+	{
+		return mRoot;
+	}
+
+	// Размер лепестков дерева вместе с таблицей агрегатов и индексом.
+	size_t GetByteSize() const
+	{
+		if (mRoot == nullptr)
+		{
+			return 0;
+		}
+
+		size_t perLeaf = sizeof(typename std::unordered_map<BinaryLeaf<T>*, leaf_aggregate_t<T>>::value_type) + sizeof(leaf_ratio_entry_t<T>);
+
+		return mRoot->GetByteSize() + mAggregates.size() * perLeaf + mAggregates.bucket_count() * sizeof(void*);
+	}
+public:
+	// Изменение значения лепестка. Разница в весе поднимается по родителям до корня.
+	void SetValue(BinaryLeaf<T>* leaf, T value)
+	{
+		leaf_weight_t<T> weightDelta = static_cast<leaf_weight_t<T>>(leaf->mDepth * value) - static_cast<leaf_weight_t<T>>(leaf->mDepth * leaf->mValue);
+
+		leaf->SetValue(value);
+
+		if (mAggregates.count(leaf) > 0)
+		{
+			Propagate(leaf, weightDelta, 0);
+		}
+	}
+
+	/*
+		Установка потомков лепестка parent, как BinaryLeaf::SetLeftChild и SetRightChild, но с пересчётом агрегатов.
+		Если leaf уже стоит в этом дереве, он переносится: прежний родитель его теряет, а прежние предки - его поддерево.
+		Корень перенести нельзя (он стал бы потомком самого себя), такой вызов ничего не делает.
+	*/
+
+	void SetLeftChild(BinaryLeaf<T>* parent, BinaryLeaf<T>* leaf)
+	{
+		if (leaf == mRoot)
+		{
+			return;
+		}
+
+		Release(leaf);
+
+		BinaryLeaf<T>* previous = parent->mLeft;
+
+		parent->SetLeftChild(leaf);
+
+		ReplaceChild(parent, previous, leaf);
+	}
+
+	void SetRightChild(BinaryLeaf<T>* parent, BinaryLeaf<T>* leaf)
+	{
+		if (leaf == mRoot)
+		{
+			return;
+		}
+
+		Release(leaf);
+
+		BinaryLeaf<T>* previous = parent->mRight;
+
+		parent->SetRightChild(leaf);
+
+		ReplaceChild(parent, previous, leaf);
+	}
+public:
+	// Отношение (сумма весов / количество потомков) поддерева лепестка за O(1).
+	double GetWeightSumChildrenRatio(BinaryLeaf<T>* leaf) const
+	{
+		auto found = mAggregates.find(leaf);
+
+		if (found == mAggregates.end())
+		{
+			return leaf->GetWeightSumChildrenRatio();
+		}
+
+		return BinaryLeaf<T>::MakeRatio(found->second.weightSum, found->second.count);
+	}
+
+	/*
+		Минимальное и максимальное отношение среди всех поддеревьев из индекса за O(log n). Результат в точности
+		совпадает с BinaryLeaf::GetMinMaxWeightSumChildrenRatio на корне: при равных отношениях побеждает менее
+		глубокий лепесток, а на одной глубине - более правый (см. leaf_ratio_order_t).
+	*/
+	void GetMinMaxWeightSumChildrenRatio(double& outputMin, BinaryLeaf<T>*& outputMinHolder, double& outputMax, BinaryLeaf<T>*& outputMaxHolder) const
+	{
+		if (mIndex.empty())
+		{
+			return;
+		}
+
+		const leaf_ratio_entry_t<T>& minEntry = *mIndex.begin();
+		if (minEntry.ratio < outputMin)
+		{
+			outputMin = minEntry.ratio;
+			outputMinHolder = minEntry.leaf;
+		}
+
+		double maxRatio = std::prev(mIndex.end())->ratio;
+		// Среди записей с максимальным отношением берём первую: наименее глубокую и самую правую.
+		const leaf_ratio_entry_t<T>& maxEntry = *mIndex.lower_bound({ maxRatio, 0, nullptr });
+		if (maxEntry.ratio > outputMax)
+		{
+			outputMax = maxEntry.ratio;
+			outputMaxHolder = maxEntry.leaf;
+		}
+	}
+private:
+	/*
+		Предпочтёт ли последовательный поиск лепесток first лепестку second при равных отношении и глубине.
+		Поиск идёт в обратном порядке и оставляет посещённого позже: предка, а из разных ветвей - ветвь правого
+		потомка их ближайшего общего предка. Уровни берутся из агрегатов, а не из mDepth: после переноса
+		поддерева глубины его внутренних лепестков не пересчитываются. nullptr идёт раньше всех, так ищется
+		начало записей одной глубины.
+	*/
+	bool IsPreferred(BinaryLeaf<T>* first, BinaryLeaf<T>* second) const
+	{
+		if (first == second || second == nullptr)
+		{
+			return false;
+		}
+
+		if (first == nullptr)
+		{
+			return true;
+		}
+
+		size_t firstLevel = mAggregates.find(first)->second.level;
+		size_t secondLevel = mAggregates.find(second)->second.level;
+
+		// Поднимаем более глубокий лепесток на уровень другого. Если так встретили другой, то другой - предок.
+		for (; firstLevel > secondLevel; firstLevel--)
+		{
+			first = GetParent(first);
+		}
+
+		if (first == second)
+		{
+			return false;
+		}
+
+		for (; secondLevel > firstLevel; secondLevel--)
+		{
+			second = GetParent(second);
+		}
+
+		if (first == second)
+		{
+			return true;
+		}
+
+		// Поднимаемся от обоих лепестков одновременно, пока они не станут братьями.
+		BinaryLeaf<T>* firstParent = GetParent(first);
+		BinaryLeaf<T>* secondParent = GetParent(second);
+
+		while (firstParent != secondParent)
+		{
+			first = firstParent;
+			second = secondParent;
+
+			firstParent = GetParent(first);
+			secondParent = GetParent(second);
+		}
+
+		return first->mDirection == TreeDirection::RIGHT;
+	}
+
+	BinaryLeaf<T>* GetParent(BinaryLeaf<T>* leaf) const
+	{
+		auto found = mAggregates.find(leaf);
+
+		return (found != mAggregates.end()) ? found->second.parent : nullptr;
+	}
+
+	/*
+		Создание агрегатов всему поддереву лепестка leaf и добавление их в индекс. parent - родитель leaf.
+		В индекс записи попадают вторым проходом: порядку индекса нужны родители всего поддерева.
+	*/
+	void Attach(BinaryLeaf<T>* leaf, BinaryLeaf<T>* parent)
+	{
+		std::vector<BinaryLeaf<T>*> attached = {};
+
+		leaf->Aggregate([&](BinaryLeaf<T>* current, leaf_weight_t<T> weightSum, size_t count, BinaryLeaf<T>* currentParent) {
+			leaf_aggregate_t<T>& aggregate = mAggregates[current];
+
+			aggregate.parent = (current == leaf) ? parent : currentParent;
+
+			aggregate.weightSum = weightSum;
+			aggregate.count = count;
+
+			attached.push_back(current);
+		});
+
+		// Обратный порядок обхода кладёт предков после потомков, так что уровни считаются с конца.
+		for (auto it = attached.rbegin(); it != attached.rend(); it++)
+		{
+			leaf_aggregate_t<T>& aggregate = mAggregates.find(*it)->second;
+
+			aggregate.level = (aggregate.parent == nullptr) ? 0 : mAggregates.find(aggregate.parent)->second.level + 1;
+		}
+
+		for (BinaryLeaf<T>* current : attached)
+		{
+			leaf_aggregate_t<T>& aggregate = mAggregates.find(current)->second;
+
+			aggregate.entry = mIndex.insert({ BinaryLeaf<T>::MakeRatio(aggregate.weightSum, aggregate.count), current->mDepth, current }).first;
+		}
+	}
+
+	/*
+		Отсоединение лепестка leaf, который уже стоит в этом дереве, от прежнего родителя: из сумм прежних предков
+		вычитается его поддерево, указатель родителя на него обнуляется, а агрегаты поддерева удаляются.
+	*/
+	void Release(BinaryLeaf<T>* leaf)
+	{
+		auto found = mAggregates.find(leaf);
+
+		if (found == mAggregates.end())
+		{
+			return;
+		}
+
+		BinaryLeaf<T>* parent = found->second.parent;
+
+		if (parent != nullptr)
+		{
+			Propagate(parent, -found->second.weightSum, -static_cast<ptrdiff_t>(found->second.count));
+
+			if (parent->mLeft == leaf)
+			{
+				parent->mLeft = nullptr;
+			}
+
+			if (parent->mRight == leaf)
+			{
+				parent->mRight = nullptr;
+			}
+		}
+
+		Detach(leaf);
+	}
+
+	// Удаление агрегатов всего поддерева лепестка leaf вместе с их записями в индексе.
+	void Detach(BinaryLeaf<T>* leaf)
+	{
+		leaf->Walk([&](BinaryLeaf<T>* current) -> bool {
+			auto found = mAggregates.find(current);
+
+			if (found != mAggregates.end())
+			{
+				mIndex.erase(found->second.entry);
+				mAggregates.erase(found);
+			}
+
+			return false;
+		});
+	}
+
+	// Добавление разницы в сумме весов и количестве лепестков к лепестку leaf и всем его предкам, с обновлением индекса.
+	void Propagate(BinaryLeaf<T>* leaf, leaf_weight_t<T> weightDelta, ptrdiff_t countDelta)
+	{
+		while (leaf != nullptr)
+		{
+			leaf_aggregate_t<T>& aggregate = mAggregates.find(leaf)->second;
+
+			aggregate.weightSum += weightDelta;
+			aggregate.count += countDelta;
+
+			mIndex.erase(aggregate.entry);
+			aggregate.entry = mIndex.insert({ BinaryLeaf<T>::MakeRatio(aggregate.weightSum, aggregate.count), leaf->mDepth, leaf }).first;
+
+			leaf = aggregate.parent;
+		}
+	}
+
+	/*
+		Замена потомка лепестка parent. Старое поддерево previous убирается из таблицы и индекса, новое (уже отсоединённое
+		через Release, если оно стояло в этом дереве) получает агрегаты, а разница поднимается до корня.
+		Это O(размер нового поддерева + высота * log n), для нового одиночного лепестка - O(высота * log n).
+	*/
+	void ReplaceChild(BinaryLeaf<T>* parent, BinaryLeaf<T>* previous, BinaryLeaf<T>* leaf)
+	{
+		// Лепесток не из этого дерева - пересчитывать нечего.
+		if (mAggregates.count(parent) == 0)
+		{
+			return;
+		}
+
+		leaf_weight_t<T> weightDelta = 0;
+		ptrdiff_t countDelta = 0;
+
+		auto found = (previous != nullptr) ? mAggregates.find(previous) : mAggregates.end();
+
+		if (found != mAggregates.end() && found->second.parent == parent)
+		{
+			weightDelta -= found->second.weightSum;
+			countDelta -= static_cast<ptrdiff_t>(found->second.count);
+
+			Detach(previous);
+		}
+
+		Attach(leaf, parent);
+
+		const leaf_aggregate_t<T>& aggregate = mAggregates.find(leaf)->second;
+
+		weightDelta += aggregate.weightSum;
+		countDelta += static_cast<ptrdiff_t>(aggregate.count);
+
+		Propagate(parent, weightDelta, countDelta);
+	}
+};
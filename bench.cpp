@@ -0,0 +1,130 @@
+﻿#include "bench.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "itree.hpp"
+
+size_t GetBenchArgument(int argc, const char** argv, int index, size_t defaultValue)
+{
+	if (index >= argc)
+	{
+		return defaultValue;
+	}
+
+	return static_cast<size_t>(std::strtoull(argv[index], nullptr, 10));
+}
+
+std::vector<size_t> GetBenchSizes(int argc, const char** argv, int index, const std::vector<size_t>& defaultSizes)
+{
+	if (index >= argc)
+	{
+		return defaultSizes;
+	}
+
+	std::vector<size_t> sizes = {};
+
+	const char* cursor = argv[index];
+
+	while (*cursor != '\0')
+	{
+		char* end = nullptr;
+		sizes.push_back(static_cast<size_t>(std::strtoull(cursor, &end, 10)));
+
+		// Пропускаем запятую (или любой другой разделитель) после числа.
+		cursor = (*end != '\0') ? end + 1 : end;
+	}
+
+	return sizes;
+}
+
+BinaryLeaf<int>* GenerateBenchTree(size_t leaves, LeafArena<int>* arena)
+{
+	// Фиксированный сид, чтобы повторные запуски мерили одно и то же дерево.
+	std::mt19937 random(12345);
+
+	std::vector<int> values(leaves);
+
+	for (size_t index = 0; index < leaves; index++)
+	{
+		values[index] = static_cast<int>(random() % 255);
+	}
+
+	return ImplicitBinaryTree<int>(std::move(values)).ToBinaryLeaf(arena);
+}
+
+bench_stats_t GetBenchStats(std::vector<double> samples)
+{
+	if (samples.size() == 0)
+	{
+		return {};
+	}
+
+	std::sort(samples.begin(), samples.end());
+
+	size_t count = samples.size();
+
+	// Замер с рангом ceil(percentile * count), считая с 1.
+	auto percentile = [&](double fraction) -> double {
+		size_t rank = static_cast<size_t>(std::ceil(fraction * static_cast<double>(count)));
+
+		return samples[std::clamp<size_t>(rank, 1, count) - 1];
+	};
+
+	double median = (count % 2 == 1) ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2.0;
+
+	return { samples[0], median, percentile(0.95), percentile(0.99) };
+}
+
+double GetNodesPerSecond(const bench_stats_t& stats, size_t nodes)
+{
+	return (stats.median > 0.0) ? static_cast<double>(nodes) * 1e9 / stats.median : 0.0;
+}
+
+void WriteBenchStatsJson(std::ostream& stream, const bench_stats_t& stats, size_t nodes)
+{
+	// Целые числа, чтобы большие времена не уходили в экспоненциальную запись с потерей точности.
+	auto integer = [](double value) -> unsigned long long {
+		return static_cast<unsigned long long>(std::llround(value));
+	};
+
+	stream << "{\"min_ns\": " << integer(stats.min) << ", \"median_ns\": " << integer(stats.median) << ", \"p95_ns\": " << integer(stats.p95) << ", \"p99_ns\": " << integer(stats.p99);
+	stream << ", \"nodes_per_second\": " << integer(GetNodesPerSecond(stats, nodes)) << "}";
+}
+
+int main(int argc, const char** argv)
+{
+	std::string mode = (argc >= 2) ? argv[1] : "";
+
+	// Аргументы после имени режима передаются самому режиму.
+	if (mode == "walk")
+	{
+		return RunWalkBenchmark(argc - 2, argv + 2);
+	}
+
+	if (mode == "pipeline")
+	{
+		return RunPipelineBenchmark(argc - 2, argv + 2);
+	}
+
+	if (mode == "sweep")
+	{
+		return RunSweepBenchmark(argc - 2, argv + 2);
+	}
+
+	if (mode == "edits")
+	{
+		return RunEditsBenchmark(argc - 2, argv + 2);
+	}
+
+	std::cout << "Usage: bench <mode> [arguments]" << std::endl;
+	std::cout << "\t walk [leaves] [repetitions] - ns per leaf of std::function and templated Walk" << std::endl;
+	std::cout << "\t pipeline [leaves,...] [repetitions] [warmup] [json file] - time of every pipeline phase over repeated runs" << std::endl;
+	std::cout << "\t sweep [leaves,...] [repetitions] [json file] - growth of every operation over tree shapes and sizes" << std::endl;
+	std::cout << "\t edits [leaves] [edits] [batch] - incremental ratio index against the full search after random edits" << std::endl;
+
+	return 1;
+}
@@ -0,0 +1,62 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstdlib>
+#include <ostream>
+#include <vector>
+
+#include "btree.hpp"
+
+/*
+	Общие функции бенчмарков. Каждый бенчмарк - это отдельный режим исполняемого файла bench,
+	который выбирается первым аргументом командной строки (например, "bench walk").
+*/
+
+// Замер времени исполнения функции в наносекундах.
+template<typename F>
+double MeasureNanoseconds(F&& function)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	function();
+
+	std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+// Получение числового аргумента командной строки под номером index или значения по умолчанию, если его нет.
+size_t GetBenchArgument(int argc, const char** argv, int index, size_t defaultValue);
+
+// Получение списка чисел через запятую (например, "1000,100000") под номером index или списка по умолчанию.
+std::vector<size_t> GetBenchSizes(int argc, const char** argv, int index, const std::vector<size_t>& defaultSizes);
+
+/*
+	Генерация дерева той же формы, что и у GenerateTree из main.cpp (полное, по уровням, правый потомок первым),
+	со случайными значениями 0..254. Лепестки создаются в арене, а без арены - через new, как в main.cpp без арены.
+*/
+BinaryLeaf<int>* GenerateBenchTree(size_t leaves, LeafArena<int>* arena);
+
+// Сводка по замерам в наносекундах. Перцентили берутся по ближайшему рангу, медиана двух средних - их среднее.
+struct bench_stats_t
+{
+	double min;
+	double median;
+	double p95;
+	double p99;
+};
+
+bench_stats_t GetBenchStats(std::vector<double> samples);
+
+// Лепестков в секунду при медианном времени на nodes лепестков.
+double GetNodesPerSecond(const bench_stats_t& stats, size_t nodes);
+
+// Вывод сводки как JSON-объекта {"min_ns": ..., "median_ns": ..., "p95_ns": ..., "p99_ns": ..., "nodes_per_second": ...} без перевода строки.
+void WriteBenchStatsJson(std::ostream& stream, const bench_stats_t& stats, size_t nodes);
+
+// Режимы бенчмарка.
+
+int RunWalkBenchmark(int argc, const char** argv);
+int RunPipelineBenchmark(int argc, const char** argv);
+int RunSweepBenchmark(int argc, const char** argv);
+int RunEditsBenchmark(int argc, const char** argv);
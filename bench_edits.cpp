@@ -0,0 +1,159 @@
+﻿#include "bench.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <random>
+
+#include "arena.hpp"
+#include "atree.hpp"
+
+// Поиск минимального и максимального отношения, одинаковый у AggregatedBinaryTree и BinaryLeaf.
+struct edits_search_t
+{
+	double min;
+	BinaryLeaf<int>* minHolder;
+
+	double max;
+	BinaryLeaf<int>* maxHolder;
+};
+
+template<typename S>
+static edits_search_t SearchRatios(S& searchable)
+{
+	edits_search_t search = { std::numeric_limits<double>::max(), nullptr, std::numeric_limits<double>::lowest(), nullptr };
+
+	searchable.GetMinMaxWeightSumChildrenRatio(search.min, search.minHolder, search.max, search.maxHolder);
+
+	return search;
+}
+
+// Случайный лепесток из leaves, у которого есть свободное место под потомка.
+static BinaryLeaf<int>* PickFreeParent(const std::vector<BinaryLeaf<int>*>& leaves, std::mt19937& random)
+{
+	while (true)
+	{
+		BinaryLeaf<int>* leaf = leaves[random() % leaves.size()];
+
+		if (*leaf->GetLeftChild() == nullptr || *leaf->GetRightChild() == nullptr)
+		{
+			return leaf;
+		}
+	}
+}
+
+// Добавление лепестка leaf на свободное место лепестка parent через дерево с агрегатами.
+static void AttachToFree(AggregatedBinaryTree<int>& tree, BinaryLeaf<int>* parent, BinaryLeaf<int>* leaf)
+{
+	if (*parent->GetRightChild() == nullptr)
+	{
+		tree.SetRightChild(parent, leaf);
+	}
+	else
+	{
+		tree.SetLeftChild(parent, leaf);
+	}
+}
+
+/*
+	Проверка и замер AggregatedBinaryTree на случайных правках: смене значений, добавлении новых лепестков
+	и переносе лепестков без потомков под другого родителя. После каждой пачки правок ответ индекса сравнивается
+	с полным поиском BinaryLeaf::GetMinMaxWeightSumChildrenRatio по корню - отношения и лепестки должны совпасть.
+*/
+int RunEditsBenchmark(int argc, const char** argv)
+{
+	size_t leaves = GetBenchArgument(argc, argv, 0, 1 << 16);
+	size_t edits = GetBenchArgument(argc, argv, 1, 1 << 14);
+	size_t batch = std::max<size_t>(1, GetBenchArgument(argc, argv, 2, 16));
+
+	LeafArena<int> arena;
+	BinaryLeaf<int>* root = GenerateBenchTree(leaves, &arena);
+
+	// Список всех лепестков дерева. Правки их не удаляют, только добавляют новые.
+	std::vector<BinaryLeaf<int>*> live = {};
+	root->Walk([&](BinaryLeaf<int>* leaf) -> bool {
+		live.push_back(leaf);
+
+		return false;
+	});
+
+	AggregatedBinaryTree<int>* tree = nullptr;
+
+	double buildTime = MeasureNanoseconds([&]() {
+		tree = new AggregatedBinaryTree<int>(root);
+	});
+
+	std::mt19937 random(54321);
+
+	double editTime = 0.0;
+	double indexTime = 0.0;
+	double fullTime = 0.0;
+
+	size_t searches = 0;
+	size_t mismatches = 0;
+
+	for (size_t done = 0; done < edits; done += batch)
+	{
+		size_t count = std::min(batch, edits - done);
+
+		editTime += MeasureNanoseconds([&]() {
+			for (size_t edit = 0; edit < count; edit++)
+			{
+				uint32_t kind = random() % 3;
+
+				if (kind == 0)
+				{
+					tree->SetValue(live[random() % live.size()], static_cast<int>(random() % 255));
+				}
+				else if (kind == 1)
+				{
+					BinaryLeaf<int>* leaf = arena.Create(static_cast<int>(random() % 255));
+
+					AttachToFree(*tree, PickFreeParent(live, random), leaf);
+
+					live.push_back(leaf);
+				}
+				else
+				{
+					// Переносим лепесток без потомков, так что новый родитель не может оказаться внутри его поддерева.
+					BinaryLeaf<int>* leaf = live[random() % live.size()];
+					BinaryLeaf<int>* parent = PickFreeParent(live, random);
+
+					if (leaf != root && leaf != parent && *leaf->GetLeftChild() == nullptr && *leaf->GetRightChild() == nullptr)
+					{
+						AttachToFree(*tree, parent, leaf);
+					}
+				}
+			}
+		});
+
+		edits_search_t incremental = {};
+		edits_search_t full = {};
+
+		indexTime += MeasureNanoseconds([&]() {
+			incremental = SearchRatios(*tree);
+		});
+
+		fullTime += MeasureNanoseconds([&]() {
+			full = SearchRatios(*root);
+		});
+
+		searches++;
+
+		if (incremental.min != full.min || incremental.minHolder != full.minHolder || incremental.max != full.max || incremental.maxHolder != full.maxHolder)
+		{
+			mismatches++;
+		}
+	}
+
+	std::cout << "Aggregated tree over " << leaves << " leaves, " << edits << " edits in batches of " << batch << ":" << std::endl;
+	std::cout << "\t build: " << buildTime / static_cast<double>(leaves) << " ns/leaf, " << tree->GetByteSize() << " bytes" << std::endl;
+	std::cout << "\t edit: " << editTime / static_cast<double>(std::max<size_t>(1, edits)) << " ns/edit" << std::endl;
+	std::cout << "\t index search: " << indexTime / static_cast<double>(std::max<size_t>(1, searches)) << " ns" << std::endl;
+	std::cout << "\t full search: " << fullTime / static_cast<double>(std::max<size_t>(1, searches)) << " ns" << std::endl;
+	std::cout << "\t mismatches: " << mismatches << " of " << searches << " searches" << std::endl;
+
+	delete tree;
+
+	return (mismatches == 0) ? 0 : 1;
+}
@@ -0,0 +1,219 @@
+﻿#include "bench.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Этапы конвейера в порядке исполнения внутри одного прогона.
+typedef uint8_t pipelinephase_t;
+
+namespace PipelinePhase
+{
+	constexpr pipelinephase_t GENERATE = 0;
+	constexpr pipelinephase_t SERIALIZE = 1;
+	constexpr pipelinephase_t DESERIALIZE = 2;
+	constexpr pipelinephase_t SEARCH = 3;
+	constexpr pipelinephase_t BYTE_SIZE = 4;
+	constexpr pipelinephase_t DESTROY = 5;
+
+	constexpr pipelinephase_t COUNT = 6;
+}
+
+static const char* const PIPELINE_PHASE_NAMES[PipelinePhase::COUNT] = {
+	"generate", "serialize", "deserialize", "search", "bytesize", "destroy"
+};
+
+// Замеры одного размера дерева: по вектору времён в наносекундах на каждый этап.
+struct pipeline_result_t
+{
+	size_t leaves;
+	std::vector<double> samples[PipelinePhase::COUNT];
+};
+
+/*
+	Один прогон конвейера над деревом из leaves лепестков: генерация, запись текстом, чтение обратно,
+	поиск отношений, подсчёт размера и удаление дерева. Лепестки создаются через new, как в main.cpp без арены,
+	чтобы удаление мерило деструктор BinaryLeaf. Замеры добавляются в result, если record.
+	sink собирает результаты этапов, чтобы компилятор их не выбросил.
+*/
+static bool RunPipeline(size_t leaves, WorkStealingPool& pool, pipeline_result_t& result, bool record, double& sink)
+{
+	double elapsed[PipelinePhase::COUNT] = {};
+
+	BinaryLeaf<int>* tree = nullptr;
+
+	elapsed[PipelinePhase::GENERATE] = MeasureNanoseconds([&]() {
+		tree = GenerateBenchTree(leaves, nullptr);
+	});
+
+	std::string text = {};
+
+	elapsed[PipelinePhase::SERIALIZE] = MeasureNanoseconds([&]() {
+		std::ostringstream output;
+		tree->Serialize(output);
+
+		text = std::move(output).str();
+	});
+
+	BinaryLeaf<int>* loaded = nullptr;
+	bool deserialized = false;
+
+	elapsed[PipelinePhase::DESERIALIZE] = MeasureNanoseconds([&]() {
+		std::istringstream input(text);
+
+		deserialized = BinaryLeaf<int>::Deserialize(input, &loaded, [](const std::string& value) -> int {
+			return std::stoi(value);
+		});
+	});
+
+	// Поиск идёт по прочитанному дереву, как в main.cpp после загрузки.
+	if (!deserialized || loaded == nullptr)
+	{
+		delete tree;
+
+		return false;
+	}
+
+	elapsed[PipelinePhase::SEARCH] = MeasureNanoseconds([&]() {
+		BinaryLeaf<int>* minHolder = nullptr;
+		BinaryLeaf<int>* maxHolder = nullptr;
+
+		double minRatio = 99999999.0;
+		double maxRatio = 0.0;
+
+		loaded->GetMinMaxWeightSumChildrenRatio(minRatio, minHolder, maxRatio, maxHolder, pool);
+
+		sink += minRatio + maxRatio;
+	});
+
+	elapsed[PipelinePhase::BYTE_SIZE] = MeasureNanoseconds([&]() {
+		sink += static_cast<double>(loaded->GetByteSize());
+	});
+
+	elapsed[PipelinePhase::DESTROY] = MeasureNanoseconds([&]() {
+		delete loaded;
+	});
+
+	delete tree;
+
+	if (record)
+	{
+		for (pipelinephase_t phase = 0; phase < PipelinePhase::COUNT; phase++)
+		{
+			result.samples[phase].push_back(elapsed[phase]);
+		}
+	}
+
+	return true;
+}
+
+// Результаты всех размеров в JSON, чтобы их можно было собирать между запусками.
+static bool WritePipelineJson(const char* path, const std::vector<pipeline_result_t>& results, size_t repetitions, size_t warmup)
+{
+	std::ofstream output = std::ofstream(path);
+
+	if (!output.is_open())
+	{
+		return false;
+	}
+
+	output << "{" << std::endl;
+	output << "\t\"benchmark\": \"pipeline\"," << std::endl;
+	output << "\t\"repetitions\": " << repetitions << "," << std::endl;
+	output << "\t\"warmup\": " << warmup << "," << std::endl;
+	output << "\t\"results\": [" << std::endl;
+
+	for (size_t index = 0; index < results.size(); index++)
+	{
+		const pipeline_result_t& result = results[index];
+
+		output << "\t\t{" << std::endl;
+		output << "\t\t\t\"leaves\": " << result.leaves << "," << std::endl;
+		output << "\t\t\t\"phases\": {" << std::endl;
+
+		for (pipelinephase_t phase = 0; phase < PipelinePhase::COUNT; phase++)
+		{
+			output << "\t\t\t\t\"" << PIPELINE_PHASE_NAMES[phase] << "\": ";
+			WriteBenchStatsJson(output, GetBenchStats(result.samples[phase]), result.leaves);
+			output << ((phase + 1 < PipelinePhase::COUNT) ? "," : "") << std::endl;
+		}
+
+		output << "\t\t\t}" << std::endl;
+		output << "\t\t}" << ((index + 1 < results.size()) ? "," : "") << std::endl;
+	}
+
+	output << "\t]" << std::endl;
+	output << "}" << std::endl;
+
+	return output.good();
+}
+
+/*
+	Время каждого этапа конвейера main.cpp по многим прогонам. Первые warmup прогонов не учитываются
+	(прогрев кэшей, аллокатора и пула), по остальным выводятся минимум, медиана, p95, p99 и лепестков в секунду
+	при медианном времени. Аргументы: размеры через запятую, количество прогонов, прогрев и путь к JSON-файлу.
+*/
+int RunPipelineBenchmark(int argc, const char** argv)
+{
+	std::vector<size_t> sizes = GetBenchSizes(argc, argv, 0, { 1 << 16, 1 << 20 });
+	size_t repetitions = GetBenchArgument(argc, argv, 1, 10);
+	size_t warmup = GetBenchArgument(argc, argv, 2, 2);
+	const char* jsonPath = (argc > 3) ? argv[3] : nullptr;
+
+	WorkStealingPool pool;
+
+	std::vector<pipeline_result_t> results = {};
+
+	double sink = 0.0;
+
+	for (size_t leaves : sizes)
+	{
+		if (leaves == 0 || repetitions == 0)
+		{
+			continue;
+		}
+
+		pipeline_result_t result = {};
+		result.leaves = leaves;
+
+		for (size_t run = 0; run < warmup + repetitions; run++)
+		{
+			if (!RunPipeline(leaves, pool, result, run >= warmup, sink))
+			{
+				std::cout << "Failed to read back the serialized tree of " << leaves << " leaves" << std::endl;
+
+				return 1;
+			}
+		}
+
+		std::cout << "Pipeline over " << leaves << " leaves, " << repetitions << " runs after " << warmup << " warmup runs:" << std::endl;
+
+		for (pipelinephase_t phase = 0; phase < PipelinePhase::COUNT; phase++)
+		{
+			bench_stats_t stats = GetBenchStats(result.samples[phase]);
+
+			std::cout << "\t " << PIPELINE_PHASE_NAMES[phase] << ": min " << stats.min / 1e6 << " ms, median " << stats.median / 1e6
+				<< " ms, p95 " << stats.p95 / 1e6 << " ms, p99 " << stats.p99 / 1e6 << " ms, "
+				<< GetNodesPerSecond(stats, leaves) / 1e6 << " M leaves/s" << std::endl;
+		}
+
+		results.push_back(std::move(result));
+	}
+
+	std::cout << "(checksum " << sink << ")" << std::endl;
+
+	if (jsonPath != nullptr)
+	{
+		if (!WritePipelineJson(jsonPath, results, repetitions, warmup))
+		{
+			std::cout << "Failed to write " << jsonPath << std::endl;
+
+			return 1;
+		}
+
+		std::cout << "Results written to " << jsonPath << std::endl;
+	}
+
+	return 0;
+}
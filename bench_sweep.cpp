@@ -0,0 +1,580 @@
+﻿#include "bench.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+
+// Формы деревьев, на которых меряются операции.
+typedef uint8_t benchshape_t;
+
+namespace BenchShape
+{
+	// Полное дерево, как у GenerateTree из main.cpp.
+	constexpr benchshape_t COMPLETE = 0;
+
+	// Цепочка: у каждого лепестка один потомок со случайной стороны. Глубина равна количеству лепестков.
+	constexpr benchshape_t DEGENERATE = 1;
+
+	// Двоичное дерево поиска из случайных ключей, вставленных по очереди. Глубина - O(log n) в среднем.
+	constexpr benchshape_t RANDOM_BST = 2;
+
+	// "Гребёнка": длинная цепочка влево (или вправо), у каждого её лепестка есть ещё лист с другой стороны.
+	constexpr benchshape_t LEFT_SKEWED = 3;
+	constexpr benchshape_t RIGHT_SKEWED = 4;
+
+	// Дерево Гальтона-Ватсона (0, 1 или 2 потомка с вероятностями 1/4, 1/2, 1/4) ровно из n лепестков. Глубина - O(sqrt(n)).
+	constexpr benchshape_t GALTON_WATSON = 5;
+
+	constexpr benchshape_t COUNT = 6;
+}
+
+static const char* const BENCH_SHAPE_NAMES[BenchShape::COUNT] = {
+	"complete", "degenerate", "random-bst", "left-skewed", "right-skewed", "galton-watson"
+};
+
+// Операции над деревом в порядке исполнения внутри одного прогона.
+typedef uint8_t sweepop_t;
+
+namespace SweepOp
+{
+	constexpr sweepop_t BUILD = 0;
+	constexpr sweepop_t WALK = 1;
+	constexpr sweepop_t SEARCH = 2;
+	constexpr sweepop_t BYTE_SIZE = 3;
+	constexpr sweepop_t SERIALIZE = 4;
+	constexpr sweepop_t DESTROY = 5;
+
+	constexpr sweepop_t COUNT = 6;
+}
+
+static const char* const SWEEP_OP_NAMES[SweepOp::COUNT] = {
+	"build", "walk", "search", "bytesize", "serialize", "destroy"
+};
+
+// Все операции ожидаются линейными, кроме построения дерева поиска: каждая вставка спускается на O(log n).
+static bool HasLogFactor(benchshape_t shape, sweepop_t op)
+{
+	return shape == BenchShape::RANDOM_BST && op == SweepOp::BUILD;
+}
+
+// Насколько подобранный показатель может превышать ожидаемый 1, прежде чем операция будет отмечена.
+constexpr double EXPONENT_TOLERANCE = 0.2;
+
+static BinaryLeaf<int>* CreateLeaf(std::mt19937_64& random)
+{
+	return new BinaryLeaf<int>(static_cast<int>(random() % 255));
+}
+
+static BinaryLeaf<int>* GenerateDegenerate(size_t leaves, std::mt19937_64& random)
+{
+	BinaryLeaf<int>* root = CreateLeaf(random);
+	BinaryLeaf<int>* last = root;
+
+	for (size_t index = 1; index < leaves; index++)
+	{
+		BinaryLeaf<int>* leaf = CreateLeaf(random);
+
+		if (random() % 2 == 0)
+		{
+			last->SetLeftChild(leaf);
+		}
+		else
+		{
+			last->SetRightChild(leaf);
+		}
+
+		last = leaf;
+	}
+
+	return root;
+}
+
+/*
+	Ключи вставляются по очереди, как в обычное дерево поиска. На время построения ключ хранится
+	в значении лепестка, а потом значения заменяются случайными 0..254, как у остальных форм.
+*/
+static BinaryLeaf<int>* GenerateRandomBst(size_t leaves, std::mt19937_64& random)
+{
+	std::uniform_int_distribution<int> keys(0, std::numeric_limits<int>::max());
+
+	BinaryLeaf<int>* root = new BinaryLeaf<int>(keys(random));
+
+	for (size_t index = 1; index < leaves; index++)
+	{
+		int key = keys(random);
+
+		BinaryLeaf<int>* current = root;
+
+		while (true)
+		{
+			bool left = key < current->GetValue();
+			BinaryLeaf<int>* next = left ? *current->GetLeftChild() : *current->GetRightChild();
+
+			if (next != nullptr)
+			{
+				current = next;
+
+				continue;
+			}
+
+			BinaryLeaf<int>* leaf = new BinaryLeaf<int>(key);
+
+			if (left)
+			{
+				current->SetLeftChild(leaf);
+			}
+			else
+			{
+				current->SetRightChild(leaf);
+			}
+
+			break;
+		}
+	}
+
+	root->Walk<WalkOrder::PreOrder>([&](BinaryLeaf<int>* leaf) {
+		leaf->SetValue(static_cast<int>(random() % 255));
+	});
+
+	return root;
+}
+
+static BinaryLeaf<int>* GenerateSkewed(size_t leaves, bool leftSpine, std::mt19937_64& random)
+{
+	BinaryLeaf<int>* root = CreateLeaf(random);
+	BinaryLeaf<int>* spine = root;
+
+	size_t created = 1;
+
+	while (created < leaves)
+	{
+		BinaryLeaf<int>* next = CreateLeaf(random);
+		created++;
+
+		if (leftSpine)
+		{
+			spine->SetLeftChild(next);
+		}
+		else
+		{
+			spine->SetRightChild(next);
+		}
+
+		if (created < leaves)
+		{
+			BinaryLeaf<int>* side = CreateLeaf(random);
+			created++;
+
+			if (leftSpine)
+			{
+				spine->SetRightChild(side);
+			}
+			else
+			{
+				spine->SetLeftChild(side);
+			}
+		}
+
+		spine = next;
+	}
+
+	return root;
+}
+
+/*
+	Дерево Гальтона-Ватсона, обусловленное размером, - это равномерно случайное двоичное дерево из leaves лепестков.
+	Перезапускать вырождающийся процесс не нужно: из 2 * leaves мест для потомков выбираются ровно leaves - 1,
+	а по циклической лемме ровно один циклический сдвиг такой последовательности лепестков - корректный
+	прямой (pre-order) обход дерева. Сдвиг начинается сразу после первого минимума префиксных сумм (потомки - 1).
+*/
+static BinaryLeaf<int>* GenerateGaltonWatson(size_t leaves, std::mt19937_64& random)
+{
+	// Бит 0 - у лепестка есть правый потомок, бит 1 - левый.
+	std::vector<uint8_t> slots(leaves, 0);
+
+	// Выборка ровно leaves - 1 мест за один проход: место берётся с вероятностью (сколько ещё нужно) / (сколько осталось).
+	size_t needed = leaves - 1;
+	size_t remaining = 2 * leaves;
+
+	for (size_t slot = 0; slot < 2 * leaves; slot++, remaining--)
+	{
+		if (random() % remaining < needed)
+		{
+			slots[slot / 2] |= static_cast<uint8_t>(1 << (slot % 2));
+			needed--;
+		}
+	}
+
+	int64_t sum = 0;
+	int64_t minimum = 0;
+	size_t start = 0;
+
+	for (size_t index = 0; index < leaves; index++)
+	{
+		sum += std::popcount(slots[index]) - 1;
+
+		if (sum < minimum)
+		{
+			minimum = sum;
+			start = index + 1;
+		}
+	}
+
+	start %= leaves;
+
+	// Места, ждущие потомка. Правое место кладётся последним, чтобы правое поддерево строилось первым.
+	struct pending_slot_t
+	{
+		BinaryLeaf<int>* parent;
+		bool left;
+	};
+
+	std::vector<pending_slot_t> pending = {};
+
+	BinaryLeaf<int>* root = nullptr;
+
+	for (size_t offset = 0; offset < leaves; offset++)
+	{
+		uint8_t children = slots[(start + offset) % leaves];
+
+		BinaryLeaf<int>* leaf = CreateLeaf(random);
+
+		if (root == nullptr)
+		{
+			root = leaf;
+		}
+		else
+		{
+			pending_slot_t slot = pending.back();
+			pending.pop_back();
+
+			if (slot.left)
+			{
+				slot.parent->SetLeftChild(leaf);
+			}
+			else
+			{
+				slot.parent->SetRightChild(leaf);
+			}
+		}
+
+		if ((children & 2) != 0)
+		{
+			pending.push_back({ leaf, true });
+		}
+
+		if ((children & 1) != 0)
+		{
+			pending.push_back({ leaf, false });
+		}
+	}
+
+	return root;
+}
+
+static BinaryLeaf<int>* GenerateShape(benchshape_t shape, size_t leaves, std::mt19937_64& random)
+{
+	switch (shape)
+	{
+	case BenchShape::COMPLETE:
+		return GenerateBenchTree(leaves, nullptr);
+	case BenchShape::DEGENERATE:
+		return GenerateDegenerate(leaves, random);
+	case BenchShape::RANDOM_BST:
+		return GenerateRandomBst(leaves, random);
+	case BenchShape::LEFT_SKEWED:
+		return GenerateSkewed(leaves, true, random);
+	case BenchShape::RIGHT_SKEWED:
+		return GenerateSkewed(leaves, false, random);
+	default:
+		return GenerateGaltonWatson(leaves, random);
+	}
+}
+
+// Один прогон всех операций над деревом формы shape. Время операций в наносекундах записывается в elapsed.
+static void RunSweep(benchshape_t shape, size_t leaves, std::mt19937_64& random, double* elapsed, double& sink)
+{
+	BinaryLeaf<int>* tree = nullptr;
+
+	elapsed[SweepOp::BUILD] = MeasureNanoseconds([&]() {
+		tree = GenerateShape(shape, leaves, random);
+	});
+
+	elapsed[SweepOp::WALK] = MeasureNanoseconds([&]() {
+		long long sum = 0;
+
+		tree->Walk<WalkOrder::BFS>([&](BinaryLeaf<int>* leaf) {
+			sum += leaf->GetValue();
+		});
+
+		sink += static_cast<double>(sum);
+	});
+
+	elapsed[SweepOp::SEARCH] = MeasureNanoseconds([&]() {
+		BinaryLeaf<int>* minHolder = nullptr;
+		BinaryLeaf<int>* maxHolder = nullptr;
+
+		double minRatio = 99999999.0;
+		double maxRatio = 0.0;
+
+		tree->GetMinMaxWeightSumChildrenRatio(minRatio, minHolder, maxRatio, maxHolder);
+
+		sink += minRatio + maxRatio;
+	});
+
+	elapsed[SweepOp::BYTE_SIZE] = MeasureNanoseconds([&]() {
+		sink += static_cast<double>(tree->GetByteSize());
+	});
+
+	elapsed[SweepOp::SERIALIZE] = MeasureNanoseconds([&]() {
+		std::ostringstream output;
+		tree->Serialize(output);
+
+		sink += static_cast<double>(output.tellp());
+	});
+
+	elapsed[SweepOp::DESTROY] = MeasureNanoseconds([&]() {
+		delete tree;
+	});
+}
+
+/*
+	Показатель степени k в time ~ n^k (или n^k * log n, если logFactor) методом наименьших квадратов
+	по логарифмам. Возвращает NaN, если различных размеров меньше двух.
+*/
+static double FitExponent(const std::vector<size_t>& sizes, const std::vector<double>& times, bool logFactor)
+{
+	std::vector<double> x = {};
+	std::vector<double> y = {};
+
+	for (size_t index = 0; index < sizes.size(); index++)
+	{
+		double size = static_cast<double>(sizes[index]);
+		double time = logFactor ? times[index] / std::log2(std::max(size, 2.0)) : times[index];
+
+		x.push_back(std::log(size));
+		y.push_back(std::log(std::max(time, 1.0)));
+	}
+
+	double meanX = 0.0;
+	double meanY = 0.0;
+
+	for (size_t index = 0; index < x.size(); index++)
+	{
+		meanX += x[index];
+		meanY += y[index];
+	}
+
+	meanX /= static_cast<double>(x.size());
+	meanY /= static_cast<double>(y.size());
+
+	double covariance = 0.0;
+	double variance = 0.0;
+
+	for (size_t index = 0; index < x.size(); index++)
+	{
+		covariance += (x[index] - meanX) * (y[index] - meanY);
+		variance += (x[index] - meanX) * (x[index] - meanX);
+	}
+
+	return (variance > 0.0) ? covariance / variance : std::nan("");
+}
+
+// Результаты одной формы: лучшее время каждой операции на каждом размере и подобранные показатели.
+struct sweep_result_t
+{
+	benchshape_t shape;
+	std::vector<double> best[SweepOp::COUNT];
+	double exponents[SweepOp::COUNT];
+};
+
+static bool IsFlagged(const sweep_result_t& result, sweepop_t op)
+{
+	return !std::isnan(result.exponents[op]) && result.exponents[op] > 1.0 + EXPONENT_TOLERANCE;
+}
+
+static bool WriteSweepJson(const char* path, const std::vector<size_t>& sizes, const std::vector<sweep_result_t>& results, size_t repetitions)
+{
+	std::ofstream output = std::ofstream(path);
+
+	if (!output.is_open())
+	{
+		return false;
+	}
+
+	output << "{" << std::endl;
+	output << "\t\"benchmark\": \"sweep\"," << std::endl;
+	output << "\t\"repetitions\": " << repetitions << "," << std::endl;
+
+	output << "\t\"sizes\": [";
+
+	for (size_t index = 0; index < sizes.size(); index++)
+	{
+		output << ((index > 0) ? ", " : "") << sizes[index];
+	}
+
+	output << "]," << std::endl;
+	output << "\t\"shapes\": {" << std::endl;
+
+	for (size_t index = 0; index < results.size(); index++)
+	{
+		const sweep_result_t& result = results[index];
+
+		output << "\t\t\"" << BENCH_SHAPE_NAMES[result.shape] << "\": {" << std::endl;
+
+		for (sweepop_t op = 0; op < SweepOp::COUNT; op++)
+		{
+			output << "\t\t\t\"" << SWEEP_OP_NAMES[op] << "\": {\"min_ns\": [";
+
+			for (size_t size = 0; size < result.best[op].size(); size++)
+			{
+				output << ((size > 0) ? ", " : "") << static_cast<unsigned long long>(std::llround(result.best[op][size]));
+			}
+
+			output << "], \"expected\": \"" << (HasLogFactor(result.shape, op) ? "n log n" : "n") << "\"";
+
+			// В JSON нет NaN, поэтому неподобранный показатель пишется как null.
+			if (std::isnan(result.exponents[op]))
+			{
+				output << ", \"exponent\": null";
+			}
+			else
+			{
+				output << ", \"exponent\": " << result.exponents[op];
+			}
+
+			output << ", \"flagged\": " << (IsFlagged(result, op) ? "true" : "false") << "}";
+			output << ((op + 1 < SweepOp::COUNT) ? "," : "") << std::endl;
+		}
+
+		output << "\t\t}" << ((index + 1 < results.size()) ? "," : "") << std::endl;
+	}
+
+	output << "\t}" << std::endl;
+	output << "}" << std::endl;
+
+	return output.good();
+}
+
+/*
+	Прогон операций над деревьями всех форм на ряде размеров. По лучшему из repetitions прогонов на каждом размере
+	подбирается показатель степени роста каждой операции. Операция отмечается, если растёт заметно быстрее ожидаемого:
+	так видны формы, на которых алгоритм незаметно становится квадратичным. Аргументы: размеры через запятую
+	(1K..100M, но 100M лепестков - это несколько гигабайт), количество прогонов и путь к JSON-файлу.
+*/
+int RunSweepBenchmark(int argc, const char** argv)
+{
+	std::vector<size_t> sizes = GetBenchSizes(argc, argv, 0, { 1000, 10000, 100000, 1000000 });
+	size_t repetitions = std::max<size_t>(GetBenchArgument(argc, argv, 1, 3), 1);
+	const char* jsonPath = (argc > 2) ? argv[2] : nullptr;
+
+	sizes.erase(std::remove(sizes.begin(), sizes.end(), 0), sizes.end());
+
+	if (sizes.size() == 0)
+	{
+		std::cout << "No tree sizes to sweep" << std::endl;
+
+		return 1;
+	}
+
+	// Фиксированный сид, чтобы повторные запуски мерили одни и те же деревья.
+	std::mt19937_64 random(12345);
+
+	std::vector<sweep_result_t> results = {};
+
+	double sink = 0.0;
+	size_t flagged = 0;
+
+	for (benchshape_t shape = 0; shape < BenchShape::COUNT; shape++)
+	{
+		sweep_result_t result = {};
+		result.shape = shape;
+
+		std::cout << "Shape " << BENCH_SHAPE_NAMES[shape] << ", ns per leaf (best of " << repetitions << " runs):" << std::endl;
+		std::cout << "\t leaves";
+
+		for (sweepop_t op = 0; op < SweepOp::COUNT; op++)
+		{
+			std::cout << "\t " << SWEEP_OP_NAMES[op];
+		}
+
+		std::cout << std::endl;
+
+		for (size_t leaves : sizes)
+		{
+			double best[SweepOp::COUNT] = {};
+
+			for (size_t repetition = 0; repetition < repetitions; repetition++)
+			{
+				double elapsed[SweepOp::COUNT] = {};
+
+				RunSweep(shape, leaves, random, elapsed, sink);
+
+				for (sweepop_t op = 0; op < SweepOp::COUNT; op++)
+				{
+					best[op] = (repetition == 0) ? elapsed[op] : std::min(best[op], elapsed[op]);
+				}
+			}
+
+			std::cout << "\t " << leaves;
+
+			for (sweepop_t op = 0; op < SweepOp::COUNT; op++)
+			{
+				result.best[op].push_back(best[op]);
+
+				std::cout << "\t " << best[op] / static_cast<double>(leaves);
+			}
+
+			std::cout << std::endl;
+		}
+
+		std::cout << "\t exponents:";
+
+		for (sweepop_t op = 0; op < SweepOp::COUNT; op++)
+		{
+			result.exponents[op] = FitExponent(sizes, result.best[op], HasLogFactor(shape, op));
+
+			std::cout << " " << SWEEP_OP_NAMES[op] << " " << result.exponents[op] << (HasLogFactor(shape, op) ? " (over log n)" : "");
+		}
+
+		std::cout << std::endl;
+
+		for (sweepop_t op = 0; op < SweepOp::COUNT; op++)
+		{
+			if (IsFlagged(result, op))
+			{
+				std::cout << "\t WARNING: " << SWEEP_OP_NAMES[op] << " grows as n^" << result.exponents[op]
+					<< (HasLogFactor(shape, op) ? " log n" : "") << ", expected n^1" << (HasLogFactor(shape, op) ? " log n" : "") << std::endl;
+
+				flagged++;
+			}
+		}
+
+		std::cout << std::endl;
+
+		results.push_back(std::move(result));
+	}
+
+	std::cout << flagged << " operations grow faster than expected" << std::endl;
+	std::cout << "(checksum " << sink << ")" << std::endl;
+
+	if (jsonPath != nullptr)
+	{
+		if (!WriteSweepJson(jsonPath, sizes, results, repetitions))
+		{
+			std::cout << "Failed to write " << jsonPath << std::endl;
+
+			return 1;
+		}
+
+		std::cout << "Results written to " << jsonPath << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+﻿#include "bench.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+// Лучшее время из repetitions прогонов одного обхода, в наносекундах на лепесток.
+template<typename F>
+double MeasureWalk(size_t leaves, size_t repetitions, F&& walk)
+{
+	double best = 0.0;
+
+	for (size_t repetition = 0; repetition < repetitions; repetition++)
+	{
+		double elapsed = MeasureNanoseconds(walk);
+
+		best = (repetition == 0) ? elapsed : std::min(best, elapsed);
+	}
+
+	return best / static_cast<double>(leaves);
+}
+
+/*
+	Сравнение обхода через std::function с шаблонным Walk. Visitor во всех случаях одинаковый - сумма значений,
+	так что разница во времени - это стоимость вызова через std::function и порядка обхода.
+*/
+int RunWalkBenchmark(int argc, const char** argv)
+{
+	size_t leaves = GetBenchArgument(argc, argv, 0, 1 << 22);
+	size_t repetitions = GetBenchArgument(argc, argv, 1, 5);
+
+	LeafArena<int> arena;
+	BinaryLeaf<int>* tree = GenerateBenchTree(leaves, &arena);
+
+	// Сумма выводится в конце, чтобы компилятор не выбросил обходы.
+	long long sink = 0;
+
+	BinaryLeaf<int>::walk_callback_t function = [&](BinaryLeaf<int>* leaf) -> bool {
+		sink += leaf->GetValue();
+
+		return false;
+	};
+
+	auto visitor = [&](BinaryLeaf<int>* leaf) {
+		sink += leaf->GetValue();
+	};
+
+	double functionBFS = MeasureWalk(leaves, repetitions, [&]() {
+		tree->Walk(function);
+	});
+
+	double templateBFS = MeasureWalk(leaves, repetitions, [&]() {
+		tree->Walk<WalkOrder::BFS>(visitor);
+	});
+
+	double templatePreOrder = MeasureWalk(leaves, repetitions, [&]() {
+		tree->Walk<WalkOrder::PreOrder>(visitor);
+	});
+
+	double templatePostOrder = MeasureWalk(leaves, repetitions, [&]() {
+		tree->Walk<WalkOrder::PostOrder>(visitor);
+	});
+
+	double templateInOrder = MeasureWalk(leaves, repetitions, [&]() {
+		tree->Walk<WalkOrder::InOrder>(visitor);
+	});
+
+	std::cout << "Walk over " << leaves << " leaves, best of " << repetitions << " runs:" << std::endl;
+	std::cout << "\t std::function, BFS: " << functionBFS << " ns/leaf" << std::endl;
+	std::cout << "\t template, BFS: " << templateBFS << " ns/leaf" << std::endl;
+	std::cout << "\t template, pre-order: " << templatePreOrder << " ns/leaf" << std::endl;
+	std::cout << "\t template, post-order: " << templatePostOrder << " ns/leaf" << std::endl;
+	std::cout << "\t template, in-order: " << templateInOrder << " ns/leaf" << std::endl;
+	std::cout << "(checksum " << sink << ")" << std::endl;
+
+	return 0;
+}
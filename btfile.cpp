@@ -0,0 +1,269 @@
+﻿#include "btfile.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "checksum.hpp"
+
+bool btfile::HasMagic(const uint8_t* data, size_t size)
+{
+	return size >= sizeof(MAGIC) && std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+bool btfile::IsBinaryFile(const char* path)
+{
+	std::ifstream stream = std::ifstream(path, std::ios::binary);
+
+	char magic[sizeof(MAGIC)] = {};
+	stream.read(magic, sizeof(magic));
+
+	return stream.gcount() == sizeof(magic) && HasMagic(reinterpret_cast<const uint8_t*>(magic), sizeof(magic));
+}
+
+// Контрольная сумма заголовка - CRC32C всех его байт при нулевом headerChecksum.
+static uint32_t GetHeaderChecksum(const btfile_header_t& header)
+{
+	btfile_header_t copy = header;
+	copy.headerChecksum = 0;
+
+	return checksum::Crc32c(&copy, sizeof(copy));
+}
+
+// Согласованы ли длины одного закодированного массива из count значений: всего массива или одного куска.
+static bool CheckBlockSizes(btencoding_t encoding, uint64_t count, uint8_t valueSize, uint64_t dataSize, uint64_t packedSize)
+{
+	// Сравнения построены так, чтобы не переполниться.
+	if (encoding == BtEncoding::RAW)
+	{
+		return dataSize / valueSize == count && dataSize % valueSize == 0 && packedSize == dataSize;
+	}
+
+	// Упакованный массив не длиннее GetMaxPackedSize. Иначе повреждённый packedSize заставил бы выделить сколько угодно памяти.
+	if (count > std::numeric_limits<uint64_t>::max() / 16 || packedSize > packing::GetMaxPackedSize(count))
+	{
+		return false;
+	}
+
+	return encoding == BtEncoding::PACKED_LZ || packedSize == dataSize;
+}
+
+bool btfile::CheckHeader(const btfile_header_t& header)
+{
+	// Значения записаны в little-endian и используются без преобразования.
+	if constexpr (std::endian::native != std::endian::little)
+	{
+		return false;
+	}
+
+	if (!HasMagic(reinterpret_cast<const uint8_t*>(header.magic), sizeof(header.magic)))
+	{
+		return false;
+	}
+
+	if (header.version != VERSION || header.headerChecksum != GetHeaderChecksum(header))
+	{
+		return false;
+	}
+
+	if (header.valueSize == 0 || header.dataOffset < sizeof(btfile_header_t))
+	{
+		return false;
+	}
+
+	// Форма LOUDS лежит сразу за заголовком и занимает столько слов, сколько нужно на nodeCount лепестков.
+	if (header.shape == BtShape::LOUDS)
+	{
+		if (header.nodeCount > std::numeric_limits<uint64_t>::max() / 16 || header.dataOffset != sizeof(btfile_header_t) + LoudsShape::GetWordCount(static_cast<size_t>(header.nodeCount)) * sizeof(uint64_t))
+		{
+			return false;
+		}
+	}
+	else if (header.shape != BtShape::COMPLETE)
+	{
+		return false;
+	}
+
+	if (header.encoding != BtEncoding::RAW && header.encoding != BtEncoding::PACKED && header.encoding != BtEncoding::PACKED_LZ)
+	{
+		return false;
+	}
+
+	// Кусками пишется только полное дерево. Длины кусков проверяет GetChunk, здесь - только то, что оглавление помещается в массив.
+	if (header.chunkSize > 0)
+	{
+		return header.shape == BtShape::COMPLETE && header.packedSize == 0 && GetChunkCount(header) <= header.dataSize / sizeof(btfile_chunk_t);
+	}
+
+	return CheckBlockSizes(header.encoding, header.nodeCount, header.valueSize, header.dataSize, header.packedSize);
+}
+
+bool btfile::ReadHeader(const uint8_t* data, size_t size, btfile_header_t& header)
+{
+	if (size < sizeof(btfile_header_t) || !HasMagic(data, size))
+	{
+		return false;
+	}
+
+	std::memcpy(&header, data, sizeof(header));
+
+	if (!CheckHeader(header))
+	{
+		return false;
+	}
+
+	// Массив значений должен целиком помещаться в файле.
+	return header.dataOffset <= size && header.dataSize <= size - header.dataOffset;
+}
+
+bool btfile::ReadHeader(const char* path, btfile_header_t& header)
+{
+	std::ifstream stream = std::ifstream(path, std::ios::binary);
+	stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+	return stream.gcount() == sizeof(header) && CheckHeader(header);
+}
+
+uint64_t btfile::GetChunkCount(const btfile_header_t& header)
+{
+	if (header.chunkSize == 0)
+	{
+		return 0;
+	}
+
+	return header.nodeCount / header.chunkSize + (header.nodeCount % header.chunkSize != 0);
+}
+
+bool btfile::GetChunk(const btfile_header_t& header, const uint8_t* data, size_t chunk, btfile_chunk_t& entry)
+{
+	std::memcpy(&entry, data + chunk * sizeof(btfile_chunk_t), sizeof(entry));
+
+	uint64_t count = std::min<uint64_t>(header.chunkSize, header.nodeCount - chunk * header.chunkSize);
+	uint64_t indexSize = GetChunkCount(header) * sizeof(btfile_chunk_t);
+
+	if (entry.offset < indexSize || entry.offset > header.dataSize || entry.size > header.dataSize - entry.offset)
+	{
+		return false;
+	}
+
+	return CheckBlockSizes(header.encoding, count, header.valueSize, entry.size, entry.packedSize);
+}
+
+bool btfile::VerifyChunk(const uint8_t* data, const btfile_chunk_t& entry)
+{
+	return checksum::Crc32c(data + entry.offset, static_cast<size_t>(entry.size)) == entry.checksum;
+}
+
+bool btfile::VerifyData(const uint8_t* data, const btfile_header_t& header)
+{
+	return checksum::Crc32c(data + header.dataOffset, static_cast<size_t>(header.dataSize)) == header.dataChecksum;
+}
+
+bool btfile::Verify(const uint8_t* data, size_t size)
+{
+	btfile_header_t header = {};
+
+	if (!ReadHeader(data, size, header))
+	{
+		return false;
+	}
+
+	if (header.shape == BtShape::LOUDS)
+	{
+		const uint8_t* shapeData = data + sizeof(btfile_header_t);
+		size_t shapeSize = static_cast<size_t>(header.dataOffset) - sizeof(btfile_header_t);
+
+		if (checksum::Crc32c(shapeData, shapeSize) != header.shapeChecksum)
+		{
+			return false;
+		}
+
+		// Сумма сходится и у формы, записанной неправильно, поэтому форма ещё и строится. Слова копируются, только если data не выровнен.
+		size_t nodeCount = static_cast<size_t>(header.nodeCount);
+		size_t wordCount = shapeSize / sizeof(uint64_t);
+
+		LoudsShape shape;
+		bool valid = false;
+
+		if (reinterpret_cast<uintptr_t>(shapeData) % alignof(uint64_t) == 0)
+		{
+			valid = shape.AssignView(reinterpret_cast<const uint64_t*>(shapeData), wordCount, nodeCount);
+		}
+		else
+		{
+			std::vector<uint64_t> words(wordCount);
+			std::memcpy(words.data(), shapeData, shapeSize);
+
+			valid = shape.Assign(std::move(words), nodeCount);
+		}
+
+		if (!valid)
+		{
+			return false;
+		}
+	}
+
+	if (!VerifyData(data, header))
+	{
+		return false;
+	}
+
+	// Сумма массива покрывает и оглавление, и куски, так что остаётся проверить, что оглавление согласовано.
+	btfile_chunk_t entry = {};
+
+	for (uint64_t chunk = 0; chunk < GetChunkCount(header); chunk++)
+	{
+		if (!GetChunk(header, data + header.dataOffset, static_cast<size_t>(chunk), entry))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool btfile::Verify(const char* path)
+{
+	MappedFile file;
+
+	if (!file.Open(path))
+	{
+		return false;
+	}
+
+	file.Advise(MapAccess::SEQUENTIAL);
+
+	return Verify(file.GetData(), file.GetSize());
+}
+
+void btfile::FillHeader(btfile_header_t& header, btvalue_t valueType, uint8_t valueSize, uint16_t rootDepth, uint64_t nodeCount,
+	btencoding_t encoding, uint32_t chunkSize, const void* data, uint64_t dataSize, uint64_t packedSize, const LoudsShape* shape)
+{
+	header = {};
+
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+
+	header.valueType = valueType;
+	header.valueSize = valueSize;
+	header.shape = (shape != nullptr) ? BtShape::LOUDS : BtShape::COMPLETE;
+	header.encoding = encoding;
+	header.chunkSize = chunkSize;
+	header.rootDepth = rootDepth;
+
+	header.nodeCount = nodeCount;
+	header.dataOffset = sizeof(btfile_header_t);
+	header.dataSize = dataSize;
+	header.packedSize = packedSize;
+
+	if (shape != nullptr)
+	{
+		size_t shapeSize = LoudsShape::GetWordCount(shape->GetNodeCount()) * sizeof(uint64_t);
+
+		header.dataOffset += shapeSize;
+		header.shapeChecksum = checksum::Crc32c(shape->GetWords(), shapeSize);
+	}
+
+	header.dataChecksum = checksum::Crc32c(data, static_cast<size_t>(header.dataSize));
+	header.headerChecksum = GetHeaderChecksum(header);
+}
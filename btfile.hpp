@@ -0,0 +1,637 @@
+﻿#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "checksum.hpp"
+#include "itree.hpp"
+#include "louds.hpp"
+#include "lz.hpp"
+#include "mapping.hpp"
+#include "packing.hpp"
+
+/*
+	Двоичный формат дерева (.bt с сигнатурой BTRE).
+
+	Файл - это заголовок btfile_header_t, за которым по смещению dataOffset идёт сырой массив значений
+	в порядке Walk, как в ImplicitBinaryTree. Числа записаны в little-endian.
+
+	Файл не разбирается при загрузке: он отображается в память, и ImplicitBinaryTree становится видом
+	прямо на массив в отображении. Поэтому открытие дерева любого размера - это проверка заголовка и mmap.
+	Текстовый формат остаётся основным, двоичный отличается от него по сигнатуре в начале файла.
+
+	Форма BtShape::LOUDS хранит перед массивом значений битовую карту LoudsShape, так что записать можно и дерево
+	BinaryLeaf любой формы, а не только полное.
+
+	Целочисленный массив можно записать и упакованным (BtEncoding::PACKED, PACKED_LZ). Такой файл меньше в 4 и более раз,
+	но при открытии распаковывается в память, а не отображается.
+
+	Массив значений полного дерева можно разбить на куски по chunkSize значений, каждый кодируется отдельно.
+	Тогда массив начинается с оглавления btfile_chunk_t, и LazyBinaryTree читает только те куски, к которым обращаются.
+*/
+
+// Тип значения в файле.
+typedef uint8_t btvalue_t;
+namespace BtValueType
+{
+	constexpr btvalue_t UNKNOWN = 0;
+
+	constexpr btvalue_t INT8 = 1;
+	constexpr btvalue_t UINT8 = 2;
+	constexpr btvalue_t INT16 = 3;
+	constexpr btvalue_t UINT16 = 4;
+	constexpr btvalue_t INT32 = 5;
+	constexpr btvalue_t UINT32 = 6;
+	constexpr btvalue_t INT64 = 7;
+	constexpr btvalue_t UINT64 = 8;
+	constexpr btvalue_t FLOAT32 = 9;
+	constexpr btvalue_t FLOAT64 = 10;
+}
+
+// Способ кодирования массива значений.
+typedef uint8_t btencoding_t;
+namespace BtEncoding
+{
+	// Сырой массив значений, как в памяти.
+	constexpr btencoding_t RAW = 0;
+
+	// Блоки packing::PackValues.
+	constexpr btencoding_t PACKED = 1;
+
+	// Блоки packing::PackValues, сжатые lz::Compress.
+	constexpr btencoding_t PACKED_LZ = 2;
+}
+
+// Способ кодирования формы дерева.
+typedef uint8_t btshape_t;
+namespace BtShape
+{
+	// Полное дерево в порядке Walk, форма задаётся только количеством лепестков - как у ImplicitBinaryTree.
+	constexpr btshape_t COMPLETE = 1;
+
+	// Произвольное дерево. Между заголовком и массивом значений лежат слова LoudsShape.
+	constexpr btshape_t LOUDS = 2;
+}
+
+#pragma pack(push, 1)
+struct btfile_header_t
+{
+	// Сигнатура btfile::MAGIC и версия формата.
+	char magic[4];
+	uint16_t version;
+
+	// Тип значения (BtValueType) и его размер в байтах.
+	btvalue_t valueType;
+	uint8_t valueSize;
+
+	// Форма дерева (BtShape) и кодирование массива значений (BtEncoding).
+	btshape_t shape;
+	btencoding_t encoding;
+
+	// Глубина корня.
+	uint16_t rootDepth;
+
+	// Количество лепестков.
+	uint64_t nodeCount;
+
+	// Смещение массива значений от начала файла и его длина в байтах (в файле, то есть после кодирования).
+	uint64_t dataOffset;
+	uint64_t dataSize;
+
+	// CRC32C массива значений и заголовка. Заголовок считается с нулевым headerChecksum.
+	uint32_t dataChecksum;
+	uint32_t headerChecksum;
+
+	// Для PACKED_LZ - длина упакованных блоков до сжатия. Для остальных кодирований равна dataSize.
+	uint64_t packedSize;
+
+	// CRC32C слов формы для BtShape::LOUDS, иначе 0.
+	uint32_t shapeChecksum;
+
+	// Количество значений в куске. 0 - массив значений не разбит на куски.
+	uint32_t chunkSize;
+
+	uint8_t reserved[4];
+};
+
+// Запись оглавления кусков. Оглавление лежит в начале массива значений, по записи на кусок.
+struct btfile_chunk_t
+{
+	// Смещение куска от начала массива значений (dataOffset) и его длина в файле.
+	uint64_t offset;
+	uint64_t size;
+
+	// Длина упакованных блоков куска до сжатия (для PACKED_LZ), иначе равна size.
+	uint64_t packedSize;
+
+	// CRC32C куска.
+	uint32_t checksum;
+	uint32_t reserved;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(btfile_header_t) == 64, "btfile_header_t must stay 64 bytes");
+static_assert(sizeof(btfile_chunk_t) == 32, "btfile_chunk_t must stay 32 bytes");
+
+namespace btfile
+{
+	constexpr char MAGIC[4] = { 'B', 'T', 'R', 'E' };
+	constexpr uint16_t VERSION = 1;
+
+	// Размер куска по умолчанию: 64K значений - доли миллисекунды на распаковку.
+	constexpr uint32_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+	// Тип значения в файле для типа T. Для неподдерживаемых типов - BtValueType::UNKNOWN.
+	template<typename T>
+	constexpr btvalue_t GetValueType()
+	{
+		if constexpr (std::is_integral_v<T> && sizeof(T) <= 8)
+		{
+			constexpr btvalue_t SIGNED_TYPES[] = { BtValueType::INT8, BtValueType::INT16, BtValueType::INT32, BtValueType::INT64 };
+			constexpr btvalue_t UNSIGNED_TYPES[] = { BtValueType::UINT8, BtValueType::UINT16, BtValueType::UINT32, BtValueType::UINT64 };
+
+			size_t width = std::bit_width(sizeof(T)) - 1;
+
+			return std::is_signed_v<T> ? SIGNED_TYPES[width] : UNSIGNED_TYPES[width];
+		}
+		else if constexpr (std::is_same_v<T, float>)
+		{
+			return BtValueType::FLOAT32;
+		}
+		else if constexpr (std::is_same_v<T, double>)
+		{
+			return BtValueType::FLOAT64;
+		}
+		else
+		{
+			return BtValueType::UNKNOWN;
+		}
+	}
+
+	// Начинаются ли данные (или файл path) с сигнатуры двоичного формата.
+	bool HasMagic(const uint8_t* data, size_t size);
+	bool IsBinaryFile(const char* path);
+
+	/*
+		Проверка уже прочитанного заголовка: сигнатура, версия, контрольная сумма заголовка и согласованность
+		длин массива значений с количеством лепестков и кодированием. Где лежит массив, здесь не проверяется.
+	*/
+	bool CheckHeader(const btfile_header_t& header);
+
+	/*
+		Чтение и проверка заголовка из начала data: CheckHeader и то, что массив значений целиком лежит в data.
+		Массив значений здесь не проверяется - для этого есть VerifyData.
+	*/
+	bool ReadHeader(const uint8_t* data, size_t size, btfile_header_t& header);
+
+	// Чтение и проверка (CheckHeader) заголовка файла path без чтения остального файла.
+	bool ReadHeader(const char* path, btfile_header_t& header);
+
+	// Проверка контрольной суммы массива значений. data - начало всего файла. Читает весь массив.
+	bool VerifyData(const uint8_t* data, const btfile_header_t& header);
+
+	// Количество кусков массива значений. 0, если массив не разбит на куски.
+	uint64_t GetChunkCount(const btfile_header_t& header);
+
+	/*
+		Чтение и проверка записи оглавления для куска chunk. data - начало массива значений (dataOffset).
+		Проверяется, что кусок лежит в массиве и его длины согласованы с количеством значений. Сам кусок не читается.
+	*/
+	bool GetChunk(const btfile_header_t& header, const uint8_t* data, size_t chunk, btfile_chunk_t& entry);
+
+	// Проверка контрольной суммы куска. data - начало массива значений.
+	bool VerifyChunk(const uint8_t* data, const btfile_chunk_t& entry);
+
+	/*
+		Полная проверка двоичного файла без построения дерева: заголовок, контрольная сумма и устройство формы LOUDS,
+		контрольная сумма всего массива значений и, у файла с кусками, оглавление. Значения не распаковываются,
+		файл читается один раз подряд. Возвращает false при любом расхождении, в том числе у обрезанного файла.
+	*/
+	bool Verify(const uint8_t* data, size_t size);
+	bool Verify(const char* path);
+
+	/*
+		Заполнение заголовка, включая все контрольные суммы. data - массив значений в том виде, в каком он
+		пишется в файл (dataSize байт, вместе с оглавлением, если chunkSize не 0), packedSize - длина упакованных
+		блоков для PACKED_LZ. shape - форма для BtShape::LOUDS, для COMPLETE - nullptr.
+	*/
+	void FillHeader(btfile_header_t& header, btvalue_t valueType, uint8_t valueSize, uint16_t rootDepth, uint64_t nodeCount,
+		btencoding_t encoding, uint32_t chunkSize, const void* data, uint64_t dataSize, uint64_t packedSize, const LoudsShape* shape);
+
+	/*
+		Кодирование count значений values в encoding. Результат дописывается в конец output,
+		длина упакованных блоков до сжатия (или длина результата) - в packedSize.
+		Возвращает false, если кодирование не поддерживается для T.
+	*/
+	template<typename T>
+	bool EncodeBlock(const T* values, size_t count, btencoding_t encoding, std::vector<uint8_t>& output, uint64_t& packedSize)
+	{
+		size_t first = output.size();
+
+		if (encoding == BtEncoding::RAW)
+		{
+			output.resize(first + count * sizeof(T));
+
+			if (count > 0)
+			{
+				std::memcpy(output.data() + first, values, count * sizeof(T));
+			}
+
+			packedSize = output.size() - first;
+
+			return true;
+		}
+
+		if constexpr (std::is_integral_v<T>)
+		{
+			if (encoding == BtEncoding::PACKED)
+			{
+				packing::PackValues(values, count, output);
+				packedSize = output.size() - first;
+
+				return true;
+			}
+
+			if (encoding == BtEncoding::PACKED_LZ)
+			{
+				std::vector<uint8_t> packed = {};
+				packing::PackValues(values, count, packed);
+
+				lz::Compress(packed.data(), packed.size(), output);
+				packedSize = packed.size();
+
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/*
+		Декодирование size байт data в ровно count значений values. packedSize - длина упакованных блоков для PACKED_LZ.
+		Возвращает false, если данные повреждены или кодирование не поддерживается для T.
+	*/
+	template<typename T>
+	bool DecodeBlock(btencoding_t encoding, const uint8_t* data, size_t size, size_t packedSize, T* values, size_t count)
+	{
+		if (encoding == BtEncoding::RAW)
+		{
+			if (size != count * sizeof(T))
+			{
+				return false;
+			}
+
+			if (count > 0)
+			{
+				std::memcpy(values, data, size);
+			}
+
+			return true;
+		}
+
+		if constexpr (std::is_integral_v<T>)
+		{
+			if (encoding == BtEncoding::PACKED)
+			{
+				return packing::UnpackValues(data, size, values, count);
+			}
+
+			if (encoding == BtEncoding::PACKED_LZ)
+			{
+				std::vector<uint8_t> packed = std::vector<uint8_t>(packedSize);
+
+				return lz::Decompress(data, size, packed.data(), packed.size())
+					&& packing::UnpackValues(packed.data(), packed.size(), values, count);
+			}
+		}
+
+		return false;
+	}
+
+	/*
+		Запись count значений values в порядке Walk, а с ними и формы shape (nullptr для полного дерева).
+		Упаковывать (PACKED, PACKED_LZ) можно только целочисленные значения.
+		Если chunkSize не 0, массив значений разбивается на куски по chunkSize значений - только для полного дерева.
+		Возвращает false, если тип значения или кодирование не поддерживается или запись не удалась.
+	*/
+	template<typename T>
+	bool SerializeValues(std::ostream& stream, const T* values, size_t count, uint16_t rootDepth, const LoudsShape* shape, btencoding_t encoding, uint32_t chunkSize = 0)
+	{
+		constexpr btvalue_t valueType = GetValueType<T>();
+
+		if constexpr (valueType == BtValueType::UNKNOWN || std::endian::native != std::endian::little)
+		{
+			return false;
+		}
+		else
+		{
+			// Сырой массив целиком пишется прямо из values, без копии.
+			const uint8_t* data = reinterpret_cast<const uint8_t*>(values);
+			uint64_t dataSize = count * sizeof(T);
+			uint64_t packedSize = dataSize;
+
+			std::vector<uint8_t> encoded = {};
+
+			if (chunkSize > 0)
+			{
+				if (shape != nullptr)
+				{
+					return false;
+				}
+
+				// Сначала место под оглавление, затем куски подряд.
+				size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+				encoded.resize(chunkCount * sizeof(btfile_chunk_t));
+
+				for (size_t chunk = 0; chunk < chunkCount; chunk++)
+				{
+					size_t first = chunk * chunkSize;
+
+					btfile_chunk_t entry = {};
+					entry.offset = encoded.size();
+
+					if (!EncodeBlock(values + first, std::min<size_t>(chunkSize, count - first), encoding, encoded, entry.packedSize))
+					{
+						return false;
+					}
+
+					entry.size = encoded.size() - entry.offset;
+					entry.checksum = checksum::Crc32c(encoded.data() + entry.offset, static_cast<size_t>(entry.size));
+
+					std::memcpy(encoded.data() + chunk * sizeof(btfile_chunk_t), &entry, sizeof(entry));
+				}
+
+				data = encoded.data();
+				dataSize = encoded.size();
+				packedSize = 0;
+			}
+			else if (encoding != BtEncoding::RAW)
+			{
+				if (!EncodeBlock(values, count, encoding, encoded, packedSize))
+				{
+					return false;
+				}
+
+				data = encoded.data();
+				dataSize = encoded.size();
+			}
+
+			btfile_header_t header = {};
+			FillHeader(header, valueType, sizeof(T), rootDepth, count, encoding, chunkSize, data, dataSize, packedSize, shape);
+
+			stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+			if (shape != nullptr)
+			{
+				stream.write(reinterpret_cast<const char*>(shape->GetWords()), static_cast<std::streamsize>(LoudsShape::GetWordCount(shape->GetNodeCount()) * sizeof(uint64_t)));
+			}
+
+			stream.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(dataSize));
+
+			return stream.good();
+		}
+	}
+
+	// Запись полного дерева в поток. См. SerializeValues.
+	template<typename T>
+	bool Serialize(std::ostream& stream, const ImplicitBinaryTree<T>& tree, btencoding_t encoding = BtEncoding::RAW, uint32_t chunkSize = 0)
+	{
+		return SerializeValues(stream, tree.GetData(), tree.GetSize(), tree.GetDepth(0), nullptr, encoding, chunkSize);
+	}
+
+	// Запись дерева любой формы с корнем root (или пустого дерева, если root - nullptr) в поток как BtShape::LOUDS.
+	template<typename T>
+	bool Serialize(std::ostream& stream, BinaryLeaf<T>* root, btencoding_t encoding = BtEncoding::RAW)
+	{
+		std::vector<T> values = {};
+		LoudsShape shape = LoudsShape::FromBinaryLeaf(root, &values);
+
+		return SerializeValues(stream, values.data(), values.size(), (root != nullptr) ? root->GetDepth() : 0, &shape, encoding);
+	}
+
+	// Запись дерева в файл path. См. Serialize.
+	template<typename T>
+	bool Save(const char* path, const ImplicitBinaryTree<T>& tree, btencoding_t encoding = BtEncoding::RAW, uint32_t chunkSize = 0)
+	{
+		std::ofstream stream = std::ofstream(path, std::ios::binary | std::ios::trunc);
+
+		return Serialize(stream, tree, encoding, chunkSize) && stream.good();
+	}
+
+	template<typename T>
+	bool Save(const char* path, BinaryLeaf<T>* root, btencoding_t encoding = BtEncoding::RAW)
+	{
+		std::ofstream stream = std::ofstream(path, std::ios::binary | std::ios::trunc);
+
+		return Serialize(stream, root, encoding) && stream.good();
+	}
+
+	// Подходит ли заголовок для значений типа T. Форма здесь не проверяется.
+	template<typename T>
+	bool IsCompatible(const btfile_header_t& header)
+	{
+		return header.valueType == GetValueType<T>()
+			&& header.valueSize == sizeof(T)
+			&& (header.encoding == BtEncoding::RAW || std::is_integral_v<T>);
+	}
+
+	/*
+		Декодирование всего массива значений data (dataSize байт в кодировании из header, возможно кусками) в values.
+		Заголовок должен быть уже проверен CheckHeader и IsCompatible<T>. Контрольные суммы кусков здесь не проверяются.
+	*/
+	template<typename T>
+	bool DecodeValues(const btfile_header_t& header, const uint8_t* data, std::vector<T>& values)
+	{
+		size_t count = static_cast<size_t>(header.nodeCount);
+
+		values.resize(count);
+
+		if (header.chunkSize == 0)
+		{
+			return DecodeBlock(header.encoding, data, static_cast<size_t>(header.dataSize), static_cast<size_t>(header.packedSize), values.data(), count);
+		}
+
+		size_t chunkCount = static_cast<size_t>(GetChunkCount(header));
+
+		for (size_t chunk = 0; chunk < chunkCount; chunk++)
+		{
+			size_t first = chunk * header.chunkSize;
+			btfile_chunk_t entry = {};
+
+			bool decoded = GetChunk(header, data, chunk, entry)
+				&& DecodeBlock(header.encoding, data + entry.offset, static_cast<size_t>(entry.size), static_cast<size_t>(entry.packedSize), values.data() + first, std::min<size_t>(header.chunkSize, count - first));
+
+			if (!decoded)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/*
+		Чтение заголовка, формы (для BtShape::LOUDS) и значений из потока, записанного SerializeValues.
+		Форма и массив значений всегда проверяются по контрольным суммам, потому что они всё равно читаются целиком.
+	*/
+	template<typename T>
+	bool DeserializeValues(std::istream& stream, btfile_header_t& header, LoudsShape& shape, std::vector<T>& values)
+	{
+		stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+		if (stream.gcount() != sizeof(header) || !CheckHeader(header) || !IsCompatible<T>(header))
+		{
+			return false;
+		}
+
+		if (header.shape == BtShape::LOUDS)
+		{
+			std::vector<uint64_t> words = std::vector<uint64_t>(LoudsShape::GetWordCount(static_cast<size_t>(header.nodeCount)));
+			std::streamsize shapeSize = static_cast<std::streamsize>(words.size() * sizeof(uint64_t));
+
+			stream.read(reinterpret_cast<char*>(words.data()), shapeSize);
+
+			if (stream.gcount() != shapeSize || checksum::Crc32c(words.data(), static_cast<size_t>(shapeSize)) != header.shapeChecksum)
+			{
+				return false;
+			}
+
+			if (!shape.Assign(std::move(words), static_cast<size_t>(header.nodeCount)))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			// Всё, что до массива значений, пропускается - так читаются и файлы с более длинным заголовком.
+			stream.ignore(static_cast<std::streamsize>(header.dataOffset - sizeof(header)));
+		}
+
+		std::vector<uint8_t> data = std::vector<uint8_t>(static_cast<size_t>(header.dataSize));
+		stream.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+
+		if (static_cast<size_t>(stream.gcount()) != data.size() || checksum::Crc32c(data.data(), data.size()) != header.dataChecksum)
+		{
+			return false;
+		}
+
+		return DecodeValues(header, data.data(), values);
+	}
+
+	/*
+		Чтение полного дерева из потока, записанного Serialize.
+		Возвращает false, если поток не двоичный, повреждён, хранит значения другого типа или дерево не полное.
+	*/
+	template<typename T>
+	bool Deserialize(std::istream& stream, ImplicitBinaryTree<T>& output)
+	{
+		btfile_header_t header = {};
+		LoudsShape shape;
+		std::vector<T> values = {};
+
+		if (!DeserializeValues(stream, header, shape, values) || header.shape != BtShape::COMPLETE)
+		{
+			return false;
+		}
+
+		output = ImplicitBinaryTree<T>(std::move(values), header.rootDepth);
+
+		return true;
+	}
+
+	/*
+		Чтение дерева любой формы из потока. Корень записывается по указателю output (nullptr для пустого дерева),
+		лепестки создаются в arena или через new. Полное дерево (BtShape::COMPLETE) читается так же.
+
+		Глубина корня в BinaryLeaf всегда 0, поэтому сохранённая в файле глубина корня не восстанавливается.
+	*/
+	template<typename T>
+	bool Deserialize(std::istream& stream, BinaryLeaf<T>** output, LeafArena<T>* arena = nullptr)
+	{
+		btfile_header_t header = {};
+		LoudsShape shape;
+		std::vector<T> values = {};
+
+		if (!DeserializeValues(stream, header, shape, values))
+		{
+			return false;
+		}
+
+		if (header.shape == BtShape::COMPLETE)
+		{
+			*output = ImplicitBinaryTree<T>(values.data(), values.size()).ToBinaryLeaf(arena);
+		}
+		else
+		{
+			*output = shape.ToBinaryLeaf(values.data(), arena);
+		}
+
+		return true;
+	}
+
+	// Чтение дерева любой формы из файла path. См. Deserialize.
+	template<typename T>
+	bool Load(const char* path, BinaryLeaf<T>** output, LeafArena<T>* arena = nullptr)
+	{
+		std::ifstream stream = std::ifstream(path, std::ios::binary);
+
+		return stream.is_open() && Deserialize(stream, output, arena);
+	}
+
+	/*
+		Открытие дерева из файла path. file отображает файл, а output становится видом на массив в отображении,
+		так что file должен жить дольше output. Если verify, то проверяется и контрольная сумма массива,
+		но тогда весь файл читается с диска.
+
+		Упакованный или разбитый на куски массив отображать бессмысленно: он распаковывается в собственный массив output,
+		а file закрывается. Чтобы читать куски по требованию, есть LazyBinaryTree.
+
+		Возвращает false, если файл не двоичный, повреждён или хранит значения другого типа.
+	*/
+	template<typename T>
+	bool Open(MappedFile& file, const char* path, ImplicitBinaryTree<T>& output, bool verify = false)
+	{
+		if (!file.Open(path))
+		{
+			return false;
+		}
+
+		btfile_header_t header = {};
+
+		bool valid = ReadHeader(file.GetData(), file.GetSize(), header)
+			&& IsCompatible<T>(header)
+			&& header.shape == BtShape::COMPLETE
+			&& header.dataOffset % alignof(T) == 0
+			&& (!verify || VerifyData(file.GetData(), header));
+
+		if (!valid)
+		{
+			file.Close();
+
+			return false;
+		}
+
+		if (header.encoding != BtEncoding::RAW || header.chunkSize > 0)
+		{
+			std::vector<T> values = {};
+			valid = DecodeValues(header, file.GetData() + header.dataOffset, values);
+
+			file.Close();
+
+			if (valid)
+			{
+				output = ImplicitBinaryTree<T>(std::move(values), header.rootDepth);
+			}
+
+			return valid;
+		}
+
+		T* values = reinterpret_cast<T*>(file.GetData() + header.dataOffset);
+		output = ImplicitBinaryTree<T>(values, static_cast<size_t>(header.nodeCount), header.rootDepth);
+
+		return true;
+	}
+}
@@ -3,7 +3,17 @@
 #include <algorithm>
 #include <queue>
 #include <functional>
+#include <iostream>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.hpp"
+#include "loader.hpp"
+#include "parallel.hpp"
+#include "traversal.hpp"
+#include "writer.hpp"
 
 // Объявление лепестка наперёд.
 template<typename T>
@@ -21,10 +31,11 @@ using BinaryTree = BinaryLeaf<T>;
 typedef uint8_t treedir_t;
 namespace TreeDirection
 {
-	treedir_t ROOT = 0;
+	// constexpr, чтобы заголовок можно было подключать из нескольких единиц трансляции.
+	constexpr treedir_t ROOT = 0;
 
-	treedir_t LEFT = 1;
-	treedir_t RIGHT = 2;
+	constexpr treedir_t LEFT = 1;
+	constexpr treedir_t RIGHT = 2;
 }
 
 // Данные, используемые для генерации и десериализации лепестка.
@@ -41,6 +52,55 @@ struct leaf_generation_data_t
 	treedir_t direction;
 };
 
+/*
+	Тип суммы весов поддерева. Вес лепестка (глубина * значение) для целочисленных T суммируется в int64_t,
+	так как на деревьях в миллионы лепестков сумма весов уже не помещается в int.
+*/
+template<typename T>
+using leaf_weight_t = std::conditional_t<std::is_integral_v<T>, int64_t, T>;
+
+// Кадр стека обхода в обратном порядке (post-order), используемый при поиске отношений.
+template<typename T>
+struct leaf_aggregation_frame_t
+{
+	// Лепесток, поддерево которого сейчас агрегируется.
+	BinaryLeaf<T>* leaf;
+
+	// Сумма весов уже обработанной части поддерева, включая сам лепесток.
+	leaf_weight_t<T> weightSum;
+
+	// Количество лепестков в уже обработанной части поддерева, включая сам лепесток.
+	size_t count;
+
+	// Сколько потомков уже было отправлено в стек: 0 - ни одного, 1 - левый, 2 - оба.
+	uint8_t stage;
+};
+
+/*
+	Кандидат в поиске минимального или максимального отношения: отношение, поддерево и глубина его корня.
+	found = false означает, что кандидата ещё нет.
+*/
+template<typename T>
+struct ratio_candidate_t
+{
+	double ratio;
+	BinaryLeaf<T>* holder;
+	uint16_t depth;
+
+	bool found;
+};
+
+// Результат поиска по поддереву: лучшие кандидаты и агрегаты самого поддерева.
+template<typename T>
+struct ratio_search_result_t
+{
+	ratio_candidate_t<T> min;
+	ratio_candidate_t<T> max;
+
+	leaf_weight_t<T> weightSum;
+	size_t count;
+};
+
 // Имплементация лепестка (и дерева).
 template<typename T>
 class BinaryLeaf
@@ -77,6 +137,14 @@ private:
 	// Потомки лепестка - левый и правый.
 	BinaryLeaf<T>* mRight;
 	BinaryLeaf<T>* mLeft;
+
+	// Буфер итераторов продвигает обход сам, по полям потомков.
+	template<typename U, typename Order>
+	friend class TraversalBuffer;
+
+	// Дерево с агрегатами поддеревьев строит их тем же обходом, что и поиск (см. Aggregate).
+	template<typename U>
+	friend class AggregatedBinaryTree;
 public:
 	// Стандартный конструктор лепестка.
 	BinaryLeaf()
@@ -100,15 +168,45 @@ public:
 		mRight = mLeft = nullptr;
 	}
 
-	// Деструктор лепестка, уничтожающий всех потомков в цикле. Метод Walk описывается чуть ниже.
+	/*
+		Деструктор лепестка, уничтожающий всех потомков в цикле.
+
+		Перед удалением каждый потомок отсоединяется от своих потомков. Иначе его собственный деструктор
+		удалил бы их ещё раз, а цикл потом обратился бы к уже удалённым лепесткам.
+	*/
 	~BinaryLeaf()
 	{
-		// Проходимся по всем потомкам и удаляем их, не включая себя.
-		Walk([](BinaryLeaf<T>* leaf) -> bool {
-			delete leaf;
+		std::vector<BinaryLeaf<T>*> toDelete = {};
 
-			return false;
-		}, false);
+		if (mLeft != nullptr)
+		{
+			toDelete.push_back(mLeft);
+		}
+
+		if (mRight != nullptr)
+		{
+			toDelete.push_back(mRight);
+		}
+
+		while (toDelete.size() > 0)
+		{
+			BinaryLeaf<T>* leaf = toDelete.back();
+			toDelete.pop_back();
+
+			if (leaf->mLeft != nullptr)
+			{
+				toDelete.push_back(leaf->mLeft);
+			}
+
+			if (leaf->mRight != nullptr)
+			{
+				toDelete.push_back(leaf->mRight);
+			}
+
+			leaf->mLeft = leaf->mRight = nullptr;
+
+			delete leaf;
+		}
 	}
 public:
 	// Получение размера всего дерева в байтах.
@@ -135,62 +233,238 @@ public:
 		Если флаг includeSelf установлен в false, то лямбда walker не будет вызвана
 		на корень, то есть на лепесток, который вызвал метод Walk. Это нужно, чтобы пройтись
 		только по потомкам лепестка, не включая сам лепесток.
+
+		Эта перегрузка принимает std::function и остаётся для тех, кому нужен один нешаблонный тип callback'а.
+		Лямбды, переданные напрямую, попадают в шаблонный Walk ниже, где вызов не идёт через std::function.
 	*/
 	void Walk(walk_callback_t walker, bool includeSelf = true)
 	{
-		// Очередь лепестков для итерации.
-		std::queue<BinaryLeaf<T>*> collected = {};
+		Walk<WalkOrder::BFS>(walker, includeSelf);
+	}
+
+	/*
+		Шаблонная итерация по поддереву. Order - один из порядков WalkOrder, visitor - любой вызываемый объект,
+		принимающий BinaryLeaf<T>*. Если visitor возвращает bool, то true, как и в обычном Walk, прекращает итерацию.
+		visitor может ничего не возвращать - тогда итерация проходит все лепестки.
+
+		Вызов visitor'а не виртуальный и не идёт через std::function, поэтому компилятор встраивает его в цикл.
+		Очередь и стек обхода - это std::vector, а не std::queue, так что памяти выделяется лишь несколько раз за обход.
+	*/
+	template<typename Order = WalkOrder::BFS, typename F>
+	void Walk(F&& visitor, bool includeSelf = true)
+	{
+		if constexpr (std::is_same_v<Order, WalkOrder::BFS>)
+		{
+			WalkBFS(visitor, includeSelf);
+		}
+		else if constexpr (std::is_same_v<Order, WalkOrder::PreOrder>)
+		{
+			WalkPreOrder(visitor, includeSelf);
+		}
+		else if constexpr (std::is_same_v<Order, WalkOrder::PostOrder>)
+		{
+			WalkPostOrder(visitor, includeSelf);
+		}
+		else
+		{
+			static_assert(std::is_same_v<Order, WalkOrder::InOrder>, "Unknown walk order");
+
+			WalkInOrder(visitor, includeSelf);
+		}
+	}
+private:
+	// Вызов visitor'а. Возвращает true, если итерацию нужно прекратить.
+	template<typename F>
+	static bool Visit(F& visitor, BinaryLeaf<T>* leaf)
+	{
+		if constexpr (std::is_void_v<std::invoke_result_t<F&, BinaryLeaf<T>*>>)
+		{
+			visitor(leaf);
+
+			return false;
+		}
+		else
+		{
+			return visitor(leaf);
+		}
+	}
+
+	template<typename F>
+	void WalkBFS(F& visitor, bool includeSelf)
+	{
+		/*
+			Очередь лепестков для итерации. Голова очереди - индекс head, а не начало массива.
+			Когда пройденная часть становится больше оставшейся, она стирается, так что массив не растёт больше ширины дерева.
+		*/
+		std::vector<BinaryLeaf<T>*> collected = {};
+		size_t head = 0;
 
 		/*
 			Если надо добавить текущий лепесток, то добавляем this в очередь.
-			Иначе добавляем только потомков mLeft и mRight.
+			Иначе добавляем только потомков mLeft и mRight. Здесь, в отличие от остального обхода, левый идёт первым.
 		*/
 		if (includeSelf)
 		{
-			collected.push(this);
+			collected.push_back(this);
 		}
 		else
 		{
 			if (mLeft != nullptr)
 			{
-				collected.push(mLeft);
+				collected.push_back(mLeft);
 			}
 
 			if (mRight != nullptr)
 			{
-				collected.push(mRight);
+				collected.push_back(mRight);
 			}
 		}
 
 		// Пока в очереди есть лепестки...
-		while (collected.size() > 0)
+		while (head < collected.size())
 		{
 			// Получаем первый на очереди лепесток.
-			BinaryLeaf<T>* leaf = collected.front();
-			collected.pop();
+			BinaryLeaf<T>* leaf = collected[head];
+			head++;
 
 			// Добавляем левого и правого потомков полученного лепестка в очередь, если они есть.
 
 			if (leaf->mRight != nullptr)
 			{
-				collected.push(leaf->mRight);
+				collected.push_back(leaf->mRight);
 			}
 
 			if (leaf->mLeft != nullptr)
 			{
-				collected.push(leaf->mLeft);
+				collected.push_back(leaf->mLeft);
+			}
+
+			// Если visitor вернул true, то прекращаем проходиться по очереди.
+			if (Visit(visitor, leaf))
+			{
+				break;
+			}
+
+			if (head > collected.size() / 2 && head > 1024)
+			{
+				collected.erase(collected.begin(), collected.begin() + head);
+				head = 0;
+			}
+		}
+	}
+
+	template<typename F>
+	void WalkPreOrder(F& visitor, bool includeSelf)
+	{
+		std::vector<BinaryLeaf<T>*> stack = {};
+		stack.push_back(this);
+
+		while (stack.size() > 0)
+		{
+			BinaryLeaf<T>* leaf = stack.back();
+			stack.pop_back();
+
+			// Правый кладётся первым, чтобы левое поддерево было снято со стека раньше.
+			if (leaf->mRight != nullptr)
+			{
+				stack.push_back(leaf->mRight);
 			}
 
-			// Вызываем переданную в Walk лямбду и передаём туда полученный лепесток. Ожидаем, чтобы она вернула bool.
-			bool shouldStop = walker(leaf);
+			if (leaf->mLeft != nullptr)
+			{
+				stack.push_back(leaf->mLeft);
+			}
 
-			// Если лямбда вернула true, то прекращаем проходиться по очереди.
-			if (shouldStop)
+			if ((includeSelf || leaf != this) && Visit(visitor, leaf))
 			{
 				break;
 			}
 		}
 	}
+
+	template<typename F>
+	void WalkPostOrder(F& visitor, bool includeSelf)
+	{
+		// Второй элемент пары - были ли потомки лепестка уже отправлены в стек.
+		std::vector<std::pair<BinaryLeaf<T>*, bool>> stack = {};
+		stack.push_back({ this, false });
+
+		while (stack.size() > 0)
+		{
+			std::pair<BinaryLeaf<T>*, bool>& top = stack.back();
+			BinaryLeaf<T>* leaf = top.first;
+
+			if (!top.second)
+			{
+				top.second = true;
+
+				if (leaf->mRight != nullptr)
+				{
+					stack.push_back({ leaf->mRight, false });
+				}
+
+				if (leaf->mLeft != nullptr)
+				{
+					stack.push_back({ leaf->mLeft, false });
+				}
+
+				continue;
+			}
+
+			stack.pop_back();
+
+			if ((includeSelf || leaf != this) && Visit(visitor, leaf))
+			{
+				break;
+			}
+		}
+	}
+
+	template<typename F>
+	void WalkInOrder(F& visitor, bool includeSelf)
+	{
+		std::vector<BinaryLeaf<T>*> stack = {};
+		BinaryLeaf<T>* leaf = this;
+
+		while (leaf != nullptr || stack.size() > 0)
+		{
+			// Спускаемся влево до упора, запоминая путь.
+			while (leaf != nullptr)
+			{
+				stack.push_back(leaf);
+				leaf = leaf->mLeft;
+			}
+
+			leaf = stack.back();
+			stack.pop_back();
+
+			if ((includeSelf || leaf != this) && Visit(visitor, leaf))
+			{
+				break;
+			}
+
+			leaf = leaf->mRight;
+		}
+	}
+public:
+	/*
+		Представления обхода поддерева для range-based for и std::ranges: по уровням (в порядке Walk)
+		и в глубину (лепесток, левое поддерево, правое). Состояние обхода хранится в переданном буфере,
+		поэтому повторный обход с тем же буфером не выделяет память. Например:
+
+		TraversalBuffer<int, WalkOrder::BFS> buffer;
+		for (BinaryLeaf<int>* leaf : tree->BreadthFirst(buffer) | std::views::filter(...)) { ... }
+	*/
+
+	TraversalView<T, WalkOrder::BFS> BreadthFirst(TraversalBuffer<T, WalkOrder::BFS>& buffer)
+	{
+		return TraversalView<T, WalkOrder::BFS>(this, buffer);
+	}
+
+	TraversalView<T, WalkOrder::PreOrder> DepthFirst(TraversalBuffer<T, WalkOrder::PreOrder>& buffer)
+	{
+		return TraversalView<T, WalkOrder::PreOrder>(this, buffer);
+	}
 public:
 	/* 
 		Методы установки потомков лепестка.
@@ -263,10 +537,10 @@ public:
 	double GetWeightSumChildrenRatio()
 	{
 		// Количество потомков данного лепестка.
-		int children = 0;
+		size_t children = 0;
 
 		// Сумма весов. Инициализируем весом текущего лепестка.
-		int weightSum = (mDepth * mValue);
+		leaf_weight_t<T> weightSum = (mDepth * mValue);
 
 		/*
 			Проходимся по всем потомкам данного лепестка.
@@ -280,39 +554,316 @@ public:
 			return false;
 		}, false);
 
-		// На 0 делить нельзя. Убеждаемся, что количество потомков хотя бы равняется 1.
-		children = std::max(1, children);
-
-		// Кастуем к числу с плавающей точкой и делим, затем возвращаем полученное отношение.
-		return static_cast<double>(weightSum) / static_cast<double>(children);
+		// Количество лепестков поддерева - это потомки и сам лепесток.
+		return MakeRatio(weightSum, children + 1);
 	}
 
 	/*
-		Этот метод просто проходится по всем потомкам, включая текущий лепесток, и находит максимальное и минимальное отношение.
-		
+		Этот метод находит минимальное и максимальное отношение среди всех поддеревьев, включая текущий лепесток.
+
 		Минимальное отношение записывается по ссылке outputMin, максимальное - outputMax.
 		Соответствующие им поддеревья записываются по ссылкам outputMinHolder и outputMaxHolder.
+
+		Вызывать GetWeightSumChildrenRatio на каждый лепесток нельзя: каждый такой вызов обходит всё поддерево,
+		и поиск становится O(n^2) на вырожденных деревьях. Вместо этого дерево обходится один раз в обратном порядке
+		(сначала левый потомок, затем правый, затем сам лепесток), и сумма весов с количеством лепестков
+		каждого поддерева складывается из уже посчитанных сумм его потомков. Стек обхода занимает O(высоты) памяти.
+
+		Результат совпадает с обходом через Walk: при равных отношениях побеждает лепесток, который Walk посетил бы первым,
+		то есть менее глубокий, а среди лепестков одной глубины - самый правый (Walk кладёт в очередь правого потомка первым).
+		В обратном порядке более правый лепесток той же глубины всегда посещается позже, поэтому при равенстве
+		отношений и глубины кандидат заменяется.
 	*/
 	void GetMinMaxWeightSumChildrenRatio(double& outputMin, BinaryLeaf<T>*& outputMinHolder, double& outputMax, BinaryLeaf<T>*& outputMaxHolder)
 	{
-		Walk([&](BinaryLeaf<T>* leaf) -> bool {
-			double ratio = leaf->GetWeightSumChildrenRatio();
+		ratio_search_result_t<T> result = SearchSubtree([](BinaryLeaf<T>*, leaf_weight_t<T>&, size_t&) -> bool {
+			return false;
+		});
+
+		ApplySearchResult(result, outputMin, outputMinHolder, outputMax, outputMaxHolder);
+	}
+
+	/*
+		Параллельный поиск минимального и максимального отношения. Результат в точности совпадает с обычным поиском.
+
+		Дерево разрезается по уровню, на котором лепестков уже хотя бы в 8 раз больше, чем потоков в пуле.
+		Поддеревья этих лепестков - независимые задачи: каждая считает агрегаты и своих кандидатов, а пул
+		раздаёт задачи потокам с перехватом работы. Затем верх дерева (выше разреза) досчитывается в одном потоке
+		по уже готовым агрегатам задач.
+
+		Кандидаты сливаются так, как их выбрал бы Walk: при равном отношении побеждает менее глубокий,
+		а на одной глубине - задача, корень которой Walk посетил бы раньше. Лепестки верха всегда менее глубокие,
+		чем лепестки задач, поэтому их равенство с задачами решается глубиной.
+	*/
+	void GetMinMaxWeightSumChildrenRatio(double& outputMin, BinaryLeaf<T>*& outputMinHolder, double& outputMax, BinaryLeaf<T>*& outputMaxHolder, WorkStealingPool& pool)
+	{
+		if (pool.GetThreadCount() <= 1)
+		{
+			GetMinMaxWeightSumChildrenRatio(outputMin, outputMinHolder, outputMax, outputMaxHolder);
+
+			return;
+		}
+
+		// Спускаемся по уровням (в порядке Walk), пока уровень не станет достаточно широким.
+		size_t targetTasks = pool.GetThreadCount() * 8;
+
+		std::vector<BinaryLeaf<T>*> level = { this };
+		std::vector<BinaryLeaf<T>*> next = {};
+
+		while (level.size() > 0 && level.size() < targetTasks)
+		{
+			next.clear();
 
-			if (ratio < outputMin)
+			for (BinaryLeaf<T>* leaf : level)
 			{
-				outputMin = ratio;
-				outputMinHolder = leaf;
+				if (leaf->mRight != nullptr)
+				{
+					next.push_back(leaf->mRight);
+				}
+
+				if (leaf->mLeft != nullptr)
+				{
+					next.push_back(leaf->mLeft);
+				}
 			}
-			
-			if (ratio > outputMax)
+
+			level.swap(next);
+		}
+
+		// Дерево закончилось раньше, чем набралось достаточно задач. Оно маленькое, считаем в одном потоке.
+		if (level.size() == 0)
+		{
+			GetMinMaxWeightSumChildrenRatio(outputMin, outputMinHolder, outputMax, outputMaxHolder);
+
+			return;
+		}
+
+		std::vector<ratio_search_result_t<T>> results(level.size());
+
+		pool.Run(level.size(), [&](size_t task) {
+			results[task] = level[task]->SearchSubtree([](BinaryLeaf<T>*, leaf_weight_t<T>&, size_t&) -> bool {
+				return false;
+			});
+		});
+
+		// Номера задач по их корням, чтобы верх дерева подставлял готовые агрегаты вместо спуска в поддерево.
+		std::unordered_map<BinaryLeaf<T>*, size_t> tasks = {};
+
+		for (size_t task = 0; task < level.size(); task++)
+		{
+			tasks[level[task]] = task;
+		}
+
+		ratio_search_result_t<T> result = SearchSubtree([&](BinaryLeaf<T>* leaf, leaf_weight_t<T>& weightSum, size_t& count) -> bool {
+			auto found = tasks.find(leaf);
+			if (found == tasks.end())
 			{
-				outputMax = ratio;
-				outputMaxHolder = leaf;
+				return false;
 			}
 
+			weightSum = results[found->second].weightSum;
+			count = results[found->second].count;
+
+			return true;
+		});
+
+		/*
+			Сливаем задачи в порядке Walk, заменяя кандидата только на строго лучшего или на строго менее глубокого
+			с тем же отношением. Кандидаты верха идут последними: они всегда менее глубокие.
+		*/
+		ratio_search_result_t<T> merged = results[0];
+
+		for (size_t task = 1; task < results.size(); task++)
+		{
+			MergeCandidate(merged.min, results[task].min, std::less<double>());
+			MergeCandidate(merged.max, results[task].max, std::greater<double>());
+		}
+
+		MergeCandidate(merged.min, result.min, std::less<double>());
+		MergeCandidate(merged.max, result.max, std::greater<double>());
+
+		ApplySearchResult(merged, outputMin, outputMinHolder, outputMax, outputMaxHolder);
+	}
+private:
+	// Отношение по сумме весов и количеству лепестков поддерева. На 0 делить нельзя, поэтому потомков хотя бы 1.
+	static double MakeRatio(leaf_weight_t<T> weightSum, size_t count)
+	{
+		size_t children = std::max<size_t>(1, count - 1);
+
+		// Кастуем к числу с плавающей точкой и делим, затем возвращаем полученное отношение.
+		return static_cast<double>(weightSum) / static_cast<double>(children);
+	}
+
+	/*
+		Предложение нового кандидата при обходе в обратном порядке. better - строгое сравнение отношений
+		(std::less для минимума, std::greater для максимума). При равенстве побеждает менее глубокий лепесток,
+		а на той же глубине - посещённый позже, то есть более правый.
+	*/
+	template<typename Compare>
+	static void ProposeCandidate(ratio_candidate_t<T>& candidate, double ratio, BinaryLeaf<T>* leaf, Compare better)
+	{
+		if (!candidate.found || better(ratio, candidate.ratio) || (ratio == candidate.ratio && leaf->mDepth <= candidate.depth))
+		{
+			candidate = { ratio, leaf, leaf->mDepth, true };
+		}
+	}
+
+	// Слияние кандидатов разных поддеревьев: other побеждает, только если он строго лучше или строго менее глубокий.
+	template<typename Compare>
+	static void MergeCandidate(ratio_candidate_t<T>& candidate, const ratio_candidate_t<T>& other, Compare better)
+	{
+		if (!other.found)
+		{
+			return;
+		}
+
+		if (!candidate.found || better(other.ratio, candidate.ratio) || (other.ratio == candidate.ratio && other.depth < candidate.depth))
+		{
+			candidate = other;
+		}
+	}
+
+	// Запись результата поиска по ссылкам. Как и раньше, выход меняется, только если найдено строго лучшее отношение.
+	static void ApplySearchResult(const ratio_search_result_t<T>& result, double& outputMin, BinaryLeaf<T>*& outputMinHolder, double& outputMax, BinaryLeaf<T>*& outputMaxHolder)
+	{
+		if (result.min.found && result.min.ratio < outputMin)
+		{
+			outputMin = result.min.ratio;
+			outputMinHolder = result.min.holder;
+		}
+
+		if (result.max.found && result.max.ratio > outputMax)
+		{
+			outputMax = result.max.ratio;
+			outputMaxHolder = result.max.holder;
+		}
+	}
+
+	/*
+		Поиск кандидатов в поддереве этого лепестка за один обход в обратном порядке.
+		cut - см. Aggregate: поддеревья, для которых он вернул true, не обходятся и не дают кандидатов.
+	*/
+	template<typename C>
+	ratio_search_result_t<T> SearchSubtree(C&& cut)
+	{
+		ratio_search_result_t<T> result = {};
+
+		Aggregate([&](BinaryLeaf<T>* leaf, leaf_weight_t<T> weightSum, size_t count, BinaryLeaf<T>* parent) {
+			double ratio = MakeRatio(weightSum, count);
+
+			ProposeCandidate(result.min, ratio, leaf, std::less<double>());
+			ProposeCandidate(result.max, ratio, leaf, std::greater<double>());
+
+			if (parent == nullptr)
+			{
+				result.weightSum = weightSum;
+				result.count = count;
+			}
+		}, cut);
+
+		return result;
+	}
+
+	/*
+		Обход поддерева в обратном порядке со сложением агрегатов потомков в родителя.
+		finalizer вызывается на каждый лепесток, как только его поддерево полностью посчитано:
+		finalizer(лепесток, сумма весов поддерева, количество лепестков поддерева, родитель или nullptr для this).
+	*/
+	template<typename F>
+	void Aggregate(F&& finalizer)
+	{
+		Aggregate(finalizer, [](BinaryLeaf<T>*, leaf_weight_t<T>&, size_t&) -> bool {
 			return false;
 		});
 	}
+
+	/*
+		То же самое, но с разрезом: cut(потомок, сумма весов, количество) вызывается перед спуском в каждого потомка.
+		Если он вернул true и записал агрегаты поддерева потомка по ссылкам, то в потомка не спускаемся,
+		а его агрегаты просто добавляются к родителю.
+	*/
+	template<typename F, typename C>
+	void Aggregate(F&& finalizer, C&& cut)
+	{
+		std::vector<leaf_aggregation_frame_t<T>> stack = {};
+		stack.push_back({ this, (mDepth * mValue), 1, 0 });
+
+		while (stack.size() > 0)
+		{
+			leaf_aggregation_frame_t<T>& frame = stack.back();
+
+			// Сначала отправляем в стек левого потомка, затем правого.
+			if (frame.stage == 0)
+			{
+				frame.stage = 1;
+
+				BinaryLeaf<T>* left = frame.leaf->mLeft;
+				if (left != nullptr)
+				{
+					leaf_weight_t<T> weightSum = 0;
+					size_t count = 0;
+
+					if (cut(left, weightSum, count))
+					{
+						frame.weightSum += weightSum;
+						frame.count += count;
+					}
+					else
+					{
+						stack.push_back({ left, (left->mDepth * left->mValue), 1, 0 });
+					}
+				}
+
+				continue;
+			}
+
+			if (frame.stage == 1)
+			{
+				frame.stage = 2;
+
+				BinaryLeaf<T>* right = frame.leaf->mRight;
+				if (right != nullptr)
+				{
+					leaf_weight_t<T> weightSum = 0;
+					size_t count = 0;
+
+					if (cut(right, weightSum, count))
+					{
+						frame.weightSum += weightSum;
+						frame.count += count;
+					}
+					else
+					{
+						stack.push_back({ right, (right->mDepth * right->mValue), 1, 0 });
+					}
+				}
+
+				continue;
+			}
+
+			// Оба потомка обработаны, поддерево полностью агрегировано.
+			BinaryLeaf<T>* leaf = frame.leaf;
+			leaf_weight_t<T> weightSum = frame.weightSum;
+			size_t count = frame.count;
+
+			// Снимаем кадр и добавляем агрегаты поддерева к родителю.
+			stack.pop_back();
+
+			BinaryLeaf<T>* parent = nullptr;
+
+			if (stack.size() > 0)
+			{
+				leaf_aggregation_frame_t<T>& parentFrame = stack.back();
+
+				parentFrame.weightSum += weightSum;
+				parentFrame.count += count;
+
+				parent = parentFrame.leaf;
+			}
+
+			finalizer(leaf, weightSum, count, parent);
+		}
+	}
 public:
 	/*
 		Метод сериализации. Приводит дерево в вид, который можно либо хранить в файле, либо вывести в консоль.
@@ -322,9 +873,20 @@ public:
 		Следующие аргументы не стоит передавать для хранения в файле, так как десериализатор их не обрабатывает:
 		skipDeep - при достижении данной глубины сериализация прекратится. Может быть -1 в случае если ограничение не требуется.
 		pretty - включить табуляцию.
+
+		Текст собирается в BufferedWriter и пишется в stream большими блоками, а не построчно с std::endl.
+		Сам текст от этого не меняется.
 	*/
 	void Serialize(std::ostream& stream, uint16_t skipDeep = -1, bool pretty = false)
 	{
+		BufferedWriter writer(stream);
+
+		// Первая строка обещает загрузчику последнюю (см. textload::CHECKSUM_HEADER).
+		if (!pretty)
+		{
+			writer.WriteChecksumHeader();
+		}
+
 		Walk([&](BinaryLeaf<T>* leaf) -> bool {
 			// "Красивизация" дерева.
 			if (pretty)
@@ -341,79 +903,78 @@ public:
 				// Вывод табов.
 				for (uint16_t t = 0; t < tabDepth; t++)
 				{
-					stream << "\t";
+					writer.Write('\t');
 				}
 
 				// Вывод глубины и двоеточия.
-				stream << leaf->mDepth << ": ";
+				writer.WriteValue(leaf->mDepth);
+				writer.Write(": ", 2);
 			}
 			
 			// Вывод значения лепестка и перенос на следующую строку.
-			stream << leaf->mValue << std::endl;
+			writer.WriteValue(leaf->mValue);
+			writer.Write('\n');
 
 			// Если skipDeep включен и мы его достигли по глубине, то не продолжать дальше выводить лепестки.
 			if (skipDeep != -1 && leaf->mDepth > skipDeep)
 			{
-				stream << "..." << std::endl;
+				writer.Write("...\n", 4);
 
 				return true;
 			}
 
 			return false;
 		});
+
+		// Файловый формат заканчивается строкой контрольной суммы, чтобы обрезанный файл не загрузился молча.
+		if (!pretty)
+		{
+			writer.WriteChecksumLine();
+		}
+
+		writer.Flush();
 	}
 
 	/*
 		Метод десериализации (статический). Из дерева в файле создаёт дерево в коде и записывает его по указателю output.
 
 		stream - поток ввода. может быть как cin, так и ifstream.
-		valueDeserializer - десериализатор строковых значений в T данного лепестка.
+		valueDeserializer - десериализатор строковых значений в T данного лепестка. Получает строку без перевода строки
+		и крайних пробелов и вызывается одновременно из нескольких потоков, так что не должен менять общего состояния.
+		arena - арена, в которой создаются лепестки. Если nullptr, то каждый лепесток создаётся через new.
+		stats - если не nullptr, сюда записываются счётчики этапов загрузки.
+
+		Чтение, разбор строк и связывание лепестков идут одновременно в разных потоках (см. PipelinedLoader).
+		Возвращает false, если valueDeserializer бросил исключение (как std::stoi на строке не с числом).
+		Исключение не может пересечь границу потока разбора, поэтому оно превращается в false, а output - в nullptr.
+		Так же false и nullptr получаются, если в конце нет строки контрольной суммы или сумма не совпала:
+		обрезанный или повреждённый файл не загружается как дерево поменьше.
 	*/
-	static void Deserialize(std::istream& stream, BinaryLeaf<T>** output, deserializer_t valueDeserializer)
+	static bool Deserialize(std::istream& stream, BinaryLeaf<T>** output, deserializer_t valueDeserializer, LeafArena<T>* arena = nullptr, load_pipeline_stats_t* stats = nullptr)
 	{
-		// Очередь лепестков на популяцию.
-		std::queue<leaf_generation_data_t<T>> toPopulate = {};
-		toPopulate.push({ output, nullptr, TreeDirection::ROOT });
+		PipelinedLoader<T> loader;
 
-		// Текущая строка в потоке.
-		std::string curline = "";
-
-		// Пока в потоке есть данные и пока очередь на популяцию не пустая...
-		while (stream.good() && toPopulate.size() > 0)
-		{
-			// Получаем текущую строку и проверяем её на пустоту.
-			std::getline(stream, curline);
-			if (curline.size() <= 0)
+		bool loaded = loader.Load(stream, output, [&](const char* first, const char* last, T& value) {
+			try
 			{
-				continue;
+				value = valueDeserializer(std::string(first, last));
 			}
-
-			// Преобразовываем строку в T значение лепестка.
-			T value = valueDeserializer(curline);
-
-			// Создаём лепесток с преобразованным значением.
-			const leaf_generation_data_t<T>& leafData = toPopulate.front();
-			(*leafData.output) = new BinaryLeaf<T>(value);
-
-			// Устанавливаем иерархию, направление лепестка и его глубину.
-			if (leafData.parent != nullptr)
+			catch (...)
 			{
-				if (leafData.direction == TreeDirection::LEFT)
-				{
-					leafData.parent->SetLeftChild((*leafData.output));
-				}
-				else if (leafData.direction == TreeDirection::RIGHT)
-				{
-					leafData.parent->SetRightChild((*leafData.output));
-				}
+				return false;
 			}
 
-			// Добавляем в очередь на популяцию левый и правый будущих потомков созданного лепестка.
-			toPopulate.push({ (*leafData.output)->GetRightChild(), (*leafData.output), TreeDirection::RIGHT });
-			toPopulate.push({ (*leafData.output)->GetLeftChild(), (*leafData.output), TreeDirection::LEFT });
+			return true;
+		}, arena);
 
-			// Удаляем из очереди на популяцию созданный лепесток.
-			toPopulate.pop();
+		if (stats != nullptr)
+		{
+			*stats = loader.GetStats();
 		}
+
+		return loaded;
 	}
 };
+
+// Агрегаты поддеревьев живут вне лепестка (см. AggregatedBinaryTree), лепесток - это значение, глубина, направление и два указателя.
+static_assert(sizeof(BinaryLeaf<int>) == 8 + 2 * sizeof(void*), "BinaryLeaf<int> must stay a value, a depth, a direction and two pointers");
@@ -0,0 +1,288 @@
+﻿#include "checksum.hpp"
+
+#include <array>
+#include <bit>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+#include <nmmintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// Как и в simd.cpp: GCC и Clang разрешают интринсики SSE4.2 только в функциях с нужным target.
+#if defined(CHECKSUM_X86) && (defined(__GNUC__) || defined(__clang__))
+#define CHECKSUM_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define CHECKSUM_TARGET_SSE42
+#endif
+
+/*
+	Таблицы для подсчёта CRC32C по 8 байт за шаг (slicing-by-8). Строятся на этапе компиляции.
+	CRC32C_TABLES[0] - обычная побайтовая таблица, CRC32C_TABLES[k][b] - CRC байта b, за которым идут ещё k нулевых байт.
+*/
+static constexpr std::array<std::array<uint32_t, 256>, 8> CRC32C_TABLES = []() {
+	std::array<std::array<uint32_t, 256>, 8> tables = {};
+
+	for (uint32_t byte = 0; byte < 256; byte++)
+	{
+		uint32_t crc = byte;
+
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? ((crc >> 1) ^ 0x82F63B78u) : (crc >> 1);
+		}
+
+		tables[0][byte] = crc;
+	}
+
+	for (size_t table = 1; table < tables.size(); table++)
+	{
+		for (uint32_t byte = 0; byte < 256; byte++)
+		{
+			uint32_t previous = tables[table - 1][byte];
+
+			tables[table][byte] = (previous >> 8) ^ tables[0][previous & 0xFF];
+		}
+	}
+
+	return tables;
+}();
+
+// Табличный подсчёт. crc здесь и в Crc32cSse42 - уже инвертированный, как внутри Crc32c.
+static uint32_t Crc32cTable(const uint8_t* bytes, size_t size, uint32_t crc)
+{
+	// Восемь байт за шаг складываются с CRC как одно слово, поэтому так можно только на little-endian.
+	if constexpr (std::endian::native == std::endian::little)
+	{
+		for (; size >= 8; bytes += 8, size -= 8)
+		{
+			uint64_t word = 0;
+			std::memcpy(&word, bytes, sizeof(word));
+
+			uint32_t low = static_cast<uint32_t>(word) ^ crc;
+			uint32_t high = static_cast<uint32_t>(word >> 32);
+
+			crc = CRC32C_TABLES[7][low & 0xFF] ^ CRC32C_TABLES[6][(low >> 8) & 0xFF]
+				^ CRC32C_TABLES[5][(low >> 16) & 0xFF] ^ CRC32C_TABLES[4][low >> 24]
+				^ CRC32C_TABLES[3][high & 0xFF] ^ CRC32C_TABLES[2][(high >> 8) & 0xFF]
+				^ CRC32C_TABLES[1][(high >> 16) & 0xFF] ^ CRC32C_TABLES[0][high >> 24];
+		}
+	}
+
+	for (size_t index = 0; index < size; index++)
+	{
+		crc = CRC32C_TABLES[0][(crc ^ bytes[index]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+// Применение линейного отображения 32 бит, заданного столбцами matrix, к вектору vector.
+static uint32_t ApplyMatrix(const std::array<uint32_t, 32>& matrix, uint32_t vector)
+{
+	uint32_t result = 0;
+
+	for (int bit = 0; vector != 0; bit++, vector >>= 1)
+	{
+		if (vector & 1)
+		{
+			result ^= matrix[bit];
+		}
+	}
+
+	return result;
+}
+
+/*
+	Сдвиги состояния CRC на 2^k нулевых байт (k = 0..63) как линейные отображения 32 бит. Сдвиг на один нулевой байт
+	берётся из побайтовой таблицы, каждый следующий - его квадрат. Строятся один раз при первом обращении.
+*/
+static const std::array<std::array<uint32_t, 32>, 64>& GetPowerShifts()
+{
+	static const std::array<std::array<uint32_t, 32>, 64> shifts = []() {
+		std::array<std::array<uint32_t, 32>, 64> result = {};
+
+		for (int bit = 0; bit < 32; bit++)
+		{
+			uint32_t crc = uint32_t(1) << bit;
+
+			result[0][bit] = CRC32C_TABLES[0][crc & 0xFF] ^ (crc >> 8);
+		}
+
+		for (size_t power = 1; power < result.size(); power++)
+		{
+			for (int bit = 0; bit < 32; bit++)
+			{
+				result[power][bit] = ApplyMatrix(result[power - 1], result[power - 1][bit]);
+			}
+		}
+
+		return result;
+	}();
+
+	return shifts;
+}
+
+#ifdef CHECKSUM_X86
+/*
+	Инструкция crc32 ждёт результата предыдущей, поэтому одна цепочка использует треть её пропускной способности.
+	Длинные данные считаются тремя независимыми цепочками по INTERLEAVE_SIZE байт, а их CRC потом склеиваются.
+
+	Склейка основана на линейности CRC: CRC состояния crc после size байт data равен сдвигу crc на size нулевых байт,
+	сложенному (xor) с CRC тех же data от нулевого состояния. Сдвиг на INTERLEAVE_SIZE нулевых байт - линейное
+	отображение 32 бит, и оно считается по четырём таблицам, по одной на байт состояния.
+*/
+static constexpr size_t INTERLEAVE_SIZE = 4096;
+
+typedef std::array<std::array<uint32_t, 256>, 4> crc_shift_tables_t;
+
+// Таблицы сдвига состояния на INTERLEAVE_SIZE нулевых байт. Строятся один раз при первом обращении.
+static const crc_shift_tables_t& GetShiftTables()
+{
+	static const crc_shift_tables_t tables = []() {
+		static_assert(std::has_single_bit(INTERLEAVE_SIZE), "INTERLEAVE_SIZE must be a power of two");
+
+		const std::array<uint32_t, 32>& shift = GetPowerShifts()[std::countr_zero(INTERLEAVE_SIZE)];
+
+		crc_shift_tables_t result = {};
+
+		for (int byte = 0; byte < 4; byte++)
+		{
+			for (uint32_t value = 0; value < 256; value++)
+			{
+				result[byte][value] = ApplyMatrix(shift, value << (8 * byte));
+			}
+		}
+
+		return result;
+	}();
+
+	return tables;
+}
+
+static uint32_t ShiftCrc(const crc_shift_tables_t& tables, uint32_t crc)
+{
+	return tables[0][crc & 0xFF] ^ tables[1][(crc >> 8) & 0xFF] ^ tables[2][(crc >> 16) & 0xFF] ^ tables[3][crc >> 24];
+}
+
+// Подсчёт инструкцией crc32 из SSE4.2: 8 байт за инструкцию на x64 и 4 на x86.
+CHECKSUM_TARGET_SSE42 static uint32_t Crc32cSse42(const uint8_t* bytes, size_t size, uint32_t crc)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	if (size >= 3 * INTERLEAVE_SIZE)
+	{
+		const crc_shift_tables_t& tables = GetShiftTables();
+
+		for (; size >= 3 * INTERLEAVE_SIZE; bytes += 3 * INTERLEAVE_SIZE, size -= 3 * INTERLEAVE_SIZE)
+		{
+			uint64_t first = crc;
+			uint64_t second = 0;
+			uint64_t third = 0;
+
+			for (size_t offset = 0; offset < INTERLEAVE_SIZE; offset += 8)
+			{
+				uint64_t words[3] = {};
+				std::memcpy(&words[0], bytes + offset, sizeof(uint64_t));
+				std::memcpy(&words[1], bytes + INTERLEAVE_SIZE + offset, sizeof(uint64_t));
+				std::memcpy(&words[2], bytes + 2 * INTERLEAVE_SIZE + offset, sizeof(uint64_t));
+
+				first = _mm_crc32_u64(first, words[0]);
+				second = _mm_crc32_u64(second, words[1]);
+				third = _mm_crc32_u64(third, words[2]);
+			}
+
+			crc = ShiftCrc(tables, static_cast<uint32_t>(first)) ^ static_cast<uint32_t>(second);
+			crc = ShiftCrc(tables, crc) ^ static_cast<uint32_t>(third);
+		}
+	}
+
+	uint64_t wide = crc;
+
+	for (; size >= 8; bytes += 8, size -= 8)
+	{
+		uint64_t word = 0;
+		std::memcpy(&word, bytes, sizeof(word));
+
+		wide = _mm_crc32_u64(wide, word);
+	}
+
+	crc = static_cast<uint32_t>(wide);
+#endif
+
+	for (; size >= 4; bytes += 4, size -= 4)
+	{
+		uint32_t word = 0;
+		std::memcpy(&word, bytes, sizeof(word));
+
+		crc = _mm_crc32_u32(crc, word);
+	}
+
+	for (size_t index = 0; index < size; index++)
+	{
+		crc = _mm_crc32_u8(crc, bytes[index]);
+	}
+
+	return crc;
+}
+#endif
+
+static bool HasSse42()
+{
+#if defined(CHECKSUM_X86) && defined(_MSC_VER)
+	int info[4] = {};
+
+	__cpuid(info, 1);
+
+	return (info[2] & (1 << 20)) != 0;
+#elif defined(CHECKSUM_X86)
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("sse4.2");
+#else
+	return false;
+#endif
+}
+
+bool checksum::IsAccelerated()
+{
+	static const bool accelerated = HasSse42();
+
+	return accelerated;
+}
+
+uint32_t checksum::Crc32c(const void* data, size_t size, uint32_t crc)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+	crc = ~crc;
+
+#ifdef CHECKSUM_X86
+	if (IsAccelerated())
+	{
+		return ~Crc32cSse42(bytes, size, crc);
+	}
+#endif
+
+	return ~Crc32cTable(bytes, size, crc);
+}
+
+uint32_t checksum::Crc32cCombine(uint32_t first, uint32_t second, uint64_t secondSize)
+{
+	// Линейность CRC: CRC склейки - это CRC первой части, сдвинутая на secondSize нулевых байт, xor CRC второй.
+	// Инверсии в начале и в конце Crc32c при этом взаимно сокращаются.
+	const std::array<std::array<uint32_t, 32>, 64>& shifts = GetPowerShifts();
+
+	for (size_t power = 0; secondSize != 0; power++, secondSize >>= 1)
+	{
+		if (secondSize & 1)
+		{
+			first = ApplyMatrix(shifts[power], first);
+		}
+	}
+
+	return first ^ second;
+}
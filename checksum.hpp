@@ -0,0 +1,25 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace checksum
+{
+	/*
+		CRC32C (полином Кастаньоли) массива data длиной size байт.
+		crc - CRC предыдущих данных, так что длинный массив можно считать частями: Crc32c(b, n, Crc32c(a, m)).
+	*/
+	uint32_t Crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+	/*
+		CRC32C склейки двух массивов по их CRC: Crc32cCombine(Crc32c(a, m), Crc32c(b, n), n) == Crc32c(b, n, Crc32c(a, m)).
+		Так куски можно считать независимо, в разных потоках, а склейка стоит O(log n), а не проход по данным.
+	*/
+	uint32_t Crc32cCombine(uint32_t first, uint32_t second, uint64_t secondSize);
+
+	/*
+		Считает ли Crc32c инструкцией crc32 из SSE4.2 (по 8 байт за инструкцию на x64). Если процессор её не поддерживает,
+		CRC считается по таблицам по 8 байт за шаг. Результат у обоих вариантов одинаковый.
+	*/
+	bool IsAccelerated();
+}
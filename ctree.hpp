@@ -0,0 +1,618 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+#include "btree.hpp"
+
+/*
+	Лепесток компактного дерева. Вместо 64-битных указателей потомки хранятся 32-битными индексами в пуле лепестков,
+	глубина не хранится вовсе (она вычисляется при обходе), а направление занимает два старших бита индекса правого потомка.
+
+	Структура упакована (pack(1)), поэтому лепесток занимает ровно 8 байт плюс размер значения:
+	9 байт для uint8_t, 10 для uint16_t и 12 для int - против 24 байт у BinaryLeaf<int>.
+*/
+#pragma pack(push, 1)
+template<typename V>
+struct compact_leaf_t
+{
+	// Младшие 30 бит - индекс правого потомка, старшие 2 бита - направление самого лепестка (treedir_t).
+	uint32_t rightAndDirection;
+
+	// Индекс левого потомка.
+	uint32_t left;
+
+	V value;
+};
+#pragma pack(pop)
+
+/*
+	Компактное бинарное дерево. Все лепестки лежат в одном массиве (пуле) и ссылаются друг на друга по индексам.
+	Корень - лепесток с индексом 0.
+
+	V - тип хранимого значения. Для значений 0..254 из GenerateTree хватает uint8_t, тогда дерево в несколько раз
+	меньше BinaryLeaf<int> и во столько же раз меньше занимает в кэше.
+	Форма дерева может быть любой, в отличие от ImplicitBinaryTree.
+*/
+template<typename V>
+class CompactBinaryTree
+{
+	static_assert(std::is_arithmetic_v<V>, "CompactBinaryTree stores numeric values only");
+public:
+	// Callback итерации. Получает индекс лепестка и его глубину. Возвращаемое значение работает так же, как в BinaryLeaf::Walk.
+	using walk_callback_t = std::function<bool(uint32_t, uint16_t)>;
+
+	using deserializer_t = std::function<V(const std::string&)>;
+
+	// Индекс несуществующего лепестка. Он же - ограничение на количество лепестков в дереве.
+	static constexpr uint32_t npos = (1u << 30) - 1;
+private:
+	static constexpr uint32_t DIRECTION_SHIFT = 30;
+
+	// Пул лепестков.
+	std::vector<compact_leaf_t<V>> mLeaves;
+
+	// Глубина корня. Глубины остальных лепестков отсчитываются от неё.
+	uint16_t mRootDepth;
+public:
+	CompactBinaryTree()
+	{
+		mRootDepth = 0;
+	}
+public:
+	// Количество лепестков в пуле.
+	size_t GetSize() const
+	{
+		return mLeaves.size();
+	}
+
+	// Получение размера всего дерева в байтах, включая ещё не занятую часть пула.
+	size_t GetByteSize() const
+	{
+		return sizeof(*this) + mLeaves.capacity() * sizeof(compact_leaf_t<V>);
+	}
+
+	uint16_t GetRootDepth() const
+	{
+		return mRootDepth;
+	}
+
+	void SetRootDepth(uint16_t depth)
+	{
+		mRootDepth = depth;
+	}
+
+	// Резервирование места в пуле, чтобы он не перевыделялся при создании лепестков.
+	void Reserve(size_t leaves)
+	{
+		mLeaves.reserve(leaves);
+	}
+
+	void Clear()
+	{
+		mLeaves.clear();
+	}
+public:
+	/*
+		Создание лепестка без родителя и потомков. Возвращает его индекс, или npos, если пул заполнен.
+		Первый созданный лепесток становится корнем.
+	*/
+	uint32_t CreateLeaf(V value)
+	{
+		if (mLeaves.size() >= npos)
+		{
+			return npos;
+		}
+
+		compact_leaf_t<V> leaf = {};
+		leaf.rightAndDirection = npos | (static_cast<uint32_t>(TreeDirection::ROOT) << DIRECTION_SHIFT);
+		leaf.left = npos;
+		leaf.value = value;
+
+		mLeaves.push_back(leaf);
+
+		return static_cast<uint32_t>(mLeaves.size() - 1);
+	}
+
+	// Установка потомков. child может быть npos, тогда потомок просто отсоединяется.
+
+	void SetRightChild(uint32_t index, uint32_t child)
+	{
+		compact_leaf_t<V>& leaf = mLeaves[index];
+
+		leaf.rightAndDirection = (leaf.rightAndDirection & ~npos) | child;
+
+		if (child != npos)
+		{
+			SetDirection(child, TreeDirection::RIGHT);
+		}
+	}
+
+	void SetLeftChild(uint32_t index, uint32_t child)
+	{
+		mLeaves[index].left = child;
+
+		if (child != npos)
+		{
+			SetDirection(child, TreeDirection::LEFT);
+		}
+	}
+
+	// Получение потомков. Если потомка нет, возвращается npos.
+
+	uint32_t GetRightChild(uint32_t index) const
+	{
+		return mLeaves[index].rightAndDirection & npos;
+	}
+
+	uint32_t GetLeftChild(uint32_t index) const
+	{
+		return mLeaves[index].left;
+	}
+
+	treedir_t GetDirection(uint32_t index) const
+	{
+		return static_cast<treedir_t>(mLeaves[index].rightAndDirection >> DIRECTION_SHIFT);
+	}
+
+	// Установка и получение значения лепестка.
+
+	V GetValue(uint32_t index) const
+	{
+		return mLeaves[index].value;
+	}
+
+	void SetValue(uint32_t index, V value)
+	{
+		mLeaves[index].value = value;
+	}
+private:
+	void SetDirection(uint32_t index, treedir_t direction)
+	{
+		compact_leaf_t<V>& leaf = mLeaves[index];
+
+		leaf.rightAndDirection = (leaf.rightAndDirection & npos) | (static_cast<uint32_t>(direction) << DIRECTION_SHIFT);
+	}
+
+	template<typename F>
+	static bool Visit(F& visitor, uint32_t index, uint16_t depth)
+	{
+		if constexpr (std::is_void_v<std::invoke_result_t<F&, uint32_t, uint16_t>>)
+		{
+			visitor(index, depth);
+
+			return false;
+		}
+		else
+		{
+			return visitor(index, depth);
+		}
+	}
+public:
+	/*
+		Итерация по поддереву лепестка root по уровням, правый потомок раньше левого - как в ImplicitBinaryTree.
+		Глубина не хранится в лепестках, поэтому она вычисляется здесь: очередь обхода делится на уровни,
+		и при переходе через границу уровня глубина увеличивается на 1.
+
+		rootDepth - глубина лепестка root. По умолчанию root - корень дерева с глубиной mRootDepth.
+	*/
+	void Walk(walk_callback_t walker, bool includeSelf = true, uint32_t root = 0, uint16_t rootDepth = -1) const
+	{
+		Walk<walk_callback_t&>(walker, includeSelf, root, rootDepth);
+	}
+
+	// Шаблонная версия Walk: visitor встраивается в цикл, а не вызывается через std::function. Visitor может ничего не возвращать.
+	template<typename F>
+	void Walk(F&& walker, bool includeSelf = true, uint32_t root = 0, uint16_t rootDepth = -1) const
+	{
+		if (root >= mLeaves.size())
+		{
+			return;
+		}
+
+		uint16_t depth = (rootDepth == static_cast<uint16_t>(-1)) ? mRootDepth : rootDepth;
+
+		// Очередь обхода и её голова. Пройденная часть стирается так же, как в BinaryLeaf::Walk.
+		std::vector<uint32_t> collected = {};
+		size_t head = 0;
+
+		if (includeSelf)
+		{
+			collected.push_back(root);
+		}
+		else
+		{
+			PushChildren(collected, root);
+
+			depth++;
+		}
+
+		// Индекс в очереди, с которого начинается следующий уровень.
+		size_t levelEnd = collected.size();
+
+		while (head < collected.size())
+		{
+			if (head == levelEnd)
+			{
+				depth++;
+				levelEnd = collected.size();
+			}
+
+			uint32_t index = collected[head];
+			head++;
+
+			PushChildren(collected, index);
+
+			if (Visit(walker, index, depth))
+			{
+				break;
+			}
+
+			if (head > collected.size() / 2 && head > 1024)
+			{
+				collected.erase(collected.begin(), collected.begin() + head);
+
+				levelEnd -= head;
+				head = 0;
+			}
+		}
+	}
+private:
+	void PushChildren(std::vector<uint32_t>& collected, uint32_t index) const
+	{
+		uint32_t right = GetRightChild(index);
+		if (right != npos)
+		{
+			collected.push_back(right);
+		}
+
+		uint32_t left = GetLeftChild(index);
+		if (left != npos)
+		{
+			collected.push_back(left);
+		}
+	}
+public:
+	// Получаем отношение (сумма весов / количество потомков) для лепестка index с глубиной depth.
+	double GetWeightSumChildrenRatio(uint32_t index, uint16_t depth) const
+	{
+		size_t children = 0;
+
+		leaf_weight_t<V> weightSum = (depth * mLeaves[index].value);
+
+		Walk([&](uint32_t leaf, uint16_t leafDepth) {
+			children++;
+
+			weightSum += (leafDepth * mLeaves[leaf].value);
+		}, false, index, depth);
+
+		children = std::max<size_t>(1, children);
+
+		return static_cast<double>(weightSum) / static_cast<double>(children);
+	}
+
+	/*
+		Поиск минимального и максимального отношения среди всех поддеревьев. Вместо указателей на поддеревья
+		по ссылкам outputMinHolder и outputMaxHolder записываются индексы их корней.
+
+		Сначала обход по уровням записывает порядок лепестков, затем агрегаты считаются в обратном порядке:
+		к моменту обработки лепестка его потомки уже посчитаны. При равных отношениях побеждает тот лепесток,
+		который Walk посетил бы первым, - так же, как в BinaryLeaf.
+	*/
+	void GetMinMaxWeightSumChildrenRatio(double& outputMin, uint32_t& outputMinHolder, double& outputMax, uint32_t& outputMaxHolder) const
+	{
+		// Лепестки в порядке обхода и их глубины.
+		std::vector<uint32_t> order = {};
+		std::vector<uint16_t> depths = {};
+
+		order.reserve(mLeaves.size());
+		depths.reserve(mLeaves.size());
+
+		Walk([&](uint32_t index, uint16_t depth) {
+			order.push_back(index);
+			depths.push_back(depth);
+		});
+
+		// Суммы весов и количества лепестков поддеревьев, по индексам пула.
+		std::vector<leaf_weight_t<V>> weightSums(mLeaves.size());
+		std::vector<uint32_t> counts(mLeaves.size());
+
+		bool minFound = false;
+		bool maxFound = false;
+
+		for (size_t position = order.size(); position-- > 0;)
+		{
+			uint32_t index = order[position];
+
+			leaf_weight_t<V> weightSum = (depths[position] * mLeaves[index].value);
+			uint32_t count = 1;
+
+			uint32_t right = GetRightChild(index);
+			if (right != npos)
+			{
+				weightSum += weightSums[right];
+				count += counts[right];
+			}
+
+			uint32_t left = GetLeftChild(index);
+			if (left != npos)
+			{
+				weightSum += weightSums[left];
+				count += counts[left];
+			}
+
+			weightSums[index] = weightSum;
+			counts[index] = count;
+
+			uint32_t children = std::max<uint32_t>(1, count - 1);
+			double ratio = static_cast<double>(weightSum) / static_cast<double>(children);
+
+			if (ratio < outputMin || (minFound && ratio == outputMin))
+			{
+				outputMin = ratio;
+				outputMinHolder = index;
+
+				minFound = true;
+			}
+
+			if (ratio > outputMax || (maxFound && ratio == outputMax))
+			{
+				outputMax = ratio;
+				outputMaxHolder = index;
+
+				maxFound = true;
+			}
+		}
+	}
+public:
+	// Метод сериализации. Вывод совпадает с BinaryLeaf::Serialize для того же дерева, аргументы значат то же самое.
+	void Serialize(std::ostream& stream, uint16_t skipDeep = -1, bool pretty = false) const
+	{
+		BufferedWriter writer(stream);
+
+		// Первая строка обещает загрузчику последнюю (см. textload::CHECKSUM_HEADER).
+		if (!pretty)
+		{
+			writer.WriteChecksumHeader();
+		}
+
+		Walk([&](uint32_t index, uint16_t depth) -> bool {
+			if (pretty)
+			{
+				uint16_t tabDepth = (depth < 32) ? depth : 32;
+
+				if (GetDirection(index) == TreeDirection::LEFT)
+				{
+					tabDepth -= 1;
+				}
+
+				for (uint16_t t = 0; t < tabDepth; t++)
+				{
+					writer.Write('\t');
+				}
+
+				writer.WriteValue(depth);
+				writer.Write(": ", 2);
+			}
+
+			// Унарный плюс, чтобы uint8_t выводился числом, а не символом.
+			V value = mLeaves[index].value;
+			writer.WriteValue(+value);
+			writer.Write('\n');
+
+			if (skipDeep != -1 && depth > skipDeep)
+			{
+				writer.Write("...\n", 4);
+
+				return true;
+			}
+
+			return false;
+		});
+
+		// Файловый формат заканчивается строкой контрольной суммы, чтобы обрезанный файл не загрузился молча.
+		if (!pretty)
+		{
+			writer.WriteChecksumLine();
+		}
+
+		writer.Flush();
+	}
+
+	/*
+		Метод десериализации. Формат тот же, что у BinaryLeaf::Deserialize: по одному значению на строку, по уровням.
+		Как и там, лепестки заполняют дерево уровень за уровнем, поэтому потомки лепестка i - это 2i + 1 и 2i + 2.
+		Строки контрольной суммы проверяются так же (см. textload::CHECKSUM_HEADER): если сумма не совпала, последней
+		строки нет или после неё что-то есть (файл обрезан или повреждён), output становится пустым.
+	*/
+	static void Deserialize(std::istream& stream, CompactBinaryTree<V>& output, deserializer_t valueDeserializer)
+	{
+		output.mLeaves.clear();
+		output.mRootDepth = 0;
+
+		std::string curline = "";
+
+		// CRC32C всех прочитанных строк вместе с переводами строк - ровно тех байт, что идут до последней строки контрольной суммы.
+		uint32_t crc = 0;
+
+		textload::TextFrame frame;
+		bool valid = true;
+
+		// Строки после последней строки контрольной суммы тоже читаются: любая непустая из них - ошибка, как и в PipelinedLoader.
+		while (stream.good())
+		{
+			std::getline(stream, curline);
+
+			const char* first = curline.data();
+			const char* last = curline.data() + curline.size();
+
+			bool filled = textload::TrimLine(first, last);
+
+			uint32_t expected = 0;
+			textload::textline_t line = filled ? textload::ClassifyLine(first, last, expected) : textload::TextLine::VALUE;
+
+			if (filled && (!frame.Next(line) || (line == textload::TextLine::FOOTER && crc != expected)))
+			{
+				valid = false;
+
+				break;
+			}
+
+			crc = checksum::Crc32c(curline.data(), curline.size(), crc);
+			crc = checksum::Crc32c("\n", 1, crc);
+
+			if (!filled || line != textload::TextLine::VALUE)
+			{
+				continue;
+			}
+
+			uint32_t index = output.CreateLeaf(valueDeserializer(curline));
+			if (index == npos)
+			{
+				return;
+			}
+
+			if (index == 0)
+			{
+				continue;
+			}
+
+			uint32_t parent = (index - 1) / 2;
+
+			if (index % 2 == 1)
+			{
+				output.SetRightChild(parent, index);
+			}
+			else
+			{
+				output.SetLeftChild(parent, index);
+			}
+		}
+
+		if (!valid || !frame.IsComplete())
+		{
+			output.mLeaves.clear();
+		}
+	}
+public:
+	/*
+		Преобразование из BinaryLeaf. Лепестки кладутся в пул в порядке Walk, так что обход компактного дерева -
+		почти последовательное чтение пула. Если какое-то значение не помещается в V или лепестков больше,
+		чем помещается в пул, возвращается false, а output не меняется.
+	*/
+	template<typename T>
+	static bool FromBinaryLeaf(BinaryLeaf<T>* root, CompactBinaryTree<V>& output)
+	{
+		CompactBinaryTree<V> result = {};
+		result.mRootDepth = root->GetDepth();
+
+		// Лепестки исходного дерева. Лепесток под номером i в этом массиве становится лепестком i в пуле.
+		std::vector<BinaryLeaf<T>*> leaves = { root };
+
+		for (size_t index = 0; index < leaves.size(); index++)
+		{
+			BinaryLeaf<T>* leaf = leaves[index];
+			T value = leaf->GetValue();
+
+			if constexpr (std::is_integral_v<T> && std::is_integral_v<V>)
+			{
+				if (!std::in_range<V>(value))
+				{
+					return false;
+				}
+			}
+
+			if (result.CreateLeaf(static_cast<V>(value)) == npos)
+			{
+				return false;
+			}
+
+			// Потомки получат индексы по порядку добавления в очередь.
+			BinaryLeaf<T>* right = *leaf->GetRightChild();
+			BinaryLeaf<T>* left = *leaf->GetLeftChild();
+
+			if (leaves.size() + 2 > npos)
+			{
+				return false;
+			}
+
+			compact_leaf_t<V>& compact = result.mLeaves[index];
+
+			if (right != nullptr)
+			{
+				compact.rightAndDirection = (compact.rightAndDirection & ~npos) | static_cast<uint32_t>(leaves.size());
+				leaves.push_back(right);
+			}
+
+			if (left != nullptr)
+			{
+				compact.left = static_cast<uint32_t>(leaves.size());
+				leaves.push_back(left);
+			}
+		}
+
+		// Направления потомков ставятся, когда все лепестки уже созданы.
+		for (uint32_t index = 0; index < result.mLeaves.size(); index++)
+		{
+			uint32_t right = result.GetRightChild(index);
+			if (right != npos)
+			{
+				result.SetDirection(right, TreeDirection::RIGHT);
+			}
+
+			uint32_t left = result.GetLeftChild(index);
+			if (left != npos)
+			{
+				result.SetDirection(left, TreeDirection::LEFT);
+			}
+		}
+
+		output = std::move(result);
+
+		return true;
+	}
+
+	/*
+		Преобразование в BinaryLeaf<T>. Возвращает корень нового дерева или nullptr, если дерево пустое.
+		Корень нового дерева, как и любой новый лепесток, имеет глубину 0 независимо от mRootDepth.
+		Если передана арена, лепестки создаются в ней.
+	*/
+	template<typename T = V>
+	BinaryLeaf<T>* ToBinaryLeaf(LeafArena<T>* arena = nullptr) const
+	{
+		if (mLeaves.size() == 0)
+		{
+			return nullptr;
+		}
+
+		auto create = [&](uint32_t index) -> BinaryLeaf<T>* {
+			T value = static_cast<T>(mLeaves[index].value);
+
+			return (arena != nullptr) ? arena->Create(value) : new BinaryLeaf<T>(value);
+		};
+
+		// Новые лепестки по индексам пула. Лепесток создаётся, когда обход доходит до его родителя.
+		std::vector<BinaryLeaf<T>*> leaves(mLeaves.size(), nullptr);
+		leaves[0] = create(0);
+
+		Walk([&](uint32_t index, uint16_t) {
+			uint32_t right = GetRightChild(index);
+			if (right != npos)
+			{
+				leaves[right] = create(right);
+				leaves[index]->SetRightChild(leaves[right]);
+			}
+
+			uint32_t left = GetLeftChild(index);
+			if (left != npos)
+			{
+				leaves[left] = create(left);
+				leaves[index]->SetLeftChild(leaves[left]);
+			}
+		});
+
+		return leaves[0];
+	}
+};
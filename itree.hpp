@@ -0,0 +1,624 @@
+﻿#pragma once
+
+#include <bit>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+#include "btree.hpp"
+#include "simd.hpp"
+
+/*
+	Неявное (implicit) бинарное дерево. Все значения хранятся в одном непрерывном массиве в порядке обхода Walk,
+	а иерархия выводится из индекса, как в двоичной куче: потомки лепестка i лежат в 2i + 1 и 2i + 2.
+
+	GenerateTree и BinaryLeaf::Deserialize заполняют дерево строго по уровням, причём правого потомка раньше левого.
+	Поэтому здесь 2i + 1 - это правый потомок, а 2i + 2 - левый: тогда порядок массива совпадает с порядком Walk
+	и с порядком строк в btree.bt, и сериализация обоих деревьев даёт один и тот же текст.
+
+	Такое дерево не хранит ни указателей, ни глубины, ни направления, а обход - это последовательное чтение массива.
+	Представимы только полные деревья, у которых последний уровень заполнен в порядке Walk.
+
+	Дерево может и не владеть массивом, а быть видом (view) на чужую память - например, на отображённый
+	в память файл btfile. Тогда ничего не копируется, а за время жизни памяти отвечает вызывающий.
+*/
+template<typename T>
+class ImplicitBinaryTree
+{
+public:
+	// Callback итерации. Получает индекс лепестка. Возвращаемое значение работает так же, как в BinaryLeaf::Walk.
+	using walk_callback_t = std::function<bool(size_t)>;
+
+	using deserializer_t = typename BinaryLeaf<T>::deserializer_t;
+
+	// Индекс несуществующего лепестка.
+	static constexpr size_t npos = std::numeric_limits<size_t>::max();
+private:
+	// Собственный массив значений. У вида пуст.
+	std::vector<T> mStorage;
+
+	// Значения лепестков в порядке обхода и их количество. Указывают либо на mStorage, либо на чужую память.
+	T* mValues;
+	size_t mSize;
+
+	// Глубина корня. Не равна 0, если дерево получено из поддерева BinaryLeaf.
+	uint16_t mRootDepth;
+public:
+	ImplicitBinaryTree()
+	{
+		mValues = nullptr;
+		mSize = 0;
+		mRootDepth = 0;
+	}
+
+	// Конструктор дерева из готового массива значений в порядке обхода.
+	ImplicitBinaryTree(std::vector<T> values, uint16_t rootDepth = 0)
+	{
+		Assign(std::move(values));
+		mRootDepth = rootDepth;
+	}
+
+	// Конструктор вида на чужой массив из size значений в порядке обхода. Массив не копируется.
+	ImplicitBinaryTree(T* values, size_t size, uint16_t rootDepth = 0)
+	{
+		mValues = values;
+		mSize = size;
+		mRootDepth = rootDepth;
+	}
+
+	// Копия вида - снова вид на ту же память, копия владеющего дерева владеет своей копией массива.
+	ImplicitBinaryTree(const ImplicitBinaryTree<T>& other)
+	{
+		*this = other;
+	}
+
+	ImplicitBinaryTree(ImplicitBinaryTree<T>&& other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	ImplicitBinaryTree<T>& operator=(const ImplicitBinaryTree<T>& other)
+	{
+		if (this == &other)
+		{
+			return *this;
+		}
+
+		mStorage = other.mStorage;
+		mValues = other.IsView() ? other.mValues : mStorage.data();
+		mSize = other.mSize;
+		mRootDepth = other.mRootDepth;
+
+		return *this;
+	}
+
+	ImplicitBinaryTree<T>& operator=(ImplicitBinaryTree<T>&& other) noexcept
+	{
+		if (this == &other)
+		{
+			return *this;
+		}
+
+		// При перемещении std::vector его память не меняется, так что указатель на неё остаётся верным.
+		mStorage = std::move(other.mStorage);
+		mValues = other.mValues;
+		mSize = other.mSize;
+		mRootDepth = other.mRootDepth;
+
+		other.mValues = nullptr;
+		other.mSize = 0;
+
+		return *this;
+	}
+public:
+	// Количество лепестков в дереве.
+	size_t GetSize() const
+	{
+		return mSize;
+	}
+
+	// Является ли дерево видом на чужую память.
+	bool IsView() const
+	{
+		return mValues != mStorage.data();
+	}
+
+	// Получение размера всего дерева в байтах. Для вида учитывается и просматриваемый массив.
+	size_t GetByteSize() const
+	{
+		size_t values = IsView() ? mSize : mStorage.capacity();
+
+		return sizeof(*this) + values * sizeof(T);
+	}
+
+	// Непосредственный доступ к массиву значений.
+	const T* GetData() const
+	{
+		return mValues;
+	}
+private:
+	// Переход в режим владения массивом values.
+	void Assign(std::vector<T> values)
+	{
+		mStorage = std::move(values);
+		mValues = mStorage.data();
+		mSize = mStorage.size();
+	}
+public:
+	// Навигация по индексам. Если лепестка нет, возвращается npos.
+
+	size_t GetRightChild(size_t index) const
+	{
+		size_t child = 2 * index + 1;
+
+		return (child < mSize) ? child : npos;
+	}
+
+	size_t GetLeftChild(size_t index) const
+	{
+		size_t child = 2 * index + 2;
+
+		return (child < mSize) ? child : npos;
+	}
+
+	size_t GetParent(size_t index) const
+	{
+		return (index == 0) ? npos : (index - 1) / 2;
+	}
+
+	// Глубина и направление выводятся из индекса.
+
+	uint16_t GetDepth(size_t index) const
+	{
+		return mRootDepth + static_cast<uint16_t>(std::bit_width(index + 1) - 1);
+	}
+
+	treedir_t GetDirection(size_t index) const
+	{
+		if (index == 0)
+		{
+			return TreeDirection::ROOT;
+		}
+
+		return (index % 2 == 1) ? TreeDirection::RIGHT : TreeDirection::LEFT;
+	}
+
+	// Установка и получение значения лепестка.
+
+	T GetValue(size_t index) const
+	{
+		return mValues[index];
+	}
+
+	void SetValue(size_t index, T value)
+	{
+		mValues[index] = value;
+	}
+public:
+	/*
+		Итерация по поддереву лепестка root в том же порядке, что и BinaryLeaf::Walk.
+		На каждом следующем уровне потомки root занимают непрерывный отрезок массива, который в два раза длиннее предыдущего,
+		поэтому обход - это последовательное чтение отрезков, а для всего дерева - просто чтение массива от начала до конца.
+	*/
+	void Walk(walk_callback_t walker, bool includeSelf = true, size_t root = 0) const
+	{
+		Walk<walk_callback_t&>(walker, includeSelf, root);
+	}
+
+	// Шаблонная версия Walk, как у BinaryLeaf: visitor встраивается в цикл, а не вызывается через std::function.
+	template<typename F>
+	void Walk(F&& walker, bool includeSelf = true, size_t root = 0) const
+	{
+		size_t first = root;
+		size_t width = 1;
+
+		if (!includeSelf)
+		{
+			first = 2 * root + 1;
+			width = 2;
+		}
+
+		while (first < mSize)
+		{
+			size_t last = std::min(first + width, mSize);
+
+			for (size_t index = first; index < last; index++)
+			{
+				if (walker(index))
+				{
+					return;
+				}
+			}
+
+			first = 2 * first + 1;
+			width *= 2;
+		}
+	}
+public:
+	// Получаем отношение (сумма весов / количество потомков) для лепестка index.
+	double GetWeightSumChildrenRatio(size_t index) const
+	{
+		size_t children = 0;
+
+		leaf_weight_t<T> weightSum = (GetDepth(index) * mValues[index]);
+
+		Walk([&](size_t leaf) -> bool {
+			children++;
+
+			weightSum += (GetDepth(leaf) * mValues[leaf]);
+
+			return false;
+		}, false, index);
+
+		children = std::max<size_t>(1, children);
+
+		return static_cast<double>(weightSum) / static_cast<double>(children);
+	}
+
+	/*
+		Поиск минимального и максимального отношения среди всех поддеревьев. Вместо указателей на поддеревья
+		по ссылкам outputMinHolder и outputMaxHolder записываются индексы их корней.
+
+		Агрегаты считаются снизу вверх за один проход по массиву с конца: к моменту обработки лепестка i
+		его потомки 2i + 1 и 2i + 2 уже посчитаны. При равных отношениях побеждает меньший индекс,
+		то есть тот лепесток, который Walk посетил бы первым, - так же, как в BinaryLeaf.
+
+		Для целочисленных значений сначала пробуется векторный путь (SearchVectorized), результат у него тот же.
+	*/
+	void GetMinMaxWeightSumChildrenRatio(double& outputMin, size_t& outputMinHolder, double& outputMax, size_t& outputMaxHolder) const
+	{
+		if constexpr (std::is_integral_v<T>)
+		{
+			if (SearchVectorized(outputMin, outputMinHolder, outputMax, outputMaxHolder))
+			{
+				return;
+			}
+		}
+
+		size_t size = mSize;
+
+		// Суммы весов и количества лепестков поддеревьев.
+		std::vector<leaf_weight_t<T>> weightSums(size);
+		std::vector<size_t> counts(size);
+
+		bool minFound = false;
+		bool maxFound = false;
+
+		for (size_t index = size; index-- > 0;)
+		{
+			leaf_weight_t<T> weightSum = (GetDepth(index) * mValues[index]);
+			size_t count = 1;
+
+			size_t right = 2 * index + 1;
+			if (right < size)
+			{
+				weightSum += weightSums[right];
+				count += counts[right];
+			}
+
+			size_t left = right + 1;
+			if (left < size)
+			{
+				weightSum += weightSums[left];
+				count += counts[left];
+			}
+
+			weightSums[index] = weightSum;
+			counts[index] = count;
+
+			size_t children = std::max<size_t>(1, count - 1);
+			double ratio = static_cast<double>(weightSum) / static_cast<double>(children);
+
+			if (ratio < outputMin || (minFound && ratio == outputMin))
+			{
+				outputMin = ratio;
+				outputMinHolder = index;
+
+				minFound = true;
+			}
+
+			if (ratio > outputMax || (maxFound && ratio == outputMax))
+			{
+				outputMax = ratio;
+				outputMaxHolder = index;
+
+				maxFound = true;
+			}
+		}
+	}
+private:
+	/*
+		Векторный поиск минимального и максимального отношения. Аргументы те же, что у GetMinMaxWeightSumChildrenRatio.
+
+		Суммы и количества считаются в double уровень за уровнем, начиная с самого глубокого. Потомки родителей
+		одного уровня лежат в массиве подряд, поэтому уровень - это одно сложение пар (simd::AddChildPairs).
+		Затем все суммы на месте превращаются в отношения, и по массиву отношений ищутся первые минимум и максимум.
+
+		double точно представляет целые числа до 2^53, поэтому результат совпадает со скалярным, пока
+		сумма весов всего дерева заведомо не больше 2^53. Иначе возвращается false, и ничего не меняется.
+	*/
+	bool SearchVectorized(double& outputMin, size_t& outputMinHolder, double& outputMax, size_t& outputMaxHolder) const
+	{
+		size_t size = mSize;
+
+		if (size == 0)
+		{
+			return true;
+		}
+
+		// Суммы весов поддеревьев (а в конце - их отношения) и количества лепестков в них.
+		std::vector<double> sums(size);
+		std::vector<double> counts(size, 1.0);
+
+		// Собственные веса лепестков. Заодно ищутся наименьшее и наибольшее значения для проверки точности.
+		T lowest = mValues[0];
+		T highest = mValues[0];
+
+		for (size_t first = 0, width = 1; first < size; first = 2 * first + 1, width *= 2)
+		{
+			size_t last = std::min(first + width, size);
+			double depth = static_cast<double>(GetDepth(first));
+
+			for (size_t index = first; index < last; index++)
+			{
+				lowest = std::min(lowest, mValues[index]);
+				highest = std::max(highest, mValues[index]);
+
+				sums[index] = depth * static_cast<double>(mValues[index]);
+			}
+		}
+
+		double maxValue = std::max(std::abs(static_cast<double>(lowest)), std::abs(static_cast<double>(highest)));
+		double maxDepth = static_cast<double>(GetDepth(size - 1));
+
+		if (maxValue * maxDepth * static_cast<double>(size) > 9007199254740992.0)
+		{
+			return false;
+		}
+
+		// Родители с обоими потомками - это индексы меньше (size - 1) / 2. Их потомки - отрезок [2 * first + 1, ...).
+		size_t paired = (size - 1) / 2;
+
+		size_t levels = std::bit_width(size);
+
+		for (size_t level = levels; level-- > 0;)
+		{
+			size_t first = (static_cast<size_t>(1) << level) - 1;
+			size_t last = std::min(2 * first + 1, size);
+
+			size_t pairedLast = std::clamp(paired, first, last);
+
+			if (pairedLast > first)
+			{
+				simd::AddChildPairs(sums.data() + first, sums.data() + 2 * first + 1, pairedLast - first);
+				simd::AddChildPairs(counts.data() + first, counts.data() + 2 * first + 1, pairedLast - first);
+			}
+
+			// Не больше одного родителя на всё дерево имеет только правого потомка.
+			if (pairedLast < last && 2 * pairedLast + 1 < size)
+			{
+				sums[pairedLast] += sums[2 * pairedLast + 1];
+				counts[pairedLast] += counts[2 * pairedLast + 1];
+			}
+		}
+
+		simd::DivideRatios(sums.data(), counts.data(), size);
+
+		size_t minHolder = simd::FindFirstMin(sums.data(), size);
+		size_t maxHolder = simd::FindFirstMax(sums.data(), size);
+
+		if (sums[minHolder] < outputMin)
+		{
+			outputMin = sums[minHolder];
+			outputMinHolder = minHolder;
+		}
+
+		if (sums[maxHolder] > outputMax)
+		{
+			outputMax = sums[maxHolder];
+			outputMaxHolder = maxHolder;
+		}
+
+		return true;
+	}
+public:
+	/*
+		Метод сериализации. Вывод совпадает с BinaryLeaf::Serialize для того же дерева, аргументы значат то же самое.
+		root - корень сериализуемого поддерева, по умолчанию всё дерево.
+	*/
+	void Serialize(std::ostream& stream, uint16_t skipDeep = -1, bool pretty = false, size_t root = 0) const
+	{
+		BufferedWriter writer(stream);
+
+		// Первая строка обещает загрузчику последнюю (см. textload::CHECKSUM_HEADER).
+		if (!pretty)
+		{
+			writer.WriteChecksumHeader();
+		}
+
+		Walk([&](size_t index) -> bool {
+			uint16_t depth = GetDepth(index);
+
+			if (pretty)
+			{
+				uint16_t tabDepth = (depth < 32) ? depth : 32;
+
+				if (GetDirection(index) == TreeDirection::LEFT)
+				{
+					tabDepth -= 1;
+				}
+
+				for (uint16_t t = 0; t < tabDepth; t++)
+				{
+					writer.Write('\t');
+				}
+
+				writer.WriteValue(depth);
+				writer.Write(": ", 2);
+			}
+
+			writer.WriteValue(mValues[index]);
+			writer.Write('\n');
+
+			if (skipDeep != -1 && depth > skipDeep)
+			{
+				writer.Write("...\n", 4);
+
+				return true;
+			}
+
+			return false;
+		}, true, root);
+
+		// Файловый формат заканчивается строкой контрольной суммы, чтобы обрезанный файл не загрузился молча.
+		if (!pretty)
+		{
+			writer.WriteChecksumLine();
+		}
+
+		writer.Flush();
+	}
+
+	/*
+		Метод десериализации. Формат тот же, что у BinaryLeaf::Deserialize: по одному значению на строку и, у новых файлов,
+		строки контрольной суммы в начале и в конце (см. textload::CHECKSUM_HEADER). Если сумма не совпала, последней
+		строки нет или после неё что-то есть (файл обрезан или повреждён), output становится пустым.
+	*/
+	static void Deserialize(std::istream& stream, ImplicitBinaryTree<T>& output, deserializer_t valueDeserializer)
+	{
+		std::vector<T> values = {};
+
+		std::string curline = "";
+
+		// CRC32C всех прочитанных строк вместе с переводами строк - ровно тех байт, что идут до последней строки контрольной суммы.
+		uint32_t crc = 0;
+
+		textload::TextFrame frame;
+		bool valid = true;
+
+		// Строки после последней строки контрольной суммы тоже читаются: любая непустая из них - ошибка, как и в PipelinedLoader.
+		while (stream.good())
+		{
+			std::getline(stream, curline);
+
+			const char* first = curline.data();
+			const char* last = curline.data() + curline.size();
+
+			bool filled = textload::TrimLine(first, last);
+
+			uint32_t expected = 0;
+			textload::textline_t line = filled ? textload::ClassifyLine(first, last, expected) : textload::TextLine::VALUE;
+
+			if (filled && (!frame.Next(line) || (line == textload::TextLine::FOOTER && crc != expected)))
+			{
+				valid = false;
+
+				break;
+			}
+
+			crc = checksum::Crc32c(curline.data(), curline.size(), crc);
+			crc = checksum::Crc32c("\n", 1, crc);
+
+			if (!filled || line != textload::TextLine::VALUE)
+			{
+				continue;
+			}
+
+			values.push_back(valueDeserializer(curline));
+		}
+
+		if (!valid || !frame.IsComplete())
+		{
+			values.clear();
+		}
+
+		output.Assign(std::move(values));
+		output.mRootDepth = 0;
+	}
+public:
+	/*
+		Преобразование из BinaryLeaf. Дерево обходится через Walk, и каждый лепесток должен оказаться на своём месте в куче.
+		Если форма дерева не представима в виде массива (где-то не хватает лепестка), возвращается false, а output не меняется.
+	*/
+	static bool FromBinaryLeaf(BinaryLeaf<T>* root, ImplicitBinaryTree<T>& output)
+	{
+		std::vector<T> values = {};
+
+		// Все лепестки, у которых не хватает потомка, должны идти после последнего лепестка. Проверяем это по индексам.
+		bool representable = true;
+		size_t expectedSize = 1;
+
+		root->Walk([&](BinaryLeaf<T>* leaf) -> bool {
+			size_t index = values.size();
+
+			values.push_back(leaf->GetValue());
+
+			BinaryLeaf<T>* right = *leaf->GetRightChild();
+			BinaryLeaf<T>* left = *leaf->GetLeftChild();
+
+			// Потомки лепестка index должны занять индексы 2 * index + 1 и 2 * index + 2 и идти подряд без пропусков.
+			if (right != nullptr)
+			{
+				representable = representable && (expectedSize == 2 * index + 1);
+				expectedSize = 2 * index + 2;
+			}
+
+			if (left != nullptr)
+			{
+				representable = representable && (right != nullptr) && (expectedSize == 2 * index + 2);
+				expectedSize = 2 * index + 3;
+			}
+
+			return !representable;
+		});
+
+		if (!representable)
+		{
+			return false;
+		}
+
+		output.Assign(std::move(values));
+		output.mRootDepth = root->GetDepth();
+
+		return true;
+	}
+
+	/*
+		Преобразование в BinaryLeaf. Возвращает корень нового дерева или nullptr, если дерево пустое.
+		Корень нового дерева, как и любой новый лепесток, имеет глубину 0 независимо от mRootDepth.
+		Если передана арена, лепестки создаются в ней.
+	*/
+	BinaryLeaf<T>* ToBinaryLeaf(LeafArena<T>* arena = nullptr) const
+	{
+		size_t size = mSize;
+		if (size == 0)
+		{
+			return nullptr;
+		}
+
+		std::vector<BinaryLeaf<T>*> leaves(size);
+
+		for (size_t index = 0; index < size; index++)
+		{
+			leaves[index] = (arena != nullptr) ? arena->Create(mValues[index]) : new BinaryLeaf<T>(mValues[index]);
+
+			if (index == 0)
+			{
+				continue;
+			}
+
+			BinaryLeaf<T>* parent = leaves[GetParent(index)];
+
+			if (GetDirection(index) == TreeDirection::RIGHT)
+			{
+				parent->SetRightChild(leaves[index]);
+			}
+			else
+			{
+				parent->SetLeftChild(leaves[index]);
+			}
+		}
+
+		return leaves[0];
+	}
+};
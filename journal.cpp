@@ -0,0 +1,260 @@
+﻿#include "journal.hpp"
+
+#include "checksum.hpp"
+#include "mapping.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+std::string journal::GetJournalPath(const char* snapshotPath)
+{
+	return std::string(snapshotPath) + ".journal";
+}
+
+std::string journal::GetCompactionPath(const std::string& path)
+{
+	return path + ".compact";
+}
+
+bool journal::GetSnapshotId(const char* snapshotPath, uint64_t& size, uint32_t& checksum)
+{
+	MappedFile file;
+
+	if (!file.Open(snapshotPath))
+	{
+		return false;
+	}
+
+	size = file.GetSize();
+
+	btfile_header_t header = {};
+
+	if (btfile::ReadHeader(file.GetData(), file.GetSize(), header))
+	{
+		checksum = header.headerChecksum;
+
+		return true;
+	}
+
+	file.Advise(MapAccess::SEQUENTIAL);
+	checksum = checksum::Crc32c(file.GetData(), file.GetSize());
+
+	return true;
+}
+
+// Контрольная сумма заголовка - CRC32C всех его байт при нулевом headerChecksum, как у btfile_header_t.
+static uint32_t GetHeaderChecksum(const journal_header_t& header)
+{
+	journal_header_t copy = header;
+	copy.headerChecksum = 0;
+
+	return checksum::Crc32c(&copy, sizeof(copy));
+}
+
+void journal::FillHeader(journal_header_t& header, btvalue_t valueType, uint8_t valueSize, uint64_t snapshotSize, uint32_t snapshotChecksum)
+{
+	header = {};
+
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+
+	header.valueType = valueType;
+	header.valueSize = valueSize;
+
+	header.snapshotSize = snapshotSize;
+	header.snapshotChecksum = snapshotChecksum;
+
+	header.headerChecksum = GetHeaderChecksum(header);
+}
+
+bool journal::CheckHeader(const journal_header_t& header)
+{
+	return std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+		&& header.version == VERSION
+		&& header.headerChecksum == GetHeaderChecksum(header);
+}
+
+void journal::EncodeRecord(journalop_t operation, const tree_path_t& path, const void* value, size_t valueSize, std::vector<uint8_t>& output)
+{
+	size_t start = output.size();
+	size_t pathSize = (path.size() + 7) / 8;
+
+	journal_record_t record = {};
+	record.operation = operation;
+	record.pathLength = static_cast<uint16_t>(path.size());
+
+	output.resize(start + sizeof(record) + pathSize + valueSize, 0);
+
+	uint8_t* pathData = output.data() + start + sizeof(record);
+
+	for (size_t step = 0; step < path.size(); step++)
+	{
+		if (path[step] == TreeDirection::LEFT)
+		{
+			pathData[step / 8] |= uint8_t(1) << (step % 8);
+		}
+	}
+
+	std::memcpy(pathData + pathSize, value, valueSize);
+
+	// Сумма считается по записи с нулевым полем checksum, а затем в него и пишется.
+	std::memcpy(output.data() + start, &record, sizeof(record));
+	record.checksum = checksum::Crc32c(output.data() + start + sizeof(record.checksum), output.size() - start - sizeof(record.checksum));
+	std::memcpy(output.data() + start, &record, sizeof(record));
+}
+
+size_t journal::DecodeRecord(const uint8_t* data, size_t size, size_t valueSize, journal_record_t& record, tree_path_t& path, const uint8_t*& value)
+{
+	if (size < sizeof(record))
+	{
+		return 0;
+	}
+
+	std::memcpy(&record, data, sizeof(record));
+
+	size_t pathSize = (static_cast<size_t>(record.pathLength) + 7) / 8;
+	size_t length = sizeof(record) + pathSize + valueSize;
+
+	if (size < length || checksum::Crc32c(data + sizeof(record.checksum), length - sizeof(record.checksum)) != record.checksum)
+	{
+		return 0;
+	}
+
+	const uint8_t* pathData = data + sizeof(record);
+
+	path.clear();
+
+	for (size_t step = 0; step < record.pathLength; step++)
+	{
+		bool left = (pathData[step / 8] >> (step % 8)) & 1;
+
+		path.push_back(left ? TreeDirection::LEFT : TreeDirection::RIGHT);
+	}
+
+	value = pathData + pathSize;
+
+	return length;
+}
+
+bool journal::SyncFile(const char* path)
+{
+#ifdef _WIN32
+	// FlushFileBuffers требует дескриптор с правом записи.
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	bool synced = FlushFileBuffers(file) != FALSE;
+
+	CloseHandle(file);
+
+	return synced;
+#else
+	int file = open(path, O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	bool synced = fsync(file) == 0;
+
+	close(file);
+
+	return synced;
+#endif
+}
+
+bool journal::SyncDirectory(const char* path)
+{
+#ifdef _WIN32
+	// На Windows переименование не требует отдельного сброса каталога.
+	(void)path;
+
+	return true;
+#else
+	std::filesystem::path directory = std::filesystem::path(path).parent_path();
+
+	if (directory.empty())
+	{
+		directory = ".";
+	}
+
+	int file = open(directory.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	bool synced = fsync(file) == 0;
+
+	close(file);
+
+	return synced;
+#endif
+}
+
+bool journal::MatchesSnapshot(const char* journalPath, const char* snapshotPath)
+{
+	journal_header_t header = {};
+
+	std::ifstream stream = std::ifstream(journalPath, std::ios::binary);
+	stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+	uint64_t snapshotSize = 0;
+	uint32_t snapshotChecksum = 0;
+
+	return static_cast<size_t>(stream.gcount()) == sizeof(header)
+		&& CheckHeader(header)
+		&& GetSnapshotId(snapshotPath, snapshotSize, snapshotChecksum)
+		&& header.snapshotSize == snapshotSize
+		&& header.snapshotChecksum == snapshotChecksum;
+}
+
+bool journal::RecoverCompaction(const char* snapshotPath)
+{
+	std::string journalPath = GetJournalPath(snapshotPath);
+
+	std::string snapshotTemp = GetCompactionPath(snapshotPath);
+	std::string journalTemp = GetCompactionPath(journalPath);
+
+	std::error_code error;
+
+	// Новый снимок не успел встать на место - старые снимок и журнал целы, недописанное сжатие просто выбрасывается.
+	if (std::filesystem::exists(snapshotTemp, error))
+	{
+		std::filesystem::remove(snapshotTemp, error);
+		std::filesystem::remove(journalTemp, error);
+
+		return true;
+	}
+
+	if (!std::filesystem::exists(journalTemp, error))
+	{
+		return true;
+	}
+
+	// Снимок уже новый, журнал ещё старый. Новый журнал дописан и сброшен до первого переименования.
+	if (MatchesSnapshot(journalPath.c_str(), snapshotPath))
+	{
+		std::filesystem::remove(journalTemp, error);
+
+		return true;
+	}
+
+	if (!MatchesSnapshot(journalTemp.c_str(), snapshotPath))
+	{
+		return false;
+	}
+
+	std::filesystem::rename(journalTemp, journalPath, error);
+
+	return !error && SyncDirectory(journalPath.c_str());
+}
@@ -0,0 +1,743 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "arena.hpp"
+#include "btfile.hpp"
+#include "btree.hpp"
+#include "itree.hpp"
+#include "loader.hpp"
+
+/*
+	Журнал правок дерева. Вместо того чтобы после каждой правки переписывать весь снимок (btree.bt), правка дописывается
+	в конец журнала рядом с ним (btree.bt.journal), так что сохранение правки стоит столько байт, сколько занимает она сама.
+	Загрузка - это снимок и затем все правки журнала по порядку. Когда журнал вырастает выше порога, он в фоне
+	сворачивается в новый снимок (см. TreeJournal).
+
+	Лепесток в правке задаётся путём от корня, а не номером: номер в порядке Walk меняется, когда в дерево добавляются
+	лепестки, а путь к уже существующему лепестку не меняется никогда.
+
+	Файл журнала - заголовок journal_header_t и записи подряд. Запись - journal_record_t, затем шаги пути по биту на шаг
+	(0 - правый, 1 - левый, младшими битами вперёд) и затем valueSize байт значения. Значения хранятся как в памяти,
+	поэтому журнал, как и двоичный снимок, пишется только для числовых типов на little-endian.
+*/
+typedef uint8_t journalop_t;
+namespace JournalOp
+{
+	// Новое значение лепестка по пути.
+	constexpr journalop_t SET_VALUE = 1;
+
+	// Новый правый или левый потомок лепестка по пути со значением из записи. Место потомка должно быть свободно.
+	constexpr journalop_t SET_RIGHT_CHILD = 2;
+	constexpr journalop_t SET_LEFT_CHILD = 3;
+}
+
+#pragma pack(push, 1)
+struct journal_header_t
+{
+	char magic[8];
+	uint32_t version;
+
+	// Тип значений, как в btfile_header_t.
+	btvalue_t valueType;
+	uint8_t valueSize;
+
+	uint8_t reserved[2];
+
+	// Снимок, к которому относится журнал (см. journal::GetSnapshotId). Журнал от другого снимка не применяется.
+	uint64_t snapshotSize;
+	uint32_t snapshotChecksum;
+
+	// CRC32C заголовка при нулевом headerChecksum.
+	uint32_t headerChecksum;
+};
+
+struct journal_record_t
+{
+	// CRC32C остальной записи: полей после checksum, пути и значения. Оборванная при падении запись на ней не сходится.
+	uint32_t checksum;
+
+	journalop_t operation;
+	uint8_t reserved;
+
+	// Количество шагов пути. 0 - корень.
+	uint16_t pathLength;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(journal_header_t) == 32, "journal_header_t must stay 32 bytes");
+static_assert(sizeof(journal_record_t) == 8, "journal_record_t must stay 8 bytes");
+
+// Путь от корня: направление (TreeDirection::RIGHT или LEFT) каждого шага.
+using tree_path_t = std::vector<treedir_t>;
+
+namespace journal
+{
+	constexpr char MAGIC[8] = { 'B', 'T', 'J', 'O', 'U', 'R', 'N', 'L' };
+	constexpr uint32_t VERSION = 1;
+
+	// Размер журнала в байтах, после которого TreeJournal начинает фоновое сжатие.
+	constexpr uint64_t DEFAULT_COMPACTION_THRESHOLD = 4 * 1024 * 1024;
+
+	// Путь журнала для снимка snapshotPath - тот же файл с суффиксом ".journal".
+	std::string GetJournalPath(const char* snapshotPath);
+
+	// Путь временного файла, который сжатие пишет вместо снимка или журнала path, - с суффиксом ".compact".
+	std::string GetCompactionPath(const std::string& path);
+
+	/*
+		Опознавательные данные снимка, которые журнал запоминает в заголовке: размер файла и контрольная сумма.
+		У двоичного снимка сумма берётся из его заголовка (она покрывает суммы формы и значений), у текстового -
+		это CRC32C всего файла. Возвращает false, если файл не открылся.
+	*/
+	bool GetSnapshotId(const char* snapshotPath, uint64_t& size, uint32_t& checksum);
+
+	// Сброс содержимого файла path на диск (fsync). Возвращает false, если файл не открылся или сброс не удался.
+	bool SyncFile(const char* path);
+
+	// Сброс на диск каталога файла path, чтобы переименования в нём пережили падение системы.
+	bool SyncDirectory(const char* path);
+
+	// Записан ли журнал journalPath с целым заголовком для снимка snapshotPath в его нынешнем виде.
+	bool MatchesSnapshot(const char* journalPath, const char* snapshotPath);
+
+	/*
+		Доведение до конца сжатия, прерванного падением (см. TreeJournal::CompactPrefix). Если новый снимок ещё
+		не встал на место, временные файлы удаляются. Если снимок уже заменён, а журнал нет, на место журнала
+		ставится новый журнал из временного файла. Возвращает false, если ни один журнал не подходит к снимку.
+	*/
+	bool RecoverCompaction(const char* snapshotPath);
+
+	// Заполнение заголовка вместе с его контрольной суммой.
+	void FillHeader(journal_header_t& header, btvalue_t valueType, uint8_t valueSize, uint64_t snapshotSize, uint32_t snapshotChecksum);
+
+	// Проверка сигнатуры, версии и контрольной суммы заголовка.
+	bool CheckHeader(const journal_header_t& header);
+
+	// Запись правки в конец output. value - valueSize байт значения.
+	void EncodeRecord(journalop_t operation, const tree_path_t& path, const void* value, size_t valueSize, std::vector<uint8_t>& output);
+
+	/*
+		Разбор записи из начала data длиной size. Путь записывается в path, value указывает на байты значения внутри data.
+		Возвращает длину записи или 0, если запись неполная или её контрольная сумма не сходится - так выглядит
+		запись, оборванная падением посреди дописывания.
+	*/
+	size_t DecodeRecord(const uint8_t* data, size_t size, size_t valueSize, journal_record_t& record, tree_path_t& path, const uint8_t*& value);
+
+	// Лепесток по пути path от root. nullptr, если такого лепестка нет.
+	template<typename T>
+	BinaryLeaf<T>* FindLeaf(BinaryLeaf<T>* root, const tree_path_t& path)
+	{
+		BinaryLeaf<T>* leaf = root;
+
+		for (size_t step = 0; step < path.size() && leaf != nullptr; step++)
+		{
+			if (path[step] == TreeDirection::RIGHT)
+			{
+				leaf = *leaf->GetRightChild();
+			}
+			else if (path[step] == TreeDirection::LEFT)
+			{
+				leaf = *leaf->GetLeftChild();
+			}
+			else
+			{
+				return nullptr;
+			}
+		}
+
+		return leaf;
+	}
+
+	// Можно ли применить правку к дереву root: лепесток по пути есть, а место нового потомка свободно.
+	template<typename T>
+	bool CanApply(BinaryLeaf<T>* root, journalop_t operation, const tree_path_t& path)
+	{
+		BinaryLeaf<T>* leaf = FindLeaf(root, path);
+
+		if (leaf == nullptr)
+		{
+			return false;
+		}
+
+		switch (operation)
+		{
+		case JournalOp::SET_VALUE:
+			return true;
+		case JournalOp::SET_RIGHT_CHILD:
+			return *leaf->GetRightChild() == nullptr;
+		case JournalOp::SET_LEFT_CHILD:
+			return *leaf->GetLeftChild() == nullptr;
+		default:
+			return false;
+		}
+	}
+
+	/*
+		Применение правки к дереву root. Новые лепестки создаются в arena или через new.
+		Возвращает лепесток, который изменился или появился, или nullptr, если правку применить нельзя (см. CanApply).
+	*/
+	template<typename T>
+	BinaryLeaf<T>* Apply(BinaryLeaf<T>* root, journalop_t operation, const tree_path_t& path, T value, LeafArena<T>* arena = nullptr)
+	{
+		if (!CanApply(root, operation, path))
+		{
+			return nullptr;
+		}
+
+		BinaryLeaf<T>* leaf = FindLeaf(root, path);
+
+		if (operation == JournalOp::SET_VALUE)
+		{
+			leaf->SetValue(value);
+
+			return leaf;
+		}
+
+		BinaryLeaf<T>* child = (arena != nullptr) ? arena->Create(value) : new BinaryLeaf<T>(value);
+
+		if (operation == JournalOp::SET_RIGHT_CHILD)
+		{
+			leaf->SetRightChild(child);
+		}
+		else
+		{
+			leaf->SetLeftChild(child);
+		}
+
+		return child;
+	}
+
+	/*
+		Повтор записей журнала data длиной size (весь файл, с заголовком) поверх дерева root.
+		Проверяется только сам журнал, а не то, к какому снимку он относится, - это делает Replay по пути.
+
+		validSize - длина журнала до первой оборванной записи (см. DecodeRecord): всё после неё не применяется.
+		Возвращает false, если заголовок не подходит к T или какую-то запись нельзя применить к дереву.
+	*/
+	template<typename T>
+	bool Replay(const uint8_t* data, size_t size, BinaryLeaf<T>* root, LeafArena<T>* arena, size_t& validSize, size_t& recordCount)
+	{
+		validSize = 0;
+		recordCount = 0;
+
+		journal_header_t header = {};
+
+		if (size < sizeof(header))
+		{
+			return false;
+		}
+
+		std::memcpy(&header, data, sizeof(header));
+
+		if (!CheckHeader(header) || header.valueType != btfile::GetValueType<T>() || header.valueSize != sizeof(T))
+		{
+			return false;
+		}
+
+		size_t offset = sizeof(header);
+
+		journal_record_t record = {};
+		tree_path_t path = {};
+		const uint8_t* valueData = nullptr;
+
+		while (offset < size)
+		{
+			size_t length = DecodeRecord(data + offset, size - offset, sizeof(T), record, path, valueData);
+
+			if (length == 0)
+			{
+				break;
+			}
+
+			T value = {};
+			std::memcpy(&value, valueData, sizeof(T));
+
+			if (Apply(root, record.operation, path, value, arena) == nullptr)
+			{
+				return false;
+			}
+
+			offset += length;
+			recordCount++;
+		}
+
+		validSize = offset;
+
+		return true;
+	}
+
+	/*
+		Повтор журнала снимка snapshotPath поверх уже загруженного из него дерева root. Если журнала нет, ничего не делается.
+		Возвращает false, если журнал повреждён, записан для другого снимка или не применяется к дереву.
+	*/
+	template<typename T>
+	bool Replay(const char* snapshotPath, BinaryLeaf<T>* root, LeafArena<T>* arena, size_t& recordCount, size_t* validSize = nullptr)
+	{
+		recordCount = 0;
+
+		std::string journalPath = GetJournalPath(snapshotPath);
+		std::ifstream stream = std::ifstream(journalPath, std::ios::binary);
+
+		if (!stream.is_open())
+		{
+			if (validSize != nullptr)
+			{
+				*validSize = 0;
+			}
+
+			return true;
+		}
+
+		std::vector<uint8_t> data = std::vector<uint8_t>(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+
+		journal_header_t header = {};
+		uint64_t snapshotSize = 0;
+		uint32_t snapshotChecksum = 0;
+
+		if (data.size() < sizeof(header) || !GetSnapshotId(snapshotPath, snapshotSize, snapshotChecksum))
+		{
+			return false;
+		}
+
+		std::memcpy(&header, data.data(), sizeof(header));
+
+		if (header.snapshotSize != snapshotSize || header.snapshotChecksum != snapshotChecksum)
+		{
+			return false;
+		}
+
+		size_t replayedSize = 0;
+
+		if (!Replay(data.data(), data.size(), root, arena, replayedSize, recordCount))
+		{
+			return false;
+		}
+
+		if (validSize != nullptr)
+		{
+			*validSize = replayedSize;
+		}
+
+		return true;
+	}
+
+	// Загрузка снимка любого формата: двоичного через btfile::Load, текстового через PipelinedLoader.
+	template<typename T>
+	bool LoadSnapshot(const char* path, BinaryLeaf<T>** output, LeafArena<T>* arena = nullptr)
+	{
+		if (btfile::IsBinaryFile(path))
+		{
+			return btfile::Load(path, output, arena);
+		}
+
+		std::ifstream stream = std::ifstream(path, std::ios::binary);
+
+		return stream.is_open() && PipelinedLoader<T>().Load(stream, output, PipelinedLoader<T>::ParseNumber, arena);
+	}
+
+	/*
+		Запись снимка дерева root в path. Полное дерево пишется массивом, любое другое - с формой LOUDS.
+		Если format не nullptr, снимок двоичный с тем же кодированием и размером куска, что в format. Иначе снимок текстовый,
+		пока дерево полное: текст хранит только значения, и дерево с пропусками в нём не представимо, поэтому
+		такое дерево пишется двоичным файлом без упаковки.
+	*/
+	template<typename T>
+	bool SaveSnapshot(const char* path, BinaryLeaf<T>* root, const btfile_header_t* format)
+	{
+		ImplicitBinaryTree<T> array;
+		bool complete = (root == nullptr) || ImplicitBinaryTree<T>::FromBinaryLeaf(root, array);
+
+		if (format == nullptr && complete)
+		{
+			std::ofstream stream = std::ofstream(path, std::ios::binary);
+
+			if (root != nullptr)
+			{
+				root->Serialize(stream);
+			}
+			else
+			{
+				// Пустое дерево - текст из одних строк контрольной суммы, как его записал бы Serialize.
+				BufferedWriter writer(stream);
+				writer.WriteChecksumHeader();
+				writer.WriteChecksumLine();
+			}
+
+			return stream.good();
+		}
+
+		btencoding_t encoding = (format != nullptr) ? format->encoding : BtEncoding::RAW;
+		uint32_t chunkSize = (format != nullptr) ? format->chunkSize : 0;
+
+		return complete ? btfile::Save(path, array, encoding, chunkSize) : btfile::Save(path, root, encoding);
+	}
+}
+
+/*
+	Журнал, открытый на дозапись, вместе с фоновым сжатием.
+
+	Правки (SetValue, SetRightChild, SetLeftChild) сначала проверяются на дереве, затем дописываются в журнал
+	и только потом применяются, так что журнал никогда не содержит правку, которую нельзя повторить.
+	Каждая правка сбрасывается в файл сразу.
+
+	Когда журнал вырастает до порога, запускается сжатие в отдельном потоке. Оно не трогает дерево в памяти:
+	снимок и уже записанная часть журнала загружаются заново в собственную арену, из них пишется новый снимок,
+	а затем под замком новый снимок и новый журнал из правок, дописанных за время сжатия, переименовываются
+	на место старых. Правки во время сжатия продолжают дописываться как обычно. Сжатие временно держит в памяти
+	вторую копию дерева.
+
+	Оба временных файла сбрасываются на диск до переименований, переименований два, снимок идёт первым, и каталог
+	сбрасывается после каждого. Если процесс упадёт между ними, журнал останется от старого снимка, а готовый
+	новый журнал - во временном файле; Open (через journal::RecoverCompaction) тогда ставит его на место.
+*/
+template<typename T>
+class TreeJournal
+{
+private:
+	std::string mSnapshotPath;
+	std::string mJournalPath;
+
+	// Поток дозаписи журнала и длина журнала. Под mMutex, потому что сжатие подменяет файл.
+	std::ofstream mOutput;
+	uint64_t mSize;
+	std::mutex mMutex;
+
+	uint64_t mThreshold;
+
+	std::thread mCompaction;
+	std::atomic<bool> mCompacting;
+
+	// Последнее сжатие не удалось. Тогда автоматическое сжатие больше не запускается, остаётся Compact.
+	std::atomic<bool> mCompactionFailed;
+public:
+	TreeJournal(uint64_t threshold = journal::DEFAULT_COMPACTION_THRESHOLD)
+	{
+		mSize = 0;
+		mThreshold = threshold;
+
+		mCompacting = false;
+		mCompactionFailed = false;
+	}
+
+	~TreeJournal()
+	{
+		Close();
+	}
+
+	TreeJournal(const TreeJournal<T>&) = delete;
+	TreeJournal<T>& operator=(const TreeJournal<T>&) = delete;
+public:
+	/*
+		Загрузка дерева из снимка snapshotPath с повтором его журнала и открытие журнала на дозапись.
+		Если журнала нет, он создаётся пустым; оборванная в конце запись отрезается. Сжатие, прерванное падением,
+		сначала доводится до конца (см. journal::RecoverCompaction).
+		Возвращает false, если снимок не загрузился или журнал к нему не применяется. Тогда output не определён.
+	*/
+	bool Open(const char* snapshotPath, BinaryLeaf<T>** output, LeafArena<T>* arena = nullptr)
+	{
+		static_assert(btfile::GetValueType<T>() != BtValueType::UNKNOWN, "journal stores numeric values only");
+
+		Close();
+
+		mSnapshotPath = snapshotPath;
+		mJournalPath = journal::GetJournalPath(snapshotPath);
+
+		size_t recordCount = 0;
+		size_t validSize = 0;
+
+		if (!journal::RecoverCompaction(snapshotPath))
+		{
+			return false;
+		}
+
+		if (!journal::LoadSnapshot(snapshotPath, output, arena) || !journal::Replay(snapshotPath, *output, arena, recordCount, &validSize))
+		{
+			return false;
+		}
+
+		std::error_code error;
+
+		if (validSize == 0)
+		{
+			if (!CreateJournal(mJournalPath, mSnapshotPath, nullptr, 0))
+			{
+				return false;
+			}
+
+			validSize = sizeof(journal_header_t);
+		}
+		else if (std::filesystem::file_size(mJournalPath, error) != validSize)
+		{
+			std::filesystem::resize_file(mJournalPath, validSize, error);
+
+			if (error)
+			{
+				return false;
+			}
+		}
+
+		mOutput = std::ofstream(mJournalPath, std::ios::binary | std::ios::app);
+		mSize = validSize;
+
+		return mOutput.is_open();
+	}
+
+	// Закрытие журнала. Идущее сжатие сначала дожидается.
+	void Close()
+	{
+		WaitForCompaction();
+
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mOutput.close();
+		mSize = 0;
+	}
+
+	// Длина журнала в байтах, вместе с заголовком.
+	uint64_t GetSize()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		return mSize;
+	}
+public:
+	// Новое значение лепестка по пути path от root. Возвращает false, если лепестка нет или правка не записалась.
+	bool SetValue(BinaryLeaf<T>* root, const tree_path_t& path, T value)
+	{
+		return Edit(root, JournalOp::SET_VALUE, path, value, nullptr) != nullptr;
+	}
+
+	// Новый потомок лепестка по пути path. Возвращает этот потомок или nullptr, если место занято или правка не записалась.
+	BinaryLeaf<T>* SetRightChild(BinaryLeaf<T>* root, const tree_path_t& path, T value, LeafArena<T>* arena = nullptr)
+	{
+		return Edit(root, JournalOp::SET_RIGHT_CHILD, path, value, arena);
+	}
+
+	BinaryLeaf<T>* SetLeftChild(BinaryLeaf<T>* root, const tree_path_t& path, T value, LeafArena<T>* arena = nullptr)
+	{
+		return Edit(root, JournalOp::SET_LEFT_CHILD, path, value, arena);
+	}
+public:
+	// Немедленное сжатие в этом потоке. Возвращает false, если оно не удалось; журнал и снимок тогда прежние.
+	bool Compact()
+	{
+		WaitForCompaction();
+
+		uint64_t cutoff = GetSize();
+		bool compacted = CompactPrefix(cutoff);
+
+		mCompactionFailed = !compacted;
+
+		return compacted;
+	}
+
+	// Ожидание фонового сжатия. Возвращает false, если последнее сжатие не удалось.
+	bool WaitForCompaction()
+	{
+		if (mCompaction.joinable())
+		{
+			mCompaction.join();
+		}
+
+		return !mCompactionFailed;
+	}
+private:
+	BinaryLeaf<T>* Edit(BinaryLeaf<T>* root, journalop_t operation, const tree_path_t& path, T value, LeafArena<T>* arena)
+	{
+		if (path.size() > UINT16_MAX || !journal::CanApply(root, operation, path))
+		{
+			return nullptr;
+		}
+
+		std::vector<uint8_t> record = {};
+		journal::EncodeRecord(operation, path, &value, sizeof(T), record);
+
+		uint64_t size = 0;
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+
+			mOutput.write(reinterpret_cast<const char*>(record.data()), static_cast<std::streamsize>(record.size()));
+			mOutput.flush();
+
+			if (!mOutput.good())
+			{
+				return nullptr;
+			}
+
+			mSize += record.size();
+			size = mSize;
+		}
+
+		if (size >= mThreshold && !mCompacting && !mCompactionFailed)
+		{
+			StartCompaction(size);
+		}
+
+		return journal::Apply(root, operation, path, value, arena);
+	}
+
+	void StartCompaction(uint64_t cutoff)
+	{
+		if (mCompaction.joinable())
+		{
+			mCompaction.join();
+		}
+
+		mCompacting = true;
+
+		mCompaction = std::thread([this, cutoff]() {
+			mCompactionFailed = !CompactPrefix(cutoff);
+			mCompacting = false;
+		});
+	}
+
+	/*
+		Сжатие первых cutoff байт журнала в новый снимок. Правки после cutoff переносятся в новый журнал.
+		Вызывается без замка: дерево из файлов строится заново, а замок берётся только на подмену файлов.
+	*/
+	bool CompactPrefix(uint64_t cutoff)
+	{
+		std::string snapshotTemp = journal::GetCompactionPath(mSnapshotPath);
+		std::string journalTemp = journal::GetCompactionPath(mJournalPath);
+
+		std::vector<uint8_t> prefix(static_cast<size_t>(cutoff));
+
+		std::ifstream input = std::ifstream(mJournalPath, std::ios::binary);
+		input.read(reinterpret_cast<char*>(prefix.data()), static_cast<std::streamsize>(prefix.size()));
+
+		if (static_cast<uint64_t>(input.gcount()) != cutoff)
+		{
+			return false;
+		}
+
+		input.close();
+
+		btfile_header_t format = {};
+		bool binary = btfile::ReadHeader(mSnapshotPath.c_str(), format);
+
+		{
+			LeafArena<T> arena;
+			BinaryLeaf<T>* root = nullptr;
+
+			size_t validSize = 0;
+			size_t recordCount = 0;
+
+			bool rebuilt = journal::LoadSnapshot(mSnapshotPath.c_str(), &root, &arena)
+				&& journal::Replay(prefix.data(), prefix.size(), root, &arena, validSize, recordCount)
+				&& validSize == cutoff
+				&& journal::SaveSnapshot(snapshotTemp.c_str(), root, binary ? &format : nullptr);
+
+			if (!rebuilt)
+			{
+				std::error_code error;
+				std::filesystem::remove(snapshotTemp, error);
+
+				return false;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		// Правки, дописанные за время сжатия.
+		std::vector<uint8_t> tail(static_cast<size_t>(mSize - cutoff));
+
+		input = std::ifstream(mJournalPath, std::ios::binary);
+		input.seekg(static_cast<std::streamoff>(cutoff));
+		input.read(reinterpret_cast<char*>(tail.data()), static_cast<std::streamsize>(tail.size()));
+
+		bool valid = static_cast<size_t>(input.gcount()) == tail.size();
+
+		input.close();
+
+		std::error_code error;
+
+		// Оба временных файла должны лежать на диске до первого переименования: после него их уже не перепишешь.
+		valid = valid && CreateJournal(journalTemp, snapshotTemp, tail.data(), tail.size())
+			&& journal::SyncFile(snapshotTemp.c_str())
+			&& journal::SyncFile(journalTemp.c_str());
+
+		if (!valid)
+		{
+			std::filesystem::remove(snapshotTemp, error);
+			std::filesystem::remove(journalTemp, error);
+
+			return false;
+		}
+
+		mOutput.close();
+
+		std::filesystem::rename(snapshotTemp, mSnapshotPath, error);
+
+		if (error)
+		{
+			mOutput = std::ofstream(mJournalPath, std::ios::binary | std::ios::app);
+
+			std::filesystem::remove(snapshotTemp, error);
+			std::filesystem::remove(journalTemp, error);
+
+			return false;
+		}
+
+		/*
+			Снимок уже новый. Дальше временный журнал не удаляется ни при какой ошибке: без него правки после cutoff
+			потеряны, а journal::RecoverCompaction при следующем Open поставит его на место.
+		*/
+		bool renamed = journal::SyncDirectory(mSnapshotPath.c_str());
+
+		if (renamed)
+		{
+			std::filesystem::rename(journalTemp, mJournalPath, error);
+
+			renamed = !error && journal::SyncDirectory(mJournalPath.c_str());
+		}
+
+		// Старый журнал к новому снимку уже не подходит, так что без переименования дозапись остаётся закрытой и правки отклоняются.
+		if (!renamed)
+		{
+			return false;
+		}
+
+		mOutput = std::ofstream(mJournalPath, std::ios::binary | std::ios::app);
+
+		mSize = sizeof(journal_header_t) + tail.size();
+
+		return mOutput.is_open();
+	}
+
+	// Запись журнала path для снимка snapshotPath: заголовок и size байт готовых записей records.
+	static bool CreateJournal(const std::string& path, const std::string& snapshotPath, const uint8_t* records, size_t size)
+	{
+		uint64_t snapshotSize = 0;
+		uint32_t snapshotChecksum = 0;
+
+		if (!journal::GetSnapshotId(snapshotPath.c_str(), snapshotSize, snapshotChecksum))
+		{
+			return false;
+		}
+
+		journal_header_t header = {};
+		journal::FillHeader(header, btfile::GetValueType<T>(), sizeof(T), snapshotSize, snapshotChecksum);
+
+		std::ofstream stream = std::ofstream(path, std::ios::binary | std::ios::trunc);
+		stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+		if (size > 0)
+		{
+			stream.write(reinterpret_cast<const char*>(records), static_cast<std::streamsize>(size));
+		}
+
+		stream.flush();
+
+		return stream.good();
+	}
+};
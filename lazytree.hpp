@@ -0,0 +1,277 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <vector>
+
+#include "btfile.hpp"
+#include "itree.hpp"
+#include "mapping.hpp"
+
+/*
+	Полное дерево из двоичного файла, значения которого читаются по требованию.
+
+	Открытие - это отображение файла и проверка заголовка, массив значений при этом не трогается. Значения читаются
+	кусками (см. btfile_header_t::chunkSize): первое обращение к лепестку распаковывает и проверяет по CRC32C весь его кусок,
+	а страницы остальных кусков так и не подгружаются с диска. Поэтому посмотреть верхние уровни или одно поддерево
+	стоит столько же на файле любого размера. Файл без кусков считается одним большим куском.
+
+	Индексы, глубины и направления - как у ImplicitBinaryTree. Навигация не читает значений.
+*/
+template<typename T>
+class LazyBinaryTree
+{
+public:
+	static constexpr size_t npos = std::numeric_limits<size_t>::max();
+private:
+	MappedFile mFile;
+	btfile_header_t mHeader;
+
+	// Количество значений в куске. Для файла без кусков - все значения.
+	size_t mChunkSize;
+
+	// Распакованные куски. Пустой - ещё не прочитан.
+	std::vector<std::vector<T>> mChunks;
+	size_t mLoadedChunks;
+public:
+	LazyBinaryTree()
+	{
+		mHeader = {};
+
+		mChunkSize = 1;
+		mLoadedChunks = 0;
+	}
+
+	LazyBinaryTree(const LazyBinaryTree<T>&) = delete;
+	LazyBinaryTree<T>& operator=(const LazyBinaryTree<T>&) = delete;
+public:
+	/*
+		Открытие файла path. Читается только заголовок.
+		Возвращает false, если файл не двоичный, повреждён, хранит значения другого типа или дерево не полное.
+	*/
+	bool Open(const char* path)
+	{
+		Close();
+
+		if (!mFile.Open(path))
+		{
+			return false;
+		}
+
+		bool valid = btfile::ReadHeader(mFile.GetData(), mFile.GetSize(), mHeader)
+			&& btfile::IsCompatible<T>(mHeader)
+			&& mHeader.shape == BtShape::COMPLETE;
+
+		if (!valid)
+		{
+			Close();
+
+			return false;
+		}
+
+		size_t size = static_cast<size_t>(mHeader.nodeCount);
+
+		mChunkSize = (mHeader.chunkSize > 0) ? mHeader.chunkSize : std::max<size_t>(size, 1);
+		mChunks.resize((size + mChunkSize - 1) / mChunkSize);
+
+		return true;
+	}
+
+	void Close()
+	{
+		mFile.Close();
+		mHeader = {};
+
+		mChunkSize = 1;
+		mChunks.clear();
+		mLoadedChunks = 0;
+	}
+
+	size_t GetSize() const
+	{
+		return static_cast<size_t>(mHeader.nodeCount);
+	}
+
+	// Сколько кусков всего и сколько из них уже прочитано.
+	size_t GetChunkCount() const
+	{
+		return mChunks.size();
+	}
+
+	size_t GetLoadedChunkCount() const
+	{
+		return mLoadedChunks;
+	}
+public:
+	// Навигация по индексам, как у ImplicitBinaryTree. Если лепестка нет, возвращается npos.
+
+	size_t GetRightChild(size_t index) const
+	{
+		size_t child = 2 * index + 1;
+
+		return (child < GetSize()) ? child : npos;
+	}
+
+	size_t GetLeftChild(size_t index) const
+	{
+		size_t child = 2 * index + 2;
+
+		return (child < GetSize()) ? child : npos;
+	}
+
+	size_t GetParent(size_t index) const
+	{
+		return (index == 0) ? npos : (index - 1) / 2;
+	}
+
+	uint16_t GetDepth(size_t index) const
+	{
+		return mHeader.rootDepth + static_cast<uint16_t>(std::bit_width(index + 1) - 1);
+	}
+
+	// Значение лепестка index. Если его кусок ещё не прочитан, он читается сейчас. false, если кусок повреждён.
+	bool GetValue(size_t index, T& value)
+	{
+		if (!LoadChunk(index / mChunkSize))
+		{
+			return false;
+		}
+
+		value = mChunks[index / mChunkSize][index % mChunkSize];
+
+		return true;
+	}
+
+	// Чтение всех кусков, в которых лежат лепестки [first, last).
+	bool LoadRange(size_t first, size_t last)
+	{
+		last = std::min(last, GetSize());
+
+		for (size_t chunk = first / mChunkSize; first < last && chunk <= (last - 1) / mChunkSize; chunk++)
+		{
+			if (!LoadChunk(chunk))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+public:
+	/*
+		Итерация по поддереву лепестка root не глубже maxDepth уровней под ним, в том же порядке, что и BinaryLeaf::Walk.
+		walker получает индекс и значение лепестка и, как и в других Walk, возвращает true, чтобы прекратить итерацию.
+		Куски читаются по мере того, как до них доходит обход. Возвращает false, если какой-то кусок повреждён.
+	*/
+	template<typename F>
+	bool Walk(F&& walker, size_t root = 0, uint16_t maxDepth = -1)
+	{
+		size_t first = root;
+		size_t width = 1;
+
+		for (uint16_t level = 0; first < GetSize() && level <= maxDepth; level++)
+		{
+			size_t last = std::min(first + width, GetSize());
+
+			if (!LoadRange(first, last))
+			{
+				return false;
+			}
+
+			for (size_t index = first; index < last; index++)
+			{
+				if (walker(index, mChunks[index / mChunkSize][index % mChunkSize]))
+				{
+					return true;
+				}
+			}
+
+			// Дальше следующего уровня индексы не помещаются в size_t, а значит, и в дерево.
+			if (first > (std::numeric_limits<size_t>::max() - 1) / 2 || level == maxDepth)
+			{
+				break;
+			}
+
+			first = 2 * first + 1;
+			width *= 2;
+		}
+
+		return true;
+	}
+
+	/*
+		Поддерево лепестка root не глубже maxDepth уровней под ним как отдельное ImplicitBinaryTree.
+		Поддерево полного дерева тоже полное, поэтому его значения в порядке обхода - это готовый массив.
+	*/
+	bool LoadSubtree(size_t root, ImplicitBinaryTree<T>& output, uint16_t maxDepth = -1)
+	{
+		std::vector<T> values = {};
+
+		bool loaded = Walk([&](size_t, T value) {
+			values.push_back(value);
+
+			return false;
+		}, root, maxDepth);
+
+		if (!loaded)
+		{
+			return false;
+		}
+
+		output = ImplicitBinaryTree<T>(std::move(values), GetDepth(root));
+
+		return true;
+	}
+
+	// Верхние уровни дерева, до глубины depth под корнем включительно.
+	bool LoadPrefix(uint16_t depth, ImplicitBinaryTree<T>& output)
+	{
+		return LoadSubtree(0, output, depth);
+	}
+private:
+	// Распаковка и проверка куска chunk, если он ещё не прочитан.
+	bool LoadChunk(size_t chunk)
+	{
+		if (mChunks[chunk].size() > 0)
+		{
+			return true;
+		}
+
+		const uint8_t* data = mFile.GetData() + mHeader.dataOffset;
+
+		size_t first = chunk * mChunkSize;
+		size_t count = std::min(mChunkSize, GetSize() - first);
+
+		std::vector<T> values = std::vector<T>(count);
+
+		if (mHeader.chunkSize == 0)
+		{
+			bool decoded = btfile::VerifyData(mFile.GetData(), mHeader)
+				&& btfile::DecodeBlock(mHeader.encoding, data, static_cast<size_t>(mHeader.dataSize), static_cast<size_t>(mHeader.packedSize), values.data(), count);
+
+			if (!decoded)
+			{
+				return false;
+			}
+		}
+		else
+		{
+			btfile_chunk_t entry = {};
+
+			bool decoded = btfile::GetChunk(mHeader, data, chunk, entry)
+				&& btfile::VerifyChunk(data, entry)
+				&& btfile::DecodeBlock(mHeader.encoding, data + entry.offset, static_cast<size_t>(entry.size), static_cast<size_t>(entry.packedSize), values.data(), count);
+
+			if (!decoded)
+			{
+				return false;
+			}
+		}
+
+		mChunks[chunk] = std::move(values);
+		mLoadedChunks++;
+
+		return true;
+	}
+};
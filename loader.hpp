@@ -0,0 +1,498 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "arena.hpp"
+#include "checksum.hpp"
+#include "ring.hpp"
+#include "textparse.hpp"
+
+// Объявление лепестка наперёд. Загрузчик подключается из btree.hpp до объявления самого лепестка.
+template<typename T>
+class BinaryLeaf;
+
+// Счётчики одного этапа конвейера загрузки.
+struct load_stage_stats_t
+{
+	// Единицы работы этапа: блоки у чтения, значения у разбора и связывания.
+	uint64_t items;
+
+	// Байты текста, прошедшие через этап.
+	uint64_t bytes;
+
+	/*
+		Время работы этапа и время, которое он простоял в ожидании соседей (пустой вход или полный выход).
+		Пропускная способность этапа - items или bytes, делённые на busyTime. У разбора это суммы по всем его потокам.
+	*/
+	std::chrono::microseconds busyTime;
+	std::chrono::microseconds waitTime;
+};
+
+struct load_pipeline_stats_t
+{
+	load_stage_stats_t reader;
+	load_stage_stats_t parser;
+	load_stage_stats_t builder;
+
+	size_t parserThreads;
+};
+
+/*
+	Конвейерная загрузка текстового формата (по одному значению на строку, в порядке Walk) в BinaryLeaf.
+
+	Этапов три, и все идут одновременно:
+	1. Чтение - отдельный поток читает поток ввода большими блоками, обрезанными по последнему переводу строки.
+	2. Разбор - несколько потоков, каждый превращает свои блоки в пакеты значений.
+	3. Связывание - вызывающий поток создаёт лепестки и связывает их по индексам, как ImplicitBinaryTree::ToBinaryLeaf.
+
+	Этапы соединены очередями SpscRing, по паре на каждый поток разбора: блоки раздаются потокам по кругу и
+	в том же порядке забираются связыванием, так что порядок значений сохраняется без общей очереди и блокировок.
+	Блоки и пакеты не выделяются заново, а возвращаются обратно по встречным очередям. Их количество ограничено
+	(RING_BLOCKS на поток разбора), поэтому быстрый этап ждёт медленный, а память не растёт с размером файла.
+
+	Строки контрольной суммы (textload::CHECKSUM_HEADER) проверяются, если они есть. CRC32C своего блока считает
+	поток разбора, пока блок ещё в кэше, а связывание склеивает суммы блоков по порядку (checksum::Crc32cCombine),
+	так что отдельного прохода по тексту нет.
+*/
+template<typename T>
+class PipelinedLoader
+{
+public:
+	// Разбор строки [first, last) без перевода строки и крайних пробелов. Вызывается одновременно из нескольких потоков.
+	using parser_t = std::function<bool(const char*, const char*, T&)>;
+
+	static constexpr size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+
+	// Сколько блоков и сколько пакетов значений есть у каждого потока разбора.
+	static constexpr size_t RING_BLOCKS = 4;
+private:
+	// Блок текста. Буфер может быть больше size, если он вырос под длинную строку.
+	struct load_block_t
+	{
+		std::vector<char> data;
+		size_t size = 0;
+	};
+
+	/*
+		Пакет значений одного блока. valid = false, если какая-то строка блока не разобралась.
+		header и footer - в блоке были первая и последняя строки контрольной суммы, footerChecksum - сумма из последней.
+		checksum - CRC32C первых checksumSize байт блока: всего блока или текста до последней строки контрольной суммы.
+	*/
+	struct load_batch_t
+	{
+		std::vector<T> values;
+		uint64_t bytes = 0;
+		bool valid = true;
+
+		bool header = false;
+		bool footer = false;
+		uint32_t footerChecksum = 0;
+
+		uint32_t checksum = 0;
+		size_t checksumSize = 0;
+	};
+
+	// Поток разбора и его очереди: полные и пустые блоки, готовые и свободные пакеты.
+	struct load_worker_t
+	{
+		SpscRing<load_block_t> full = SpscRing<load_block_t>(RING_BLOCKS);
+		SpscRing<load_block_t> empty = SpscRing<load_block_t>(RING_BLOCKS);
+
+		SpscRing<load_batch_t> batches = SpscRing<load_batch_t>(RING_BLOCKS);
+		SpscRing<load_batch_t> spare = SpscRing<load_batch_t>(RING_BLOCKS);
+
+		load_stage_stats_t stats = {};
+		std::thread thread;
+	};
+
+	size_t mParsers;
+	size_t mBlockSize;
+
+	load_pipeline_stats_t mStats;
+public:
+	// parsers - количество потоков разбора. 0 означает по одному на ядро, кроме занятых чтением и связыванием.
+	explicit PipelinedLoader(size_t parsers = 0, size_t blockSize = DEFAULT_BLOCK_SIZE)
+	{
+		if (parsers == 0)
+		{
+			parsers = std::max<size_t>(1, std::thread::hardware_concurrency() - std::min<size_t>(2, std::thread::hardware_concurrency()));
+		}
+
+		mParsers = parsers;
+		mBlockSize = std::max<size_t>(blockSize, 64);
+
+		mStats = {};
+	}
+
+	// Счётчики последней загрузки.
+	const load_pipeline_stats_t& GetStats() const
+	{
+		return mStats;
+	}
+
+	// Разбор числа через std::from_chars. Подходит как parser для числовых T.
+	static bool ParseNumber(const char* first, const char* last, T& value)
+	{
+		return textload::ParseValue(first, last, value);
+	}
+
+	/*
+		Загрузка дерева из stream. Корень записывается по указателю output (nullptr для пустого потока),
+		лепестки создаются в arena или через new.
+
+		Возвращает false, если какая-то строка не разобралась или строки контрольной суммы не сошлись: сумма
+		не совпала, последней строки нет при первой или после неё что-то есть (файл обрезан или повреждён).
+		Тогда output - nullptr, лепестки, созданные через new, удалены, а созданные в арене остаются в ней до её очистки.
+	*/
+	bool Load(std::istream& stream, BinaryLeaf<T>** output, parser_t parser, LeafArena<T>* arena = nullptr)
+	{
+		mStats = {};
+		mStats.parserThreads = mParsers;
+
+		std::vector<std::unique_ptr<load_worker_t>> workers(mParsers);
+
+		for (std::unique_ptr<load_worker_t>& worker : workers)
+		{
+			worker = std::make_unique<load_worker_t>();
+
+			for (size_t index = 0; index < RING_BLOCKS; index++)
+			{
+				worker->empty.Push(load_block_t());
+				worker->spare.Push(load_batch_t());
+			}
+		}
+
+		// Связывание выставляет флаг, если разбор не удался, и чтение больше не читает.
+		std::atomic<bool> cancelled = false;
+
+		for (std::unique_ptr<load_worker_t>& worker : workers)
+		{
+			worker->thread = std::thread([&, self = worker.get()]() {
+				ParseBlocks(*self, parser);
+			});
+		}
+
+		std::thread reader = std::thread([&]() {
+			ReadBlocks(stream, workers, cancelled);
+		});
+
+		bool valid = BuildTree(workers, output, arena, cancelled);
+
+		reader.join();
+
+		for (std::unique_ptr<load_worker_t>& worker : workers)
+		{
+			worker->thread.join();
+
+			mStats.parser.items += worker->stats.items;
+			mStats.parser.bytes += worker->stats.bytes;
+			mStats.parser.busyTime += worker->stats.busyTime;
+			mStats.parser.waitTime += worker->stats.waitTime;
+		}
+
+		return valid;
+	}
+private:
+	using load_clock_t = std::chrono::steady_clock;
+
+	static std::chrono::microseconds Since(load_clock_t::time_point start)
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(load_clock_t::now() - start);
+	}
+
+	// Этап чтения. Блоки раздаются потокам разбора по кругу. Неполная последняя строка переносится в следующий блок.
+	void ReadBlocks(std::istream& stream, std::vector<std::unique_ptr<load_worker_t>>& workers, std::atomic<bool>& cancelled)
+	{
+		load_clock_t::time_point start = load_clock_t::now();
+
+		std::vector<char> carry = {};
+		size_t worker = 0;
+		bool ended = false;
+
+		while (!ended && !cancelled.load(std::memory_order_relaxed))
+		{
+			load_block_t block;
+
+			load_clock_t::time_point waitStart = load_clock_t::now();
+			workers[worker]->empty.Pop(block);
+			mStats.reader.waitTime += Since(waitStart);
+
+			if (block.data.size() < mBlockSize)
+			{
+				block.data.resize(mBlockSize);
+			}
+
+			if (carry.size() > 0)
+			{
+				std::memcpy(block.data.data(), carry.data(), carry.size());
+			}
+
+			size_t size = carry.size();
+
+			const char* lineEnd = nullptr;
+
+			// Читаем, пока в блоке нет ни одного перевода строки. Буфер растёт, если строка длиннее блока.
+			while (true)
+			{
+				if (size == block.data.size())
+				{
+					block.data.resize(block.data.size() * 2);
+				}
+
+				stream.read(block.data.data() + size, static_cast<std::streamsize>(block.data.size() - size));
+				size += static_cast<size_t>(stream.gcount());
+
+				ended = !stream.good();
+
+				lineEnd = FindLastLineEnd(block.data.data(), size);
+
+				if (ended || lineEnd != nullptr)
+				{
+					break;
+				}
+			}
+
+			// В конце потока последняя строка может быть и без перевода строки.
+			size_t used = ended ? size : static_cast<size_t>(lineEnd - block.data.data()) + 1;
+
+			carry.assign(block.data.data() + used, block.data.data() + size);
+			block.size = used;
+
+			mStats.reader.items++;
+			mStats.reader.bytes += used;
+
+			waitStart = load_clock_t::now();
+			workers[worker]->full.Push(std::move(block));
+			mStats.reader.waitTime += Since(waitStart);
+
+			worker = (worker + 1) % workers.size();
+		}
+
+		for (std::unique_ptr<load_worker_t>& entry : workers)
+		{
+			entry->full.Close();
+		}
+
+		mStats.reader.busyTime = Since(start) - mStats.reader.waitTime;
+	}
+
+	static const char* FindLastLineEnd(const char* data, size_t size)
+	{
+		for (size_t index = size; index > 0; index--)
+		{
+			if (data[index - 1] == '\n')
+			{
+				return data + index - 1;
+			}
+		}
+
+		return nullptr;
+	}
+
+	// Этап разбора одного потока.
+	static void ParseBlocks(load_worker_t& worker, const parser_t& parser)
+	{
+		load_clock_t::time_point start = load_clock_t::now();
+
+		load_block_t block;
+		load_batch_t batch;
+
+		while (true)
+		{
+			load_clock_t::time_point waitStart = load_clock_t::now();
+
+			bool received = worker.full.Pop(block);
+
+			if (received)
+			{
+				worker.spare.Pop(batch);
+			}
+
+			worker.stats.waitTime += Since(waitStart);
+
+			if (!received)
+			{
+				break;
+			}
+
+			batch.values.clear();
+			batch.bytes = block.size;
+			batch.valid = true;
+			batch.header = false;
+			batch.footer = false;
+			batch.checksumSize = block.size;
+
+			// Порядок строк контрольной суммы внутри блока. Между блоками его проверяет связывание.
+			textload::TextFrame frame;
+
+			const char* cursor = block.data.data();
+			const char* end = cursor + block.size;
+
+			while (cursor < end && batch.valid)
+			{
+				const char* lineEnd = static_cast<const char*>(std::memchr(cursor, '\n', static_cast<size_t>(end - cursor)));
+				if (lineEnd == nullptr)
+				{
+					lineEnd = end;
+				}
+
+				const char* first = cursor;
+				const char* last = lineEnd;
+
+				if (!textload::TrimLine(first, last))
+				{
+					cursor = lineEnd + 1;
+
+					continue;
+				}
+
+				textload::textline_t line = textload::ClassifyLine(first, last, batch.footerChecksum);
+
+				batch.valid = frame.Next(line);
+
+				if (line == textload::TextLine::VALUE && batch.valid)
+				{
+					T value = T();
+
+					batch.valid = parser(first, last, value);
+					batch.values.push_back(value);
+				}
+
+				batch.header = batch.header || (line == textload::TextLine::HEADER);
+
+				if (line == textload::TextLine::FOOTER)
+				{
+					batch.footer = true;
+					batch.checksumSize = static_cast<size_t>(cursor - block.data.data());
+				}
+
+				cursor = lineEnd + 1;
+			}
+
+			if (batch.valid)
+			{
+				batch.checksum = checksum::Crc32c(block.data.data(), batch.checksumSize);
+			}
+
+			worker.stats.items += batch.values.size();
+			worker.stats.bytes += batch.bytes;
+
+			waitStart = load_clock_t::now();
+
+			worker.batches.Push(std::move(batch));
+			worker.empty.Push(std::move(block));
+
+			worker.stats.waitTime += Since(waitStart);
+		}
+
+		worker.batches.Close();
+
+		worker.stats.busyTime = Since(start) - worker.stats.waitTime;
+	}
+
+	/*
+		Этап связывания. Пакеты забираются у потоков разбора в том же порядке, в котором им раздавались блоки.
+		Лепесток i - потомок лепестка (i - 1) / 2: правый, если i нечётный, и левый, если чётный.
+	*/
+	bool BuildTree(std::vector<std::unique_ptr<load_worker_t>>& workers, BinaryLeaf<T>** output, LeafArena<T>* arena, std::atomic<bool>& cancelled)
+	{
+		load_clock_t::time_point start = load_clock_t::now();
+
+		std::vector<BinaryLeaf<T>*> leaves = {};
+
+		load_batch_t batch;
+		size_t worker = 0;
+		bool valid = true;
+
+		// Порядок строк контрольной суммы между пакетами и CRC32C текста до последней строки контрольной суммы.
+		textload::TextFrame frame;
+		uint32_t checksum = 0;
+
+		while (true)
+		{
+			load_clock_t::time_point waitStart = load_clock_t::now();
+			bool received = workers[worker]->batches.Pop(batch);
+			mStats.builder.waitTime += Since(waitStart);
+
+			// Очередь потока закрыта и пуста: блока с этим номером не было, а значит, и следующих.
+			if (!received)
+			{
+				break;
+			}
+
+			// Внутри пакета строки идут в порядке: первая строка контрольной суммы, значения, последняя.
+			batch.valid = batch.valid &&
+				(!batch.header || frame.Next(textload::TextLine::HEADER)) &&
+				(batch.values.size() == 0 || frame.Next(textload::TextLine::VALUE)) &&
+				(!batch.footer || frame.Next(textload::TextLine::FOOTER));
+
+			if (batch.valid)
+			{
+				checksum = checksum::Crc32cCombine(checksum, batch.checksum, batch.checksumSize);
+				batch.valid = !batch.footer || (checksum == batch.footerChecksum);
+			}
+
+			if (!batch.valid)
+			{
+				valid = false;
+				cancelled = true;
+			}
+
+			// После ошибки пакеты только возвращаются, чтобы остальные этапы могли закончить работу.
+			if (valid)
+			{
+				for (T value : batch.values)
+				{
+					BinaryLeaf<T>* leaf = (arena != nullptr) ? arena->Create(value) : new BinaryLeaf<T>(value);
+					size_t index = leaves.size();
+
+					leaves.push_back(leaf);
+
+					if (index == 0)
+					{
+						continue;
+					}
+
+					BinaryLeaf<T>* parent = leaves[(index - 1) / 2];
+
+					if (index % 2 == 1)
+					{
+						parent->SetRightChild(leaf);
+					}
+					else
+					{
+						parent->SetLeftChild(leaf);
+					}
+				}
+
+				mStats.builder.items += batch.values.size();
+				mStats.builder.bytes += batch.bytes;
+			}
+
+			workers[worker]->spare.Push(std::move(batch));
+			worker = (worker + 1) % workers.size();
+		}
+
+		// Текст с первой строкой контрольной суммы, но без последней, обрезан.
+		valid = valid && frame.IsComplete();
+
+		if (!valid && arena == nullptr && leaves.size() > 0)
+		{
+			delete leaves[0];
+		}
+
+		*output = (valid && leaves.size() > 0) ? leaves[0] : nullptr;
+
+		mStats.builder.busyTime = Since(start) - mStats.builder.waitTime;
+
+		return valid;
+	}
+};
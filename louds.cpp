@@ -0,0 +1,226 @@
+﻿#include "louds.hpp"
+
+#include <algorithm>
+#include <bit>
+
+LoudsShape::LoudsShape()
+{
+	mView = nullptr;
+	mNodeCount = 0;
+}
+
+bool LoudsShape::Assign(std::vector<uint64_t> words, size_t nodeCount)
+{
+	mWords.clear();
+	mView = nullptr;
+
+	if (!BuildDirectories(words.data(), words.size(), nodeCount))
+	{
+		return false;
+	}
+
+	mWords = std::move(words);
+	mNodeCount = nodeCount;
+
+	return true;
+}
+
+bool LoudsShape::AssignView(const uint64_t* words, size_t wordCount, size_t nodeCount)
+{
+	mWords.clear();
+	mView = nullptr;
+
+	if (!BuildDirectories(words, wordCount, nodeCount))
+	{
+		return false;
+	}
+
+	mView = words;
+	mNodeCount = nodeCount;
+
+	return true;
+}
+
+bool LoudsShape::BuildDirectories(const uint64_t* words, size_t wordCount, size_t nodeCount)
+{
+	mNodeCount = 0;
+	mBlockRanks.clear();
+	mSelectSamples.clear();
+
+	if (wordCount != GetWordCount(nodeCount))
+	{
+		return false;
+	}
+
+	// Хвост последнего слова за формой должен быть пуст, иначе Rank насчитает лишние рёбра.
+	size_t bits = 2 * nodeCount;
+	if (bits % 64 != 0 && (words[wordCount - 1] >> (bits % 64)) != 0)
+	{
+		return false;
+	}
+
+	size_t ones = 0;
+
+	for (size_t word = 0; word < wordCount; word++)
+	{
+		if (word % BLOCK_WORDS == 0)
+		{
+			mBlockRanks.push_back(ones);
+		}
+
+		// Потомок на бите p получает номер ones + 1 и должен идти после своего родителя p / 2, иначе это не дерево.
+		for (uint64_t bits = words[word], edge = ones; bits != 0; bits &= bits - 1, edge++)
+		{
+			if (edge + 1 <= (word * 64 + std::countr_zero(bits)) / 2)
+			{
+				mBlockRanks.clear();
+				mSelectSamples.clear();
+
+				return false;
+			}
+		}
+
+		// Образец Select - блок, в котором лежит единица с номером, кратным SELECT_SAMPLE.
+		size_t count = std::popcount(words[word]);
+
+		while (mSelectSamples.size() * SELECT_SAMPLE < ones + count)
+		{
+			mSelectSamples.push_back(word / BLOCK_WORDS);
+		}
+
+		ones += count;
+	}
+
+	mBlockRanks.push_back(ones);
+
+	// В дереве из n лепестков ровно n - 1 рёбер.
+	if (ones + 1 != std::max<size_t>(nodeCount, 1))
+	{
+		mBlockRanks.clear();
+		mSelectSamples.clear();
+
+		return false;
+	}
+
+	return true;
+}
+
+size_t LoudsShape::GetWordCount(size_t nodeCount)
+{
+	return (2 * nodeCount + 63) / 64;
+}
+
+size_t LoudsShape::GetNodeCount() const
+{
+	return mNodeCount;
+}
+
+const uint64_t* LoudsShape::GetWords() const
+{
+	return (mView != nullptr) ? mView : mWords.data();
+}
+
+size_t LoudsShape::GetByteSize() const
+{
+	return mWords.size() * sizeof(uint64_t) + mBlockRanks.size() * sizeof(uint64_t) + mSelectSamples.size() * sizeof(size_t);
+}
+
+bool LoudsShape::Get(size_t position) const
+{
+	return (GetWords()[position / 64] >> (position % 64)) & 1;
+}
+
+size_t LoudsShape::Rank(size_t position) const
+{
+	size_t word = position / 64;
+	size_t block = word / BLOCK_WORDS;
+
+	const uint64_t* words = GetWords();
+	size_t result = mBlockRanks[block];
+
+	for (size_t index = block * BLOCK_WORDS; index < word; index++)
+	{
+		result += std::popcount(words[index]);
+	}
+
+	if (position % 64 != 0)
+	{
+		result += std::popcount(words[word] & ((uint64_t(1) << (position % 64)) - 1));
+	}
+
+	return result;
+}
+
+size_t LoudsShape::Select(size_t k) const
+{
+	if (mBlockRanks.size() == 0 || k >= mBlockRanks.back())
+	{
+		return npos;
+	}
+
+	// Образцы ограничивают поиск блока сверху и снизу, между ними - двоичный поиск по справочнику Rank.
+	size_t sample = k / SELECT_SAMPLE;
+
+	size_t first = mSelectSamples[sample];
+	size_t last = (sample + 1 < mSelectSamples.size()) ? mSelectSamples[sample + 1] + 1 : mBlockRanks.size() - 1;
+
+	size_t block = std::upper_bound(mBlockRanks.begin() + first, mBlockRanks.begin() + last, k) - mBlockRanks.begin() - 1;
+
+	const uint64_t* words = GetWords();
+
+	size_t remaining = k - mBlockRanks[block];
+	size_t word = block * BLOCK_WORDS;
+
+	while (true)
+	{
+		size_t count = std::popcount(words[word]);
+
+		if (remaining < count)
+		{
+			break;
+		}
+
+		remaining -= count;
+		word++;
+	}
+
+	// Снимаем младшие единицы слова, пока не дойдём до нужной.
+	uint64_t bits = words[word];
+
+	for (size_t index = 0; index < remaining; index++)
+	{
+		bits &= bits - 1;
+	}
+
+	return word * 64 + std::countr_zero(bits);
+}
+
+size_t LoudsShape::GetRightChild(size_t index) const
+{
+	return Get(2 * index) ? Rank(2 * index) + 1 : npos;
+}
+
+size_t LoudsShape::GetLeftChild(size_t index) const
+{
+	return Get(2 * index + 1) ? Rank(2 * index + 1) + 1 : npos;
+}
+
+size_t LoudsShape::GetParent(size_t index) const
+{
+	if (index == 0 || index >= mNodeCount)
+	{
+		return npos;
+	}
+
+	return Select(index - 1) / 2;
+}
+
+treedir_t LoudsShape::GetDirection(size_t index) const
+{
+	if (index == 0 || index >= mNodeCount)
+	{
+		return TreeDirection::ROOT;
+	}
+
+	return (Select(index - 1) % 2 == 0) ? TreeDirection::RIGHT : TreeDirection::LEFT;
+}
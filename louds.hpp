@@ -0,0 +1,165 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "btree.hpp"
+
+/*
+	Форма произвольного бинарного дерева в виде битовой карты по уровням (LOUDS).
+
+	Лепестки нумеруются в порядке обхода Walk: по уровням, правый потомок раньше левого. Лепестку i принадлежат
+	биты 2i (есть ли правый потомок) и 2i + 1 (есть ли левый). Каждая единица - это ребро к следующему
+	по порядку лепестку, поэтому потомок на бите p имеет номер Rank(p) + 1, а родитель лепестка j - Select(j - 1) / 2.
+
+	Форма занимает 2 бита на лепесток плюс около 15% на справочники Rank и Select, и в отличие от ImplicitBinaryTree
+	не требует, чтобы дерево было полным.
+*/
+class LoudsShape
+{
+public:
+	// Номер несуществующего лепестка или позиции.
+	static constexpr size_t npos = std::numeric_limits<size_t>::max();
+private:
+	// Биты формы, младшими битами слова вперёд. Биты за 2 * mNodeCount нулевые.
+	std::vector<uint64_t> mWords;
+
+	// Чужие слова формы (см. AssignView). Если не nullptr, mWords пуст.
+	const uint64_t* mView;
+	size_t mNodeCount;
+
+	// Справочник Rank: количество единиц до начала каждого блока из BLOCK_WORDS слов.
+	std::vector<uint64_t> mBlockRanks;
+
+	// Справочник Select: номер блока, в котором лежит каждая SELECT_SAMPLE-я единица.
+	std::vector<size_t> mSelectSamples;
+
+	static constexpr size_t BLOCK_WORDS = 8;
+	static constexpr size_t SELECT_SAMPLE = 512;
+private:
+	// Проверка слов words и построение справочников по ним. Аргументы и результат - как у Assign.
+	bool BuildDirectories(const uint64_t* words, size_t wordCount, size_t nodeCount);
+public:
+	LoudsShape();
+
+	/*
+		Форма из готовых слов для nodeCount лепестков. Справочники строятся сразу.
+		Возвращает false, если биты не описывают дерево из nodeCount лепестков: слов не столько, сколько нужно,
+		биты за формой не нулевые, единиц не nodeCount - 1 или какой-то лепесток ссылается на более ранний.
+	*/
+	bool Assign(std::vector<uint64_t> words, size_t nodeCount);
+
+	/*
+		То же, что Assign, но слова не копируются: форма читает wordCount слов прямо по words (например, из отображённого файла),
+		и они должны жить, пока форма используется. В собственной памяти формы остаются только справочники.
+	*/
+	bool AssignView(const uint64_t* words, size_t wordCount, size_t nodeCount);
+
+	// Форма дерева с корнем root. Значения лепестков в порядке Walk складываются в values, если он не nullptr.
+	template<typename T>
+	static LoudsShape FromBinaryLeaf(BinaryLeaf<T>* root, std::vector<T>* values = nullptr)
+	{
+		std::vector<uint64_t> words = {};
+		size_t nodeCount = 0;
+
+		if (root != nullptr)
+		{
+			root->Walk([&](BinaryLeaf<T>* leaf) {
+				if (words.size() * 64 < 2 * (nodeCount + 1))
+				{
+					words.push_back(0);
+				}
+
+				size_t position = 2 * nodeCount;
+
+				if (*leaf->GetRightChild() != nullptr)
+				{
+					words[position / 64] |= uint64_t(1) << (position % 64);
+				}
+
+				if (*leaf->GetLeftChild() != nullptr)
+				{
+					words[(position + 1) / 64] |= uint64_t(1) << ((position + 1) % 64);
+				}
+
+				if (values != nullptr)
+				{
+					values->push_back(leaf->GetValue());
+				}
+
+				nodeCount++;
+			});
+		}
+
+		LoudsShape result;
+		result.Assign(std::move(words), nodeCount);
+
+		return result;
+	}
+
+	// Количество слов, в которых помещается форма nodeCount лепестков.
+	static size_t GetWordCount(size_t nodeCount);
+
+	size_t GetNodeCount() const;
+
+	// Слова формы, их GetWordCount(GetNodeCount()).
+	const uint64_t* GetWords() const;
+
+	// Байты, занятые формой вместе со справочниками. Чужие слова (AssignView) не считаются.
+	size_t GetByteSize() const;
+
+	bool Get(size_t position) const;
+
+	// Количество единиц в битах [0, position).
+	size_t Rank(size_t position) const;
+
+	// Позиция единицы с номером k (с нуля). npos, если единиц не больше k.
+	size_t Select(size_t k) const;
+
+	// Потомки, родитель и направление лепестка с номером index. Для отсутствующих - npos и TreeDirection::ROOT у корня.
+	size_t GetRightChild(size_t index) const;
+	size_t GetLeftChild(size_t index) const;
+	size_t GetParent(size_t index) const;
+	treedir_t GetDirection(size_t index) const;
+
+	/*
+		Построение дерева из формы и значений values в порядке Walk. Лепестки создаются в arena (или через new),
+		а связываются по Rank, так что каждый лепесток находит своих потомков независимо от остальных.
+		Для пустой формы возвращает nullptr.
+	*/
+	template<typename T>
+	BinaryLeaf<T>* ToBinaryLeaf(const T* values, LeafArena<T>* arena = nullptr) const
+	{
+		if (mNodeCount == 0)
+		{
+			return nullptr;
+		}
+
+		std::vector<BinaryLeaf<T>*> leaves(mNodeCount);
+
+		for (size_t index = 0; index < mNodeCount; index++)
+		{
+			leaves[index] = (arena != nullptr) ? arena->Create(values[index]) : new BinaryLeaf<T>(values[index]);
+		}
+
+		// Родитель всегда раньше потомка, поэтому глубина родителя уже верна, когда к нему привязывают потомков.
+		for (size_t index = 0; index < mNodeCount; index++)
+		{
+			size_t right = GetRightChild(index);
+			if (right != npos)
+			{
+				leaves[index]->SetRightChild(leaves[right]);
+			}
+
+			size_t left = GetLeftChild(index);
+			if (left != npos)
+			{
+				leaves[index]->SetLeftChild(leaves[left]);
+			}
+		}
+
+		return leaves[0];
+	}
+};
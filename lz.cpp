@@ -0,0 +1,203 @@
+﻿#include "lz.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+// Минимальная длина совпадения и самое дальнее смещение.
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t MAX_OFFSET = 65535;
+
+// Размер хеш-таблицы последних позиций четвёрок байт, в битах.
+static constexpr unsigned HASH_BITS = 14;
+
+static uint32_t Read32(const uint8_t* data)
+{
+	uint32_t value = 0;
+	std::memcpy(&value, data, sizeof(value));
+
+	return value;
+}
+
+static uint32_t Hash(uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Запись продолжения длины: сначала байты 255, затем остаток.
+static void WriteLength(std::vector<uint8_t>& output, size_t length)
+{
+	while (length >= 255)
+	{
+		output.push_back(255);
+		length -= 255;
+	}
+
+	output.push_back(static_cast<uint8_t>(length));
+}
+
+static void WriteSequence(std::vector<uint8_t>& output, const uint8_t* literals, size_t literalLength, size_t matchLength, size_t offset)
+{
+	size_t matchCode = (matchLength > 0) ? matchLength - MIN_MATCH : 0;
+
+	uint8_t token = static_cast<uint8_t>((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(matchCode, 15));
+	output.push_back(token);
+
+	if (literalLength >= 15)
+	{
+		WriteLength(output, literalLength - 15);
+	}
+
+	output.insert(output.end(), literals, literals + literalLength);
+
+	if (matchLength == 0)
+	{
+		return;
+	}
+
+	output.push_back(static_cast<uint8_t>(offset & 0xFF));
+	output.push_back(static_cast<uint8_t>(offset >> 8));
+
+	if (matchCode >= 15)
+	{
+		WriteLength(output, matchCode - 15);
+	}
+}
+
+void lz::Compress(const uint8_t* data, size_t size, std::vector<uint8_t>& output)
+{
+	std::vector<uint32_t> table(static_cast<size_t>(1) << HASH_BITS, UINT32_MAX);
+
+	size_t anchor = 0;
+	size_t position = 0;
+
+	while (position + MIN_MATCH <= size)
+	{
+		uint32_t sequence = Read32(data + position);
+		uint32_t hash = Hash(sequence);
+
+		size_t candidate = table[hash];
+		table[hash] = static_cast<uint32_t>(position);
+
+		if (candidate == UINT32_MAX || position - candidate > MAX_OFFSET || Read32(data + candidate) != sequence)
+		{
+			position++;
+
+			continue;
+		}
+
+		size_t length = MIN_MATCH;
+		while (position + length < size && data[candidate + length] == data[position + length])
+		{
+			length++;
+		}
+
+		WriteSequence(output, data + anchor, position - anchor, length, position - candidate);
+
+		position += length;
+		anchor = position;
+	}
+
+	// Хвост без совпадений. Он пишется всегда, даже пустой, - по нему распаковка узнаёт конец.
+	WriteSequence(output, data + anchor, size - anchor, 0, 0);
+}
+
+// Чтение продолжения длины. Возвращает false, если данные кончились.
+static bool ReadLength(const uint8_t*& cursor, const uint8_t* end, size_t& length)
+{
+	uint8_t byte = 255;
+
+	while (byte == 255)
+	{
+		if (cursor >= end)
+		{
+			return false;
+		}
+
+		byte = *cursor;
+		cursor++;
+
+		length += byte;
+	}
+
+	return true;
+}
+
+bool lz::Decompress(const uint8_t* data, size_t size, uint8_t* output, size_t outputSize)
+{
+	const uint8_t* cursor = data;
+	const uint8_t* end = data + size;
+
+	size_t produced = 0;
+
+	while (cursor < end)
+	{
+		uint8_t token = *cursor;
+		cursor++;
+
+		size_t literalLength = token >> 4;
+		if (literalLength == 15 && !ReadLength(cursor, end, literalLength))
+		{
+			return false;
+		}
+
+		if (literalLength > static_cast<size_t>(end - cursor) || literalLength > outputSize - produced)
+		{
+			return false;
+		}
+
+		if (literalLength > 0)
+		{
+			std::memcpy(output + produced, cursor, literalLength);
+		}
+
+		cursor += literalLength;
+		produced += literalLength;
+
+		// Последняя последовательность - только литералы.
+		if (cursor == end)
+		{
+			break;
+		}
+
+		if (end - cursor < 2)
+		{
+			return false;
+		}
+
+		size_t offset = cursor[0] | (static_cast<size_t>(cursor[1]) << 8);
+		cursor += 2;
+
+		size_t matchLength = token & 0x0F;
+		if (matchLength == 15 && !ReadLength(cursor, end, matchLength))
+		{
+			return false;
+		}
+
+		matchLength += MIN_MATCH;
+
+		if (offset == 0 || offset > produced || matchLength > outputSize - produced)
+		{
+			return false;
+		}
+
+		// Совпадение может перекрываться с самим собой, поэтому копируем побайтово, если оно ближе своей длины.
+		uint8_t* target = output + produced;
+		const uint8_t* source = target - offset;
+
+		if (offset >= matchLength)
+		{
+			std::memcpy(target, source, matchLength);
+		}
+		else
+		{
+			for (size_t index = 0; index < matchLength; index++)
+			{
+				target[index] = source[index];
+			}
+		}
+
+		produced += matchLength;
+	}
+
+	return produced == outputSize;
+}
@@ -0,0 +1,27 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+	Простое байтовое сжатие семейства LZ77 (по устройству близко к блочному LZ4).
+
+	Сжатые данные - это последовательности "литералы + совпадение". Каждая начинается с байта-токена:
+	старшие 4 бита - количество литералов, младшие - длина совпадения минус 4. Значение 15 в любой половине
+	означает, что длина продолжается байтами, пока байт равен 255. За токеном идут литералы, затем
+	2-байтовое смещение совпадения назад (little-endian). Последняя последовательность состоит только из литералов.
+
+	Распаковка - это копирование байтов без какой-либо арифметики, поэтому она работает со скоростью памяти.
+*/
+namespace lz
+{
+	// Сжатие size байт из data. Результат дописывается в конец output.
+	void Compress(const uint8_t* data, size_t size, std::vector<uint8_t>& output);
+
+	/*
+		Распаковка size байт из data ровно в outputSize байт по адресу output.
+		Все длины и смещения проверяются, так что повреждённые данные дают false, а не выход за границы.
+	*/
+	bool Decompress(const uint8_t* data, size_t size, uint8_t* output, size_t outputSize);
+}
@@ -5,10 +5,17 @@
 
 #include <fstream>
 
+#include "analyzer.hpp"
 #include "btree.hpp"
-
-// Генерирует бинарное дерево. maxLeaves - максимальное количество элементов.
-BinaryTree<int>* GenerateTree(int maxLeaves)
+#include "btfile.hpp"
+#include "checksum.hpp"
+#include "journal.hpp"
+#include "lazytree.hpp"
+#include "mappedtree.hpp"
+#include "textload.hpp"
+
+// Генерирует бинарное дерево. maxLeaves - максимальное количество элементов, arena - арена для лепестков (или nullptr).
+BinaryTree<int>* GenerateTree(int maxLeaves, LeafArena<int>* arena = nullptr)
 {
 	// Установка сида для рандомных значений лепестков.
 	srand(time(NULL));
@@ -29,7 +36,7 @@ BinaryTree<int>* GenerateTree(int maxLeaves)
 
 		// Создать лепесток по этим данным со случайным значением.
 		int leafValue = rand() % 255;
-		(*leafData.output) = new BinaryLeaf<int>(leafValue);
+		(*leafData.output) = (arena != nullptr) ? arena->Create(leafValue) : new BinaryLeaf<int>(leafValue);
 		
 		// Устанавливаем иерархию, направление лепестка и его глубину.
 		if (leafData.parent != nullptr)
@@ -62,40 +69,473 @@ BinaryTree<int>* GenerateTree(int maxLeaves)
 	return result;
 }
 
+/*
+	Вывод памяти последнего замера: сколько байт запрошено, сколько было выделений и освобождений,
+	на сколько выросла живая память к концу замера и её пик. blankLine - пустая строка после вывода.
+*/
+void PrintMemoryProfile(bool blankLine)
+{
+	profile::memory_profile_t memory = profile::GetMemoryProfile();
+
+	std::cout << "\t with " << memory.allocatedBytes << " bytes of memory allocated in total" << std::endl;
+	std::cout << "\t " << memory.allocations << " allocations, " << memory.frees << " frees, "
+		<< memory.liveBytes << " live bytes, " << memory.peakLiveBytes << " peak live bytes" << std::endl;
+
+	if (blankLine)
+	{
+		std::cout << std::endl;
+	}
+}
+
+/*
+	Этап работы: регион профиля (profile::Scope) и замер памяти всех потоков, ведь этапы работают и в пуле,
+	а Scope считает память только своего потока. Этапы не вкладываются друг в друга, внутри этапа
+	вложенные регионы - обычные profile::Scope.
+*/
+class Phase
+{
+public:
+	explicit Phase(const char* name) : mScope(name)
+	{
+		profile::StartMemoryProfiling();
+	}
+
+	~Phase()
+	{
+		End();
+	}
+
+	void End()
+	{
+		if (mScope.IsActive())
+		{
+			profile::EndMemoryProfiling();
+			mScope.End();
+		}
+	}
+
+	// Количество лепестков, которые обработал этап, чтобы вывести промахи на лепесток.
+	void AddItems(uint64_t count)
+	{
+		mScope.AddItems(count);
+	}
+
+	// Завершение этапа и вывод "title took N microseconds." с памятью этапа и аппаратными счётчиками, если они доступны.
+	void Print(const char* title, bool blankLine)
+	{
+		End();
+
+		std::cout << title << " took " << mScope.GetTime().count() << " microseconds." << std::endl;
+		PrintMemoryProfile(false);
+
+		if (mScope.GetHardwareCounters().availableMask != 0)
+		{
+			std::cout << "\t ";
+			profile::PrintHardwareCounters(std::cout, mScope.GetHardwareCounters(), mScope.GetItems());
+			std::cout << std::endl;
+		}
+
+		if (blankLine)
+		{
+			std::cout << std::endl;
+		}
+	}
+private:
+	profile::Scope mScope;
+};
+
+// Отчёт по всем регионам профиля в конце вывода.
+void PrintProfileReport()
+{
+	std::cout << std::endl << "Profile: " << std::endl;
+
+	profile::PrintRegionReport(std::cout);
+}
+
+/*
+	Загрузка и поиск для дерева в двоичном формате. Файл не разбирается, а отображается в память,
+	и дерево работает прямо поверх отображения. Перед этим сверяется контрольная сумма значений,
+	поэтому повреждённый файл не загрузится. Упакованный файл распаковывается в память -
+	это всё равно намного быстрее разбора текста.
+*/
+int RunBinaryTree(const char* path)
+{
+	MappedFile file;
+	ImplicitBinaryTree<int> tree;
+
+	Phase loading("Loading");
+
+	bool loaded = btfile::Open(file, path, tree, true);
+
+	loading.End();
+
+	if (!loaded)
+	{
+		std::cout << "Failed to open binary tree file " << path << std::endl;
+
+		return 1;
+	}
+
+	loading.Print("1. Loading (binary file)", true);
+
+	size_t maxRatioSubtree = ImplicitBinaryTree<int>::npos;
+	double maxRatio = 0.0;
+
+	size_t minRatioSubtree = ImplicitBinaryTree<int>::npos;
+	double minRatio = 99999999.0;
+
+	Phase search("Search");
+	search.AddItems(tree.GetSize());
+
+	tree.GetMinMaxWeightSumChildrenRatio(minRatio, minRatioSubtree, maxRatio, maxRatioSubtree);
+
+	search.Print("2. Search", true);
+
+	std::cout << tree.GetByteSize() << " bytes used by tree" << std::endl;
+	std::cout << std::endl << "Tree: " << std::endl;
+
+	tree.Serialize(std::cout, 6, true);
+
+	std::cout << std::endl << "Minimum ratio subtree: " << std::endl;
+	std::cout << minRatio << " ratio; Tree: " << std::endl;
+	tree.Serialize(std::cout, 6, true, minRatioSubtree);
+
+	std::cout << std::endl << "Maximum ratio subtree: " << std::endl;
+	std::cout << maxRatio << " ratio; Tree: " << std::endl;
+	tree.Serialize(std::cout, 6, true, maxRatioSubtree);
+
+	PrintProfileReport();
+
+	return 0;
+}
+
+// Сворачивание журнала правок в новый снимок (см. TreeJournal).
+int RunCompaction(const char* path)
+{
+	ArenaTree<int> treeHandle;
+	TreeJournal<int> journal;
+
+	if (!journal.Open(path, treeHandle.GetRootOutput(), &treeHandle.GetArena()))
+	{
+		std::cout << "Failed to load tree file " << path << " with its journal" << std::endl;
+
+		return 1;
+	}
+
+	uint64_t journalSize = journal.GetSize();
+
+	Phase compaction("Compaction");
+
+	bool compacted = journal.Compact();
+
+	compaction.End();
+
+	if (!compacted)
+	{
+		std::cout << "Failed to compact journal of " << path << std::endl;
+
+		return 1;
+	}
+
+	compaction.Print("1. Compaction", false);
+	std::cout << "\t journal shrank from " << journalSize << " to " << journal.GetSize() << " bytes" << std::endl;
+
+	return 0;
+}
+
+// Проверка двоичного файла (btfile::Verify) без загрузки дерева.
+int RunVerify(const char* path)
+{
+	Phase verification("Verification");
+
+	bool valid = btfile::Verify(path);
+
+	verification.Print("1. Verification", false);
+	std::cout << "\t CRC32C computed with " << (checksum::IsAccelerated() ? "SSE4.2" : "lookup tables") << std::endl << std::endl;
+
+	if (!valid)
+	{
+		std::cout << "Binary tree file " << path << " is damaged or not a binary tree file" << std::endl;
+
+		return 1;
+	}
+
+	std::cout << "Binary tree file " << path << " is intact" << std::endl;
+
+	return 0;
+}
+
+/*
+	Поиск прямо по отображению двоичного файла любой формы, без загрузки дерева. Собственная память - только
+	справочники формы и путь поиска, всё остальное - страницы файла в кэше ОС.
+*/
+int RunMappedTree(const char* path)
+{
+	MappedBinaryTree<int> tree;
+
+	Phase mapping("Mapping");
+
+	bool loaded = tree.Open(path);
+
+	mapping.End();
+
+	if (!loaded)
+	{
+		std::cout << "Failed to map binary tree file " << path << " (only unpacked files without chunks can be mapped)" << std::endl;
+
+		return 1;
+	}
+
+	mapping.Print("1. Mapping", true);
+
+	size_t maxRatioSubtree = MappedBinaryTree<int>::npos;
+	double maxRatio = 0.0;
+
+	size_t minRatioSubtree = MappedBinaryTree<int>::npos;
+	double minRatio = 99999999.0;
+
+	Phase search("Search");
+	search.AddItems(tree.GetSize());
+
+	tree.GetMinMaxWeightSumChildrenRatio(minRatio, minRatioSubtree, maxRatio, maxRatioSubtree);
+
+	search.Print("2. Search", true);
+
+	std::cout << tree.GetByteSize() << " bytes used by tree (" << tree.GetSize() << " leaves mapped)" << std::endl;
+	std::cout << std::endl << "Tree: " << std::endl;
+
+	tree.Serialize(std::cout, 6, true);
+
+	std::cout << std::endl << "Minimum ratio subtree: " << std::endl;
+	std::cout << minRatio << " ratio; Tree: " << std::endl;
+	tree.Serialize(std::cout, 6, true, minRatioSubtree);
+
+	std::cout << std::endl << "Maximum ratio subtree: " << std::endl;
+	std::cout << maxRatio << " ratio; Tree: " << std::endl;
+	tree.Serialize(std::cout, 6, true, maxRatioSubtree);
+
+	PrintProfileReport();
+
+	return 0;
+}
+
+/*
+	Просмотр верхних уровней двоичного файла без загрузки всего дерева. Для файла, разбитого на куски (--chunked),
+	читается только первый кусок, так что время не зависит от размера файла.
+*/
+int RunPreview(const char* path)
+{
+	LazyBinaryTree<int> tree;
+	ImplicitBinaryTree<int> preview;
+
+	Phase loading("Loading preview");
+
+	// Serialize с skipDeep = 6 останавливается на первом лепестке глубины 7, поэтому нужен и этот уровень.
+	bool loaded = tree.Open(path) && tree.LoadPrefix(7, preview);
+
+	loading.End();
+
+	if (!loaded)
+	{
+		std::cout << "Failed to preview binary tree file " << path << std::endl;
+
+		return 1;
+	}
+
+	loading.Print("1. Loading preview", false);
+	std::cout << "\t " << tree.GetLoadedChunkCount() << " of " << tree.GetChunkCount() << " chunks read, " << tree.GetSize() << " leaves in file" << std::endl << std::endl;
+
+	std::cout << "Tree: " << std::endl;
+
+	preview.Serialize(std::cout, 6, true);
+
+	return 0;
+}
+
+/*
+	Потоковый анализ текстового файла: только поиск отношений, без построения дерева в памяти.
+	Вместо поддеревьев выводятся номера их корней в порядке обхода и их глубины.
+*/
+int RunStreamAnalysis(const char* path)
+{
+	std::ifstream input = std::ifstream(path, std::ios::binary);
+
+	if (!input.is_open())
+	{
+		std::cout << "Failed to open tree file " << path << std::endl;
+
+		return 1;
+	}
+
+	uint64_t maxRatioSubtree = 0;
+	double maxRatio = 0.0;
+
+	uint64_t minRatioSubtree = 0;
+	double minRatio = 99999999.0;
+
+	Phase analysis("Streaming analysis");
+
+	bool analyzed = StreamAnalyzer<int>::GetMinMaxWeightSumChildrenRatio(input, minRatio, minRatioSubtree, maxRatio, maxRatioSubtree);
+
+	analysis.End();
+
+	if (!analyzed)
+	{
+		std::cout << "Failed to analyze tree file " << path << std::endl;
+
+		return 1;
+	}
+
+	analysis.Print("1. Streaming analysis", true);
+
+	std::cout << "Minimum ratio: " << minRatio << " at leaf #" << minRatioSubtree << " (depth " << StreamAnalyzer<int>::GetDepth(minRatioSubtree) << ")" << std::endl;
+	std::cout << "Maximum ratio: " << maxRatio << " at leaf #" << maxRatioSubtree << " (depth " << StreamAnalyzer<int>::GetDepth(maxRatioSubtree) << ")" << std::endl;
+
+	return 0;
+}
+
 int main(int argc, const char** argv)
 {
-	// Открываем поток ввода для файла tree.bt
-	std::ifstream input = std::ifstream("btree.bt");
+	std::string mode = (argc > 1 ? argv[1] : "");
+
+	// Аппаратные счётчики выводятся, только если система их даёт (Linux, разрешение perf_event_paranoid).
+	profile::EnableHardwareCounters();
+
+	// С флагом --preview у двоичного файла выводятся только верхние уровни.
+	if (mode == "--preview")
+	{
+		return RunPreview("btree.bt");
+	}
+
+	// С флагом --verify двоичный файл только проверяется по контрольным суммам.
+	if (mode == "--verify")
+	{
+		return RunVerify("btree.bt");
+	}
+
+	// С флагом --compact журнал правок сворачивается в новый btree.bt.
+	if (mode == "--compact")
+	{
+		return RunCompaction("btree.bt");
+	}
+
+	// С флагом --mapped двоичный файл не загружается, а поиск идёт прямо по его отображению.
+	if (mode == "--mapped")
+	{
+		return RunMappedTree("btree.bt");
+	}
+
+	// Двоичный файл узнаётся по сигнатуре, всё остальное читается как текст.
+	// Дерево произвольной формы (BtShape::LOUDS) массивом не представимо и загружается в BinaryTree, как текст.
+	// Правки из журнала (btree.bt.journal) применяются к BinaryTree, поэтому с журналом он тоже загружается в BinaryTree.
+	btfile_header_t binaryHeader = {};
+	bool binaryInput = btfile::IsBinaryFile("btree.bt");
+	bool sparseInput = btfile::ReadHeader("btree.bt", binaryHeader) && binaryHeader.shape == BtShape::LOUDS;
+	// Сжатие журнала, прерванное падением, доводится до конца до того, как журнал будет найден и применён.
+	journal::RecoverCompaction("btree.bt");
+	bool journalInput = std::ifstream(journal::GetJournalPath("btree.bt")).is_open();
+
+	if (binaryInput && !sparseInput && !journalInput)
+	{
+		return RunBinaryTree("btree.bt");
+	}
+
+	// С флагом --binary сгенерированное дерево сохраняется в двоичном формате, а не текстом.
+	// --packed и --packed-lz делают то же, но упаковывают значения (и дополнительно сжимают).
+	// --chunked упаковывает значения кусками, чтобы файл можно было читать по частям (см. --preview).
+	bool saveBinary = (mode == "--binary" || mode == "--packed" || mode == "--packed-lz" || mode == "--chunked");
+	btencoding_t binaryEncoding = (mode == "--packed" || mode == "--chunked") ? BtEncoding::PACKED : (mode == "--packed-lz") ? BtEncoding::PACKED_LZ : BtEncoding::RAW;
+	uint32_t binaryChunkSize = (mode == "--chunked") ? btfile::DEFAULT_CHUNK_SIZE : 0;
+
+	// С флагом --analyze существующий файл только анализируется потоково, без загрузки дерева.
+	if (mode == "--analyze")
+	{
+		return RunStreamAnalysis("btree.bt");
+	}
+
+	// Проверяем, есть ли файл tree.bt
+	bool inputExists = std::ifstream("btree.bt").is_open();
 
 	// Поток вывода пока что не открыт, но объявлен.
 	std::ofstream output;
 
+	// Нужно ли после поиска записать дерево в двоичном формате.
+	bool binaryOutput = false;
+
+	// Все лепестки дерева живут в арене, которая освободится целиком при выходе из main.
+	ArenaTree<int> treeHandle;
+
 	BinaryTree<int>* tree = nullptr;
 
-	if (input.is_open())
+	// Пул потоков для загрузки и поиска.
+	WorkStealingPool pool;
+
+	if (inputExists)
 	{
 		// Десериализация.
 
-		// Запускаем профилизацию памяти и времени.
-		profile::StartMemoryProfiling();
-		profile::StartTimeProfiling();
+		// Запускаем профилизацию этапа. Загрузка из текста и применение журнала - вложенные регионы.
+		Phase loading("Deserialization");
 
-		// Десериализацией подгружаем дерево из потока ввода.
-		tree = new BinaryTree<int>();
-		BinaryTree<int>::Deserialize(input, &tree, [](const std::string& serialized) -> int {
-			// Это лямбда обработки строкового значения. Тут мы просто преобразуем строковое число в int.
-			return std::stoi(serialized);
-		});
+		if (binaryInput)
+		{
+			btfile::Load("btree.bt", treeHandle.GetRootOutput(), &treeHandle.GetArena());
+			tree = treeHandle.GetRoot();
+		}
+		else
+		{
+			/*
+				Файл разбирается параллельно в массив значений, а лепестки связываются из него одним проходом.
+				Результат тот же, что у BinaryTree<int>::Deserialize, но без построчного чтения через iostream.
+			*/
+			ImplicitBinaryTree<int> values;
+
+			profile::Scope parsing("Parsing");
+			bool loaded = textload::Load("btree.bt", values, pool);
+			parsing.End();
+
+			if (loaded)
+			{
+				profile::Scope linking("Linking leaves");
+
+				tree = values.ToBinaryLeaf(&treeHandle.GetArena());
+				treeHandle.SetRoot(tree);
+			}
+		}
+
+		size_t journalRecords = 0;
+
+		if (journalInput && tree != nullptr)
+		{
+			profile::Scope replay("Journal replay");
+
+			if (!journal::Replay("btree.bt", tree, &treeHandle.GetArena(), journalRecords))
+			{
+				std::cout << "Journal " << journal::GetJournalPath("btree.bt") << " does not apply to btree.bt" << std::endl;
+
+				return 1;
+			}
+		}
+
+		// Завершаем профилизацию этапа.
+		loading.End();
+
+		if (tree == nullptr)
+		{
+			std::cout << "Failed to load tree file btree.bt" << std::endl;
 
-		// Завершаем профилизацию памяти и времени.
-		profile::EndTimeProfiling();
-		profile::EndMemoryProfiling();
+			return 1;
+		}
 
 		// Выводим информацию, полученную за время профилизации.
-		std::cout << "1. Deserialization (loading from file) took " << profile::GetProfiledTime().count() << " microseconds." << std::endl;
-		std::cout << "\t with " << profile::GetProfiledMemory() << " bytes of memory allocated in total" << std::endl << std::endl;
+		loading.Print("1. Deserialization (loading from file)", false);
+
+		if (journalInput)
+		{
+			std::cout << "\t " << journalRecords << " journal edits replayed" << std::endl;
+		}
 
-		input.close();
+		std::cout << std::endl;
 	}
 	else
 	{
@@ -107,20 +547,24 @@ int main(int argc, const char** argv)
 		std::cout << "Enter max amount of leaves: " << std::endl;
 		std::cin >> maxLeaves;
 
-		profile::StartMemoryProfiling();
-		profile::StartTimeProfiling();
+		Phase generation("Generation");
 
 		// Генерируем дерево.
-		tree = GenerateTree(maxLeaves);
-
-		profile::EndTimeProfiling();
-		profile::EndMemoryProfiling();
+		tree = GenerateTree(maxLeaves, &treeHandle.GetArena());
+		treeHandle.SetRoot(tree);
 
-		std::cout << "1. Generation took " << profile::GetProfiledTime().count() << " microseconds." << std::endl;
-		std::cout << "\t with " << profile::GetProfiledMemory() << " bytes of memory allocated in total" << std::endl << std::endl;
+		generation.Print("1. Generation", true);
 
 		// Открываем поток вывода, так как после генерации дерево нужно вывести в файл.
-		output = std::ofstream("btree.bt");
+		// Двоичный файл записывается целиком в конце, поток для него не нужен.
+		if (saveBinary)
+		{
+			binaryOutput = true;
+		}
+		else
+		{
+			output = std::ofstream("btree.bt");
+		}
 	}
 
 	BinaryTree<int>* maxRatioSubtree = nullptr;
@@ -131,35 +575,66 @@ int main(int argc, const char** argv)
 
 	// Нахождение необходимых отношений.
 
-	profile::StartMemoryProfiling();
-	profile::StartTimeProfiling();
+	// Лепестки считаются отдельным обходом, поэтому только когда есть счётчики, которые на них делить.
+	uint64_t leafCount = 0;
+
+	if (profile::AreHardwareCountersEnabled())
+	{
+		tree->Walk([&](BinaryLeaf<int>*) -> bool {
+			leafCount++;
+
+			return false;
+		});
+	}
 
-	tree->GetMinMaxWeightSumChildrenRatio(minRatio, minRatioSubtree, maxRatio, maxRatioSubtree);
+	Phase search("Search");
+	search.AddItems(leafCount);
 
-	profile::EndTimeProfiling();
-	profile::EndMemoryProfiling();
+	// Поиск идёт параллельно на всех ядрах. Результат совпадает с поиском в одном потоке.
+	tree->GetMinMaxWeightSumChildrenRatio(minRatio, minRatioSubtree, maxRatio, maxRatioSubtree, pool);
 
-	std::cout << "2. Search took " << profile::GetProfiledTime().count() << " microseconds." << std::endl;
-	std::cout << "\t with " << profile::GetProfiledMemory() << " bytes of memory allocated in total" << std::endl << std::endl;
+	search.Print("2. Search", true);
 
 	// Если поток вывода открыт, сериализируем дерево.
 	if (output.is_open())
 	{
 		// Сериализация.
 
-		profile::StartMemoryProfiling();
-		profile::StartTimeProfiling();
+		Phase serialization("Serialization");
 
 		tree->Serialize(output);
 
-		profile::EndTimeProfiling();
-		profile::EndMemoryProfiling();
-
-		std::cout << "3. Serialization (writing to file) took " << profile::GetProfiledTime().count() << " microseconds." << std::endl;
-		std::cout << "\t with " << profile::GetProfiledMemory() << " bytes of memory allocated in total" << std::endl << std::endl;
+		serialization.Print("3. Serialization (writing to file)", true);
 
 		output.close();
 	}
+	else if (binaryOutput)
+	{
+		// Сериализация в двоичный формат. Полное дерево (а сгенерированное всегда полное) пишется массивом, любое другое - с формой.
+
+		Phase serialization("Binary serialization");
+
+		ImplicitBinaryTree<int> array;
+
+		profile::Scope flattening("Flattening");
+		bool complete = ImplicitBinaryTree<int>::FromBinaryLeaf(tree, array);
+		flattening.End();
+
+		profile::Scope writing("Writing");
+		bool saved = complete ? btfile::Save("btree.bt", array, binaryEncoding, binaryChunkSize) : btfile::Save("btree.bt", tree, binaryEncoding);
+		writing.End();
+
+		serialization.End();
+
+		if (saved)
+		{
+			serialization.Print("3. Binary serialization (writing to file)", true);
+		}
+		else
+		{
+			std::cout << "3. Binary serialization failed" << std::endl << std::endl;
+		}
+	}
 
 	// Сериализируем основное дерево, его размер, а так же найденные отношения и поддеревья в поток cout.
 	// Таким образом сериализованные данные выведутся в консоль.
@@ -177,5 +652,7 @@ int main(int argc, const char** argv)
 	std::cout << maxRatio << " ratio; Tree: " << std::endl;
 	maxRatioSubtree->Serialize(std::cout, 6, true);
 
+	PrintProfileReport();
+
 	return 0;
 }
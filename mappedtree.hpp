@@ -0,0 +1,459 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <ostream>
+#include <vector>
+
+#include "btfile.hpp"
+#include "checksum.hpp"
+#include "louds.hpp"
+#include "mapping.hpp"
+#include "writer.hpp"
+
+/*
+	Дерево из двоичного файла, которое работает прямо поверх отображения и никогда не загружается в память.
+
+	Подходят только неупакованные файлы без кусков (BtEncoding::RAW), зато любой формы: полное дерево навигирует
+	по индексам, как ImplicitBinaryTree, а произвольное - по словам LoudsShape, которые тоже читаются из отображения.
+	В собственной памяти лежат только справочники Rank и Select (меньше половины бита на лепесток), всё остальное -
+	страницы файла, которые ОС подгружает по мере обращения и может вытеснить в любой момент. Поэтому размер дерева
+	ограничен диском, а не памятью.
+
+	Лепестки нумеруются в порядке Walk. Дети лепестков одного уровня, идущих подряд, тоже идут подряд - и в полном
+	дереве, и в LOUDS, - поэтому Walk читает файл отрезками вперёд. Поиск минимума и максимума идёт в глубину и держит
+	только путь от корня до текущего лепестка, то есть память O(высоты дерева) вместо двух массивов на всё дерево.
+
+	По умолчанию ОС подсказывается доступ вразнобой (MapAccess::RANDOM): навигация и GetValue читают по одной странице
+	без упреждающего чтения. Проходы по всему дереву (Walk от корня, GetMinMaxWeightSumChildrenRatio) на своё время
+	переключают подсказку на MapAccess::SEQUENTIAL. Подсказку по умолчанию можно поменять через SetAccess.
+*/
+template<typename T>
+class MappedBinaryTree
+{
+public:
+	static constexpr size_t npos = std::numeric_limits<size_t>::max();
+private:
+	MappedFile mFile;
+	btfile_header_t mHeader;
+
+	const T* mValues;
+
+	// Форма произвольного дерева поверх отображения. У полного дерева пуста.
+	LoudsShape mShape;
+
+	mapaccess_t mAccess;
+public:
+	MappedBinaryTree()
+	{
+		mHeader = {};
+		mValues = nullptr;
+
+		mAccess = MapAccess::RANDOM;
+	}
+
+	MappedBinaryTree(const MappedBinaryTree<T>&) = delete;
+	MappedBinaryTree<T>& operator=(const MappedBinaryTree<T>&) = delete;
+public:
+	/*
+		Открытие файла path. Читаются заголовок и, для произвольной формы, слова формы - по ним строятся справочники.
+		Если verify, дополнительно проверяются контрольные суммы формы и значений, а это чтение всего файла.
+		Возвращает false, если файл не двоичный, повреждён, упакован, разбит на куски или хранит значения другого типа.
+	*/
+	bool Open(const char* path, bool verify = false)
+	{
+		Close();
+
+		if (!mFile.Open(path))
+		{
+			return false;
+		}
+
+		const uint8_t* data = mFile.GetData();
+
+		bool valid = btfile::ReadHeader(data, mFile.GetSize(), mHeader)
+			&& btfile::IsCompatible<T>(mHeader)
+			&& mHeader.encoding == BtEncoding::RAW
+			&& mHeader.chunkSize == 0
+			&& mHeader.dataOffset % alignof(T) == 0
+			&& (!verify || btfile::VerifyData(data, mHeader));
+
+		if (valid && mHeader.shape == BtShape::LOUDS)
+		{
+			size_t nodeCount = static_cast<size_t>(mHeader.nodeCount);
+			size_t shapeSize = static_cast<size_t>(mHeader.dataOffset) - sizeof(btfile_header_t);
+
+			// Справочники строятся одним проходом по всем словам формы.
+			mFile.Advise(MapAccess::SEQUENTIAL, sizeof(btfile_header_t), shapeSize);
+
+			valid = (!verify || checksum::Crc32c(data + sizeof(btfile_header_t), shapeSize) == mHeader.shapeChecksum)
+				&& mShape.AssignView(reinterpret_cast<const uint64_t*>(data + sizeof(btfile_header_t)), LoudsShape::GetWordCount(nodeCount), nodeCount);
+		}
+
+		if (!valid)
+		{
+			Close();
+
+			return false;
+		}
+
+		mValues = reinterpret_cast<const T*>(data + mHeader.dataOffset);
+
+		mFile.Advise(mAccess);
+
+		return true;
+	}
+
+	void Close()
+	{
+		mFile.Close();
+		mHeader = {};
+
+		mValues = nullptr;
+		mShape = LoudsShape();
+	}
+
+	bool IsOpen() const
+	{
+		return mFile.IsOpen();
+	}
+
+	// Подсказка ОС о доступе вне проходов по всему дереву. См. описание класса.
+	void SetAccess(mapaccess_t access)
+	{
+		mAccess = access;
+
+		if (IsOpen())
+		{
+			mFile.Advise(mAccess);
+		}
+	}
+
+	size_t GetSize() const
+	{
+		return static_cast<size_t>(mHeader.nodeCount);
+	}
+
+	// Полное ли дерево, то есть навигирует ли оно по индексам без формы.
+	bool IsComplete() const
+	{
+		return mHeader.shape == BtShape::COMPLETE;
+	}
+
+	// Байты собственной памяти дерева. Отображённый файл сюда не входит - это страничный кэш ОС.
+	size_t GetByteSize() const
+	{
+		return sizeof(*this) + mShape.GetByteSize();
+	}
+
+	const T& GetValue(size_t index) const
+	{
+		return mValues[index];
+	}
+public:
+	// Навигация по номерам лепестков. Если лепестка нет, возвращается npos.
+
+	size_t GetRightChild(size_t index) const
+	{
+		if (!IsComplete())
+		{
+			return mShape.GetRightChild(index);
+		}
+
+		size_t child = 2 * index + 1;
+
+		return (child < GetSize()) ? child : npos;
+	}
+
+	size_t GetLeftChild(size_t index) const
+	{
+		if (!IsComplete())
+		{
+			return mShape.GetLeftChild(index);
+		}
+
+		size_t child = 2 * index + 2;
+
+		return (child < GetSize()) ? child : npos;
+	}
+
+	size_t GetParent(size_t index) const
+	{
+		if (!IsComplete())
+		{
+			return mShape.GetParent(index);
+		}
+
+		return (index == 0) ? npos : (index - 1) / 2;
+	}
+
+	treedir_t GetDirection(size_t index) const
+	{
+		if (!IsComplete())
+		{
+			return mShape.GetDirection(index);
+		}
+
+		if (index == 0)
+		{
+			return TreeDirection::ROOT;
+		}
+
+		return (index % 2 == 1) ? TreeDirection::RIGHT : TreeDirection::LEFT;
+	}
+
+	// Глубина полного дерева выводится из индекса, а произвольного - подъёмом к корню.
+	uint16_t GetDepth(size_t index) const
+	{
+		if (IsComplete())
+		{
+			return mHeader.rootDepth + static_cast<uint16_t>(std::bit_width(index + 1) - 1);
+		}
+
+		uint16_t depth = mHeader.rootDepth;
+
+		for (size_t parent = mShape.GetParent(index); parent != npos; parent = mShape.GetParent(parent))
+		{
+			depth++;
+		}
+
+		return depth;
+	}
+public:
+	/*
+		Итерация по поддереву лепестка root в том же порядке, что и BinaryLeaf::Walk. walker получает номер лепестка,
+		возвращаемое значение работает так же, как в BinaryLeaf::Walk. Проход от корня читает файл подсказкой SEQUENTIAL.
+	*/
+	template<typename F>
+	void Walk(F&& walker, bool includeSelf = true, size_t root = 0) const
+	{
+		if (root == 0)
+		{
+			mFile.Advise(MapAccess::SEQUENTIAL);
+		}
+
+		WalkLevels([&](size_t index, uint16_t) -> bool {
+			return walker(index);
+		}, includeSelf, root);
+
+		if (root == 0)
+		{
+			mFile.Advise(mAccess);
+		}
+	}
+
+	// Получаем отношение (сумма весов / количество потомков) для лепестка index.
+	double GetWeightSumChildrenRatio(size_t index) const
+	{
+		size_t children = 0;
+
+		leaf_weight_t<T> weightSum = (GetDepth(index) * mValues[index]);
+
+		WalkLevels([&](size_t leaf, uint16_t depth) -> bool {
+			children++;
+
+			weightSum += (depth * mValues[leaf]);
+
+			return false;
+		}, false, index);
+
+		children = std::max<size_t>(1, children);
+
+		return static_cast<double>(weightSum) / static_cast<double>(children);
+	}
+
+	/*
+		Поиск минимального и максимального отношения среди всех поддеревьев, как у ImplicitBinaryTree: вместо поддеревьев
+		записываются номера их корней, при равных отношениях побеждает меньший номер.
+
+		Агрегаты поддеревьев считаются обходом в глубину после потомков (post-order) с явным стеком: на стеке лежит только
+		путь от корня до текущего лепестка, и каждый лепесток, досчитав своё поддерево, добавляет его к родителю
+		и уходит со стека. На каждом уровне лепестки посещаются по возрастанию номеров, так что файл читается
+		несколькими потоками вперёд - по одному на уровень.
+	*/
+	void GetMinMaxWeightSumChildrenRatio(double& outputMin, size_t& outputMinHolder, double& outputMax, size_t& outputMaxHolder) const
+	{
+		if (GetSize() == 0)
+		{
+			return;
+		}
+
+		mFile.Advise(MapAccess::SEQUENTIAL);
+
+		// Лепесток на пути от корня. stage - сколько его потомков уже положено на стек.
+		struct path_frame_t
+		{
+			size_t index;
+			leaf_weight_t<T> weightSum;
+			size_t count;
+			uint8_t stage;
+		};
+
+		std::vector<path_frame_t> path = {};
+		path.push_back({ 0, mHeader.rootDepth * mValues[0], 1, 0 });
+
+		bool minFound = false;
+		bool maxFound = false;
+
+		while (path.size() > 0)
+		{
+			path_frame_t& frame = path.back();
+
+			if (frame.stage < 2)
+			{
+				size_t child = (frame.stage == 0) ? GetRightChild(frame.index) : GetLeftChild(frame.index);
+				frame.stage++;
+
+				if (child != npos)
+				{
+					uint16_t depth = mHeader.rootDepth + static_cast<uint16_t>(path.size());
+
+					path.push_back({ child, depth * mValues[child], 1, 0 });
+				}
+
+				continue;
+			}
+
+			size_t children = std::max<size_t>(1, frame.count - 1);
+			double ratio = static_cast<double>(frame.weightSum) / static_cast<double>(children);
+
+			if (ratio < outputMin || (minFound && ratio == outputMin && frame.index < outputMinHolder))
+			{
+				outputMin = ratio;
+				outputMinHolder = frame.index;
+
+				minFound = true;
+			}
+
+			if (ratio > outputMax || (maxFound && ratio == outputMax && frame.index < outputMaxHolder))
+			{
+				outputMax = ratio;
+				outputMaxHolder = frame.index;
+
+				maxFound = true;
+			}
+
+			leaf_weight_t<T> weightSum = frame.weightSum;
+			size_t count = frame.count;
+
+			path.pop_back();
+
+			if (path.size() > 0)
+			{
+				path.back().weightSum += weightSum;
+				path.back().count += count;
+			}
+		}
+
+		mFile.Advise(mAccess);
+	}
+public:
+	/*
+		Метод сериализации. Вывод совпадает с BinaryLeaf::Serialize для того же дерева, аргументы значат то же самое.
+		root - корень сериализуемого поддерева, по умолчанию всё дерево.
+	*/
+	void Serialize(std::ostream& stream, uint16_t skipDeep = -1, bool pretty = false, size_t root = 0) const
+	{
+		BufferedWriter writer(stream);
+
+		// Первая строка обещает загрузчику последнюю (см. textload::CHECKSUM_HEADER).
+		if (!pretty)
+		{
+			writer.WriteChecksumHeader();
+		}
+
+		WalkLevels([&](size_t index, uint16_t depth) -> bool {
+			if (pretty)
+			{
+				uint16_t tabDepth = (depth < 32) ? depth : 32;
+
+				if (GetDirection(index) == TreeDirection::LEFT)
+				{
+					tabDepth -= 1;
+				}
+
+				for (uint16_t t = 0; t < tabDepth; t++)
+				{
+					writer.Write('\t');
+				}
+
+				writer.WriteValue(depth);
+				writer.Write(": ", 2);
+			}
+
+			writer.WriteValue(mValues[index]);
+			writer.Write('\n');
+
+			if (skipDeep != -1 && depth > skipDeep)
+			{
+				writer.Write("...\n", 4);
+
+				return true;
+			}
+
+			return false;
+		}, true, root);
+
+		// Файловый формат заканчивается строкой контрольной суммы, чтобы обрезанный файл не загрузился молча.
+		if (!pretty)
+		{
+			writer.WriteChecksumLine();
+		}
+
+		writer.Flush();
+	}
+private:
+	// Номера детей отрезка лепестков [first, last) одного уровня - тоже отрезок, его и возвращает функция.
+	void GetChildRange(size_t& first, size_t& last) const
+	{
+		if (IsComplete())
+		{
+			first = std::min(2 * first + 1, GetSize());
+			last = std::min(2 * last + 1, GetSize());
+
+			return;
+		}
+
+		// Каждая единица формы - ребро к следующему по порядку лепестку, поэтому дети отрезка нумеруются по Rank его битов.
+		first = mShape.Rank(2 * first) + 1;
+		last = mShape.Rank(2 * last) + 1;
+	}
+
+	/*
+		Walk по уровням: walker(index, depth) вызывается для лепестков уровня подряд, а следующий уровень - это дети
+		только что пройденного отрезка.
+	*/
+	template<typename F>
+	void WalkLevels(F&& walker, bool includeSelf, size_t root) const
+	{
+		if (root >= GetSize())
+		{
+			return;
+		}
+
+		size_t first = root;
+		size_t last = root + 1;
+		uint16_t depth = GetDepth(root);
+
+		if (!includeSelf)
+		{
+			GetChildRange(first, last);
+			depth++;
+		}
+
+		while (first < last)
+		{
+			for (size_t index = first; index < last; index++)
+			{
+				if (walker(index, depth))
+				{
+					return;
+				}
+			}
+
+			GetChildRange(first, last);
+			depth++;
+		}
+	}
+};
@@ -0,0 +1,189 @@
+﻿#include "mapping.hpp"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+{
+	mData = nullptr;
+	mSize = 0;
+
+#ifdef _WIN32
+	mFile = INVALID_HANDLE_VALUE;
+	mMapping = nullptr;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const char* path)
+{
+	Close();
+
+#ifdef _WIN32
+	mFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (mFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER size = {};
+	if (!GetFileSizeEx(mFile, &size) || size.QuadPart <= 0)
+	{
+		Close();
+
+		return false;
+	}
+
+	mMapping = CreateFileMappingA(mFile, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	if (mMapping == nullptr)
+	{
+		Close();
+
+		return false;
+	}
+
+	mData = static_cast<uint8_t*>(MapViewOfFile(mMapping, FILE_MAP_COPY, 0, 0, 0));
+	if (mData == nullptr)
+	{
+		Close();
+
+		return false;
+	}
+
+	mSize = static_cast<size_t>(size.QuadPart);
+#else
+	int file = open(path, O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	struct stat status = {};
+	if (fstat(file, &status) != 0 || status.st_size <= 0)
+	{
+		close(file);
+
+		return false;
+	}
+
+	size_t size = static_cast<size_t>(status.st_size);
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+
+	// Отображение держит файл само, дескриптор больше не нужен.
+	close(file);
+
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+
+	mData = static_cast<uint8_t*>(data);
+	mSize = size;
+#endif
+
+	return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if (mData != nullptr)
+	{
+		UnmapViewOfFile(mData);
+	}
+
+	if (mMapping != nullptr)
+	{
+		CloseHandle(mMapping);
+	}
+
+	if (mFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(mFile);
+	}
+
+	mFile = INVALID_HANDLE_VALUE;
+	mMapping = nullptr;
+#else
+	if (mData != nullptr)
+	{
+		munmap(mData, mSize);
+	}
+#endif
+
+	mData = nullptr;
+	mSize = 0;
+}
+
+bool MappedFile::IsOpen() const
+{
+	return mData != nullptr;
+}
+
+uint8_t* MappedFile::GetData() const
+{
+	return mData;
+}
+
+size_t MappedFile::GetSize() const
+{
+	return mSize;
+}
+
+bool MappedFile::Advise(mapaccess_t access, size_t offset, size_t size) const
+{
+	if (mData == nullptr || offset >= mSize)
+	{
+		return false;
+	}
+
+	size = std::min(size, mSize - offset);
+
+#ifdef _WIN32
+	if (access != MapAccess::WILLNEED)
+	{
+		return true;
+	}
+
+	WIN32_MEMORY_RANGE_ENTRY range = {};
+	range.VirtualAddress = mData + offset;
+	range.NumberOfBytes = size;
+
+	return PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0) != FALSE;
+#else
+	// madvise принимает только адрес на границе страницы. Начало отображения на ней всегда.
+	size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t first = offset - offset % page;
+
+	int advice = MADV_NORMAL;
+
+	if (access == MapAccess::SEQUENTIAL)
+	{
+		advice = MADV_SEQUENTIAL;
+	}
+	else if (access == MapAccess::RANDOM)
+	{
+		advice = MADV_RANDOM;
+	}
+	else if (access == MapAccess::WILLNEED)
+	{
+		advice = MADV_WILLNEED;
+	}
+
+	return madvise(mData + first, offset + size - first, advice) == 0;
+#endif
+}
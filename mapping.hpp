@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Ожидаемый порядок обращений к отображённому файлу - подсказка ОС, какие страницы подгружать заранее и какие вытеснять.
+typedef uint8_t mapaccess_t;
+namespace MapAccess
+{
+	// Без подсказки, как сразу после Open.
+	constexpr mapaccess_t NORMAL = 0;
+
+	// Чтение от начала к концу: страницы подгружаются с упреждением, прочитанные вытесняются первыми.
+	constexpr mapaccess_t SEQUENTIAL = 1;
+
+	// Обращения вразнобой: упреждающее чтение выключается, подгружается только нужная страница.
+	constexpr mapaccess_t RANDOM = 2;
+
+	// Диапазон скоро понадобится: его страницы начинают читаться сразу.
+	constexpr mapaccess_t WILLNEED = 3;
+}
+
+/*
+	Файл, отображённый в память (mmap в POSIX, MapViewOfFile в Windows).
+
+	Отображение копируется при записи: данные можно менять, но изменения видны только этому процессу
+	и никогда не попадают в файл. Страницы подгружаются с диска по мере обращения к ним, поэтому
+	открытие даже очень большого файла почти ничего не стоит.
+*/
+class MappedFile
+{
+private:
+	uint8_t* mData;
+	size_t mSize;
+
+#ifdef _WIN32
+	// HANDLE файла и отображения. Хранятся как void*, чтобы не подключать windows.h в заголовке.
+	void* mFile;
+	void* mMapping;
+#endif
+public:
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+public:
+	// Отображение файла path. Ранее отображённый файл закрывается. Пустой файл отобразить нельзя, тогда возвращается false.
+	bool Open(const char* path);
+
+	void Close();
+
+	bool IsOpen() const;
+
+	uint8_t* GetData() const;
+	size_t GetSize() const;
+
+	/*
+		Подсказка ОС о порядке обращений к байтам [offset, offset + size) отображения (madvise в POSIX).
+		Диапазон расширяется до границ страниц и обрезается по размеру файла. В Windows подсказок порядка нет,
+		там выполняется только MapAccess::WILLNEED (PrefetchVirtualMemory), а остальные ничего не делают.
+		Возвращает false, если файл не открыт или ОС отвергла подсказку; на данные это не влияет.
+	*/
+	bool Advise(mapaccess_t access, size_t offset = 0, size_t size = std::numeric_limits<size_t>::max()) const;
+};
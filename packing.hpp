@@ -0,0 +1,211 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+/*
+	Упаковка целочисленного столбца значений по блокам (frame of reference + bit packing).
+
+	Значения делятся на блоки по BLOCK_SIZE. Для каждого блока записываются его минимум (base, 8 байт)
+	и ширина (width, 1 байт) - сколько бит нужно для разницы между максимумом и минимумом. Затем идут
+	разницы value - base по width бит каждая, младшими битами вперёд. Блок занимает целое число байт.
+
+	Значения из GenerateTree (0..254) укладываются в 8 бит против 4 байт в памяти и до 4 байт с переводом строки
+	в тексте. Ширины 8, 16 и 32 выровнены по байтам, и их циклы - простые поэлементные преобразования,
+	которые компилятор векторизует. Остальные ширины читаются и пишутся 64-битными словами.
+	Слова собираются через memcpy в порядке little-endian, так что формат рассчитан на little-endian машины, как и btfile.
+*/
+namespace packing
+{
+	constexpr size_t BLOCK_SIZE = 4096;
+
+	// Размер заголовка блока: base и width.
+	constexpr size_t BLOCK_HEADER_SIZE = sizeof(int64_t) + 1;
+
+	// Наибольшая длина упаковки count значений: заголовки блоков и по 64 бита на значение.
+	constexpr uint64_t GetMaxPackedSize(uint64_t count)
+	{
+		return (count + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_HEADER_SIZE + count * sizeof(uint64_t);
+	}
+
+	// Упаковка count значений из values. Результат дописывается в конец output.
+	template<typename T>
+	void PackValues(const T* values, size_t count, std::vector<uint8_t>& output)
+	{
+		static_assert(std::is_integral_v<T>, "Only integral values can be bit-packed");
+
+		for (size_t blockFirst = 0; blockFirst < count; blockFirst += BLOCK_SIZE)
+		{
+			size_t blockSize = std::min(BLOCK_SIZE, count - blockFirst);
+			const T* block = values + blockFirst;
+
+			T lowest = block[0];
+			T highest = block[0];
+
+			for (size_t index = 0; index < blockSize; index++)
+			{
+				lowest = std::min(lowest, block[index]);
+				highest = std::max(highest, block[index]);
+			}
+
+			// Разница считается в uint64_t: так она верна для любого целого T, в том числе для крайних значений int64_t.
+			uint64_t base = static_cast<uint64_t>(static_cast<int64_t>(lowest));
+			uint64_t range = static_cast<uint64_t>(static_cast<int64_t>(highest)) - base;
+
+			uint8_t width = static_cast<uint8_t>(std::bit_width(range));
+
+			size_t header = output.size();
+			size_t bytes = (blockSize * width + 7) / 8;
+
+			output.resize(header + BLOCK_HEADER_SIZE + bytes, 0);
+
+			std::memcpy(output.data() + header, &base, sizeof(base));
+			output[header + sizeof(base)] = width;
+
+			uint8_t* packed = output.data() + header + BLOCK_HEADER_SIZE;
+
+			if (width == 8)
+			{
+				for (size_t index = 0; index < blockSize; index++)
+				{
+					packed[index] = static_cast<uint8_t>(static_cast<uint64_t>(static_cast<int64_t>(block[index])) - base);
+				}
+			}
+			else if (width == 16 || width == 32)
+			{
+				for (size_t index = 0; index < blockSize; index++)
+				{
+					uint64_t delta = static_cast<uint64_t>(static_cast<int64_t>(block[index])) - base;
+
+					std::memcpy(packed + index * (width / 8), &delta, width / 8);
+				}
+			}
+			else if (width > 0)
+			{
+				for (size_t index = 0; index < blockSize; index++)
+				{
+					uint64_t delta = static_cast<uint64_t>(static_cast<int64_t>(block[index])) - base;
+
+					size_t bit = index * width;
+					size_t byte = bit / 8;
+					unsigned shift = bit % 8;
+
+					// Значение занимает не больше 9 байт: первые 8 дописываются одним словом, девятый - отдельно.
+					uint64_t word = 0;
+					size_t available = std::min<size_t>(8, bytes - byte);
+
+					std::memcpy(&word, packed + byte, available);
+					word |= delta << shift;
+					std::memcpy(packed + byte, &word, available);
+
+					if (shift + width > 64)
+					{
+						packed[byte + 8] |= static_cast<uint8_t>(delta >> (64 - shift));
+					}
+				}
+			}
+		}
+	}
+
+	/*
+		Распаковка ровно count значений из size байт data в values.
+		Возвращает false, если данные повреждены: блоков не хватает, ширина больше 64 или остались лишние байты.
+	*/
+	template<typename T>
+	bool UnpackValues(const uint8_t* data, size_t size, T* values, size_t count)
+	{
+		static_assert(std::is_integral_v<T>, "Only integral values can be bit-packed");
+
+		size_t offset = 0;
+
+		for (size_t blockFirst = 0; blockFirst < count; blockFirst += BLOCK_SIZE)
+		{
+			size_t blockSize = std::min(BLOCK_SIZE, count - blockFirst);
+			T* block = values + blockFirst;
+
+			if (size - offset < BLOCK_HEADER_SIZE)
+			{
+				return false;
+			}
+
+			uint64_t base = 0;
+			std::memcpy(&base, data + offset, sizeof(base));
+
+			uint8_t width = data[offset + sizeof(base)];
+			size_t bytes = (blockSize * width + 7) / 8;
+
+			offset += BLOCK_HEADER_SIZE;
+
+			if (width > 64 || size - offset < bytes)
+			{
+				return false;
+			}
+
+			const uint8_t* packed = data + offset;
+			offset += bytes;
+
+			if (width == 0)
+			{
+				std::fill(block, block + blockSize, static_cast<T>(base));
+			}
+			else if (width == 8)
+			{
+				for (size_t index = 0; index < blockSize; index++)
+				{
+					block[index] = static_cast<T>(base + packed[index]);
+				}
+			}
+			else if (width == 16)
+			{
+				for (size_t index = 0; index < blockSize; index++)
+				{
+					uint16_t delta = 0;
+					std::memcpy(&delta, packed + 2 * index, sizeof(delta));
+
+					block[index] = static_cast<T>(base + delta);
+				}
+			}
+			else if (width == 32)
+			{
+				for (size_t index = 0; index < blockSize; index++)
+				{
+					uint32_t delta = 0;
+					std::memcpy(&delta, packed + 4 * index, sizeof(delta));
+
+					block[index] = static_cast<T>(base + delta);
+				}
+			}
+			else
+			{
+				uint64_t mask = (width == 64) ? UINT64_MAX : ((static_cast<uint64_t>(1) << width) - 1);
+
+				for (size_t index = 0; index < blockSize; index++)
+				{
+					size_t bit = index * width;
+					size_t byte = bit / 8;
+					unsigned shift = bit % 8;
+
+					// Значение занимает не больше 9 байт. Читаем 8 байт одним memcpy, если они есть, иначе - по байту.
+					uint64_t word = 0;
+					size_t available = std::min<size_t>(8, bytes - byte);
+					std::memcpy(&word, packed + byte, available);
+
+					uint64_t delta = word >> shift;
+
+					if (shift + width > 64)
+					{
+						delta |= static_cast<uint64_t>(packed[byte + 8]) << (64 - shift);
+					}
+
+					block[index] = static_cast<T>(base + (delta & mask));
+				}
+			}
+		}
+
+		return offset == size;
+	}
+}
@@ -0,0 +1,197 @@
+﻿#include "parallel.hpp"
+
+#include <algorithm>
+#include <deque>
+
+// Очередь задач одного потока. Владелец берёт задачи с конца, остальные перехватывают с начала.
+struct work_queue_t
+{
+	std::mutex mutex;
+	std::deque<size_t> tasks;
+};
+
+/*
+	Исполнение задач из очередей queues потоком номер self: сначала своя очередь с конца, затем чужие с начала.
+	Новых задач не появляется, так что если их нет нигде, то работа закончена.
+*/
+static void DrainQueues(std::vector<work_queue_t>& queues, size_t self, const std::function<void(size_t)>& task)
+{
+	size_t threads = queues.size();
+
+	while (true)
+	{
+		size_t index = 0;
+		bool found = false;
+
+		// Сначала своя очередь, с конца.
+		{
+			std::lock_guard<std::mutex> lock(queues[self].mutex);
+
+			if (queues[self].tasks.size() > 0)
+			{
+				index = queues[self].tasks.back();
+				queues[self].tasks.pop_back();
+
+				found = true;
+			}
+		}
+
+		// Затем чужие, с начала.
+		for (size_t offset = 1; !found && offset < threads; offset++)
+		{
+			work_queue_t& victim = queues[(self + offset) % threads];
+
+			std::lock_guard<std::mutex> lock(victim.mutex);
+
+			if (victim.tasks.size() > 0)
+			{
+				index = victim.tasks.front();
+				victim.tasks.pop_front();
+
+				found = true;
+			}
+		}
+
+		if (!found)
+		{
+			return;
+		}
+
+		task(index);
+	}
+}
+
+WorkStealingPool::WorkStealingPool(size_t threads)
+{
+	if (threads == 0)
+	{
+		threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+	}
+
+	mThreads = threads;
+
+	mGeneration = 0;
+	mQueues = nullptr;
+	mTask = nullptr;
+	mActive = 0;
+
+	mStopping = false;
+	mBusy = false;
+
+	for (size_t self = 1; self < mThreads; self++)
+	{
+		mWorkers.emplace_back(&WorkStealingPool::WorkerLoop, this, self);
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mStopping = true;
+	}
+
+	mWake.notify_all();
+
+	for (std::thread& worker : mWorkers)
+	{
+		worker.join();
+	}
+}
+
+size_t WorkStealingPool::GetThreadCount() const
+{
+	return mThreads;
+}
+
+void WorkStealingPool::Run(size_t taskCount, const std::function<void(size_t)>& task)
+{
+	size_t threads = std::min(mThreads, std::max<size_t>(1, taskCount));
+
+	if (threads == 1 || mBusy.exchange(true))
+	{
+		for (size_t index = 0; index < taskCount; index++)
+		{
+			task(index);
+		}
+
+		return;
+	}
+
+	// Раздаём задачи отрезками, чтобы соседние (а значит, обычно и похожие) задачи начинал один поток.
+	std::vector<work_queue_t> queues(threads);
+
+	for (size_t index = 0; index < taskCount; index++)
+	{
+		queues[index * threads / taskCount].tasks.push_back(index);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mQueues = &queues;
+		mTask = &task;
+		mActive = mWorkers.size();
+
+		mGeneration++;
+	}
+
+	mWake.notify_all();
+
+	DrainQueues(queues, 0, task);
+
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+
+		mFinished.wait(lock, [&]() {
+			return mActive == 0;
+		});
+
+		mQueues = nullptr;
+		mTask = nullptr;
+	}
+
+	mBusy = false;
+}
+
+void WorkStealingPool::WorkerLoop(size_t self)
+{
+	uint64_t seen = 0;
+
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+
+		mWake.wait(lock, [&]() {
+			return mStopping || mGeneration != seen;
+		});
+
+		if (mStopping)
+		{
+			return;
+		}
+
+		seen = mGeneration;
+
+		std::vector<work_queue_t>* queues = mQueues;
+		const std::function<void(size_t)>* task = mTask;
+
+		lock.unlock();
+
+		// Когда задач меньше, чем потоков, очередей у лишних потоков нет - они только отчитываются.
+		if (self < queues->size())
+		{
+			DrainQueues(*queues, self, *task);
+		}
+
+		lock.lock();
+
+		mActive--;
+
+		if (mActive == 0)
+		{
+			mFinished.notify_one();
+		}
+	}
+}
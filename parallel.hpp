@@ -0,0 +1,70 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct work_queue_t;
+
+/*
+	Пул потоков с перехватом работы (work stealing).
+
+	Задачи - это номера 0..taskCount-1. Сначала они раздаются потокам поровну, и каждый поток берёт задачи
+	из своей очереди. Поток, у которого задачи кончились, перехватывает их с противоположного конца очереди
+	другого потока. Так неравные по размеру задачи (например, поддеревья разной величины) не оставляют ядра без дела.
+
+	Потоки создаются один раз в конструкторе и между вызовами Run ждут на условной переменной, а завершаются
+	в деструкторе. Так короткие Run (поиск по уровню дерева, разбор небольшого файла) не платят за создание потоков.
+*/
+class WorkStealingPool
+{
+private:
+	// Количество потоков, включая вызывающий.
+	size_t mThreads;
+
+	// Постоянные потоки пула, без вызывающего.
+	std::vector<std::thread> mWorkers;
+
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::condition_variable mFinished;
+
+	/*
+		Текущий Run под mMutex: его номер, очереди и задача. Поток берётся за Run, номер которого ещё не видел,
+		а Run ждёт, пока mActive потоков не отчитаются о нём, - только тогда очереди на его стеке можно освободить.
+	*/
+	uint64_t mGeneration;
+	std::vector<work_queue_t>* mQueues;
+	const std::function<void(size_t)>* mTask;
+	size_t mActive;
+
+	bool mStopping;
+
+	// Идёт Run. Вложенный (из задачи) или одновременный Run из другого потока исполняется вызывающим потоком по порядку.
+	std::atomic<bool> mBusy;
+public:
+	// threads - количество потоков. 0 означает std::thread::hardware_concurrency().
+	explicit WorkStealingPool(size_t threads = 0);
+
+	// Дожидается своих потоков. Run в это время идти не должен.
+	~WorkStealingPool();
+
+	WorkStealingPool(const WorkStealingPool&) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+	size_t GetThreadCount() const;
+
+	/*
+		Исполнение задач 0..taskCount-1. Возвращается, только когда все задачи выполнены.
+		Вызывающий поток тоже исполняет задачи, поэтому пул из одного потока просто выполняет их по порядку.
+	*/
+	void Run(size_t taskCount, const std::function<void(size_t)>& task);
+private:
+	// Цикл постоянного потока номер self: ожидание Run, исполнение его задач, отчёт.
+	void WorkerLoop(size_t self);
+};
@@ -1,33 +1,432 @@
 ﻿#include "profile.hpp"
 
-// Глобальные переменные для профилирования памяти.
-size_t CapturedMemory = 0;
-bool ShouldCaptureMemory = false;
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
 
-// Глобальные переменные для профилирования времени.
-std::chrono::high_resolution_clock::time_point StartTime;
-std::chrono::high_resolution_clock::duration CapturedTime;
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+	Счётчики выделений одного потока. Пишет в них только свой поток, поэтому хватает relaxed-записей без атомарного
+	сложения, а читать их во время замера может любой поток. Счётчики всех живых потоков связаны в список,
+	а счётчики завершившихся потоков складываются в RetiredCounters.
+*/
+struct thread_counters_t
+{
+	std::atomic<uint64_t> allocations;
+	std::atomic<uint64_t> frees;
+	std::atomic<uint64_t> allocatedBytes;
+	std::atomic<uint64_t> freedBytes;
+
+	// Живая память своего потока (выделено минус освобождено этим потоком) и её пик для регионов (profile::Scope).
+	// Их читает только свой поток, поэтому они не атомарные.
+	int64_t live;
+	int64_t peakLive;
+
+	thread_counters_t* next;
+};
+
+// Сумма счётчиков для чтения.
+struct counters_total_t
+{
+	uint64_t allocations;
+	uint64_t frees;
+	uint64_t allocatedBytes;
+	uint64_t freedBytes;
+};
+
+/*
+	Список счётчиков потоков. Он не выделяет память сам (потоки связаны через поле next), потому что
+	регистрация потока происходит внутри operator new. Поэтому и замок - простой std::mutex без аллокаций.
+*/
+static std::mutex CountersMutex;
+static thread_counters_t* CountersHead = nullptr;
+static counters_total_t RetiredCounters = {};
+
+/*
+	Счётчики потока уже разрушены (см. ~thread_counters_slot_t). Выделения и освобождения, которые случаются
+	позже при завершении потока (деструкторы других thread_local), идут сразу в RetiredCounters под замком.
+	Флаг тривиально разрушаемый, поэтому его можно читать в любой момент жизни потока.
+*/
+static thread_local bool ThreadCountersRetired = false;
+
+// Поток регистрирует свои счётчики при первом выделении и переносит их в RetiredCounters при завершении.
+struct thread_counters_slot_t
+{
+	thread_counters_t counters;
+
+	thread_counters_slot_t()
+	{
+		counters.allocations = 0;
+		counters.frees = 0;
+		counters.allocatedBytes = 0;
+		counters.freedBytes = 0;
+		counters.live = 0;
+		counters.peakLive = 0;
+
+		std::lock_guard<std::mutex> lock(CountersMutex);
+
+		counters.next = CountersHead;
+		CountersHead = &counters;
+	}
+
+	~thread_counters_slot_t()
+	{
+		ThreadCountersRetired = true;
+
+		std::lock_guard<std::mutex> lock(CountersMutex);
+
+		RetiredCounters.allocations += counters.allocations.load(std::memory_order_relaxed);
+		RetiredCounters.frees += counters.frees.load(std::memory_order_relaxed);
+		RetiredCounters.allocatedBytes += counters.allocatedBytes.load(std::memory_order_relaxed);
+		RetiredCounters.freedBytes += counters.freedBytes.load(std::memory_order_relaxed);
+
+		for (thread_counters_t** link = &CountersHead; *link != nullptr; link = &(*link)->next)
+		{
+			if (*link == &counters)
+			{
+				*link = counters.next;
+
+				break;
+			}
+		}
+	}
+};
+
+static thread_local thread_counters_slot_t ThreadCounters;
+
+// Добавление к счётчику своего потока. Атомарное сложение не нужно: других писателей у счётчика нет.
+static void Bump(std::atomic<uint64_t>& counter, uint64_t value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static counters_total_t SumCounters()
+{
+	std::lock_guard<std::mutex> lock(CountersMutex);
+
+	counters_total_t total = RetiredCounters;
+
+	for (thread_counters_t* counters = CountersHead; counters != nullptr; counters = counters->next)
+	{
+		total.allocations += counters->allocations.load(std::memory_order_relaxed);
+		total.frees += counters->frees.load(std::memory_order_relaxed);
+		total.allocatedBytes += counters->allocatedBytes.load(std::memory_order_relaxed);
+		total.freedBytes += counters->freedBytes.load(std::memory_order_relaxed);
+	}
+
+	return total;
+}
+
+/*
+	Живая память и её пик нужны общие для всех потоков, поэтому считаются одним атомарным счётчиком,
+	но только во время замера: вне замера выделения стоят одной записи в счётчики своего потока.
+	RegionLive - рост живой памяти с начала замера, RegionPeak - его максимум.
+*/
+static std::atomic<bool> ShouldCaptureMemory = false;
+static std::atomic<int64_t> RegionLive = 0;
+static std::atomic<int64_t> RegionPeak = 0;
+
+static counters_total_t RegionStart = {};
+static profile::memory_profile_t CapturedMemory = {};
+
+static void RecordAllocation(size_t bytes)
+{
+	if (ThreadCountersRetired)
+	{
+		std::lock_guard<std::mutex> lock(CountersMutex);
+
+		RetiredCounters.allocations++;
+		RetiredCounters.allocatedBytes += bytes;
+	}
+	else
+	{
+		thread_counters_t& counters = ThreadCounters.counters;
+
+		Bump(counters.allocations, 1);
+		Bump(counters.allocatedBytes, bytes);
+
+		counters.live += static_cast<int64_t>(bytes);
+		counters.peakLive = std::max(counters.peakLive, counters.live);
+	}
+
+	if (ShouldCaptureMemory.load(std::memory_order_relaxed))
+	{
+		int64_t live = RegionLive.fetch_add(static_cast<int64_t>(bytes), std::memory_order_relaxed) + static_cast<int64_t>(bytes);
+		int64_t peak = RegionPeak.load(std::memory_order_relaxed);
+
+		while (live > peak && !RegionPeak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+		{
+		}
+	}
+}
+
+static void RecordFree(size_t bytes)
+{
+	if (ThreadCountersRetired)
+	{
+		std::lock_guard<std::mutex> lock(CountersMutex);
+
+		RetiredCounters.frees++;
+		RetiredCounters.freedBytes += bytes;
+	}
+	else
+	{
+		thread_counters_t& counters = ThreadCounters.counters;
+
+		Bump(counters.frees, 1);
+		Bump(counters.freedBytes, bytes);
+
+		counters.live -= static_cast<int64_t>(bytes);
+	}
+
+	if (ShouldCaptureMemory.load(std::memory_order_relaxed))
+	{
+		RegionLive.fetch_sub(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+	}
+}
+
+/*
+	Перед каждым блоком лежит заголовок с запрошенным размером, чтобы delete знал, сколько байт освобождается,
+	даже когда размер ему не передали. offset - расстояние от начала выделенной памяти до блока:
+	для обычных выделений это размер заголовка, для выровненных - выравнивание, чтобы блок остался выровненным.
+*/
+struct allocation_header_t
+{
+	size_t bytes;
+	size_t offset;
+};
+
+static_assert(sizeof(allocation_header_t) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "allocation header must fit into default alignment");
+
+static constexpr size_t HEADER_OFFSET = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+static allocation_header_t* GetHeader(void* pointer)
+{
+	return reinterpret_cast<allocation_header_t*>(static_cast<char*>(pointer) - sizeof(allocation_header_t));
+}
 
 // В этом файле нам не нужно перенаправлять вызовы malloc на нашу имплементацию.
 #undef malloc
 
-// Если мы захватываем (профилируем) память, то добавить количество выделяемых байт к счётчику.
-void* operator new(size_t bytes)
+static void* Allocate(size_t bytes)
 {
-	if (ShouldCaptureMemory)
+	if (bytes > SIZE_MAX - HEADER_OFFSET)
 	{
-		CapturedMemory += bytes;
+		return nullptr;
 	}
 
-	return malloc(bytes);
+	char* memory = static_cast<char*>(std::malloc(bytes + HEADER_OFFSET));
+	if (memory == nullptr)
+	{
+		return nullptr;
+	}
+
+	char* pointer = memory + HEADER_OFFSET;
+	*GetHeader(pointer) = { bytes, HEADER_OFFSET };
+
+	RecordAllocation(bytes);
+
+	return pointer;
+}
+
+static void* AllocateAligned(size_t bytes, std::align_val_t alignment)
+{
+	size_t offset = std::max(static_cast<size_t>(alignment), HEADER_OFFSET);
+
+	if (bytes > SIZE_MAX - 2 * offset)
+	{
+		return nullptr;
+	}
+
+#ifdef _WIN32
+	char* memory = static_cast<char*>(_aligned_malloc(bytes + offset, offset));
+#else
+	// aligned_alloc требует размер, кратный выравниванию.
+	size_t size = (bytes + offset + offset - 1) / offset * offset;
+	char* memory = static_cast<char*>(std::aligned_alloc(offset, size));
+#endif
+
+	if (memory == nullptr)
+	{
+		return nullptr;
+	}
+
+	char* pointer = memory + offset;
+	*GetHeader(pointer) = { bytes, offset };
+
+	RecordAllocation(bytes);
+
+	return pointer;
+}
+
+static void Deallocate(void* pointer)
+{
+	if (pointer == nullptr)
+	{
+		return;
+	}
+
+	allocation_header_t header = *GetHeader(pointer);
+
+	RecordFree(header.bytes);
+
+	std::free(static_cast<char*>(pointer) - header.offset);
+}
+
+static void DeallocateAligned(void* pointer)
+{
+	if (pointer == nullptr)
+	{
+		return;
+	}
+
+	allocation_header_t header = *GetHeader(pointer);
+
+	RecordFree(header.bytes);
+
+#ifdef _WIN32
+	_aligned_free(static_cast<char*>(pointer) - header.offset);
+#else
+	std::free(static_cast<char*>(pointer) - header.offset);
+#endif
+}
+
+// Выделение, которое при нехватке памяти бросает std::bad_alloc, как требует стандарт для new без nothrow.
+static void* AllocateOrThrow(void* pointer)
+{
+	if (pointer == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	return pointer;
+}
+
+void* operator new(size_t bytes)
+{
+	return AllocateOrThrow(Allocate(bytes));
+}
+
+void* operator new[](size_t bytes)
+{
+	return AllocateOrThrow(Allocate(bytes));
+}
+
+void* operator new(size_t bytes, const std::nothrow_t&) noexcept
+{
+	return Allocate(bytes);
+}
+
+void* operator new[](size_t bytes, const std::nothrow_t&) noexcept
+{
+	return Allocate(bytes);
+}
+
+void* operator new(size_t bytes, std::align_val_t alignment)
+{
+	return AllocateOrThrow(AllocateAligned(bytes, alignment));
+}
+
+void* operator new[](size_t bytes, std::align_val_t alignment)
+{
+	return AllocateOrThrow(AllocateAligned(bytes, alignment));
+}
+
+void* operator new(size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return AllocateAligned(bytes, alignment);
+}
+
+void* operator new[](size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return AllocateAligned(bytes, alignment);
+}
+
+// Размер, переданный в delete, не нужен: он уже лежит в заголовке.
+
+void operator delete(void* pointer) noexcept
+{
+	Deallocate(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+	Deallocate(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+	Deallocate(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept
+{
+	Deallocate(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept
+{
+	Deallocate(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept
+{
+	Deallocate(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept
+{
+	DeallocateAligned(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t) noexcept
+{
+	DeallocateAligned(pointer);
+}
+
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept
+{
+	DeallocateAligned(pointer);
 }
 
-// Тут то же самое, что и выше.
+void operator delete[](void* pointer, size_t, std::align_val_t) noexcept
+{
+	DeallocateAligned(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	DeallocateAligned(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	DeallocateAligned(pointer);
+}
+
+// Блок malloc освобождается обычным free, поэтому он считается только как выделение.
 void* __malloc(size_t bytes)
 {
-	if (ShouldCaptureMemory)
+	if (ThreadCountersRetired)
+	{
+		std::lock_guard<std::mutex> lock(CountersMutex);
+
+		RetiredCounters.allocations++;
+		RetiredCounters.allocatedBytes += bytes;
+	}
+	else
 	{
-		CapturedMemory += bytes;
+		thread_counters_t& counters = ThreadCounters.counters;
+
+		Bump(counters.allocations, 1);
+		Bump(counters.allocatedBytes, bytes);
 	}
 
 	return malloc(bytes);
@@ -35,43 +434,552 @@ void* __malloc(size_t bytes)
 
 namespace profile
 {
-	// Обнуляем счётчик байт и устанавливаем флаг для начала счёта.
+	// Запоминаем счётчики на начало замера и начинаем считать живую память с нуля.
 	void StartMemoryProfiling()
 	{
-		CapturedMemory = 0;
+		RegionLive = 0;
+		RegionPeak = 0;
+
+		RegionStart = SumCounters();
+
 		ShouldCaptureMemory = true;
 	}
 
-	// Устанавливаем флаг для конца счёта.
+	// Конец замера: разница счётчиков с началом, рост живой памяти и его пик.
 	void EndMemoryProfiling()
 	{
 		ShouldCaptureMemory = false;
+
+		counters_total_t end = SumCounters();
+
+		CapturedMemory.allocations = end.allocations - RegionStart.allocations;
+		CapturedMemory.frees = end.frees - RegionStart.frees;
+		CapturedMemory.allocatedBytes = end.allocatedBytes - RegionStart.allocatedBytes;
+		CapturedMemory.freedBytes = end.freedBytes - RegionStart.freedBytes;
+
+		CapturedMemory.liveBytes = RegionLive.load();
+		CapturedMemory.peakLiveBytes = static_cast<uint64_t>(std::max<int64_t>(RegionPeak.load(), 0));
 	}
 
 	// Получение запрофилированной памяти.
 	size_t GetProfiledMemory()
+	{
+		return static_cast<size_t>(CapturedMemory.allocatedBytes);
+	}
+
+	memory_profile_t GetMemoryProfile()
 	{
 		return CapturedMemory;
 	}
 
-	// Устанавливаем начальную точку времени, получая текущее время через high resolution clock.
-	void StartTimeProfiling()
+	/*
+		Дерево регионов одного потока. Узлы меняет только свой поток, а замок нужен, чтобы отчёт
+		можно было собрать из другого потока. Узлы не удаляются, поэтому Scope держит указатель на свой узел.
+	*/
+	struct region_node_t
+	{
+		const char* name;
+		region_node_t* parent;
+
+		std::vector<std::unique_ptr<region_node_t>> children;
+
+		uint64_t calls;
+
+		std::chrono::steady_clock::duration inclusiveTime;
+
+		// Сумма полного времени вложенных регионов, чтобы получить собственное время.
+		std::chrono::steady_clock::duration childTime;
+
+		uint64_t allocations;
+		uint64_t frees;
+		uint64_t allocatedBytes;
+		uint64_t freedBytes;
+		uint64_t peakLiveBytes;
+
+		hw_counters_t hw;
+		uint64_t items;
+	};
+
+	struct region_thread_t
+	{
+		region_node_t root;
+
+		// Самый вложенный активный регион потока (или root).
+		region_node_t* current;
+
+		std::mutex mutex;
+	};
+}
+
+static std::atomic<bool> HardwareCountersEnabled = false;
+
+static const char* const HW_COUNTER_NAMES[profile::HwCounter::COUNT] = {
+	"cycles", "instructions", "L1D misses", "LLC misses", "branch misses", "dTLB misses"
+};
+
+/*
+	Счётчики потока: по одному событию perf на счётчик, без группы, чтобы недоступное событие
+	не мешало остальным. Открываются при первом чтении в потоке и закрываются при его завершении.
+*/
+struct thread_hw_counters_t
+{
+	int fds[profile::HwCounter::COUNT];
+	bool opened;
+
+	thread_hw_counters_t() : opened(false)
+	{
+		std::fill(std::begin(fds), std::end(fds), -1);
+	}
+
+	~thread_hw_counters_t()
+	{
+#ifdef __linux__
+		for (int fd : fds)
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+		}
+#endif
+	}
+
+	void Open()
+	{
+		opened = true;
+
+#ifdef __linux__
+		// Тип и номер события для каждого счётчика в порядке HwCounter.
+		static const uint32_t TYPES[profile::HwCounter::COUNT] = {
+			PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+		};
+
+		static const uint64_t CONFIGS[profile::HwCounter::COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES,
+			PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+		};
+
+		for (profile::hwcounter_t counter = 0; counter < profile::HwCounter::COUNT; counter++)
+		{
+			perf_event_attr attributes = {};
+			attributes.size = sizeof(attributes);
+			attributes.type = TYPES[counter];
+			attributes.config = CONFIGS[counter];
+			attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			// Только пользовательский режим: так счётчики доступны и при perf_event_paranoid = 2.
+			attributes.exclude_kernel = 1;
+			attributes.exclude_hv = 1;
+
+			fds[counter] = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+		}
+#endif
+	}
+
+	void Read(profile::hw_counters_t& output)
+	{
+		output = {};
+
+		if (!opened)
+		{
+			Open();
+		}
+
+#ifdef __linux__
+		for (profile::hwcounter_t counter = 0; counter < profile::HwCounter::COUNT; counter++)
+		{
+			// Значение, время, когда событие было включено, и время, когда оно действительно считалось.
+			uint64_t data[3] = {};
+
+			if (fds[counter] < 0 || read(fds[counter], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)))
+			{
+				continue;
+			}
+
+			if (data[2] > 0 && data[2] < data[1])
+			{
+				data[0] = static_cast<uint64_t>(static_cast<double>(data[0]) * static_cast<double>(data[1]) / static_cast<double>(data[2]));
+			}
+
+			output.values[counter] = data[0];
+			output.availableMask |= 1u << counter;
+		}
+#endif
+	}
+};
+
+static thread_local thread_hw_counters_t ThreadHwCounters;
+
+// Разница счётчиков end - start. Доступны счётчики, прочитанные в обоих случаях.
+static profile::hw_counters_t SubtractCounters(const profile::hw_counters_t& end, const profile::hw_counters_t& start)
+{
+	profile::hw_counters_t result = {};
+	result.availableMask = end.availableMask & start.availableMask;
+
+	for (profile::hwcounter_t counter = 0; counter < profile::HwCounter::COUNT; counter++)
+	{
+		if (result.IsAvailable(counter))
+		{
+			result.values[counter] = end.values[counter] - start.values[counter];
+		}
+	}
+
+	return result;
+}
+
+// Добавление прохода к сумме. first - это первый проход в сумме, тогда набор счётчиков берётся из него.
+static void AccumulateCounters(profile::hw_counters_t& sum, const profile::hw_counters_t& pass, bool first)
+{
+	sum.availableMask = first ? pass.availableMask : (sum.availableMask & pass.availableMask);
+
+	for (profile::hwcounter_t counter = 0; counter < profile::HwCounter::COUNT; counter++)
+	{
+		sum.values[counter] += pass.values[counter];
+	}
+}
+
+/*
+	Деревья регионов всех потоков, когда-либо открывавших Scope. Дерево переживает свой поток,
+	чтобы в отчёт попали и регионы уже завершившихся потоков.
+*/
+static std::mutex RegionsMutex;
+static std::vector<std::unique_ptr<profile::region_thread_t>> RegionThreads;
+
+static thread_local profile::region_thread_t* ThreadRegions = nullptr;
+
+static void ResetNode(profile::region_node_t& node)
+{
+	node.calls = 0;
+	node.inclusiveTime = {};
+	node.childTime = {};
+	node.allocations = 0;
+	node.frees = 0;
+	node.allocatedBytes = 0;
+	node.freedBytes = 0;
+	node.peakLiveBytes = 0;
+	node.hw = {};
+	node.items = 0;
+
+	for (std::unique_ptr<profile::region_node_t>& child : node.children)
+	{
+		ResetNode(*child);
+	}
+}
+
+// Добавление узлов-потомков node (и их потомков) к потомкам report. Узлы сливаются по имени.
+static void MergeNode(profile::region_report_t& report, const profile::region_node_t& node)
+{
+	for (const std::unique_ptr<profile::region_node_t>& child : node.children)
+	{
+		size_t index = 0;
+
+		while (index < report.children.size() && std::strcmp(report.children[index].name, child->name) != 0)
+		{
+			index++;
+		}
+
+		if (index == report.children.size())
+		{
+			report.children.push_back({});
+			report.children.back().name = child->name;
+		}
+
+		profile::region_report_t& target = report.children[index];
+
+		std::chrono::steady_clock::duration exclusiveTime = std::max(child->inclusiveTime - child->childTime, std::chrono::steady_clock::duration::zero());
+
+		if (child->calls > 0)
+		{
+			AccumulateCounters(target.hw, child->hw, target.calls == 0);
+		}
+
+		target.calls += child->calls;
+		target.items += child->items;
+		target.inclusiveTime += std::chrono::duration_cast<std::chrono::microseconds>(child->inclusiveTime);
+		target.exclusiveTime += std::chrono::duration_cast<std::chrono::microseconds>(exclusiveTime);
+		target.allocations += child->allocations;
+		target.frees += child->frees;
+		target.allocatedBytes += child->allocatedBytes;
+		target.freedBytes += child->freedBytes;
+		target.peakLiveBytes = std::max(target.peakLiveBytes, child->peakLiveBytes);
+
+		MergeNode(target, *child);
+	}
+}
+
+static void PrintRegion(std::ostream& stream, const profile::region_report_t& region, size_t depth)
+{
+	for (const profile::region_report_t& child : region.children)
 	{
-		StartTime = std::chrono::high_resolution_clock::now();
+		for (size_t level = 0; level < depth; level++)
+		{
+			stream << '\t';
+		}
+
+		stream << child.name << ": " << child.calls << " calls, " << child.inclusiveTime.count() << " us total, "
+			<< child.exclusiveTime.count() << " us self, " << child.allocations << " allocations, " << child.frees << " frees, "
+			<< child.allocatedBytes << " bytes allocated, " << child.peakLiveBytes << " peak live bytes";
+
+		if (child.hw.availableMask != 0)
+		{
+			stream << ", ";
+
+			profile::PrintHardwareCounters(stream, child.hw, child.items);
+		}
+
+		stream << std::endl;
+
+		PrintRegion(stream, child, depth + 1);
 	}
+}
 
-	/* 
-		Отнимаем от текущего времени начальную точку, таким образом получая разницу 
-		во времени между вызовами StartTimeProfiling и EndTimeProfiling
+namespace profile
+{
+	/*
+		Вход в регион. Узел ищется (или создаётся) до снимка счётчиков, чтобы память самого профиля
+		не попала в регион (в объемлющий регион попадает только первое создание узла). Пик живой памяти потока сбрасывается на текущее значение, а пик внешнего
+		региона запоминается и восстанавливается в End - так вложенные регионы не портят пики друг друга.
 	*/
-	void EndTimeProfiling()
+	Scope::Scope(const char* name) : mHwStart(), mTime(), mMemory(), mHw(), mItems(0), mActive(true)
+	{
+		if (ThreadRegions == nullptr)
+		{
+			std::unique_ptr<region_thread_t> thread = std::make_unique<region_thread_t>();
+			thread->root = {};
+			thread->current = &thread->root;
+
+			ThreadRegions = thread.get();
+
+			std::lock_guard<std::mutex> lock(RegionsMutex);
+			RegionThreads.push_back(std::move(thread));
+		}
+
+		mThread = ThreadRegions;
+
+		{
+			std::lock_guard<std::mutex> lock(mThread->mutex);
+
+			region_node_t* parent = mThread->current;
+			mNode = nullptr;
+
+			for (std::unique_ptr<region_node_t>& child : parent->children)
+			{
+				if (std::strcmp(child->name, name) == 0)
+				{
+					mNode = child.get();
+
+					break;
+				}
+			}
+
+			if (mNode == nullptr)
+			{
+				parent->children.push_back(std::make_unique<region_node_t>());
+
+				mNode = parent->children.back().get();
+				*mNode = {};
+				mNode->name = name;
+				mNode->parent = parent;
+			}
+
+			mThread->current = mNode;
+		}
+
+		thread_counters_t& counters = ThreadCounters.counters;
+
+		mMemoryStart = {};
+		mMemoryStart.allocations = counters.allocations.load(std::memory_order_relaxed);
+		mMemoryStart.frees = counters.frees.load(std::memory_order_relaxed);
+		mMemoryStart.allocatedBytes = counters.allocatedBytes.load(std::memory_order_relaxed);
+		mMemoryStart.freedBytes = counters.freedBytes.load(std::memory_order_relaxed);
+		mMemoryStart.liveBytes = counters.live;
+
+		mOuterPeak = counters.peakLive;
+		counters.peakLive = counters.live;
+
+		if (HardwareCountersEnabled.load(std::memory_order_relaxed))
+		{
+			ThreadHwCounters.Read(mHwStart);
+		}
+
+		mStart = std::chrono::steady_clock::now();
+	}
+
+	Scope::~Scope()
+	{
+		End();
+	}
+
+	// Регионы одного потока должны завершаться в обратном порядке входа.
+	void Scope::End()
+	{
+		if (!mActive)
+		{
+			return;
+		}
+
+		mTime = std::chrono::steady_clock::now() - mStart;
+
+		if (mHwStart.availableMask != 0)
+		{
+			hw_counters_t end = {};
+			ThreadHwCounters.Read(end);
+
+			mHw = SubtractCounters(end, mHwStart);
+		}
+
+		thread_counters_t& counters = ThreadCounters.counters;
+
+		mMemory.allocations = counters.allocations.load(std::memory_order_relaxed) - mMemoryStart.allocations;
+		mMemory.frees = counters.frees.load(std::memory_order_relaxed) - mMemoryStart.frees;
+		mMemory.allocatedBytes = counters.allocatedBytes.load(std::memory_order_relaxed) - mMemoryStart.allocatedBytes;
+		mMemory.freedBytes = counters.freedBytes.load(std::memory_order_relaxed) - mMemoryStart.freedBytes;
+		mMemory.liveBytes = counters.live - mMemoryStart.liveBytes;
+		mMemory.peakLiveBytes = static_cast<uint64_t>(std::max<int64_t>(counters.peakLive - mMemoryStart.liveBytes, 0));
+
+		counters.peakLive = std::max(mOuterPeak, counters.peakLive);
+
+		std::lock_guard<std::mutex> lock(mThread->mutex);
+
+		AccumulateCounters(mNode->hw, mHw, mNode->calls == 0);
+
+		mNode->calls++;
+		mNode->items += mItems;
+		mNode->inclusiveTime += mTime;
+		mNode->allocations += mMemory.allocations;
+		mNode->frees += mMemory.frees;
+		mNode->allocatedBytes += mMemory.allocatedBytes;
+		mNode->freedBytes += mMemory.freedBytes;
+		mNode->peakLiveBytes = std::max(mNode->peakLiveBytes, mMemory.peakLiveBytes);
+
+		mNode->parent->childTime += mTime;
+
+		mThread->current = mNode->parent;
+
+		mActive = false;
+	}
+
+	bool Scope::IsActive() const
+	{
+		return mActive;
+	}
+
+	void Scope::AddItems(uint64_t count)
 	{
-		CapturedTime = std::chrono::high_resolution_clock::now() - StartTime;
+		mItems += count;
 	}
 
-	// Получение запрофилированного времени. Здесь происходит каст к микросекундам.
-	std::chrono::microseconds GetProfiledTime()
+	std::chrono::microseconds Scope::GetTime() const
 	{
-		return std::chrono::duration_cast<std::chrono::microseconds>(CapturedTime);
+		return std::chrono::duration_cast<std::chrono::microseconds>(mTime);
+	}
+
+	const memory_profile_t& Scope::GetMemory() const
+	{
+		return mMemory;
+	}
+
+	const hw_counters_t& Scope::GetHardwareCounters() const
+	{
+		return mHw;
+	}
+
+	uint64_t Scope::GetItems() const
+	{
+		return mItems;
+	}
+
+	// Счётчики открываются в вызывающем потоке сразу, чтобы узнать, доступны ли они вообще.
+	bool EnableHardwareCounters()
+	{
+		hw_counters_t probe = {};
+		ThreadHwCounters.Read(probe);
+
+		if (probe.availableMask == 0)
+		{
+			return false;
+		}
+
+		HardwareCountersEnabled = true;
+
+		return true;
+	}
+
+	bool AreHardwareCountersEnabled()
+	{
+		return HardwareCountersEnabled;
+	}
+
+	const char* GetHardwareCounterName(hwcounter_t counter)
+	{
+		return counter < HwCounter::COUNT ? HW_COUNTER_NAMES[counter] : "unknown";
+	}
+
+	void PrintHardwareCounters(std::ostream& stream, const hw_counters_t& counters, uint64_t items)
+	{
+		bool first = true;
+
+		for (hwcounter_t counter = 0; counter < HwCounter::COUNT; counter++)
+		{
+			if (!counters.IsAvailable(counter))
+			{
+				continue;
+			}
+
+			if (!first)
+			{
+				stream << ", ";
+			}
+
+			first = false;
+
+			stream << counters.values[counter] << " " << GetHardwareCounterName(counter);
+
+			if (counter == HwCounter::INSTRUCTIONS && counters.IsAvailable(HwCounter::CYCLES))
+			{
+				stream << " (" << counters.GetIpc() << " IPC)";
+			}
+			else if (counter != HwCounter::CYCLES && counter != HwCounter::INSTRUCTIONS && items > 0)
+			{
+				stream << " (" << static_cast<double>(counters.values[counter]) / static_cast<double>(items) << " per item)";
+			}
+		}
+	}
+
+	region_report_t GetRegionReport()
+	{
+		region_report_t report = {};
+
+		std::lock_guard<std::mutex> lock(RegionsMutex);
+
+		for (std::unique_ptr<region_thread_t>& thread : RegionThreads)
+		{
+			std::lock_guard<std::mutex> threadLock(thread->mutex);
+
+			MergeNode(report, thread->root);
+		}
+
+		return report;
+	}
+
+	void PrintRegionReport(std::ostream& stream)
+	{
+		PrintRegion(stream, GetRegionReport(), 0);
+	}
+
+	void ResetRegions()
+	{
+		std::lock_guard<std::mutex> lock(RegionsMutex);
+
+		for (std::unique_ptr<region_thread_t>& thread : RegionThreads)
+		{
+			std::lock_guard<std::mutex> threadLock(thread->mutex);
+
+			ResetNode(thread->root);
+		}
 	}
 }
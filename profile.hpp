@@ -1,29 +1,219 @@
 ﻿#pragma once
 
+#include <cstdint>
 #include <cstdlib>
+#include <new>
 
 #include <chrono>
+#include <ostream>
+#include <vector>
 
-// Перегружаем оператор new. Таким образом мы сможем отследить использование памяти в нашем коде.
+/*
+	Перегружаем все варианты операторов new и delete (обычные, с размером, с выравниванием и nothrow).
+	Так мы отслеживаем и выделения, и освобождения памяти во всём коде, в том числе в других потоках.
+*/
 void* operator new(size_t bytes);
+void* operator new[](size_t bytes);
+void* operator new(size_t bytes, const std::nothrow_t&) noexcept;
+void* operator new[](size_t bytes, const std::nothrow_t&) noexcept;
+void* operator new(size_t bytes, std::align_val_t alignment);
+void* operator new[](size_t bytes, std::align_val_t alignment);
+void* operator new(size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept;
+void* operator new[](size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept;
 
-// Так же перенаправляем вызовы malloc на нашу имплементацию.
+void operator delete(void* pointer) noexcept;
+void operator delete[](void* pointer) noexcept;
+void operator delete(void* pointer, size_t bytes) noexcept;
+void operator delete[](void* pointer, size_t bytes) noexcept;
+void operator delete(void* pointer, const std::nothrow_t&) noexcept;
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept;
+void operator delete(void* pointer, std::align_val_t alignment) noexcept;
+void operator delete[](void* pointer, std::align_val_t alignment) noexcept;
+void operator delete(void* pointer, size_t bytes, std::align_val_t alignment) noexcept;
+void operator delete[](void* pointer, size_t bytes, std::align_val_t alignment) noexcept;
+void operator delete(void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept;
+void operator delete[](void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept;
+
+// Так же перенаправляем вызовы malloc на нашу имплементацию. free не перехватывается, поэтому такие блоки не попадают в живые байты.
 void* __malloc(size_t bytes);
 #define malloc __malloc
 
 namespace profile
 {
+	// Результат замера памяти между StartMemoryProfiling и EndMemoryProfiling во всех потоках.
+	struct memory_profile_t
+	{
+		// Количество выделений и освобождений.
+		uint64_t allocations;
+		uint64_t frees;
+
+		// Запрошено и освобождено байт всего.
+		uint64_t allocatedBytes;
+		uint64_t freedBytes;
+
+		// На сколько байт выросла живая (выделенная и не освобождённая) память к концу замера. Может быть отрицательным.
+		int64_t liveBytes;
+
+		// Наибольший рост живой памяти относительно начала замера в любой момент замера.
+		uint64_t peakLiveBytes;
+	};
+
 	// Функции профилирования памяти.
 
 	void StartMemoryProfiling();
 	void EndMemoryProfiling();
 
+	// Запрошено байт за замер (memory_profile_t::allocatedBytes).
 	size_t GetProfiledMemory();
 
-	// Функции профилирования времени.
+	memory_profile_t GetMemoryProfile();
+
+	/*
+		Аппаратные счётчики процессора (perf_event_open, только Linux). Они открываются для каждого потока отдельно
+		и считают только его и только в пользовательском режиме. Если событие не поддерживается процессором или
+		его запрещает perf_event_paranoid (а в виртуальных машинах их часто нет вовсе), счётчик просто недоступен:
+		его бит в availableMask не установлен, а всё остальное профилирование работает как обычно.
+	*/
+	typedef uint8_t hwcounter_t;
+
+	namespace HwCounter
+	{
+		constexpr hwcounter_t CYCLES = 0;
+		constexpr hwcounter_t INSTRUCTIONS = 1;
+		constexpr hwcounter_t L1D_MISSES = 2;
+		constexpr hwcounter_t LLC_MISSES = 3;
+		constexpr hwcounter_t BRANCH_MISSES = 4;
+		constexpr hwcounter_t DTLB_MISSES = 5;
+
+		constexpr hwcounter_t COUNT = 6;
+	}
+
+	struct hw_counters_t
+	{
+		// Значения, пересчитанные на всё время региона, если ядро делило счётчики между событиями (мультиплексирование).
+		uint64_t values[HwCounter::COUNT];
+
+		// Бит (1 << счётчик) на каждый счётчик, который удалось прочитать.
+		uint32_t availableMask;
+
+		bool IsAvailable(hwcounter_t counter) const
+		{
+			return (availableMask & (1u << counter)) != 0;
+		}
+
+		// Инструкций за такт или 0, если циклы или инструкции недоступны.
+		double GetIpc() const
+		{
+			if (!IsAvailable(HwCounter::CYCLES) || !IsAvailable(HwCounter::INSTRUCTIONS) || values[HwCounter::CYCLES] == 0)
+			{
+				return 0.0;
+			}
+
+			return static_cast<double>(values[HwCounter::INSTRUCTIONS]) / static_cast<double>(values[HwCounter::CYCLES]);
+		}
+	};
+
+	/*
+		Включение счётчиков для всех регионов (Scope) во всех потоках. Возвращает false, если в вызывающем потоке
+		не открылся ни один счётчик: тогда регионы их не читают. Чтение счётчиков - системный вызов на каждый
+		счётчик при входе и выходе из региона, поэтому регионы с ними должны быть крупными.
+	*/
+	bool EnableHardwareCounters();
+	bool AreHardwareCountersEnabled();
+
+	// Имя счётчика для вывода ("cycles", "L1D misses" и т.д.).
+	const char* GetHardwareCounterName(hwcounter_t counter);
+
+	// Вывод доступных счётчиков через запятую: значение, IPC у инструкций и, если items > 0, промахи на один элемент.
+	void PrintHardwareCounters(std::ostream& stream, const hw_counters_t& counters, uint64_t items);
+
+	/*
+		Регионы профиля. Scope - именованный регион от конструктора до деструктора (или до End). Регионы вкладываются
+		друг в друга и складываются в дерево вызовов отдельно в каждом потоке: повторный вход в регион с тем же именем
+		под тем же родителем попадает в тот же узел. В узле копятся количество вызовов, полное время (inclusive),
+		собственное время без вложенных регионов (exclusive), память, выделенная и освобождённая своим потоком,
+		и аппаратные счётчики своего потока, если они включены (EnableHardwareCounters).
+
+		GetRegionReport сливает деревья всех потоков по путям из имён. Регионы, открытые в потоках пула,
+		попадают в корень отчёта, а не под регион, из которого запущена задача.
+	*/
+	struct region_node_t;
+	struct region_thread_t;
+
+	class Scope
+	{
+	public:
+		// name должен жить, пока жив профиль (обычно это строковый литерал).
+		explicit Scope(const char* name);
+		~Scope();
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+		// Завершение региона до конца области видимости. Повторный вызов ничего не делает.
+		void End();
+
+		bool IsActive() const;
+
+		// Количество обработанных регионом элементов (например, лепестков), чтобы отчёт считал счётчики на элемент.
+		void AddItems(uint64_t count);
+
+		// Время, память и аппаратные счётчики (только своего потока) этого прохода региона. Имеют смысл после End.
+		std::chrono::microseconds GetTime() const;
+		const memory_profile_t& GetMemory() const;
+		const hw_counters_t& GetHardwareCounters() const;
+		uint64_t GetItems() const;
+	private:
+		region_thread_t* mThread;
+		region_node_t* mNode;
+
+		std::chrono::steady_clock::time_point mStart;
+
+		// Счётчики потока на входе в регион и пик живой памяти внешнего региона, который восстанавливается на выходе.
+		memory_profile_t mMemoryStart;
+		int64_t mOuterPeak;
+
+		hw_counters_t mHwStart;
+
+		std::chrono::steady_clock::duration mTime;
+		memory_profile_t mMemory;
+		hw_counters_t mHw;
+		uint64_t mItems;
+
+		bool mActive;
+	};
+
+	// Узел отчёта: регион и сумма всех его проходов во всех потоках.
+	struct region_report_t
+	{
+		const char* name;
+
+		uint64_t calls;
+
+		std::chrono::microseconds inclusiveTime;
+		std::chrono::microseconds exclusiveTime;
+
+		uint64_t allocations;
+		uint64_t frees;
+		uint64_t allocatedBytes;
+		uint64_t freedBytes;
+
+		// Наибольший за один проход рост живой памяти своего потока.
+		uint64_t peakLiveBytes;
+
+		// Сумма счётчиков по проходам; доступны те, что были доступны во всех проходах.
+		hw_counters_t hw;
+		uint64_t items;
+
+		std::vector<region_report_t> children;
+	};
+
+	// Отчёт по всем регионам. Корень отчёта безымянный (name == nullptr), регионы верхнего уровня - его потомки.
+	region_report_t GetRegionReport();
 
-	void StartTimeProfiling();
-	void EndTimeProfiling();
+	// Вывод отчёта с отступом табуляцией на каждый уровень вложенности.
+	void PrintRegionReport(std::ostream& stream);
 
-	std::chrono::microseconds GetProfiledTime();
+	// Обнуление накопленных значений всех регионов. Активные регионы продолжают считаться.
+	void ResetRegions();
 }
@@ -0,0 +1,119 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <utility>
+
+/*
+	Ограниченная очередь без блокировок для одного производителя и одного потребителя (SPSC).
+
+	Производитель двигает только mTail, потребитель - только mHead, поэтому обоим хватает пары атомарных
+	чтений и записей с acquire/release, без мьютексов и CAS. Счётчики лежат в разных строках кэша, чтобы
+	потоки не мешали друг другу. Когда очередь полна, Push ждёт потребителя - так медленный этап сдерживает быстрый.
+
+	Ожидание - это std::this_thread::yield(), а не сон: этапы конвейера обмениваются крупными блоками,
+	и ждать обычно приходится недолго.
+*/
+template<typename T>
+class SpscRing
+{
+private:
+	std::unique_ptr<T[]> mItems;
+	size_t mMask;
+
+	// Номер следующего элемента для Pop и для Push. Растут неограниченно, индекс в mItems - по маске.
+	alignas(64) std::atomic<size_t> mHead;
+	alignas(64) std::atomic<size_t> mTail;
+
+	// После Close новых элементов не будет, и Pop на пустой очереди возвращает false.
+	alignas(64) std::atomic<bool> mClosed;
+public:
+	// Вместимость округляется вверх до степени двойки.
+	explicit SpscRing(size_t capacity)
+	{
+		capacity = std::bit_ceil(std::max<size_t>(capacity, 1));
+
+		mItems = std::make_unique<T[]>(capacity);
+		mMask = capacity - 1;
+
+		mHead = 0;
+		mTail = 0;
+		mClosed = false;
+	}
+
+	SpscRing(const SpscRing<T>&) = delete;
+	SpscRing<T>& operator=(const SpscRing<T>&) = delete;
+public:
+	size_t GetCapacity() const
+	{
+		return mMask + 1;
+	}
+
+	// Вызывается только производителем. Перемещает item в очередь, если в ней есть место.
+	bool TryPush(T& item)
+	{
+		size_t tail = mTail.load(std::memory_order_relaxed);
+
+		if (tail - mHead.load(std::memory_order_acquire) > mMask)
+		{
+			return false;
+		}
+
+		mItems[tail & mMask] = std::move(item);
+		mTail.store(tail + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Вызывается только потребителем. Перемещает первый элемент в item, если очередь не пуста.
+	bool TryPop(T& item)
+	{
+		size_t head = mHead.load(std::memory_order_relaxed);
+
+		if (head == mTail.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+
+		item = std::move(mItems[head & mMask]);
+		mHead.store(head + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Push с ожиданием места.
+	void Push(T item)
+	{
+		while (!TryPush(item))
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	// Pop с ожиданием элемента. Возвращает false, только если очередь закрыта и пуста.
+	bool Pop(T& item)
+	{
+		while (!TryPop(item))
+		{
+			// Close виден только после всех Push производителя, поэтому после него достаточно проверить очередь ещё раз.
+			if (mClosed.load(std::memory_order_acquire))
+			{
+				return TryPop(item);
+			}
+
+			std::this_thread::yield();
+		}
+
+		return true;
+	}
+
+	// Вызывается производителем после последнего Push.
+	void Close()
+	{
+		mClosed.store(true, std::memory_order_release);
+	}
+};
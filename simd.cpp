@@ -0,0 +1,390 @@
+﻿#include "simd.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC разрешает интринсики любого набора без флагов, а GCC и Clang - только в функциях с нужным target.
+#if defined(SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_TARGET_SSE2 __attribute__((target("sse2")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SIMD_TARGET_SSE2
+#define SIMD_TARGET_AVX2
+#endif
+
+// Текущий набор инструкций. Определяется при первом обращении.
+static std::atomic<simdlevel_t>& GetCurrentLevel()
+{
+	static std::atomic<simdlevel_t> level(simd::GetSupportedLevel());
+
+	return level;
+}
+
+simdlevel_t simd::GetSupportedLevel()
+{
+#if defined(SIMD_X86) && defined(_MSC_VER)
+	int info[4] = {};
+
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	bool avx2 = false;
+
+	// AVX2 нужна ещё и поддержка ОС: она должна сохранять регистры ymm при переключении потоков.
+	if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+
+	if (avx2)
+	{
+		return SimdLevel::AVX2;
+	}
+
+	return sse2 ? SimdLevel::SSE2 : SimdLevel::SCALAR;
+#elif defined(SIMD_X86)
+	// __builtin_cpu_supports сам проверяет и поддержку ОС.
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return SimdLevel::AVX2;
+	}
+
+	return __builtin_cpu_supports("sse2") ? SimdLevel::SSE2 : SimdLevel::SCALAR;
+#else
+	return SimdLevel::SCALAR;
+#endif
+}
+
+simdlevel_t simd::GetLevel()
+{
+	return GetCurrentLevel().load(std::memory_order_relaxed);
+}
+
+void simd::SetLevel(simdlevel_t level)
+{
+	GetCurrentLevel().store(std::min(level, GetSupportedLevel()), std::memory_order_relaxed);
+}
+
+const char* simd::GetLevelName(simdlevel_t level)
+{
+	switch (level)
+	{
+	case SimdLevel::AVX2:
+		return "AVX2";
+	case SimdLevel::SSE2:
+		return "SSE2";
+	default:
+		return "scalar";
+	}
+}
+
+/*
+	Скалярные варианты. Они же дообрабатывают хвосты, которые не заполняют целый вектор.
+*/
+
+static void AddChildPairsScalar(double* parents, const double* children, size_t first, size_t count)
+{
+	for (size_t index = first; index < count; index++)
+	{
+		parents[index] += (children[2 * index] + children[2 * index + 1]);
+	}
+}
+
+static void DivideRatiosScalar(double* sums, const double* counts, size_t first, size_t count)
+{
+	for (size_t index = first; index < count; index++)
+	{
+		sums[index] /= std::max(1.0, counts[index] - 1.0);
+	}
+}
+
+// Первый индекс экстремума. Max выбирает между максимумом и минимумом.
+template<bool Max>
+static size_t FindFirstScalar(const double* values, size_t count)
+{
+	size_t holder = 0;
+
+	for (size_t index = 1; index < count; index++)
+	{
+		if (Max ? (values[index] > values[holder]) : (values[index] < values[holder]))
+		{
+			holder = index;
+		}
+	}
+
+	return holder;
+}
+
+// Первый индекс, начиная с first, где лежит value. Значение точно есть в массиве.
+static size_t FindFirstEqualScalar(const double* values, size_t first, size_t count, double value)
+{
+	for (size_t index = first; index < count; index++)
+	{
+		if (values[index] == value)
+		{
+			return index;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef SIMD_X86
+/*
+	SSE2: по 2 числа за раз.
+
+	Поиск экстремума идёт в два прохода: сначала векторно ищется само значение, затем векторным сравнением -
+	его первое вхождение. Так результат совпадает со скалярным, при котором при равенстве побеждает меньший индекс.
+*/
+
+SIMD_TARGET_SSE2 static void AddChildPairsSSE2(double* parents, const double* children, size_t count)
+{
+	size_t index = 0;
+
+	for (; index + 2 <= count; index += 2)
+	{
+		__m128d a = _mm_loadu_pd(children + 2 * index);
+		__m128d b = _mm_loadu_pd(children + 2 * index + 2);
+
+		// [a0 + a1, b0 + b1] - суммы пар для родителей index и index + 1.
+		__m128d pairs = _mm_add_pd(_mm_unpacklo_pd(a, b), _mm_unpackhi_pd(a, b));
+
+		_mm_storeu_pd(parents + index, _mm_add_pd(_mm_loadu_pd(parents + index), pairs));
+	}
+
+	AddChildPairsScalar(parents, children, index, count);
+}
+
+SIMD_TARGET_SSE2 static void DivideRatiosSSE2(double* sums, const double* counts, size_t count)
+{
+	const __m128d one = _mm_set1_pd(1.0);
+
+	size_t index = 0;
+
+	for (; index + 2 <= count; index += 2)
+	{
+		__m128d children = _mm_max_pd(_mm_sub_pd(_mm_loadu_pd(counts + index), one), one);
+
+		_mm_storeu_pd(sums + index, _mm_div_pd(_mm_loadu_pd(sums + index), children));
+	}
+
+	DivideRatiosScalar(sums, counts, index, count);
+}
+
+template<bool Max>
+SIMD_TARGET_SSE2 static size_t FindFirstSSE2(const double* values, size_t count)
+{
+	if (count < 2)
+	{
+		return 0;
+	}
+
+	__m128d extremum = _mm_loadu_pd(values);
+
+	size_t index = 2;
+
+	for (; index + 2 <= count; index += 2)
+	{
+		__m128d next = _mm_loadu_pd(values + index);
+
+		extremum = Max ? _mm_max_pd(extremum, next) : _mm_min_pd(extremum, next);
+	}
+
+	double lanes[2];
+	_mm_storeu_pd(lanes, extremum);
+
+	double value = Max ? std::max(lanes[0], lanes[1]) : std::min(lanes[0], lanes[1]);
+
+	for (; index < count; index++)
+	{
+		value = Max ? std::max(value, values[index]) : std::min(value, values[index]);
+	}
+
+	const __m128d target = _mm_set1_pd(value);
+
+	for (index = 0; index + 2 <= count; index += 2)
+	{
+		int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(values + index), target));
+
+		if (mask != 0)
+		{
+			return index + std::countr_zero(static_cast<unsigned int>(mask));
+		}
+	}
+
+	return FindFirstEqualScalar(values, index, count, value);
+}
+
+/*
+	AVX2: по 4 числа за раз.
+*/
+
+SIMD_TARGET_AVX2 static void AddChildPairsAVX2(double* parents, const double* children, size_t count)
+{
+	size_t index = 0;
+
+	for (; index + 4 <= count; index += 4)
+	{
+		__m256d a = _mm256_loadu_pd(children + 2 * index);
+		__m256d b = _mm256_loadu_pd(children + 2 * index + 4);
+
+		// hadd даёт [a0 + a1, b0 + b1, a2 + a3, b2 + b3], перестановка возвращает суммы пар в порядок родителей.
+		__m256d pairs = _mm256_permute4x64_pd(_mm256_hadd_pd(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+
+		_mm256_storeu_pd(parents + index, _mm256_add_pd(_mm256_loadu_pd(parents + index), pairs));
+	}
+
+	AddChildPairsScalar(parents, children, index, count);
+}
+
+SIMD_TARGET_AVX2 static void DivideRatiosAVX2(double* sums, const double* counts, size_t count)
+{
+	const __m256d one = _mm256_set1_pd(1.0);
+
+	size_t index = 0;
+
+	for (; index + 4 <= count; index += 4)
+	{
+		__m256d children = _mm256_max_pd(_mm256_sub_pd(_mm256_loadu_pd(counts + index), one), one);
+
+		_mm256_storeu_pd(sums + index, _mm256_div_pd(_mm256_loadu_pd(sums + index), children));
+	}
+
+	DivideRatiosScalar(sums, counts, index, count);
+}
+
+template<bool Max>
+SIMD_TARGET_AVX2 static size_t FindFirstAVX2(const double* values, size_t count)
+{
+	if (count < 4)
+	{
+		return FindFirstScalar<Max>(values, count);
+	}
+
+	__m256d extremum = _mm256_loadu_pd(values);
+
+	size_t index = 4;
+
+	for (; index + 4 <= count; index += 4)
+	{
+		__m256d next = _mm256_loadu_pd(values + index);
+
+		extremum = Max ? _mm256_max_pd(extremum, next) : _mm256_min_pd(extremum, next);
+	}
+
+	double lanes[4];
+	_mm256_storeu_pd(lanes, extremum);
+
+	double value = lanes[0];
+
+	for (size_t lane = 1; lane < 4; lane++)
+	{
+		value = Max ? std::max(value, lanes[lane]) : std::min(value, lanes[lane]);
+	}
+
+	for (; index < count; index++)
+	{
+		value = Max ? std::max(value, values[index]) : std::min(value, values[index]);
+	}
+
+	const __m256d target = _mm256_set1_pd(value);
+
+	for (index = 0; index + 4 <= count; index += 4)
+	{
+		int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(values + index), target, _CMP_EQ_OQ));
+
+		if (mask != 0)
+		{
+			return index + std::countr_zero(static_cast<unsigned int>(mask));
+		}
+	}
+
+	return FindFirstEqualScalar(values, index, count, value);
+}
+#endif
+
+/*
+	Выбор варианта по текущему набору инструкций.
+*/
+
+void simd::AddChildPairs(double* parents, const double* children, size_t count)
+{
+#ifdef SIMD_X86
+	switch (GetLevel())
+	{
+	case SimdLevel::AVX2:
+		AddChildPairsAVX2(parents, children, count);
+		return;
+	case SimdLevel::SSE2:
+		AddChildPairsSSE2(parents, children, count);
+		return;
+	}
+#endif
+
+	AddChildPairsScalar(parents, children, 0, count);
+}
+
+void simd::DivideRatios(double* sums, const double* counts, size_t count)
+{
+#ifdef SIMD_X86
+	switch (GetLevel())
+	{
+	case SimdLevel::AVX2:
+		DivideRatiosAVX2(sums, counts, count);
+		return;
+	case SimdLevel::SSE2:
+		DivideRatiosSSE2(sums, counts, count);
+		return;
+	}
+#endif
+
+	DivideRatiosScalar(sums, counts, 0, count);
+}
+
+size_t simd::FindFirstMin(const double* values, size_t count)
+{
+#ifdef SIMD_X86
+	switch (GetLevel())
+	{
+	case SimdLevel::AVX2:
+		return FindFirstAVX2<false>(values, count);
+	case SimdLevel::SSE2:
+		return FindFirstSSE2<false>(values, count);
+	}
+#endif
+
+	return FindFirstScalar<false>(values, count);
+}
+
+size_t simd::FindFirstMax(const double* values, size_t count)
+{
+#ifdef SIMD_X86
+	switch (GetLevel())
+	{
+	case SimdLevel::AVX2:
+		return FindFirstAVX2<true>(values, count);
+	case SimdLevel::SSE2:
+		return FindFirstSSE2<true>(values, count);
+	}
+#endif
+
+	return FindFirstScalar<true>(values, count);
+}
@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+	Векторные ядра для деревьев, хранящихся массивом по уровням (ImplicitBinaryTree).
+
+	Каждое ядро есть в трёх вариантах - AVX2, SSE2 и скалярном. Вариант выбирается во время исполнения
+	по возможностям процессора, поэтому один и тот же исполняемый файл работает на любом x86 и вне x86.
+*/
+typedef uint8_t simdlevel_t;
+namespace SimdLevel
+{
+	constexpr simdlevel_t SCALAR = 0;
+	constexpr simdlevel_t SSE2 = 1;
+	constexpr simdlevel_t AVX2 = 2;
+}
+
+namespace simd
+{
+	// Лучший набор инструкций, который поддерживают процессор и ОС.
+	simdlevel_t GetSupportedLevel();
+
+	// Набор инструкций, который сейчас используют ядра. По умолчанию - GetSupportedLevel().
+	simdlevel_t GetLevel();
+
+	// Принудительный выбор набора инструкций (например, для сравнения в бенчмарке). Выше поддерживаемого не поднимается.
+	void SetLevel(simdlevel_t level);
+
+	const char* GetLevelName(simdlevel_t level);
+
+	/*
+		Сложение пар потомков в родителей: parents[i] += children[2i] + children[2i + 1] для i < count.
+		Потомки родителей одного уровня лежат подряд, поэтому это последовательное чтение двух отрезков.
+	*/
+	void AddChildPairs(double* parents, const double* children, size_t count);
+
+	// Отношения поддеревьев на месте: sums[i] = sums[i] / max(1, counts[i] - 1).
+	void DivideRatios(double* sums, const double* counts, size_t count);
+
+	// Индекс первого минимального и первого максимального элемента. Для пустого массива возвращается 0.
+	size_t FindFirstMin(const double* values, size_t count);
+	size_t FindFirstMax(const double* values, size_t count);
+}
@@ -0,0 +1,32 @@
+﻿#include "textload.hpp"
+
+#include <algorithm>
+
+std::vector<textload::text_chunk_t> textload::SplitLines(const char* data, size_t size, size_t chunks, size_t minChunkSize)
+{
+	chunks = std::max<size_t>(1, std::min(chunks, size / std::max<size_t>(1, minChunkSize)));
+
+	std::vector<text_chunk_t> result = {};
+	result.reserve(chunks);
+
+	size_t begin = 0;
+
+	for (size_t index = 1; index <= chunks && begin < size; index++)
+	{
+		size_t end = size;
+
+		if (index < chunks)
+		{
+			// Конец куска сдвигается до ближайшего перевода строки, включая его.
+			end = std::max(begin, size / chunks * index);
+
+			const void* newline = std::memchr(data + end, '\n', size - end);
+			end = (newline != nullptr) ? static_cast<size_t>(static_cast<const char*>(newline) - data) + 1 : size;
+		}
+
+		result.push_back({ begin, end, 0, 0 });
+		begin = end;
+	}
+
+	return result;
+}
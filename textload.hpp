@@ -0,0 +1,193 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "checksum.hpp"
+#include "itree.hpp"
+#include "mapping.hpp"
+#include "parallel.hpp"
+#include "textparse.hpp"
+
+/*
+	Быстрая загрузка текстового формата (по одному значению на строку, как у BinaryLeaf::Serialize).
+
+	Файл отображается в память и делится на куски по границам строк. Загрузка идёт в два параллельных прохода:
+	сначала в каждом куске считаются строки со значениями, затем по префиксным суммам этих количеств каждый кусок
+	разбирает свои строки через std::from_chars прямо на своё место в общем массиве. Ни строк, ни std::function,
+	ни iostream здесь нет.
+
+	Значения в файле идут в порядке Walk, поэтому массив - это сразу ImplicitBinaryTree, а BinaryLeaf из него
+	связывается одним проходом по индексам (ImplicitBinaryTree::ToBinaryLeaf).
+*/
+namespace textload
+{
+	// Кусок текста [begin, end), количество строк со значениями в нём и CRC32C куска.
+	struct text_chunk_t
+	{
+		size_t begin;
+		size_t end;
+		size_t count;
+
+		uint32_t checksum;
+	};
+
+	/*
+		Разбиение текста на chunks кусков примерно равной длины. Каждый кусок, кроме последнего, заканчивается
+		сразу после перевода строки, так что строка никогда не попадает в два куска. Куски меньше minChunkSize
+		не делаются, поэтому короткий текст - это один кусок.
+	*/
+	std::vector<text_chunk_t> SplitLines(const char* data, size_t size, size_t chunks, size_t minChunkSize = 64 * 1024);
+
+	/*
+		Вызов visitor(begin, end) для каждой строки куска, в которой есть что-то кроме пробелов, табуляций и '\r'.
+		begin указывает на первый значимый символ, end - на конец строки без перевода строки и '\r'.
+		Если visitor вернул false, перебор прекращается и возвращается false.
+	*/
+	template<typename F>
+	bool ForEachLine(const char* data, const text_chunk_t& chunk, F&& visitor)
+	{
+		const char* cursor = data + chunk.begin;
+		const char* end = data + chunk.end;
+
+		while (cursor < end)
+		{
+			const char* lineEnd = static_cast<const char*>(std::memchr(cursor, '\n', static_cast<size_t>(end - cursor)));
+			if (lineEnd == nullptr)
+			{
+				lineEnd = end;
+			}
+
+			const char* first = cursor;
+			const char* last = lineEnd;
+
+			if (TrimLine(first, last) && !visitor(first, last))
+			{
+				return false;
+			}
+
+			cursor = lineEnd + 1;
+		}
+
+		return true;
+	}
+
+	/*
+		Разбор всех значений текста data длиной size байт в output. Кусков делается в несколько раз больше,
+		чем потоков в pool, чтобы перехват работы выравнивал неравные куски.
+		Если checksum не nullptr, туда записывается CRC32C всего текста: каждый кусок считает свою в первом проходе,
+		пока читает его, а затем суммы кусков склеиваются по порядку.
+		Возвращает false, если какое-то значение не разобралось; output при этом не определён.
+	*/
+	template<typename T>
+	bool ParseValues(const char* data, size_t size, std::vector<T>& output, WorkStealingPool& pool, uint32_t* checksum = nullptr)
+	{
+		static_assert(std::is_arithmetic_v<T>, "textload parses numeric values only");
+
+		std::vector<text_chunk_t> chunks = SplitLines(data, size, pool.GetThreadCount() * 4);
+
+		// Первый проход - количество значений в каждом куске.
+		pool.Run(chunks.size(), [&](size_t index) {
+			size_t count = 0;
+
+			ForEachLine(data, chunks[index], [&](const char*, const char*) {
+				count++;
+
+				return true;
+			});
+
+			chunks[index].count = count;
+
+			if (checksum != nullptr)
+			{
+				chunks[index].checksum = checksum::Crc32c(data + chunks[index].begin, chunks[index].end - chunks[index].begin);
+			}
+		});
+
+		// Префиксные суммы - место каждого куска в общем массиве.
+		std::vector<size_t> offsets(chunks.size() + 1, 0);
+
+		for (size_t index = 0; index < chunks.size(); index++)
+		{
+			offsets[index + 1] = offsets[index] + chunks[index].count;
+		}
+
+		if (checksum != nullptr)
+		{
+			*checksum = 0;
+
+			for (const text_chunk_t& chunk : chunks)
+			{
+				*checksum = checksum::Crc32cCombine(*checksum, chunk.checksum, chunk.end - chunk.begin);
+			}
+		}
+
+		output.resize(offsets.back());
+
+		// Второй проход - разбор. Куски пишут в непересекающиеся части массива.
+		std::vector<char> parsed(chunks.size(), 0);
+
+		pool.Run(chunks.size(), [&](size_t index) {
+			T* values = output.data() + offsets[index];
+
+			parsed[index] = ForEachLine(data, chunks[index], [&](const char* begin, const char* end) {
+				bool valid = ParseValue(begin, end, *values);
+				values++;
+
+				return valid;
+			});
+		});
+
+		return std::find(parsed.begin(), parsed.end(), 0) == parsed.end();
+	}
+
+	/*
+		Загрузка дерева из текстового файла path в output. Файл отображается в память только на время загрузки.
+		Возвращает false, если файл не открылся, какое-то значение не разобралось или строки контрольной суммы
+		не сошлись (см. CHECKSUM_HEADER): сумма не совпала или последней строки нет при первой. Тогда output не меняется.
+	*/
+	template<typename T>
+	bool Load(const char* path, ImplicitBinaryTree<T>& output, WorkStealingPool& pool)
+	{
+		MappedFile file;
+
+		if (!file.Open(path))
+		{
+			return false;
+		}
+
+		const char* data = reinterpret_cast<const char*>(file.GetData());
+
+		// Значения лежат между строками контрольной суммы, если они есть.
+		size_t headerSize = 0;
+		size_t textSize = file.GetSize();
+		uint32_t expected = 0;
+
+		bool header = FindChecksumHeader(data, file.GetSize(), headerSize);
+		bool footer = FindChecksumLine(data, file.GetSize(), textSize, expected);
+
+		if (header && !footer)
+		{
+			return false;
+		}
+
+		std::vector<T> values = {};
+		uint32_t crc = 0;
+
+		if (!ParseValues(data + headerSize, textSize - headerSize, values, pool, footer ? &crc : nullptr))
+		{
+			return false;
+		}
+
+		// Сумма в последней строке - от начала файла, вместе с первой строкой.
+		if (footer && checksum::Crc32cCombine(checksum::Crc32c(data, headerSize), crc, textSize - headerSize) != expected)
+		{
+			return false;
+		}
+
+		output = ImplicitBinaryTree<T>(std::move(values));
+
+		return true;
+	}
+}
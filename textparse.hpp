@@ -0,0 +1,216 @@
+﻿#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+/*
+	Разбор отдельных строк текстового формата. Вынесен из textload.hpp, чтобы им пользовался и конвейерный
+	загрузчик BinaryLeaf::Deserialize, который подключается из btree.hpp и не может подключать itree.hpp.
+*/
+namespace textload
+{
+	/*
+		Обрезка строки [first, last) без перевода строки: пробелы и табуляции в начале, пробелы, табуляции и '\r' в конце.
+		Возвращает false, если от строки ничего не осталось - такие строки, как и пустые, не содержат значений.
+	*/
+	inline bool TrimLine(const char*& first, const char*& last)
+	{
+		while (first < last && (*first == ' ' || *first == '\t'))
+		{
+			first++;
+		}
+
+		while (last > first && (last[-1] == '\r' || last[-1] == ' ' || last[-1] == '\t'))
+		{
+			last--;
+		}
+
+		return first < last;
+	}
+
+	/*
+		Разбор одного значения. Как и std::stoi, допускает знак '+' и игнорирует всё, что идёт после числа.
+		Возвращает false, если строка не начинается с числа или число не помещается в T.
+	*/
+	template<typename T>
+	bool ParseValue(const char* begin, const char* end, T& output)
+	{
+		if (*begin == '+')
+		{
+			begin++;
+		}
+
+		std::from_chars_result result = std::from_chars(begin, end, output);
+
+		return result.ec == std::errc();
+	}
+
+	/*
+		Контрольная сумма текстового формата. Файл, записанный Serialize, начинается строкой "#crc32c" и заканчивается
+		строкой "#crc32c " с CRC32C всего текста до неё (вместе с первой строкой) восемью шестнадцатеричными цифрами.
+		Их пишет BufferedWriter::WriteChecksumHeader и WriteChecksumLine.
+
+		Файлы без этих строк (записанные до них) загружаются как раньше, без проверки. Если же первая строка есть,
+		то последняя обязательна и должна совпасть: так обрезанный файл не загрузится молча как дерево поменьше.
+		После последней строки значений быть не должно.
+	*/
+	constexpr char CHECKSUM_HEADER[] = "#crc32c";
+	constexpr size_t CHECKSUM_HEADER_LENGTH = sizeof(CHECKSUM_HEADER) - 1;
+
+	constexpr char CHECKSUM_PREFIX[] = "#crc32c ";
+	constexpr size_t CHECKSUM_PREFIX_LENGTH = sizeof(CHECKSUM_PREFIX) - 1;
+	constexpr size_t CHECKSUM_DIGITS = 8;
+
+	// Вид обрезанной непустой строки текстового формата.
+	typedef uint8_t textline_t;
+
+	namespace TextLine
+	{
+		constexpr textline_t VALUE = 0;
+		constexpr textline_t HEADER = 1;
+		constexpr textline_t FOOTER = 2;
+
+		// Строка с '#', которая не является ни первой, ни последней строкой контрольной суммы.
+		constexpr textline_t INVALID = 3;
+	}
+
+	/*
+		Вид обрезанной строки [first, last). Значений, начинающихся с '#', не бывает, поэтому все такие строки служебные.
+		У последней строки контрольной суммы записанная в ней сумма возвращается по ссылке crc.
+	*/
+	inline textline_t ClassifyLine(const char* first, const char* last, uint32_t& crc)
+	{
+		if (first == last || *first != '#')
+		{
+			return TextLine::VALUE;
+		}
+
+		size_t length = static_cast<size_t>(last - first);
+
+		if (length == CHECKSUM_HEADER_LENGTH && std::memcmp(first, CHECKSUM_HEADER, CHECKSUM_HEADER_LENGTH) == 0)
+		{
+			return TextLine::HEADER;
+		}
+
+		if (length != CHECKSUM_PREFIX_LENGTH + CHECKSUM_DIGITS || std::memcmp(first, CHECKSUM_PREFIX, CHECKSUM_PREFIX_LENGTH) != 0)
+		{
+			return TextLine::INVALID;
+		}
+
+		std::from_chars_result result = std::from_chars(first + CHECKSUM_PREFIX_LENGTH, last, crc, 16);
+
+		return (result.ec == std::errc() && result.ptr == last) ? TextLine::FOOTER : TextLine::INVALID;
+	}
+
+	/*
+		Порядок строк контрольной суммы в потоке непустых строк. Next вызывается на каждую такую строку и возвращает false,
+		если строка здесь недопустима: первая строка не в начале, вторая последняя строка, что-то после последней
+		или неизвестная строка с '#'. Сверять саму сумму - дело загрузчика, только у него есть байты текста.
+	*/
+	class TextFrame
+	{
+	private:
+		bool mContent;
+		bool mHeader;
+		bool mFooter;
+	public:
+		TextFrame()
+		{
+			mContent = false;
+			mHeader = false;
+			mFooter = false;
+		}
+	public:
+		bool Next(textline_t line)
+		{
+			if (line == TextLine::INVALID || mFooter || (line == TextLine::HEADER && mContent))
+			{
+				return false;
+			}
+
+			mContent = true;
+			mHeader = mHeader || (line == TextLine::HEADER);
+			mFooter = (line == TextLine::FOOTER);
+
+			return true;
+		}
+
+		// Весь ли текст на месте: у файла с первой строкой контрольной суммы должна быть и последняя.
+		bool IsComplete() const
+		{
+			return !mHeader || mFooter;
+		}
+	};
+
+	/*
+		Поиск первой строки контрольной суммы в начале текста data длиной size. headerSize - длина текста
+		до следующей за ней строки. Возвращает false, если первая непустая строка - не строка "#crc32c".
+	*/
+	inline bool FindChecksumHeader(const char* data, size_t size, size_t& headerSize)
+	{
+		size_t begin = 0;
+
+		while (begin < size)
+		{
+			const char* lineEnd = static_cast<const char*>(std::memchr(data + begin, '\n', size - begin));
+			size_t end = (lineEnd != nullptr) ? static_cast<size_t>(lineEnd - data) : size;
+
+			const char* first = data + begin;
+			const char* last = data + end;
+
+			if (TrimLine(first, last))
+			{
+				uint32_t crc = 0;
+
+				if (ClassifyLine(first, last, crc) != TextLine::HEADER)
+				{
+					return false;
+				}
+
+				headerSize = (end < size) ? end + 1 : size;
+
+				return true;
+			}
+
+			begin = end + 1;
+		}
+
+		return false;
+	}
+
+	/*
+		Поиск последней строки контрольной суммы в конце текста data длиной size. textSize - длина текста до этой строки,
+		crc - записанная в ней сумма. Возвращает false, если последняя непустая строка - не строка контрольной суммы.
+	*/
+	inline bool FindChecksumLine(const char* data, size_t size, size_t& textSize, uint32_t& crc)
+	{
+		size_t end = size;
+
+		while (end > 0 && (data[end - 1] == '\n' || data[end - 1] == '\r' || data[end - 1] == ' ' || data[end - 1] == '\t'))
+		{
+			end--;
+		}
+
+		size_t begin = end;
+
+		while (begin > 0 && data[begin - 1] != '\n')
+		{
+			begin--;
+		}
+
+		const char* first = data + begin;
+		const char* last = data + end;
+
+		if (!TrimLine(first, last) || ClassifyLine(first, last, crc) != TextLine::FOOTER)
+		{
+			return false;
+		}
+
+		textSize = begin;
+
+		return true;
+	}
+}
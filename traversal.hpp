@@ -0,0 +1,254 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <ranges>
+#include <type_traits>
+#include <vector>
+
+// Объявление лепестка наперёд. Обход подключается из btree.hpp до объявления самого лепестка.
+template<typename T>
+class BinaryLeaf;
+
+/*
+	Порядки обхода для шаблонного BinaryLeaf::Walk и итераторов. Порядок задаётся на этапе компиляции, поэтому
+	для каждого порядка и каждого visitor'а компилятор генерирует отдельный цикл и может встроить visitor в него.
+*/
+namespace WalkOrder
+{
+	// По уровням, правый потомок раньше левого - так же, как обычный Walk.
+	struct BFS {};
+
+	// Лепесток, затем левое поддерево, затем правое.
+	struct PreOrder {};
+
+	// Левое поддерево, затем правое, затем лепесток.
+	struct PostOrder {};
+
+	// Левое поддерево, затем лепесток, затем правое.
+	struct InOrder {};
+}
+
+/*
+	Буфер обхода для итераторов. Хранит уже пройденную часть обхода и его состояние (для DFS - стек).
+
+	Обход продвигается лениво: следующий лепесток вычисляется только тогда, когда какой-нибудь итератор до него дошёл.
+	Итератор - это лишь указатель на буфер и номер лепестка в обходе, поэтому копии итераторов дешёвые
+	и независимы друг от друга, как и положено forward-итераторам.
+
+	Буфер можно и нужно переиспользовать: при повторном обходе память уже выделена, и обход ничего не аллоцирует.
+	Один буфер нельзя использовать одновременно для двух разных обходов.
+*/
+template<typename T, typename Order>
+class TraversalBuffer
+{
+	static_assert(std::is_same_v<Order, WalkOrder::BFS> || std::is_same_v<Order, WalkOrder::PreOrder>, "Only BFS and PreOrder iterators are supported");
+private:
+	// Лепестки в порядке обхода, до которых уже дошли итераторы. Для BFS это ещё и очередь обхода.
+	std::vector<BinaryLeaf<T>*> mSequence;
+
+	// Стек обхода в глубину. Для BFS не используется.
+	std::vector<BinaryLeaf<T>*> mStack;
+
+	// Для BFS: сколько лепестков из mSequence уже добавили своих потомков в очередь.
+	size_t mExpanded;
+public:
+	TraversalBuffer()
+	{
+		mExpanded = 0;
+	}
+
+	// Начало нового обхода с корня root. Выделенная память сохраняется.
+	void Reset(BinaryLeaf<T>* root)
+	{
+		mSequence.clear();
+		mStack.clear();
+
+		mExpanded = 0;
+
+		if (root == nullptr)
+		{
+			return;
+		}
+
+		if constexpr (std::is_same_v<Order, WalkOrder::BFS>)
+		{
+			mSequence.push_back(root);
+		}
+		else
+		{
+			mStack.push_back(root);
+		}
+	}
+
+	/*
+		Продвижение обхода так, чтобы лепесток под номером index был вычислен.
+		Возвращает false, если в обходе меньше лепестков.
+	*/
+	bool Produce(size_t index)
+	{
+		while (mSequence.size() <= index)
+		{
+			if constexpr (std::is_same_v<Order, WalkOrder::BFS>)
+			{
+				if (mExpanded >= mSequence.size())
+				{
+					return false;
+				}
+
+				BinaryLeaf<T>* leaf = mSequence[mExpanded];
+				mExpanded++;
+
+				if (leaf->mRight != nullptr)
+				{
+					mSequence.push_back(leaf->mRight);
+				}
+
+				if (leaf->mLeft != nullptr)
+				{
+					mSequence.push_back(leaf->mLeft);
+				}
+			}
+			else
+			{
+				if (mStack.size() == 0)
+				{
+					return false;
+				}
+
+				BinaryLeaf<T>* leaf = mStack.back();
+				mStack.pop_back();
+
+				// Правый кладётся первым, чтобы левое поддерево было снято со стека раньше.
+				if (leaf->mRight != nullptr)
+				{
+					mStack.push_back(leaf->mRight);
+				}
+
+				if (leaf->mLeft != nullptr)
+				{
+					mStack.push_back(leaf->mLeft);
+				}
+
+				mSequence.push_back(leaf);
+			}
+		}
+
+		return true;
+	}
+
+	BinaryLeaf<T>* Get(size_t index) const
+	{
+		return mSequence[index];
+	}
+};
+
+/*
+	Forward-итератор обхода. Разыменование даёт BinaryLeaf<T>*.
+	Конечный итератор - это итератор с номером END, он равен любому итератору, дошедшему до конца обхода.
+*/
+template<typename T, typename Order>
+class TraversalIterator
+{
+public:
+	using iterator_concept = std::forward_iterator_tag;
+	using iterator_category = std::input_iterator_tag;
+
+	using value_type = BinaryLeaf<T>*;
+	using difference_type = std::ptrdiff_t;
+	using reference = BinaryLeaf<T>*;
+
+	static constexpr size_t END = std::numeric_limits<size_t>::max();
+private:
+	TraversalBuffer<T, Order>* mBuffer;
+	size_t mIndex;
+public:
+	TraversalIterator()
+	{
+		mBuffer = nullptr;
+		mIndex = END;
+	}
+
+	TraversalIterator(TraversalBuffer<T, Order>* buffer, size_t index)
+	{
+		mBuffer = buffer;
+		mIndex = index;
+	}
+public:
+	BinaryLeaf<T>* operator*() const
+	{
+		mBuffer->Produce(mIndex);
+
+		return mBuffer->Get(mIndex);
+	}
+
+	TraversalIterator<T, Order>& operator++()
+	{
+		mIndex++;
+
+		return *this;
+	}
+
+	TraversalIterator<T, Order> operator++(int)
+	{
+		TraversalIterator<T, Order> previous = *this;
+		mIndex++;
+
+		return previous;
+	}
+
+	bool operator==(const TraversalIterator<T, Order>& other) const
+	{
+		if (mIndex != END && other.mIndex != END)
+		{
+			return mIndex == other.mIndex;
+		}
+
+		return IsEnd() == other.IsEnd();
+	}
+private:
+	// Дошёл ли итератор до конца обхода. Продвигает обход, если лепесток под mIndex ещё не вычислен.
+	bool IsEnd() const
+	{
+		return mIndex == END || !mBuffer->Produce(mIndex);
+	}
+};
+
+/*
+	Представление (view) обхода поддерева, с begin() и end(). Не владеет ни деревом, ни буфером.
+	Подходит для range-based for, алгоритмов std::ranges и std::ranges::views::filter/transform.
+
+	begin() начинает обход заново, переиспользуя буфер.
+*/
+template<typename T, typename Order>
+class TraversalView : public std::ranges::view_interface<TraversalView<T, Order>>
+{
+private:
+	BinaryLeaf<T>* mRoot;
+	TraversalBuffer<T, Order>* mBuffer;
+public:
+	TraversalView()
+	{
+		mRoot = nullptr;
+		mBuffer = nullptr;
+	}
+
+	TraversalView(BinaryLeaf<T>* root, TraversalBuffer<T, Order>& buffer)
+	{
+		mRoot = root;
+		mBuffer = &buffer;
+	}
+public:
+	TraversalIterator<T, Order> begin() const
+	{
+		mBuffer->Reset(mRoot);
+
+		return TraversalIterator<T, Order>(mBuffer, 0);
+	}
+
+	TraversalIterator<T, Order> end() const
+	{
+		return TraversalIterator<T, Order>(mBuffer, TraversalIterator<T, Order>::END);
+	}
+};
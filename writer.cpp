@@ -0,0 +1,187 @@
+﻿#include "writer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "checksum.hpp"
+#include "textparse.hpp"
+
+BufferedWriter::BufferedWriter(std::ostream& stream, size_t bufferSize, bool background) : mStream(stream)
+{
+	// Буфер должен вмещать хотя бы одно число целиком.
+	bufferSize = std::max<size_t>(bufferSize, 64);
+
+	mBuffers[0].reset(new char[bufferSize]);
+	mBufferSize = bufferSize;
+
+	mCurrent = 0;
+	mUsed = 0;
+
+	mChecksum = 0;
+
+	mFormatter.copyfmt(stream);
+
+	mPendingBuffer = 0;
+	mPendingSize = 0;
+	mPending = false;
+	mStopping = false;
+
+	mBackground = background;
+}
+
+BufferedWriter::~BufferedWriter()
+{
+	Flush();
+
+	if (mThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStopping = true;
+		}
+
+		mCondition.notify_all();
+		mThread.join();
+	}
+}
+
+void BufferedWriter::Write(const char* data, size_t size)
+{
+	while (size > 0)
+	{
+		if (mUsed >= mBufferSize)
+		{
+			Submit();
+		}
+
+		size_t part = std::min(size, mBufferSize - mUsed);
+
+		std::copy(data, data + part, mBuffers[mCurrent].get() + mUsed);
+
+		mUsed += part;
+		data += part;
+		size -= part;
+	}
+}
+
+void BufferedWriter::WriteChecksumHeader()
+{
+	char line[textload::CHECKSUM_HEADER_LENGTH + 1];
+	std::memcpy(line, textload::CHECKSUM_HEADER, textload::CHECKSUM_HEADER_LENGTH);
+
+	line[sizeof(line) - 1] = '\n';
+
+	Write(line, sizeof(line));
+}
+
+void BufferedWriter::WriteChecksumLine()
+{
+	// Сумма отправленных буферов готова, только когда фоновый поток их дописал.
+	WaitPending();
+
+	// В сумму входит и то, что ещё лежит в текущем буфере.
+	uint32_t crc = checksum::Crc32c(mBuffers[mCurrent].get(), mUsed, mChecksum);
+
+	char line[textload::CHECKSUM_PREFIX_LENGTH + textload::CHECKSUM_DIGITS + 1];
+	std::memcpy(line, textload::CHECKSUM_PREFIX, textload::CHECKSUM_PREFIX_LENGTH);
+
+	// Ровно восемь цифр, с ведущими нулями.
+	for (size_t digit = 0; digit < textload::CHECKSUM_DIGITS; digit++)
+	{
+		line[textload::CHECKSUM_PREFIX_LENGTH + digit] = "0123456789abcdef"[(crc >> (4 * (textload::CHECKSUM_DIGITS - 1 - digit))) & 0xF];
+	}
+
+	line[sizeof(line) - 1] = '\n';
+
+	Write(line, sizeof(line));
+}
+
+void BufferedWriter::Flush()
+{
+	if (mUsed > 0)
+	{
+		if (mThread.joinable())
+		{
+			Submit();
+		}
+		else
+		{
+			mChecksum = checksum::Crc32c(mBuffers[mCurrent].get(), mUsed, mChecksum);
+			mStream.write(mBuffers[mCurrent].get(), static_cast<std::streamsize>(mUsed));
+			mUsed = 0;
+		}
+	}
+
+	WaitPending();
+
+	mStream.flush();
+}
+
+void BufferedWriter::Submit()
+{
+	if (!mBackground)
+	{
+		mChecksum = checksum::Crc32c(mBuffers[mCurrent].get(), mUsed, mChecksum);
+		mStream.write(mBuffers[mCurrent].get(), static_cast<std::streamsize>(mUsed));
+		mUsed = 0;
+
+		return;
+	}
+
+	if (!mThread.joinable())
+	{
+		mBuffers[1].reset(new char[mBufferSize]);
+		mThread = std::thread(&BufferedWriter::WriterLoop, this);
+	}
+
+	// Второй буфер может быть ещё не дописан - тогда форматировать дальше некуда, ждём.
+	WaitPending();
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mPendingBuffer = mCurrent;
+		mPendingSize = mUsed;
+		mPending = true;
+	}
+
+	mCondition.notify_all();
+
+	mCurrent = 1 - mCurrent;
+	mUsed = 0;
+}
+
+void BufferedWriter::WaitPending()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	mCondition.wait(lock, [&]() {
+		return !mPending;
+	});
+}
+
+void BufferedWriter::WriterLoop()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	while (true)
+	{
+		mCondition.wait(lock, [&]() {
+			return mPending || mStopping;
+		});
+
+		if (!mPending)
+		{
+			return;
+		}
+
+		// Пока идёт запись, буфер принадлежит этому потоку, а форматирующий поток работает со вторым.
+		lock.unlock();
+		mChecksum = checksum::Crc32c(mBuffers[mPendingBuffer].get(), mPendingSize, mChecksum);
+		mStream.write(mBuffers[mPendingBuffer].get(), static_cast<std::streamsize>(mPendingSize));
+		lock.lock();
+
+		mPending = false;
+		mCondition.notify_all();
+	}
+}
@@ -0,0 +1,134 @@
+﻿#pragma once
+
+#include <charconv>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+
+/*
+	Буферизованная запись текста в поток.
+
+	Текст собирается в большом буфере и уходит в поток целыми блоками, без сброса (flush) после каждой строки.
+	Буферов два: когда один заполнен, он отдаётся фоновому потоку записи, а форматирование продолжается во втором.
+	Так форматирование и ввод-вывод идут одновременно. Фоновый поток запускается только тогда, когда заполнится
+	первый буфер, поэтому короткий вывод пишется одним блоком при Flush и потоков не создаёт.
+
+	Пока BufferedWriter не сброшен, в сам поток писать нельзя: часть текста может ещё лежать в буферах.
+*/
+class BufferedWriter
+{
+private:
+	std::ostream& mStream;
+
+	/*
+		Два буфера и номер того, в который сейчас идёт форматирование. Память буферов не заполняется нулями,
+		так что короткий вывод затрагивает лишь несколько страниц. Второй буфер выделяется вместе с фоновым потоком.
+	*/
+	std::unique_ptr<char[]> mBuffers[2];
+	size_t mBufferSize;
+	size_t mCurrent;
+
+	// Сколько байт занято в текущем буфере.
+	size_t mUsed;
+
+	/*
+		CRC32C всех байт, ушедших из буферов на запись (для WriteChecksumLine). С фоновым потоком её считает он,
+		пока форматирование заполняет второй буфер, поэтому читать её можно только после WaitPending.
+	*/
+	uint32_t mChecksum;
+
+	// Форматирование значений, для которых нет std::to_chars. Настроено так же, как mStream.
+	std::ostringstream mFormatter;
+
+	// Фоновая запись. mPendingSize байт буфера mPendingBuffer ждут записи, пока mPending.
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+
+	size_t mPendingBuffer;
+	size_t mPendingSize;
+	bool mPending;
+	bool mStopping;
+
+	bool mBackground;
+public:
+	static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+
+	// background - можно ли писать в фоновом потоке. Если нет, полный буфер пишется сразу, в вызывающем потоке.
+	explicit BufferedWriter(std::ostream& stream, size_t bufferSize = DEFAULT_BUFFER_SIZE, bool background = true);
+
+	// Дописывает всё, что осталось в буферах.
+	~BufferedWriter();
+
+	BufferedWriter(const BufferedWriter&) = delete;
+	BufferedWriter& operator=(const BufferedWriter&) = delete;
+public:
+	void Write(const char* data, size_t size);
+
+	void Write(char symbol)
+	{
+		if (mUsed >= mBufferSize)
+		{
+			Submit();
+		}
+
+		mBuffers[mCurrent][mUsed] = symbol;
+		mUsed++;
+	}
+
+	/*
+		Запись значения в том же виде, в каком его вывел бы operator<<. Целые числа форматируются через std::to_chars
+		прямо в буфер, остальное - через operator<< во вспомогательный поток с настройками mStream.
+		Однобайтовые типы operator<< выводит символом, поэтому они, как и bool, тоже идут через operator<<.
+	*/
+	template<typename T>
+	void WriteValue(const T& value)
+	{
+		if constexpr (std::is_integral_v<T> && !std::is_same_v<T, bool> && sizeof(T) > 1)
+		{
+			// Самое длинное 64-битное число с минусом занимает 20 символов.
+			constexpr size_t MAX_LENGTH = 24;
+
+			if (mUsed + MAX_LENGTH > mBufferSize)
+			{
+				Submit();
+			}
+
+			char* begin = mBuffers[mCurrent].get() + mUsed;
+			std::to_chars_result result = std::to_chars(begin, begin + MAX_LENGTH, value);
+
+			mUsed += static_cast<size_t>(result.ptr - begin);
+		}
+		else
+		{
+			mFormatter.str(std::string());
+			mFormatter << value;
+
+			std::string formatted = mFormatter.str();
+			Write(formatted.data(), formatted.size());
+		}
+	}
+
+	/*
+		Строки контрольной суммы текстового формата (см. textload::CHECKSUM_HEADER). Первая, "#crc32c", пишется
+		до значений, последняя, "#crc32c xxxxxxxx", - после, с CRC32C всего, что было записано через этот BufferedWriter.
+	*/
+	void WriteChecksumHeader();
+	void WriteChecksumLine();
+
+	// Запись всего накопленного в поток и сброс самого потока. Возвращается, когда всё записано.
+	void Flush();
+private:
+	// Отправка текущего буфера на запись и переход к другому буферу.
+	void Submit();
+
+	// Ожидание, пока фоновый поток допишет отданный ему буфер.
+	void WaitPending();
+
+	void WriterLoop();
+};